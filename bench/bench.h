@@ -9,10 +9,12 @@
 struct BenchConf {
   int num_ops;
   int num_threads;
+  int batch_size;
 
   void print() {
     fprintf(stdout, "num_ops (per thread): %d\n", num_ops);
     fprintf(stdout, "num_threads: %d\n", num_threads);
+    fprintf(stdout, "batch_size: %d\n", batch_size);
   }
 };
 
@@ -32,6 +34,21 @@ void parse_command_line_arguments(int argc, char* argv[], DBConf* conf, BenchCon
     { "num_pmem_levels", required_argument, 0, 0 },
     { "num_regions" , required_argument, 0, 0 },
     { "num_shards", required_argument, 0, 0 },
+    { "batch_size", required_argument, 0, 0 },
+    { "log_group_commit_mode", required_argument, 0, 0 },
+    { "log_group_commit_window", required_argument, 0, 0 },
+    { "write_slowdown_trigger", required_argument, 0, 0 },
+    { "max_write_delay", required_argument, 0, 0 },
+    { "partitioner", required_argument, 0, 0 },
+    { "shard_split_points", required_argument, 0, 0 },
+    { "vlog_gc_trigger", required_argument, 0, 0 },
+    { "vlog_gc_rate", required_argument, 0, 0 },
+    { "inline_value_threshold", required_argument, 0, 0 },
+    { "lookup_cache_size", required_argument, 0, 0 },
+    { "filter_bits_per_key", required_argument, 0, 0 },
+    { "learned_index_stride", required_argument, 0, 0 },
+    { "cascade_min_visits", required_argument, 0, 0 },
+    { "worker_scaling_mode", required_argument, 0, 0 },
     { 0, 0, 0, 0 }
   };
 
@@ -41,6 +58,7 @@ void parse_command_line_arguments(int argc, char* argv[], DBConf* conf, BenchCon
   // Default BenchConf
   bconf->num_ops = 1000000;
   bconf->num_threads = 1;
+  bconf->batch_size = 64;
 
   // Workloads
   wl->emplace_back("putrandom");
@@ -75,6 +93,60 @@ void parse_command_line_arguments(int argc, char* argv[], DBConf* conf, BenchCon
           } else if (strcmp(long_options[idx].name, "num_shards") == 0) {
             conf->num_shards = std::stoi(optarg);
             break;
+          } else if (strcmp(long_options[idx].name, "batch_size") == 0) {
+            bconf->batch_size = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "log_group_commit_mode") == 0) {
+            conf->log_group_commit_mode = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "log_group_commit_window") == 0) {
+            conf->log_group_commit_window = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "write_slowdown_trigger") == 0) {
+            conf->write_slowdown_trigger = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "max_write_delay") == 0) {
+            conf->max_write_delay = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "partitioner") == 0) {
+            conf->partitioner_mode = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "shard_split_points") == 0) {
+            // Comma-separated keys
+            conf->shard_split_points.clear();
+            std::string s(optarg);
+            size_t begin = 0;
+            while (begin <= s.size()) {
+              size_t end = s.find(',', begin);
+              if (end == std::string::npos) end = s.size();
+              conf->shard_split_points.push_back(std::stoull(s.substr(begin, end - begin)));
+              begin = end + 1;
+            }
+            break;
+          } else if (strcmp(long_options[idx].name, "vlog_gc_trigger") == 0) {
+            conf->vlog_gc_trigger = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "vlog_gc_rate") == 0) {
+            conf->vlog_gc_rate = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "inline_value_threshold") == 0) {
+            conf->inline_value_threshold = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "lookup_cache_size") == 0) {
+            conf->lookup_cache_size = std::stoull(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "filter_bits_per_key") == 0) {
+            conf->filter_bits_per_key = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "learned_index_stride") == 0) {
+            conf->learned_index_stride = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "cascade_min_visits") == 0) {
+            conf->cascade_min_visits = std::stoi(optarg);
+            break;
+          } else if (strcmp(long_options[idx].name, "worker_scaling_mode") == 0) {
+            conf->worker_scaling_mode = std::stoi(optarg);
+            break;
           }
           printf(" with arg %s", optarg);
           printf("\n");
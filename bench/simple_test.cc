@@ -44,6 +44,7 @@ void load(brdb* db, const int num_threads, const int num_ops_per_thread) {
             db->put(td, buf, (char*) &value);
 #endif
           }
+          db->release_thread(td);
         });
   }
   for (auto& t : loaders) {
@@ -70,6 +71,61 @@ void load(brdb* db, const int num_threads, const int num_ops_per_thread) {
   //fprintf(stdout, "=============================================\n");
 }
 
+void load_batch(brdb* db, const int num_threads, const int num_ops_per_thread, const int batch_size) {
+  uint64_t num_ops = num_threads * num_ops_per_thread;
+
+  std::vector<std::thread> loaders;
+  std::chrono::time_point<std::chrono::steady_clock> begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_threads; i++) {
+    loaders.emplace_back([&, id=i]{
+          std::seed_seq sseq{id, id + 1};
+          std::mt19937 gen(sseq);
+          std::uniform_int_distribution<uint64_t> dist(1, std::numeric_limits<uint64_t>::max() - 1);
+          uint64_t value = 1234;
+          ThreadData* td = new ThreadData();
+          td->cpu = id;
+          set_affinity(td->cpu);
+          td->numa = numa_node_of_cpu(td->cpu);
+          td->region = td->numa % kNumRegions;
+          db->register_client(id, td);
+#ifndef BR_STRING_KV
+          std::vector<uint64_t> keys(batch_size);
+#else
+          std::vector<std::string> keys(batch_size);
+#endif
+          std::vector<std::pair<std::string_view, std::string_view>> kvbatch;
+          for (int j = 0; j < num_ops_per_thread; j += batch_size) {
+            int n = std::min(batch_size, num_ops_per_thread - j);
+            kvbatch.clear();
+            for (int k = 0; k < n; k++) {
+              uint64_t key = dist(gen);
+#ifndef BR_STRING_KV
+              keys[k] = key;
+              kvbatch.emplace_back(std::string_view((char*) &keys[k], 8), std::string_view((char*) &value, 8));
+#else
+              keys[k] = "user" + std::to_string(key);
+              kvbatch.emplace_back(keys[k], std::string_view((char*) &value, 8));
+#endif
+            }
+            db->put_batch(td, kvbatch);
+          }
+          db->release_thread(td);
+        });
+  }
+  for (auto& t : loaders) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+  auto end_tp = std::chrono::steady_clock::now();
+  std::chrono::duration<double> dur = end_tp - begin;
+  double dur_sec = dur.count();
+
+  fprintf(stdout, "Load (batch) IOPS: %.3lf M\n", num_ops/dur_sec/1000000);
+  fprintf(stdout, "elapsed (client): %.3lf sec\n", dur_sec);
+  fprintf(stdout, "---------------------------------------------\n");
+}
+
 void search_random(brdb* db, const int num_threads, const int num_ops_per_thread) {
   uint64_t num_ops = num_threads * num_ops_per_thread;
 
@@ -122,6 +178,62 @@ void search_random(brdb* db, const int num_threads, const int num_ops_per_thread
   fprintf(stdout, "elapsed: %.3lf sec\n", dur_sec);
 }
 
+void search_batch(brdb* db, const int num_threads, const int num_ops_per_thread, const int batch_size) {
+  uint64_t num_ops = num_threads * num_ops_per_thread;
+
+  std::vector<std::thread> loaders;
+  std::chrono::time_point<std::chrono::steady_clock> begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_threads; i++) {
+    loaders.emplace_back([&, id=i]{
+          std::seed_seq sseq{id, id + 1};
+          std::mt19937 gen(sseq);
+          std::uniform_int_distribution<uint64_t> dist(1, std::numeric_limits<uint64_t>::max() - 1);
+          ThreadData* td = new ThreadData();
+          td->cpu = id;
+          set_affinity(td->cpu);
+          td->numa = numa_node_of_cpu(td->cpu);
+          td->region = td->numa % kNumRegions;
+#ifndef BR_STRING_KV
+          std::vector<uint64_t> keys(batch_size);
+#else
+          std::vector<std::string> keys(batch_size);
+#endif
+          std::vector<std::string_view> batch;
+          std::vector<bool> found_batch;
+          int found = 0;
+          for (int j = 0; j < num_ops_per_thread; j += batch_size) {
+            int n = std::min(batch_size, num_ops_per_thread - j);
+            batch.clear();
+            for (int k = 0; k < n; k++) {
+              uint64_t key = dist(gen);
+#ifndef BR_STRING_KV
+              keys[k] = key;
+              batch.emplace_back((char*) &keys[k], 8);
+#else
+              keys[k] = "user" + std::to_string(key);
+              batch.emplace_back(keys[k]);
+#endif
+            }
+            db->multi_get(td, batch, NULL, &found_batch);
+            for (int k = 0; k < n; k++) {
+              found += found_batch[k];
+            }
+          }
+          fprintf(stderr, "id=%d found=%d\n", id, found);
+        });
+  }
+  for (auto& t : loaders) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+  auto end_tp = std::chrono::steady_clock::now();
+  std::chrono::duration<double> dur = end_tp - begin;
+  double dur_sec = dur.count();
+  fprintf(stdout, "Search (batch) IOPS: %.3lf M\n", num_ops/dur_sec/1000000);
+  fprintf(stdout, "elapsed: %.3lf sec\n", dur_sec);
+}
+
 int main(int argc, char* argv[]) {
   // Parse command line args
   DBConf conf;
@@ -141,8 +253,12 @@ int main(int argc, char* argv[]) {
   for (auto& wl : workloads) {
     if (wl.compare("putrandom") == 0) {
       load(db, bconf.num_threads, bconf.num_ops);
+    } else if (wl.compare("putbatch") == 0) {
+      load_batch(db, bconf.num_threads, bconf.num_ops, bconf.batch_size);
     } else if (wl.compare("getrandom") == 0) {
       search_random(db, bconf.num_threads, bconf.num_ops);
+    } else if (wl.compare("getbatch") == 0) {
+      search_batch(db, bconf.num_threads, bconf.num_ops, bconf.batch_size);
     } else if (wl.compare("stabilize") == 0) {
       db->stabilize();
       std::string table_state_str;
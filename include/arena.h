@@ -2,7 +2,11 @@
 #define ARENA_H_
 
 #include <atomic>
+#include <cstddef>
 #include <mutex>
+#include <new>
+
+#include <sys/mman.h>
 
 class Arena {
   struct Block {
@@ -12,16 +16,23 @@ class Arena {
     Block() : p(0), next(NULL) { }
   };
  public:
-  Arena(const size_t block_size) : head_(NULL), curr_(NULL), block_size_(block_size) { }
+  // If hugepage is set, blocks are mmap'ed with MAP_HUGETLB, falling back to
+  // transparent hugepages when no hugetlb pages are reserved.
+  Arena(const size_t block_size, const bool hugepage = false)
+      : head_(NULL), curr_(NULL), block_size_(block_size), hugepage_(hugepage),
+        capacity_(block_alloc_size() - offsetof(Block, data)), num_blocks_(0) { }
   ~Arena() {
     Block* b = head_;
     while (b) {
       auto nb = b->next.load();
-      delete b;
+      free_block(b);
       b = nb;
     }
   }
 
+  // Bytes reserved from the system
+  size_t memory_usage() { return num_blocks_.load() * block_alloc_size(); }
+
   char* allocate(const size_t size) {
     char* ret;
     Block* nb = NULL;
@@ -34,7 +45,7 @@ class Arena {
     auto block = curr_.load();
     while (true) {
       if (block) {
-        if ((before = block->p.fetch_add(asize)) <= block_size_ - asize) {
+        if ((before = block->p.fetch_add(asize)) <= capacity_ - asize) {
           break;
         } else {
           block = block->next.load();
@@ -68,7 +79,7 @@ class Arena {
         pred->next.store(nb);
 
         Block* curr = curr_.load();
-        while (curr->p >= block_size_) {
+        while (curr->p >= capacity_) {
           curr_.store(curr->next);
           curr = curr_.load();
         }
@@ -79,16 +90,53 @@ class Arena {
   }
 
  private:
+  size_t block_alloc_size() {
+    size_t size = block_size_;
+    if (hugepage_) {
+      size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+    }
+    return size;
+  }
+
   Block* new_block() {
-    void* buf = aligned_alloc(8, sizeof(Block) + (block_size_ - 1));
-    return (Block*) buf;
+    void* buf;
+    if (hugepage_) {
+      buf = mmap(NULL, block_alloc_size(), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (buf == MAP_FAILED) {
+        buf = mmap(NULL, block_alloc_size(), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+          perror("mmap");
+          abort();
+        }
+        madvise(buf, block_alloc_size(), MADV_HUGEPAGE);
+      }
+    } else {
+      buf = aligned_alloc(8, block_alloc_size());
+    }
+    num_blocks_.fetch_add(1);
+    return new (buf) Block();
+  }
+
+  void free_block(Block* b) {
+    if (hugepage_) {
+      munmap(b, block_alloc_size());
+    } else {
+      free(b);
+    }
   }
 
  private:
   Block* head_;
   std::atomic<Block*> curr_;
   const size_t block_size_;
+  const bool hugepage_;
+  const size_t capacity_;  // usable bytes per block
+  std::atomic<size_t> num_blocks_;
   std::mutex mu_;
+
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
 };
 
 #endif  // ARENA_H_
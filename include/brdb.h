@@ -5,13 +5,16 @@
 #include <functional>
 #include <queue>
 #include <deque>
+#include <set>
 #include <shared_mutex>
 #include <string_view>
 #include <thread>
 #include <vector>
 
 #include "common.h"
+#include "db_iterator.h"
 #include "ds/nbr_stack.h"
+#include "epoch.h"
 #include "jobs/job_manager.h"
 #include "log.h"
 #include "memtable.h"
@@ -33,43 +36,111 @@ class brdb {
   // Client interfaces
   void put(ThreadData* td, const std::string_view& key, const std::string_view& value);
   void put_batch(ThreadData* td, std::vector<std::pair<std::string_view, std::string_view>>& kvbatch);
-  bool get(ThreadData* td, const std::string_view& key, std::string* value_out = NULL);
+  // `snapshot`: a snapshot() to read at, the latest versions by default
+  bool get(ThreadData* td, const std::string_view& key, std::string* value_out = NULL,
+           const uint64_t snapshot = kMaxSequenceNumber);
+  // Zero-copy get. *value_out points to the value in the table or the value
+  // log (8 bytes of the integer value for integer keys), and stays valid
+  // while the caller holds a read guard:
+  //
+  //   auto guard = db->read_guard();
+  //   std::string_view value;
+  //   if (db->get_view(td, key, &value)) { ... }
+  //
+  // Writes are allowed while holding a guard, but it delays freeing the
+  // tables dropped meanwhile, so it should not be held for long.
+  bool get_view(ThreadData* td, const std::string_view& key, std::string_view* value_out);
+  EpochGuard read_guard() { return EpochGuard(&epoch_); }
+  // Batched get. The keys of a shard are probed in the lookup cache at once
+  // and searched together in each table with interleaved traversals.
+  // values_out may be NULL.
+  void multi_get(ThreadData* td, const std::vector<std::string_view>& keys,
+                 std::vector<std::string>* values_out, std::vector<bool>* found_out);
+  void del(ThreadData* td, const std::string_view& key);
+  // Sequence number of the last write, whose versions reads at the snapshot
+  // see. Compactions keep the versions visible at a snapshot until it is
+  // released. Waits for the writes in flight.
+  uint64_t snapshot();
+  void release_snapshot(const uint64_t snapshot);
   void register_client(const int cid, ThreadData* td);
+  // Returns the value log blocks the thread writes to or still pins in every
+  // shard, so GC can collect them. Call it when a client thread stops
+  // writing, before its ThreadData goes away.
+  void release_thread(ThreadData* td);
   double timestamp_double();
   void table_stats();
   void get_table_state_string(std::string* out_str);
   void get_table_state(struct TableCount* out);
   void perf_stats();
+  // Current delay of a put by the write throttle (usec), the max over shards
+  double write_delay_rate();
   void wait_compaction();
   void stabilize();
 
-  bool get_cascade(ThreadData* td, const std::string_view& sv_key, std::string* value_out);
-  bool get_cascade_l0(ThreadData* td, const std::string_view& sv_key, std::string* value_out,
-    UINT64_node* mem_pred_a, UINT64_pnode* shortcut, std::shared_ptr<MemTable>& mem);
-
-  bool scan(ThreadData* td, const std::string_view& key, const uint64_t len, std::vector<void*>* result);
+  // Iterator over the whole DB, see DBIterator
+  std::unique_ptr<DBIterator> new_iterator(ThreadData* td, const uint64_t snapshot = kMaxSequenceNumber);
+  // Up to `len` key-value pairs from `key` on
+  bool scan(ThreadData* td, const std::string_view& key, const uint64_t len,
+            std::vector<std::pair<std::string, std::string>>* result,
+            const uint64_t snapshot = kMaxSequenceNumber);
 
   void perfmon_write_message(std::string msg);
 
  private:
   // Write functions
-  // value can be either integer value or offset to value log pointer
-  void write_to_mem(ThreadData* td, const int s, const std::string_view& key, const uint64_t value);
-  void write_to_pmem(ThreadData* td, const int s, const std::string_view& key, const uint64_t value);
-  uint64_t write_log(ThreadData* td, const int s, const std::string_view& key, const uint64_t value);
-  uint64_t store_value(ThreadData* td, const int s, const std::string_view& value);
+  // value can be either integer value or offset to value log pointer, or an
+  // inline value word whose bytes are `inline_value`
+  void write_to_mem(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                    const ValueType type = kTypeValue,
+                    const std::string_view& inline_value = std::string_view());
+  void write_to_pmem(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                     const ValueType type = kTypeValue,
+                     const std::string_view& inline_value = std::string_view());
+  uint64_t write_log(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                     const uint64_t tag,
+                     const std::string_view& inline_value = std::string_view());
+  // Batched write path: one log reservation per shard and region
+  void write_batch_to_mem(ThreadData* td, const int s,
+                          const std::pair<std::string_view, std::string_view>* const* kvs,
+                          const size_t n);
+  void write_log_batch(ThreadData* td, const int s, const size_t n,
+                       const std::string_view* keys, const uint64_t* values, const uint64_t* tags,
+                       const std::string_view* inline_values, uint64_t* log_moffs_out);
+  // Takes n consecutive sequence numbers for writes to *mem, the writable
+  // memtable of shard s, and returns the first. *mem is replaced by the next
+  // memtable if it was sealed before them. Called in an epoch.
+  uint64_t assign_seqs(ThreadData* td, const int s, const size_t kv_size, const size_t n, MemTable** mem);
+  // Returns the value word of `value`: its offset in the value log, or an
+  // inline value word with *inline_value_out set to `value`
+  uint64_t store_value(ThreadData* td, const int s, const std::string_view& key,
+                       const std::string_view& value, std::string_view* inline_value_out);
+  // Invalidates the lookup cache entry of a key written to shard s
+  void invalidate_cache(ThreadData* td, const int s, const std::string_view& key);
+  // Shard of a key. The only key-to-shard mapping of the DB.
+  int shard_of(const std::string_view& key) { return partitioner_->shard(key); }
   // Read functions
-  bool read_from_mem(ThreadData* td, const int s, const std::string_view& key, std::string* value_out);
-  bool read_from_imms(ThreadData* td, const int s, const std::string_view& key, std::string* value_out);
-  bool read_from_pmem_level(ThreadData* td, const int s, const int level, const std::string_view& key, std::string* value_out);
-
-bool read_from_mem_casc(ThreadData* td, const int s, const std::string_view& key, std::string* value_out);
-bool read_from_imms_casc(ThreadData* td, const int s, const std::string_view& key, std::string* value_out);
-bool read_from_pmem_level_casc(ThreadData* td, const int s, const int level, const std::string_view& key, std::string* value_out);
+  // Search of the tables, called in an epoch. *pmem_node_out is set to the
+  // version found if it is in a PMEM table.
+  bool lookup(ThreadData* td, const int s, const std::string_view& key, std::string_view* value_out,
+              const uint64_t snapshot = kMaxSequenceNumber, const pNode** pmem_node_out = NULL);
+  void multi_lookup(ThreadData* td, const int s, const size_t n, const std::string_view* keys,
+                    std::string_view* values_out, bool* found_out, const pNode** pmem_nodes_out = NULL);
+  // Return true if the key is found at the level. *deleted is set if the
+  // newest version found (at `snapshot`) is a tombstone. Called in this
+  // order by lookup(), with the cascading search (see brdb_read.cc).
+  bool read_from_mem_casc(ThreadData* td, const int s, const std::string_view& key, std::string_view* value_out, bool* deleted,
+                          const uint64_t snapshot);
+  bool read_from_imms_casc(ThreadData* td, const int s, const std::string_view& key, std::string_view* value_out, bool* deleted,
+                           const uint64_t snapshot);
+  bool read_from_pmem_level_casc(ThreadData* td, const int s, const int level, const std::string_view& key, std::string_view* value_out, bool* deleted,
+                                 const uint64_t snapshot, const pNode** node_out = NULL);
 
  private:
   // Table Management Functions
-  std::shared_ptr<MemTable> get_writable_memtable(ThreadData* td, const int s, const size_t my_size, JobManager* mgr);
+  // Called in an epoch, which keeps the returned table alive
+  MemTable* get_writable_memtable(ThreadData* td, const int s, const size_t my_size, JobManager* mgr);
+  void throttle_write(ThreadData* td, const int s, const size_t num_puts);
+  // The returned table is ref()'ed as a writer. Call unref() after writing.
   std::shared_ptr<PmemTable> get_writable_pmemtable(ThreadData* td, const int s, const int level, const size_t write_size, JobManager* mgr);
   std::shared_ptr<MemTable> new_mem_table(const int s, std::shared_ptr<MemTable> old = nullptr);
   std::shared_ptr<PmemTable> new_pmem_table(const int s, const int level, std::shared_ptr<PmemTable> old = nullptr);
@@ -77,19 +148,27 @@ bool read_from_pmem_level_casc(ThreadData* td, const int s, const int level, con
   void cworker_loop(const int cworker_id);
   void enq_mem_compaction(const int s, std::shared_ptr<MemTable>& imm, JobManager* mgr);
   //void run_mem_compaction_task(ThreadData* td, const int s, std::shared_ptr<MemTable> imm);
-  void run_mem_compaction_task(ThreadData* td, const int s, const unsigned long rmask, MemTable* imm, PmemTable* pmem);
+  // Flushes the nodes of imm from `begin` (the first one if NULL) up to `end`
+  void run_mem_compaction_task(ThreadData* td, const int s, MemTable* imm,
+                               const mNode* begin, const mNode* end, PmemTable* pmem);
+  // Adds an immutable of a level to the merges of shard s into the next
+  // level, in the order they were pushed to the immutables
+  void add_pending_merge(const int s, const int level, std::shared_ptr<PmemTable> table);
+  // Marks `lower` (added by add_pending_merge()) ready for its merge, which
+  // is enqueued to `mgr` once the older tables of its level are merged
   void enq_pmem_compaction(const int s, const int lower_level,
                            std::shared_ptr<PmemTable>& lower,
                            JobManager* mgr);
+  // Enqueues the merge of the oldest pending table of the level if it is
+  // ready and no merge of the level runs. Called with its mutex held.
+  void enq_next_pmem_compaction(const int s, const int lower_level, JobManager* mgr);
+  // Called by the callback of a merge
+  void finish_pmem_compaction(const int s, const int lower_level, JobManager* mgr);
   void enq_zipper_compaction(const int s, const int lower_level,
                              const int upper_level,
                              std::shared_ptr<PmemTable>& lower,
                              JobManager* mgr);
-  void run_zipper_compaction_task(ThreadData* td, const int s, const unsigned long rmask,
-                                  const int lower_level,
-                                  const int upper_level,
-                                  PmemTable* lower,
-                                  PmemTable* upper);
+  void run_zipper_compaction_task(ThreadData* td, const int s, ZipperCompaction* zc, const int range);
   void enq_log_structured_compaction(const int s, const int lower_level,
                                      const int upper_level,
                                      std::shared_ptr<PmemTable>& lower,
@@ -102,14 +181,40 @@ bool read_from_pmem_level_casc(ThreadData* td, const int s, const int level, con
   void enq_manual_compaction(const int s, const int level, JobManager* mgr);
   void enq_manual_mem_compaction(const int s, JobManager* mgr);
   void enq_manual_pmem_compaction(const int s, const int level, JobManager* mgr);
+  // Oldest snapshot not released, kMaxSequenceNumber if none
+  uint64_t oldest_snapshot();
+
+  // Value log GC (string keys)
+  // Enqueues a GC job if the shard has enough full value log blocks
+  void maybe_schedule_vlog_gc(const int s);
+  // Collects the oldest full value log block of the shard. Returns false if
+  // no block could be collected.
+  bool run_vlog_gc_task(ThreadData* td, const int s);
+  // Encoded keys of the versions of `key` in shard s, newest first, with true
+  // for the versions in DRAM. Stops at the newest one unless `all`. Called in
+  // an epoch.
+  void find_versions(ThreadData* td, const int s, const std::string_view& key, const bool all,
+                     std::vector<std::pair<char*, bool>>* out);
+
+  // Learned index of the last level (integer keys)
+  // Enqueues a build for shard s, or a rebuild after the running one
+  void schedule_learned_index_build(const int s);
+  // Builds the index of the last-level table of shard s, unless the table is
+  // written meanwhile. Returns true if the index was published.
+  bool build_learned_index(ThreadData* td, const int s);
+  // Drops the index of a last-level table about to be written
+  void begin_last_level_writes(PmemTable* table);
 
   // Periodic Compaction Loop
   void periodic_compaction_loop();
   // Performance Monitor Loop
   void perfmon_loop();
+  // Compaction Worker Scaling Loop
+  void worker_scaling_loop();
 
  private:
   const DBConf conf_;
+  std::shared_ptr<Partitioner> partitioner_;
   std::chrono::time_point<std::chrono::steady_clock> tp_begin_;
   std::atomic<bool> stop_;
   std::mutex mu_;  // global mutex
@@ -118,11 +223,30 @@ bool read_from_pmem_level_casc(ThreadData* td, const int s, const int level, con
   Log* log_[kMaxNumShards];
   ValueLog* vlog_[kMaxNumShards];
 
+  // Declared before the tables, which retire the PMEM space of merged-down
+  // tables when they are dropped, so that it outlives them
+  EpochManager epoch_;
+  // Entered by writes from before they take a sequence number until their
+  // versions are added, for snapshot() to wait for. Apart from epoch_, so
+  // that readers do not hold it up.
+  EpochManager write_epoch_;
+  // epoch_.retire()
+  std::function<void(std::function<void()>)> retire_fn_;
+
+  // Readers load `table_ptr` and iterate `immutables` in an epoch (epoch_)
+  // without touching reference counts. Popped immutables are retired to
+  // epoch_.
   template<class T>
   struct TableList {
     std::shared_ptr<T> table;
+    std::atomic<T*> table_ptr{nullptr};
     nbr_stack<std::shared_ptr<T>> immutables;
     std::shared_mutex mu;
+
+    void set_table(std::shared_ptr<T> t) {
+      std::atomic_store(&table, t);
+      table_ptr.store(t.get());
+    }
   };
   // DRAM Layer
   // Current memtables and immutables
@@ -130,11 +254,44 @@ bool read_from_pmem_level_casc(ThreadData* td, const int s, const int level, con
   //std::vector<nbr_stack<std::shared_ptr<MemTable>>*> immutables_;
   TableList<MemTable> mem_[kMaxNumShards];
   std::atomic<uint64_t> memtable_seq_[kMaxNumShards];
+  std::atomic<uint64_t> seq_{0};  // sequence number of the last write
   std::mutex ws_mu_[kMaxNumShards];
   std::condition_variable ws_cv_[kMaxNumShards];
+  std::atomic<uint64_t> write_delay_[kMaxNumShards];  // per-put delay (nsec)
+  // Memtable flushes: number, bytes (MemTable::size()), and wall time from
+  // the start of the first task to the end of the last one (nsec)
+  std::atomic<size_t> flush_cnt_{0};
+  std::atomic<size_t> flush_bytes_{0};
+  std::atomic<uint64_t> flush_ns_{0};
 
   // PMEM Layer
   TableList<PmemTable> level_[kMaxNumShards][kMaxNumPmemLevels];
+  // Merges of the tables of a level into the next one run one at a time per
+  // shard, oldest table first. Otherwise a tombstone could be dropped in the
+  // last level before an older version of its key gets there.
+  struct MergeQueue {
+    std::mutex mu;
+    std::deque<std::pair<std::shared_ptr<PmemTable>, bool>> tables;  // oldest first, ready
+    bool running = false;
+  };
+  MergeQueue merge_queue_[kMaxNumShards][kMaxNumPmemLevels];
+
+
+  // Snapshots not released
+  std::multiset<uint64_t> snapshots_;
+  std::mutex snapshots_mu_;
+
+  // Value log GC
+  // Exclusive: GC of a block. Shared: compactions copying nodes, which would
+  // otherwise copy a value offset being relocated.
+  std::shared_mutex vlog_gc_mu_[kMaxNumShards];
+  std::atomic<bool> vlog_gc_scheduled_[kMaxNumShards];
+  std::atomic<size_t> vlog_gc_trigger_[kMaxNumShards];  // in sealed blocks
+  std::atomic<int64_t> vlog_gc_next_time_[kMaxNumShards];  // nsec since tp_begin_, rate limit
+
+  // Learned index builds
+  std::atomic<bool> learned_index_scheduled_[kMaxNumShards];
+  std::atomic<bool> learned_index_requested_[kMaxNumShards];  // written after the build started
 
   // Compaction Queue
   //enum TaskType {
@@ -167,6 +324,12 @@ bool read_from_pmem_level_casc(ThreadData* td, const int s, const int level, con
 
   JobManager* job_mgr_ = nullptr;
   JobManager* backup_mgr_[2];
+  // Active workers of job_mgr_, NULL if all of them run jobs
+  std::shared_ptr<CompactionWorkerPolicy> worker_policy_;
+  std::atomic<size_t> worker_scale_up_cnt_{0};
+  std::atomic<size_t> worker_scale_down_cnt_{0};
+  std::atomic<size_t> worker_sample_cnt_{0};
+  std::atomic<size_t> worker_active_sum_{0};  // active workers over the samples
 
   TableQueue<MemTable> prepared_mem_tables_;
   TableQueue<PmemTable> prepared_tables_[kMaxNumPmemLevels];
@@ -179,6 +342,7 @@ bool read_from_pmem_level_casc(ThreadData* td, const int s, const int level, con
   std::condition_variable perfmon_cv_;
 
   std::thread perfmon_thread_;
+  std::thread worker_scaling_thread_;
 
   //ThreadData* cw_td_[kMaxNumWorkers];  // for compaction workers
   ThreadData* cl_td_[kMaxNumClients];  // for clients
@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <iostream>
+#include <memory>
 #include <shared_mutex>
 #include <string>
 #include <string_view>
@@ -15,6 +16,8 @@
 
 #include "util.h"
 #include "key_types.h"
+#include "partitioner.h"
+#include "worker_policy.h"
 //#include "ds/hash_table.h"
 
 extern int aahit;
@@ -35,6 +38,8 @@ constexpr int kMaxNumRegions = 4;
 constexpr int kMaxHeight = 12;
 //constexpr size_t kLogBlockSize = 128*(1ull<< 20) - 32;  // 32 = sizeof(LogBlockBase) - 1
 constexpr size_t kLogBlockSize = (1ull<<30)/kMaxNumShards - 32;  // 32 = sizeof(LogBlockBase) - 1
+constexpr size_t kLogChunkSize = 64*1024;  // per-thread slice of a log block
+constexpr size_t kMemTableArenaBlockSize = 2*1024*1024;  // one hugepage
 constexpr int kMaxNumPmemLevels = 3;
 constexpr int kMaxNumClients = 80;
 constexpr int kMaxNumWorkers = 80;
@@ -57,6 +62,24 @@ constexpr size_t kDRAMSizeTotalDefault = 1024*1000*1000;
 constexpr int kPeriodicCompactionModeDefault = 0;
 constexpr int kPerformanceMonitorModeDefault = 0;
 constexpr int kNumMergesToL0Default = 1;
+constexpr int kLogGroupCommitModeDefault = 0;
+// Time a group commit leader waits for followers before it flushes (usec).
+// A longer window puts more entries under one drain, but every writer of
+// the group waits up to that much longer. 0: the group is whatever was
+// published while the previous leader flushed.
+constexpr int kLogGroupCommitWindowDefault = 0;  // usec
+// The window ends early once this many entries of a region are pending
+constexpr size_t kLogGroupCommitMaxEntries = 64;
+constexpr int kWriteSlowdownTriggerDefault = 50;  // % of the DRAM limit
+constexpr int kMaxWriteDelayDefault = 100;  // usec per put
+constexpr int kPartitionerModeDefault = 0;  // hash
+constexpr int kVLogGCTriggerDefault = 32;  // sealed value log blocks per shard
+constexpr int kVLogGCRateDefault = 100;  // MB/s of scanned value log
+constexpr int kInlineValueThresholdDefault = 0;  // bytes, disabled
+constexpr int kFilterBitsPerKeyDefault = 10;  // about 1% false positives
+constexpr int kLearnedIndexStrideDefault = 0;  // disabled
+constexpr int kCascadeMinVisitsDefault = 0;  // disabled
+constexpr int kWorkerScalingModeDefault = 0;  // fixed
 
 // In-use
 extern int kNumShards;
@@ -69,52 +92,104 @@ extern int64_t kMemTableSize;
 extern size_t kDRAMSizeTotal;
 extern int kNumMergesToLevel[kMaxNumPmemLevels];
 extern int64_t kPmemTableSize[kMaxNumPmemLevels];
+extern int kLogGroupCommitMode;
+extern int kLogGroupCommitWindow;
+extern int kWriteSlowdownTrigger;
+extern int kMaxWriteDelay;
+extern int kVLogGCTrigger;
+extern int kVLogGCRate;
+extern int kInlineValueThreshold;
+extern int kFilterBitsPerKey;
+extern int kLearnedIndexStride;
+extern int kCascadeMinVisits;
 
 struct alignas(64) Counters {
   size_t put_cnt = 0;
   size_t get_cnt = 0;
+  size_t log_sync_cnt = 0;   // log flush+drain issued
+  size_t log_entry_cnt = 0;  // log entries made durable
+  size_t write_delay_cnt = 0;  // puts delayed by the write throttle
+  size_t write_delay_ns = 0;   // time slept by delayed puts
+  size_t write_stall_ns = 0;   // time blocked at the DRAM limit
+  size_t cache_hit_cnt = 0;         // gets answered by the lookup cache
+  size_t cache_miss_cnt = 0;        // gets that searched the index
+  size_t cache_fill_cnt = 0;        // misses admitted to the lookup cache
+  size_t cache_invalidate_cnt = 0;  // entries invalidated by writes
+  // Table filters, per level: searches skipped, and searches the filter let
+  // through that did not find the key
+  size_t filter_useful_cnt[kMaxNumPmemLevels] = {};
+  size_t filter_fp_cnt[kMaxNumPmemLevels] = {};
+  size_t learned_index_cnt = 0;  // last-level searches started by the learned index
+  // Table searches started by a shortcut of the cascading search, and the
+  // nodes they did not walk compared to the searches that added the shortcuts
+  size_t casc_hits = 0;
+  size_t casc_skipped_nodes = 0;
 };
 extern Counters* counter;
+// PMEM bytes freed from merged-down tables, per level
+extern std::atomic<size_t> pmem_reclaimed_bytes[kMaxNumPmemLevels];
+// Value log GC: size of the collected blocks, live values relocated out of
+// them, number of collected blocks
+extern std::atomic<size_t> vlog_gc_scanned_bytes;
+extern std::atomic<size_t> vlog_gc_relocated_bytes;
+extern std::atomic<size_t> vlog_gc_freed_blocks;
 
 // Hash Table
-
-//#define LPV2
-
-struct SharedVector {
-  std::shared_mutex mu;
-  std::vector<uint32_t> vec;
-};
-struct HashTableItem {
-  uint64_t version;
-  uint64_t key;
-  uint64_t value;
-#ifdef LPV2
-  SharedVector idx3;
-#endif
+// Lookup cache of each shard: an array of cache-line buckets. A bucket holds
+// kWays entries, found by comparing their fingerprints at once, and evicts
+// by CLOCK. A hit reads the one line of the bucket.
+//  - Integer keys: fingerprint is the key, data is the value.
+//  - String keys: fingerprint is a hash of the key, data points to the
+//    encoded key in the index, which also has the value word.
+struct alignas(64) LookupCacheBucket {
+  static constexpr int kWays = 3;
+  uint64_t fps[kWays];
+  // Seqlock of the entries, odd while a writer changes them
+  std::atomic<uint32_t> version;
+  uint8_t valid;  // bitmap of ways
+  uint8_t hand;   // next way the CLOCK looks at
+  // Bitmap of ways hit since the CLOCK passed them. Set by readers, outside
+  // of the seqlock.
+  std::atomic<uint8_t> referenced;
+  uint8_t unused0;
+  uint64_t data[kWays];
+  uint64_t unused1;
 };
-extern size_t kLookupCacheSize;
-extern HashTableItem* kHashTable[kMaxNumShards];
-//extern thread_local uint64_t ht_lookup_cnt;
-//extern thread_local uint64_t ht_hit_cnt;
-void ht_add(const int s, const uint64_t key, const uint64_t value);
-void ht_add(const int s, const uint64_t key, const uint64_t value);
-bool ht_get(const int s, const std::string_view& key, uint64_t* value_out);
-bool ht_get(const int s, const uint64_t key, uint64_t* value_out);
-#ifndef LPV2
-void ht_add_lp(const uint64_t key, const uint64_t value);
-bool ht_get_lp(const uint64_t key, uint64_t* value_out);
-#else
-void ht_add_lp_v2(const uint64_t key, const uint64_t value);
-bool ht_get_lp_v2(const uint64_t key, uint64_t* value_out);
-#endif
-void ht_add_stash(const uint64_t key, const uint64_t value);
-bool ht_get_stash(const uint64_t key, uint64_t* value_out);
-uint32_t ht_sha1(const std::string_view& key);
-uint32_t ht_sha1(const uint64_t key);
-void ht_sha1(const uint64_t key, char* result);
-void ht_murmur3(const uint64_t key, uint32_t* h);
-uint32_t ht_murmur3(const std::string_view& key);
-uint32_t ht_murmur3(const uint64_t key);
+static_assert(sizeof(LookupCacheBucket) == 64, "a bucket is a cache line");
+
+extern size_t kLookupCacheSize;  // entries per shard
+extern size_t kLookupCacheBuckets;  // buckets per shard
+extern LookupCacheBucket* kHashTable[kMaxNumShards];
+// Read-through cache of the newest versions, kept coherent by the writers:
+// a put or delete invalidates the entry of its key after adding its version
+// to the index, and a read fills the entry only if no writer changed the
+// bucket since ht_fill_token() was taken before the index was searched.
+//
+// `data`: the value for integer keys, the pointer to the encoded key of a
+// PMEM index node for string keys (which has the value word)
+//
+// String keys: an entry is probed and dereferenced in an epoch of the DB,
+// and a node is freed only by the Reclaimer of its table, which evicts the
+// entries of all the nodes first (ht_evict()) and frees them a grace period
+// later. Memtable nodes, which are freed without eviction, are not cached.
+bool ht_get(const int s, const std::string_view& key, uint64_t* data_out);
+bool ht_get(const int s, const uint64_t key, uint64_t* data_out);
+// Probes the keys of a shard at once, with the buckets prefetched
+void ht_get_batch(const int s, const size_t n, const std::string_view* keys, bool* hits_out,
+                  uint64_t* data_out = NULL);
+uint32_t ht_fill_token(const int s, const std::string_view& key);
+// `key`: integer key, or pointer to the encoded key of a PMEM index node
+// Returns false if the bucket was changed after `token` was taken.
+bool ht_fill(const int s, const uint64_t key, const uint64_t value, const uint32_t token);
+// Return true if an entry was invalidated
+bool ht_del(const int s, const std::string_view& key);
+bool ht_del(const int s, const uint64_t key);
+void ht_evict(const int s, const std::string_view& key, const uint64_t key_ptr);
+// True if an entry points to `key_ptr` (string keys), for checks
+bool ht_refers(const int s, const std::string_view& key, const uint64_t key_ptr);
+// Hash of the lookup cache (CRC32C if the CPU has SSE4.2)
+uint64_t ht_hash(const std::string_view& key);
+uint64_t ht_hash(const uint64_t key);
 
 
 // etc.
@@ -127,6 +202,22 @@ enum ValueType {
   kTypeDeletion = 0x2
 };
 
+// Every write of the DB gets a sequence number, kept in the tag of its nodes
+// and log entries: tag = (seq << 8 | type). A newer version has a larger one.
+constexpr uint64_t kMaxSequenceNumber = (1ull << 56) - 1;
+inline uint64_t make_tag(const uint64_t seq, const ValueType type) { return (seq << 8) | type; }
+inline uint64_t tag_seq(const uint64_t tag) { return tag >> 8; }
+
+
+// Private tail of a log (or value log) owned by a single thread.
+// Entries are bump-allocated in [cur, end) without touching the shared block.
+class LogBlock;
+struct LogTail {
+  char* cur = nullptr;
+  char* end = nullptr;
+  int16_t region = -1;
+  LogBlock* block = nullptr;  // value log: block of the chunk, ref()'ed
+};
 
 struct alignas(64) ThreadData {
   int cpu;
@@ -137,6 +228,12 @@ struct alignas(64) ThreadData {
   size_t pmem_compaction_cnt[kMaxNumPmemLevels] = { 0 };
   double pmem_compaction_dur[kMaxNumPmemLevels] = { 0 };
   Random rnd;
+  LogTail log_tail[kMaxNumShards];
+  LogTail vlog_tail[kMaxNumShards];
+  // Value log blocks written by the previous put, unref()'ed by the next one
+  std::vector<LogBlock*> vlog_pins[kMaxNumShards];
+  uint64_t write_delay_debt = 0;  // write delay not slept yet (nsec)
+  size_t visit_cnt = 0;  // nodes passed by the last memtable insert
 
   ThreadData() : rnd(0xdeadbeef) { }
 };
@@ -147,7 +244,10 @@ struct DBConf {
   int64_t mem_size = kMemTableSizeDefault;
   size_t dram_limit = kDRAMSizeTotalDefault;
   int num_workers = kNumWorkersDefault;
-  int task_size = kCompactionTaskSizeDefault;  // parallelism
+  // Tasks of a compaction job, run by different workers. A zipper compaction
+  // splits the lower table into this many key ranges, the others split the
+  // regions.
+  int task_size = kCompactionTaskSizeDefault;
   bool use_existing = false;
   // 0: Disabled
   // 1: All non-empty tables
@@ -158,13 +258,66 @@ struct DBConf {
   int l0_mem_merges = kNumMergesToL0Default;
   int num_pmem_levels = kMaxNumPmemLevels;
   int num_log_unified_levels = kNumLogUnifiedLevelsDefault;
+  // Entries of the lookup cache, divided among the shards
   size_t lookup_cache_size = 0x03ffffff + 1;
+  // Log group commit
+  // 0: Disabled (every writer persists its own entry)
+  // 1: Enabled (a leader persists the entries of concurrent writers at once)
+  int log_group_commit_mode = kLogGroupCommitModeDefault;
+  // Time the leader waits for followers before flushing (usec)
+  int log_group_commit_window = kLogGroupCommitWindowDefault;
+  // Write throttling
+  // Puts are delayed once the DRAM usage by memtables exceeds this percentage
+  // of dram_limit, and block at dram_limit. 100: Disabled (block only)
+  int write_slowdown_trigger = kWriteSlowdownTriggerDefault;
+  // Delay of a put right below dram_limit (usec)
+  int max_write_delay = kMaxWriteDelayDefault;
+  // Key to shard mapping
+  // 0: Hash (even load for point operations)
+  // 1: Range (contiguous key ranges, scans touch only the shards in range)
+  int partitioner_mode = kPartitionerModeDefault;
+  // Range partitioner: num_shards-1 sorted 8-byte key prefixes (numeric
+  // value for integer keys, big-endian bytes for string keys).
+  // Empty: the prefix space is split evenly.
+  std::vector<uint64_t> shard_split_points;
+  // User-defined mapping. Overrides partitioner_mode if set.
+  std::shared_ptr<Partitioner> partitioner;
+  // Value log GC (string keys)
+  // Number of sealed value log blocks of a shard that starts a GC. 0: Disabled
+  int vlog_gc_trigger = kVLogGCTriggerDefault;
+  // Value log bytes scanned by the GC per second (MB/s). 0: Unlimited
+  int vlog_gc_rate = kVLogGCRateDefault;
+  // Values up to this size (bytes) are stored in the index nodes instead of
+  // the value log (string keys). 0: Disabled
+  int inline_value_threshold = kInlineValueThresholdDefault;
+  // Bits per key of the DRAM Bloom filter of each L0 table, probed before
+  // the table is searched by point reads. 0: Disabled
+  int filter_bits_per_key = kFilterBitsPerKeyDefault;
+  // DRAM learned index of the last level (integer keys), built in the
+  // background once the level is no longer written. It samples one bottom
+  // node per this many. 0: Disabled
+  int learned_index_stride = kLearnedIndexStrideDefault;
+  // Cascading search: a search of a table that walks more than this many
+  // nodes adds a shortcut to the node before the key into the table searched
+  // before it, where the next searches of nearby keys start. 0: Disabled
+  int cascade_min_visits = kCascadeMinVisitsDefault;
+  // Compaction workers running jobs, out of num_workers
+  // 0: Fixed (all of them)
+  // 1: Backlog (by immutables, L0 tables, jobs, and foreground throughput)
+  int worker_scaling_mode = kWorkerScalingModeDefault;
+  // User-defined policy. Overrides worker_scaling_mode if set.
+  std::shared_ptr<CompactionWorkerPolicy> worker_policy;
 
   void print();
 };
 
 struct UINT64_pnode;
 
+// Value bytes of an encoded key, in the value log unless it is inline.
+// Called in an epoch of the DB, which keeps the value log block alive as long
+// as the view is used.
+std::string_view string_value_view(const StringKey& encoded_key);
+
 struct UINT64_node {
   uint64_t k;       // integer value or offset
   uint64_t t;       // tag
@@ -200,6 +353,9 @@ struct UINT64_node {
   uint64_t tag() const { return t; }
   uint8_t type() const { return ValueType(t & 0xff); }
   uint64_t value() const { return v; }
+  // Valid while the node is, i.e., in an epoch of the DB
+  std::string_view value_view() const { return std::string_view((char*) &v, 8); }
+  void get_value(std::string* out) const { out->assign((char*) &v, 8); }
   char* data() const { return (char*) this; }
 };
 
@@ -212,8 +368,18 @@ struct UINT64_pnode {
 
   static uint64_t head_key() { return 0ULL; }
 
+  // Links in next[]. Hybrid mode keeps the index levels in DRAM, and next[1]
+  // of a taller node points to its tower (see lockfree_pskiplist::Tower).
+  static int num_links(const int height) {
+#ifndef BR_HYBRID
+    return height;
+#else
+    return (height < 2) ? height : 2;
+#endif
+  }
+
   static size_t compute_alloc_size(const uint64_t key, const int height) {
-    return aligned_size(8, sizeof(UINT64_pnode) + (height-1)*8);
+    return aligned_size(8, sizeof(UINT64_pnode) + (num_links(height)-1)*8);
   }
 
   static UINT64_pnode* init_node(char* buf, const uint64_t key,
@@ -226,7 +392,7 @@ struct UINT64_pnode {
     //node->shortcut = NULL;
     node->height = height;
     if (init_next_arr) {
-      memset(node->next, 0, height * 8);
+      memset(node->next, 0, num_links(height) * 8);
     }
     return node;
   }
@@ -235,11 +401,14 @@ struct UINT64_pnode {
     return (UINT64_pnode*) buf;
   }
 
-  size_t alloc_size() const { return sizeof(UINT64_pnode) + (height-1)*8; }
+  size_t alloc_size() const { return sizeof(UINT64_pnode) + (num_links(height)-1)*8; }
   uint64_t key() const { return k; }
   uint64_t tag() const { return t; }
   uint8_t type() const { return ValueType(t & 0xff); }
   uint64_t value() const { return v; }
+  // Valid while the node is, i.e., in an epoch of the DB
+  std::string_view value_view() const { return std::string_view((char*) &v, 8); }
+  void get_value(std::string* out) const { out->assign((char*) &v, 8); }
   char* data() const { return (char*) this; }
 };
 
@@ -254,14 +423,16 @@ struct VARSTR_node {
     return std::string_view(hk);
   }
 
-  static size_t compute_alloc_size(const std::string_view& key, const int height) {
-    return StringKey::compute_alloc_size(key) + sizeof(VARSTR_node) + (height-1)*8;
+  // `value`: value word, which decides the space of an inline value
+  static size_t compute_alloc_size(const std::string_view& key, const int height, const uint64_t value = 0) {
+    return StringKey::compute_alloc_size(key, value) + sizeof(VARSTR_node) + (height-1)*8;
   }
 
   static VARSTR_node* init_node(char* buf, const std::string_view& key,
                                  const uint64_t tag, const uint64_t value,
-                                 const int height, bool init_next_arr = true) {
-    StringKey encoded_key(buf, key, tag, value);
+                                 const int height, bool init_next_arr = true,
+                                 const std::string_view& inline_value = std::string_view()) {
+    StringKey encoded_key(buf, key, tag, value, inline_value);
     size_t enckey_alloc_size = encoded_key.alloc_size();
     int key_roff = (-1) * enckey_alloc_size;
     char* p = buf - key_roff;
@@ -299,6 +470,17 @@ struct VARSTR_node {
     StringKey encoded_key(this->data());
     return encoded_key.value();
   }
+  std::string_view inline_value() const {
+    StringKey encoded_key(this->data());
+    return encoded_key.inline_value();
+  }
+  std::string_view value_view() const {
+    return string_value_view(this->encoded_key());
+  }
+  void get_value(std::string* out) const {
+    auto value = value_view();
+    out->assign(value.data(), value.size());
+  }
   char* data() const {
     return (char*) this + key_roff;
   }
@@ -314,14 +496,26 @@ struct VARSTR_pnode {
     return std::string_view(hk);
   }
 
-  static size_t compute_alloc_size(const std::string_view& key, const int height) {
-    return StringKey::compute_alloc_size(key) + sizeof(VARSTR_pnode) + (height-1)*8;
+  // Links in next[]. Hybrid mode keeps the index levels in DRAM, and next[1]
+  // of a taller node points to its tower (see lockfree_pskiplist::Tower).
+  static int num_links(const int height) {
+#ifndef BR_HYBRID
+    return height;
+#else
+    return (height < 2) ? height : 2;
+#endif
+  }
+
+  // `value`: value word, which decides the space of an inline value
+  static size_t compute_alloc_size(const std::string_view& key, const int height, const uint64_t value = 0) {
+    return StringKey::compute_alloc_size(key, value) + sizeof(VARSTR_pnode) + (num_links(height)-1)*8;
   }
 
   static VARSTR_pnode* init_node(char* buf, const std::string_view& key,
                                  const uint64_t tag, const uint64_t value,
-                                 const int height, bool init_next_arr = true) {
-    StringKey encoded_key(buf, key, tag, value);
+                                 const int height, bool init_next_arr = true,
+                                 const std::string_view& inline_value = std::string_view()) {
+    StringKey encoded_key(buf, key, tag, value, inline_value);
     size_t enckey_alloc_size = encoded_key.alloc_size();
     int key_roff = (-1) * enckey_alloc_size;
     char* p = buf - key_roff;
@@ -329,7 +523,7 @@ struct VARSTR_pnode {
     node->key_roff = key_roff;
     node->height = height;
     if (init_next_arr) {
-      memset(node->next, 0, height * 8);
+      memset(node->next, 0, num_links(height) * 8);
     }
     return node;
   }
@@ -341,7 +535,7 @@ struct VARSTR_pnode {
   }
 
   size_t alloc_size() {
-    return sizeof(VARSTR_pnode) + (height-1)*8 - key_roff;
+    return sizeof(VARSTR_pnode) + (num_links(height)-1)*8 - key_roff;
   }
 
   char* data() const {
@@ -366,8 +560,29 @@ struct VARSTR_pnode {
     StringKey encoded_key(this->data());
     return encoded_key.value();
   }
+  std::string_view inline_value() const {
+    StringKey encoded_key(this->data());
+    return encoded_key.inline_value();
+  }
+  std::string_view value_view() const {
+    return string_value_view(this->encoded_key());
+  }
+  void get_value(std::string* out) const {
+    auto value = value_view();
+    out->assign(value.data(), value.size());
+  }
 };
 
+// Prefetches a node for a comparison. The encoded key of a string key node
+// is stored in front of the node.
+template <typename Node>
+inline void prefetch_node(const Node* node) {
+  __builtin_prefetch(node);
+#ifdef BR_STRING_KV
+  __builtin_prefetch((const char*) node - 64);
+#endif
+}
+
 struct UINT64_cmp {
   int operator()(const UINT64_node* a, const UINT64_node* b) const {
     assert(b != NULL);
@@ -376,9 +591,11 @@ struct UINT64_cmp {
     } else if (a->key() < b->key()) {
       return -1;
     } else {
-      if (a->tag() < b->tag()) {
+      // Newer sequence first. The type byte is ignored so that versions
+      // sharing a sequence stay in insertion order (newest first).
+      if ((a->tag() >> 8) < (b->tag() >> 8)) {
         return 1;
-      } else if (a->tag() > b->tag()) {
+      } else if ((a->tag() >> 8) > (b->tag() >> 8)) {
         return -1;
       } else {
         return 0;
@@ -404,9 +621,11 @@ struct UINT64_pcmp {
     } else if (a->key() < b->key()) {
       return -1;
     } else {
-      if (a->tag() < b->tag()) {
+      // Newer sequence first. The type byte is ignored so that versions
+      // sharing a sequence stay in insertion order (newest first).
+      if ((a->tag() >> 8) < (b->tag() >> 8)) {
         return 1;
-      } else if (a->tag() > b->tag()) {
+      } else if ((a->tag() >> 8) > (b->tag() >> 8)) {
         return -1;
       } else {
         return 0;
@@ -434,9 +653,9 @@ struct VARSTR_cmp {
       auto b_enc = b->encoded_key();
       int cmp;
       if ((cmp = a_enc.key().compare(b_enc.key())) == 0) {
-        if (a_enc.tag() > b_enc.tag()) {
+        if ((a_enc.tag() >> 8) > (b_enc.tag() >> 8)) {
           return -1;
-        } else if (a_enc.tag() < b_enc.tag()) {
+        } else if ((a_enc.tag() >> 8) < (b_enc.tag() >> 8)) {
           return 1;
         } else {
           return 0;
@@ -466,9 +685,9 @@ struct VARSTR_pcmp {
       auto b_enc = b->encoded_key();
       int cmp;
       if ((cmp = a_enc.key().compare(b_enc.key())) == 0) {
-        if (a_enc.tag() > b_enc.tag()) {
+        if ((a_enc.tag() >> 8) > (b_enc.tag() >> 8)) {
           return -1;
-        } else if (a_enc.tag() < b_enc.tag()) {
+        } else if ((a_enc.tag() >> 8) < (b_enc.tag() >> 8)) {
           return 1;
         } else {
           return 0;
@@ -0,0 +1,63 @@
+#ifndef DS_BLOOM_FILTER_H_
+#define DS_BLOOM_FILTER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Blocked Bloom filter. All probes of a key fall into one cache-line block,
+// so a lookup misses the CPU cache at most once. Keys are added by a 64-bit
+// hash: the high half selects the block and the low half the bits in it.
+// Adds may run concurrently with each other and with lookups.
+class BloomFilter {
+ public:
+  BloomFilter(const size_t num_keys, const int bits_per_key)
+      : num_blocks_(std::max<size_t>(1, (num_keys * bits_per_key + kBlockBits - 1) / kBlockBits)),
+        // k = bits_per_key * ln(2) minimizes the false positive rate
+        num_probes_(std::min(30, std::max(1, (int) (bits_per_key * 0.69)))),
+        blocks_(new Block[num_blocks_]()) {}
+
+  void add(const uint64_t h) {
+    Block& b = block(h);
+    uint32_t bit = (uint32_t) h;
+    const uint32_t delta = (bit >> 17) | (bit << 15);
+    for (int i = 0; i < num_probes_; i++) {
+      const uint32_t pos = bit % kBlockBits;
+      b.words[pos / 64].fetch_or(1UL << (pos % 64), std::memory_order_relaxed);
+      bit += delta;
+    }
+  }
+
+  bool may_contain(const uint64_t h) const {
+    const Block& b = block(h);
+    uint32_t bit = (uint32_t) h;
+    const uint32_t delta = (bit >> 17) | (bit << 15);
+    for (int i = 0; i < num_probes_; i++) {
+      const uint32_t pos = bit % kBlockBits;
+      if ((b.words[pos / 64].load(std::memory_order_relaxed) & (1UL << (pos % 64))) == 0) {
+        return false;
+      }
+      bit += delta;
+    }
+    return true;
+  }
+
+  size_t memory_usage() const { return num_blocks_ * sizeof(Block); }
+
+ private:
+  static constexpr uint32_t kBlockBits = 512;
+  struct alignas(64) Block {
+    std::atomic<uint64_t> words[kBlockBits / 64];
+  };
+
+  Block& block(const uint64_t h) const {
+    return blocks_[((h >> 32) * num_blocks_) >> 32];
+  }
+
+  const size_t num_blocks_;
+  const int num_probes_;
+  std::unique_ptr<Block[]> blocks_;
+};
+
+#endif  // DS_BLOOM_FILTER_H_
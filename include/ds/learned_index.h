@@ -0,0 +1,47 @@
+#ifndef DS_LEARNED_INDEX_H_
+#define DS_LEARNED_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Learned index of sorted integer keys (PGM-style). It samples some keys of
+// a sorted list, each with a pointer to its node, and fits the positions of
+// the samples with a piecewise linear model whose error is at most kEpsilon.
+// A lookup predicts the position of a key and finishes with a binary search
+// of 2 * kEpsilon samples, from which the caller walks the list.
+// Built by a single thread and read-only afterwards.
+class LearnedIndex {
+ public:
+  static constexpr int kEpsilon = 16;
+
+  // Keys must be added in increasing order, without duplicates
+  void add(const uint64_t key, const void* ptr);
+  // Call after the last add()
+  void finish();
+  // Pointer of the largest sample less than `key`, NULL if there is none
+  const void* find_pred(const uint64_t key) const;
+  size_t size() const { return keys_.size(); }
+  size_t num_segments() const { return segments_.size(); }
+  size_t memory_usage() const;
+
+ private:
+  // Position of a key in [first_pos, next segment) is about
+  // first_pos + slope * (key - first_key)
+  struct Segment {
+    double slope;
+    size_t first_pos;
+  };
+  void close_segment();
+
+  std::vector<uint64_t> keys_;
+  std::vector<const void*> ptrs_;
+  std::vector<uint64_t> first_keys_;  // of the segments
+  std::vector<Segment> segments_;
+  // Slopes that keep every sample of the last segment within kEpsilon
+  double slope_lo_ = 0;
+  double slope_hi_ = std::numeric_limits<double>::infinity();
+};
+
+#endif  // DS_LEARNED_INDEX_H_
@@ -2,12 +2,17 @@
 #define DS_LOCK_FREE_PSKIP_LIST_H_
 
 #include <bitset>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <libpmemobj.h>
 
 #include "pmem.h"
 #include "common.h"
+#include "ds/bloom_filter.h"
 #include "ds/lockfree_skiplist.h"
 #include "ds/nodes.h"
 
@@ -28,35 +33,114 @@ class lockfree_pskiplist {
   typedef struct VARSTR_pcmp NodeCmp;
   typedef struct VARSTR_node mem_Node;
 #endif
-  // Zipper Compaction Item: (lowNode, preds[], succs[])
+#ifdef BR_HYBRID
+  // Index levels of a node in DRAM (hybrid mode). A PMEM node keeps only its
+  // bottom-level link and, if it is taller, the pointer to its tower in
+  // next[1], which is not persisted and is rebuilt by load(). A tower copies
+  // the key and the tag, so that searches touch PMEM only at the bottom.
+  struct Tower {
+    Node* node;
+    uint64_t tag;
+#ifndef BR_STRING_KV
+    uint64_t key;
+#else
+    std::string_view key;  // copy, after next[]
+#endif
+    int height;
+    std::atomic<uint64_t> next[1];  // next[l] (1 <= l < height): Tower* of the successor
+  };
+  using Upper = Tower;
+#else
+  // Holder of the index levels (l >= 1) of a node: the PMEM node itself,
+  // linked by region-local offsets
+  using Upper = Node;
+#endif
+  // Predecessors and successors of a node. Level 0 is the braided bottom
+  // level (moff links), levels >= 1 are the index levels of one region.
+  struct Position {
+    Node* bottom_pred;
+    uint64_t bottom_succ;
+    Upper* preds[kMaxHeight];
+    uint64_t succs[kMaxHeight];
+    // The predecessor at the top level, which a following search of a larger
+    // key can start from
+    Upper* finger() const { return preds[kMaxHeight - 1]; }
+  };
+  // Zipper Compaction Item: (lowNode, position)
   struct zc_item {
     int region;
     Node* node;
-    Node* preds[kMaxHeight];
-    uint64_t succs[kMaxHeight];
-    zc_item(const int r, Node* node_in, Node* preds_in[], uint64_t succs_in[]) {
-      region = r;
-      node = node_in;
-      memcpy((void*) preds, (void*) preds_in, kMaxHeight * sizeof(Node*));
-      memcpy((void*) succs, (void*) succs_in, kMaxHeight * sizeof(uint64_t));
-    }
+    Position pos;
+    zc_item(const int r, Node* node_in, const Position& pos_in) : region(r), node(node_in), pos(pos_in) {}
   };
 
  public:
   lockfree_pskiplist(PMEMobjpool* pops[]);
   void init();
+  // Hybrid mode: also rebuilds the DRAM towers from the bottom level
   void load(TOID(BraidedSkipListBase)& base);
   TOID(BraidedSkipListBase) base();
-  Node* new_node(ThreadData* td, const int r, const Key& key, const uint64_t value, int height = 0);
-  // Returns pred
-  Node* insert(ThreadData* const td, const int r, Node* const node, Node* pred = NULL, bool persist = true);
+  // `tag`: make_tag(seq, type)
+  Node* new_node(ThreadData* td, const int r, const Key& key, const uint64_t value, int height,
+                 const uint64_t tag,
+                 const std::string_view& inline_value = std::string_view());
+  // Returns a finger for a following insert() of a larger node in region r
+  Upper* insert(ThreadData* const td, const int r, Node* const node, Upper* pred = NULL, bool persist = true);
   // Returns (node->key == key) ? node : NULL
   Node* find(ThreadData* const td, const int r, const Key& key, const Node* pred = NULL);
-  void merge_WAL(ThreadData* td, const unsigned long rmask, lockfree_skiplist* other);
-  void merge_IUL(ThreadData* td, const unsigned long rmask, lockfree_skiplist* other);
+  // Interleaved find() of n keys, see lockfree_skiplist::find_batch().
+  // A traversal with a node in `preds` starts at it in the bottom level; the
+  // node must be less than the key.
+  void find_batch(ThreadData* const td, const int r, const size_t n, const Key* keys, Node** nodes_out,
+                  const Node* const* preds = NULL);
+  // See lockfree_skiplist::find_version()
+  const Node* find_version(const Node* node, const uint64_t snapshot);
+  // Compactions keep an older version of a key while a snapshot may read it,
+  // i.e., while the next newer version is newer than `oldest_snapshot`.
+  // The merges add the keys they insert to `filter`, if any.
+  // A merge flushes the nodes of `other` from `begin` (the first one if NULL)
+  // up to `end`, see lockfree_skiplist::split_points(). Merges of different
+  // ranges may run at the same time.
+  void merge_WAL(ThreadData* td, lockfree_skiplist* other, const mem_Node* begin, const mem_Node* end,
+                 const uint64_t oldest_snapshot, BloomFilter* filter = NULL);
+  void merge_IUL(ThreadData* td, lockfree_skiplist* other, const mem_Node* begin, const mem_Node* end,
+                 const uint64_t oldest_snapshot, BloomFilter* filter = NULL);
   Node* head(const int r);
-  void zipper_compaction(ThreadData* const td, const unsigned long rmask, const int lower_level, lockfree_pskiplist* lower);
-  void log_structured_compaction(ThreadData* const td, const unsigned long rmask, const int lower_level, lockfree_pskiplist* lower);
+  // Zipper compaction of `lower` into this skiplist, by key range (see
+  // ZipperCompaction). The scan phase appends the nodes of lower from `begin`
+  // (the first one if NULL) up to `end` with their positions in this
+  // skiplist. The merge phase links them, from the last one.
+  void zipper_scan(ThreadData* const td, lockfree_pskiplist* lower, Node* begin, const Node* end,
+                   std::deque<zc_item>* items);
+  void zipper_merge(ThreadData* const td, const int lower_level, std::deque<zc_item>* items);
+  // Up to n - 1 nodes of the primary region, in order, which split the bottom
+  // level into ranges of about the same number of nodes. Taken from the
+  // lowest index level that has a few of them per range.
+  std::vector<Node*> split_points(const int n);
+  // `retire_fn`: runs the freeing of the versions unlinked in the last level
+  // after a grace period
+  void log_structured_compaction(ThreadData* const td, const unsigned long rmask, const int lower_level, lockfree_pskiplist* lower,
+                                 const uint64_t oldest_snapshot,
+                                 const std::function<void(std::function<void()>)>& retire_fn);
+  // Unlinks the versions of `key` that follow `keep` (or all of them if `keep`
+  // is NULL), except those still visible at `oldest_snapshot`. `probe` is a
+  // node of the same key not older than any of them. The unlinked nodes are
+  // evicted from the lookup cache and freed through `retire_fn`.
+  // Callers must hold compaction_mu_.
+  void unlink_versions(ThreadData* const td, const int r, Node* probe, Node* keep, const uint64_t oldest_snapshot,
+                       const std::function<void(std::function<void()>)>& retire_fn);
+  // Frees the heads and the base of a merged-down skiplist, and every node in
+  // the bottom level if `reclaim_nodes` is set. No reader may reach it anymore.
+  // Hybrid mode: the towers of the nodes are freed if `reclaim_towers` is set,
+  // i.e., unless the nodes were zipped into another skiplist.
+  // Returns the number of bytes freed.
+  size_t reclaim(const bool reclaim_nodes, const bool reclaim_towers);
+#ifdef BR_STRING_KV
+  // Drops the entries of the lookup cache that point to nodes of this
+  // skiplist. Readers may still hold such a pointer until a grace period
+  // later, so the nodes are reclaimed only then.
+  void evict_cached();
+#endif
 
   std::shared_ptr<PRegionIterator> new_region_iterator(const unsigned long rmask);
 
@@ -66,14 +150,79 @@ class lockfree_pskiplist {
   void debug_scan();
 
  public:
-  void find_position(ThreadData* const td, const int r, Node* node, Node* preds[],
-                     uint64_t succs[], Node* pred = NULL, const int min_h = 0);
-  void find_position_braided(ThreadData* const td, Node* node, Node* preds[], uint64_t succs[], Node* pred = NULL);
+  // Searches the levels from min_h up; the bottom level only if min_h is 0
+  void find_position(ThreadData* const td, const int r, Node* node, Position* pos,
+                     Upper* pred = NULL, const int min_h = 0);
+  void find_position_braided(ThreadData* const td, Node* node, Position* pos, Node* pred);
   Node* find_braided(ThreadData* const td, const Key& key, const Node* pred);
+  // Bottom-level node from which find_braided() finds `key`, reached by the
+  // index levels of region r from `pred` (the head if NULL)
+  const Node* descend(const int r, const Key& key, const Node* pred = NULL);
   void* offset_to_ptr(const int r, const uint64_t offset);
   void* moff_to_ptr(const uint64_t moff);
   void* moff_to_ptr(const uint64_t moff, int16_t& r);
   int random_height(Random& rnd);
+
+  // Index levels
+  Upper* upper_head(const int r) const {
+#ifndef BR_HYBRID
+    return head_[r];
+#else
+    return head_tower_[r];
+#endif
+  }
+  // NULL if the node has no index levels
+  Upper* upper_of(const Node* node) const {
+#ifndef BR_HYBRID
+    return (Node*) node;
+#else
+    return (node->height > 1) ? (Tower*) node->next[1].load(std::memory_order_acquire) : NULL;
+#endif
+  }
+  Node* node_of(const Upper* u) const {
+#ifndef BR_HYBRID
+    return (Node*) u;
+#else
+    return u->node;
+#endif
+  }
+  uint8_t upper_type(const Upper* u) const {
+#ifndef BR_HYBRID
+    return u->type();
+#else
+    return ValueType(u->tag & 0xff);
+#endif
+  }
+  // Index-level link of region r to `u`, and back
+  uint64_t upper_link(const int r, const Upper* u) const {
+#ifndef BR_HYBRID
+    return (uintptr_t) u - (uintptr_t) pop_[r];
+#else
+    return (uintptr_t) u;
+#endif
+  }
+  Upper* upper_ptr(const int r, const uint64_t link) {
+#ifndef BR_HYBRID
+    return (Node*) offset_to_ptr(r, link);
+#else
+    return (Tower*) link;
+#endif
+  }
+#ifndef BR_HYBRID
+  int upper_cmp(const Upper* a, const Key& key) const { return cmp_(a, key); }
+  int upper_cmp(const Upper* a, const Upper* b) const { return cmp_(a, b); }
+#else
+  int upper_cmp(const Tower* a, const Key& key) const;
+  // In the order of NodeCmp: by key, then newest first
+  int upper_cmp(const Tower* a, const Tower* b) const;
+  int upper_cmp(const Tower* a, const Node* b) const;
+  Tower* new_tower(Node* node);
+#endif
+  // The bottom level of region r starts at the primary head
+  Node* bottom_start(const int r, const Upper* pred) const {
+    Node* node = node_of(pred);
+    return (node == head_[r] && r != kPrimaryRegion) ? head_[kPrimaryRegion] : node;
+  }
 #if 1
   Node* get_shortcut(const Node* node);
 #endif
@@ -81,9 +230,42 @@ class lockfree_pskiplist {
  public:
   NodeCmp cmp_;
   Node* head_[kMaxNumRegions];
+#ifdef BR_HYBRID
+  Tower* head_tower_[kMaxNumRegions];
+#endif
   PMEMobjpool* pop_[kMaxNumRegions];
   TOID(BraidedSkipListBase) base_;
   int shard_;
+  std::mutex compaction_mu_;  // serializes last-level writers
+};
+
+// Zipper compaction of a lower skiplist split into key ranges, run by the
+// tasks of one job. The scan phases of the ranges run in parallel. The merge
+// phases run one at a time from the last range, which keeps the order of a
+// single zipper: a node is linked after all the nodes that follow it in the
+// lower skiplist, so readers of the lower skiplist never miss one. The task
+// that finds the next range scanned merges it; no task waits for another.
+class ZipperCompaction {
+  using Node = lockfree_pskiplist::Node;
+  using zc_item = lockfree_pskiplist::zc_item;
+ public:
+  // `num_tasks` tasks call run(), each with its own range number
+  ZipperCompaction(const int lower_level, const int num_tasks);
+  // Splits lower once its writers are done
+  void init(lockfree_pskiplist* upper, lockfree_pskiplist* lower);
+  void run(ThreadData* td, const int range);
+  int num_ranges() const { return (int) begins_.size(); }
+
+ private:
+  const int lower_level_;
+  lockfree_pskiplist* upper_ = NULL;
+  lockfree_pskiplist* lower_ = NULL;
+  std::vector<Node*> begins_;  // first node of each range, NULL for the first range
+  std::vector<std::deque<zc_item>> items_;
+  std::mutex mu_;
+  std::vector<bool> scanned_;  // guarded by mu_
+  int next_merge_ = -1;  // guarded by mu_
+  bool merging_ = false;  // guarded by mu_
 };
 
 class PRegionIterator {
@@ -93,6 +275,8 @@ class PRegionIterator {
   bool valid();
   void next();
   Node* node();
+  // Predecessor of node() in the bottom level, regardless of its region
+  Node* prev();
   int region();
  private:
   lockfree_pskiplist* const skiplist_;
@@ -100,6 +284,7 @@ class PRegionIterator {
   std::bitset<kMaxNumRegions> rbs_;
   int r_;
   Node* node_;
+  Node* prev_;
 };
 
 #if 1
@@ -118,14 +303,20 @@ class casc_pskiplist_iterator {
   void next();
   bool valid() const;
   int cmp();
-  //Node* pred();
   Node* node();
   const Node* shortcut();
+  // Last node before the key and its region, and the number of nodes passed
+  // to reach it
+  const Node* pred() const { return pred_; }
+  int16_t pred_region() const { return pred_region_; }
+  size_t visits() const { return visits_; }
 
  public:
   const int r_;
   lockfree_pskiplist* const skiplist_;
-  //Node* pred_;
+  const Node* pred_;
+  int16_t pred_region_;
+  size_t visits_;
   Node* node_;
   int cmp_;
   const Node* shortcut_;
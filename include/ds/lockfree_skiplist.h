@@ -1,8 +1,34 @@
 #ifndef DS_LOCK_FREE_SKIP_LIST_H_
 #define DS_LOCK_FREE_SKIP_LIST_H_
 
+#include <algorithm>
+#include <vector>
+
+#include "arena.h"
 #include "common.h"
 
+// Shortcut nodes of the cascading search (kTypeShortcut) sort after the
+// versions of their key. The value of one points to a node of an older
+// table, from which a search of that table can start, and its log_moff is
+// the target word: [63] PMEM table, [62:48] nodes walked by the search that
+// added it, [47:16] id of the table, [15:0] region of the node.
+struct Shortcut {
+  const void* node = NULL;
+  uint64_t target = 0;
+};
+constexpr uint64_t kShortcutPmem = 1ull << 63;
+constexpr uint64_t kShortcutMaxWalk = 0x7fff;
+inline uint64_t shortcut_target(const bool pmem, const uint64_t table_id, const int16_t region, const size_t walk) {
+  return (pmem ? kShortcutPmem : 0) | (std::min(walk, (size_t) kShortcutMaxWalk) << 48)
+      | ((table_id & 0xffffffff) << 16) | (uint16_t) region;
+}
+// Target word without the walk and the region, to compare with the table
+// a search is about to start
+inline uint64_t shortcut_table(const uint64_t target) { return target & 0x8000ffffffff0000; }
+inline uint64_t shortcut_table(const bool pmem, const uint64_t table_id) { return shortcut_target(pmem, table_id, 0, 0); }
+inline int16_t shortcut_region(const uint64_t target) { return target & 0xffff; }
+inline size_t shortcut_walk(const uint64_t target) { return (target >> 48) & kShortcutMaxWalk; }
+
 class lockfree_skiplist {
   friend class casc_skiplist_iterator;
 
@@ -18,19 +44,47 @@ class lockfree_skiplist {
 #endif
 
  public:
-  lockfree_skiplist();
-  // Returns pred
-  Node* insert(ThreadData* const td, Node* const node, Node* pred = NULL);
+  lockfree_skiplist(const size_t arena_block_size = kMemTableArenaBlockSize);
+  // Nodes are allocated from arena_ and released all at once here
+  ~lockfree_skiplist() = default;
+  char* allocate(const size_t size) { return arena_.allocate(size); }
+  size_t memory_usage() { return arena_.memory_usage(); }
+  // `finger`: NULL, or kMaxHeight predecessors kept by the caller across
+  // inserts, all NULL at first. Each node must sort after the finger, e.g.
+  // ascending keys, or a newer version of the previous key. The search
+  // starts from the lowest level at which the node falls right after the
+  // finger, and the finger moves to the predecessors of the node.
+  void insert(ThreadData* const td, Node* const node, Node** finger = NULL);
+  // Inserts a shortcut node of `key` to `target_node`, see Shortcut, unless
+  // the key has one into the same table
+  void add_shortcut(ThreadData* const td, const Key& key, const void* target_node, const uint64_t target);
+  // The shortcut into the table `table` (shortcut_table()) last passed by a
+  // search of `key`
+  Shortcut find_shortcut(const Key& key, const uint64_t table);
   // Returns (node->key == key) ? node : NULL
   Node* find(ThreadData* const td, const Key& key, const Node* pred = NULL);
+  // The newest version of node's key, from `node` on, that is not newer than
+  // `snapshot`. NULL if this list has none.
+  const Node* find_version(const Node* node, const uint64_t snapshot);
+  // find() of n keys at once. The traversals take turns, each prefetching
+  // its next node before yielding, so that their cache misses overlap.
+  void find_batch(ThreadData* const td, const size_t n, const Key* keys, Node** nodes_out);
   //void merge(lockfree_skiplist* other);
   Node* head();
+  // Up to n - 1 nodes, in order, which split the bottom level into ranges of
+  // about the same number of nodes. Each is the first node of its key, so
+  // that the versions of a key stay in one range. Not for a list being
+  // written.
+  std::vector<Node*> split_points(const int n);
 
  private:
-  void find_position(ThreadData* const td, Node* node, Node* preds[], Node* succs[], Node* pred = NULL, const int min_h = 0);
+  // Levels from min(max_h, pred->height - 1) down to min_h
+  void find_position(ThreadData* const td, Node* node, Node* preds[], Node* succs[], Node* pred = NULL, const int min_h = 0,
+                     const int max_h = kMaxHeight - 1);
 
  public:
   NodeCmp cmp_;
+  Arena arena_;
   Node* head_;
 };
 
@@ -41,19 +95,27 @@ class casc_skiplist_iterator {
   using Node = lockfree_skiplist::Node;
   using NodeCmp = lockfree_skiplist::NodeCmp;
  public:
+  static constexpr int kMaxShortcutTables = 3;
+
   casc_skiplist_iterator(lockfree_skiplist* const skiplist);
-  void seek(const Key& key, const Node* pred = NULL);
+  // Records the last shortcut passed into each of `tables` (shortcut_table())
+  void seek(const Key& key, const Node* pred = NULL, const uint64_t* tables = NULL, const int num_tables = 0);
   bool valid();
   int cmp();
   const Node* node();
-  const Node* shortcut();
-  uint64_t pmem_shortcut_offset(const int r);
+  // Last node before the key, and the number of nodes passed to reach it
+  const Node* pred();
+  size_t visits();
+  // Last shortcut passed into tables[i] of seek()
+  const Shortcut& shortcut(const int i);
  private:
   lockfree_skiplist* const skiplist_;
   const Node* node_;
+  const Node* pred_;
   int cmp_;  // NodeCmp(node_, search_key)
-  const Node* shortcut_;  // NodeCmp(shortcut_, node_) <= 0 holds if shortcut_ != NULL
-  uint64_t pmem_shortcut_offsets_[kMaxNumRegions];
+  size_t visits_;
+  // NodeCmp(shortcut, node_) <= 0 holds if set
+  Shortcut shortcuts_[kMaxShortcutTables];
 };
 #endif
 
@@ -2,26 +2,32 @@
 #define DS_NON_BLOCKING_READ_STACK_H_
 
 #include <atomic>
+#include <cassert>
 #include <cstdlib>
+#include <functional>
+#include <shared_mutex>
 #include <vector>
 
+// Readers traverse the stack without locks or reference counting. Popped
+// nodes are handed to the retire function (e.g., EpochManager::retire) and
+// must not be freed while a reader may still hold them.
 template<typename T>
 class nbr_stack {
   struct Node {
     T t;
-    std::shared_ptr<Node> next;
+    std::atomic<Node*> next;
   };
  public:
   class Iterator {
     friend class nbr_stack;
    public:
-    Iterator(nbr_stack* st) { 
-      node_ = std::atomic_load_explicit(&st->head_, std::memory_order_relaxed);
+    Iterator(nbr_stack* st) {
+      node_ = st->head_.load(std::memory_order_acquire);
     }
     bool valid() { return node_ != nullptr; }
     void next() {
       assert(valid());
-      node_ = std::atomic_load_explicit(&node_->next, std::memory_order_relaxed);
+      node_ = node_->next.load(std::memory_order_acquire);
     }
 
     T& operator*() {
@@ -29,30 +35,19 @@ class nbr_stack {
     }
 
    private:
-    std::shared_ptr<Node> node_;
+    Node* node_;
   };
 
  public:
   nbr_stack() : head_(nullptr), num_nodes_(0) { }
-  // Element access
-  //auto front() const {
-  //  auto p =  std::atomic_load(&head_);
-  //  return p->t;
-  //}
-  //auto back() const {
-  //  auto p = std::atomic_load(&head_);
-  //  while (p) {
-  //    // For p->next:
-  //    //  - something -> nullptr: happen
-  //    //  - nullptr -> something: not happen
-  //    auto np = std::atomic_load(&p->next);
-  //    if (np == nullptr) {
-  //      break;
-  //    }
-  //    p = np;
-  //  }
-  //  return p->t;
-  //}
+  ~nbr_stack() {
+    free_nodes(head_.load());
+  }
+
+  // Called with a function freeing popped nodes. Frees them at once if unset.
+  void set_retire_fn(std::function<void(std::function<void()>)> retire_fn) {
+    retire_fn_ = retire_fn;
+  }
 
   // Iterators
   Iterator begin() { return Iterator(this); }
@@ -74,97 +69,72 @@ class nbr_stack {
   // Modifiers
   void push_front(const T& t) {
     std::unique_lock<std::shared_mutex> lk(smu_);
-    auto p = std::make_shared<Node>();
+    auto p = new Node();
     p->t = t;
-    p->next = std::atomic_load(&head_);
-    while (!std::atomic_compare_exchange_weak(&head_, &p->next, p)) { }
+    p->next.store(head_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    head_.store(p, std::memory_order_release);
     num_nodes_++;
     lk.unlock();
   }
   void pop_backs_if(std::function<bool(T&)> crit) {
-    std::unique_lock<std::shared_mutex> lk(smu_);
-    std::vector<std::shared_ptr<Node>> last;
-    auto p = std::atomic_load(&head_);
-    std::shared_ptr<Node> pred = nullptr;
-    unsigned int last_cnt = 0;
-    while (p) {
-      auto np = std::atomic_load(&p->next);
-      if (crit(p->t)) {
-        last_cnt++;
-      } else {
-        last_cnt = 0;
-        pred = std::move(p);
-      }
-      p = std::move(np);
-    }
-    if (pred) {
-      std::shared_ptr<Node> nptr = nullptr;
-      std::atomic_store(&pred->next, nptr);
-    } else if (last_cnt > 0) {
-      head_ = nullptr;
-    }
-    assert(num_nodes_ >= last_cnt);
-    num_nodes_ -= last_cnt;
-    lk.unlock();
+    pop_backs_if_with_callback(crit, [](T&){});
   }
   void pop_backs_if_with_callback(std::function<bool(T&)> crit, std::function<void(T&)> cb){
     std::unique_lock<std::shared_mutex> lk(smu_);
 
     std::vector<Node*> nodes;
-    auto p = std::atomic_load(&head_);
+    Node* pred = nullptr;
+    auto p = head_.load(std::memory_order_relaxed);
     while (p) {
       if (crit(p->t)) {
-        nodes.push_back(p.get());
+        nodes.push_back(p);
       } else {
         nodes.clear();
+        pred = p;
       }
-      p = std::atomic_load(&p->next);
+      p = p->next.load(std::memory_order_relaxed);
     }
 
     size_t last_cnt = nodes.size();
-    for (int i = last_cnt - 1; i >= 0; i--) {
-      cb(nodes[i]->t);
-      if (i > 0) {
-        std::shared_ptr<Node> nptr = nullptr;
-        std::atomic_store(&(nodes[i - 1]->next), nptr);
+    if (last_cnt > 0) {
+      for (auto it = nodes.rbegin(); it != nodes.rend(); it++) {
+        cb((*it)->t);
+      }
+      if (pred) {
+        pred->next.store(nullptr, std::memory_order_release);
       } else {
-        head_ = nullptr;
+        head_.store(nullptr, std::memory_order_release);
       }
     }
     assert(num_nodes_ >= last_cnt);
     num_nodes_ -= last_cnt;
     lk.unlock();
 
-    //std::vector<std::shared_ptr<Node>> last;
-    //auto p = std::atomic_load(&head_);
-    //std::shared_ptr<Node> pred = nullptr;
-    //unsigned int last_cnt = 0;
-    //while (p) {
-    //  auto np = std::atomic_load(&p->next);
-    //  if (crit(p->t)) {
-    //    last_cnt++;
-    //  } else {
-    //    last_cnt = 0;
-    //    pred = std::move(p);
-    //  }
-    //  p = std::move(np);
-    //}
-    //if (pred) {
-    //  // ...->O->O->X(pred)->O->...
-    //  std::shared_ptr<Node> nptr = nullptr;
-    //  std::atomic_store(&pred->next, nptr);
-    //} else if (last_cnt > 0) {
-    //  head_ = nullptr;
-    //}
-    //assert(num_nodes_ >= last_cnt);
-    //num_nodes_ -= last_cnt;
-    //lk.unlock();
+    if (last_cnt > 0) {
+      // The popped nodes are still linked to each other
+      Node* first = nodes.front();
+      if (retire_fn_) {
+        retire_fn_([first]{ free_nodes(first); });
+      } else {
+        free_nodes(first);
+      }
+    }
+  }
+
+ private:
+  static void free_nodes(Node* p) {
+    while (p) {
+      auto np = p->next.load(std::memory_order_relaxed);
+      delete p;
+      p = np;
+    }
   }
 
  private:
-  std::shared_ptr<Node> head_;
+  std::atomic<Node*> head_;
   size_t num_nodes_;
   std::shared_mutex smu_;
+  std::function<void(std::function<void()>)> retire_fn_;
 };
 
 #endif  // DS_NON_BLOCKING_READ_STACK_H_
@@ -94,9 +94,9 @@ struct UINT64_node_cmp {
     } else if (a->key() < b->key()) {
       return -1;
     } else {
-      if (a->tag() < b->tag()) {
+      if ((a->tag() >> 8) < (b->tag() >> 8)) {
         return 1;
-      } else if (a->tag() > b->tag()) {
+      } else if ((a->tag() >> 8) > (b->tag() >> 8)) {
         return -1;
       } else {
         return 0;
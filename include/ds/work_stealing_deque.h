@@ -0,0 +1,105 @@
+#ifndef DS_WORK_STEALING_DEQUE_H_
+#define DS_WORK_STEALING_DEQUE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Chase-Lev work-stealing deque of pointers. The owner thread pushes and
+// pops at the bottom; any other thread steals from the top. Only a steal and
+// a pop of the last element contend, on one CAS. The array grows by doubling.
+// Old arrays may still be read by thieves and are freed with the deque.
+template<typename T>
+class WorkStealingDeque {
+  struct Array {
+    const int64_t capacity;  // power of two
+    std::atomic<T*>* const buf;
+    explicit Array(const int64_t c) : capacity(c), buf(new std::atomic<T*>[c]) {}
+    ~Array() { delete[] buf; }
+    T* get(const int64_t i) const { return buf[i & (capacity - 1)].load(std::memory_order_relaxed); }
+    void put(const int64_t i, T* x) { buf[i & (capacity - 1)].store(x, std::memory_order_relaxed); }
+  };
+
+ public:
+  explicit WorkStealingDeque(const int64_t capacity = 64) : array_(new Array(capacity)) {}
+  ~WorkStealingDeque() {
+    delete array_.load();
+    for (auto a : retired_) {
+      delete a;
+    }
+  }
+
+  // Owner only
+  void push(T* x) {
+    const int64_t b = bottom_.load(std::memory_order_relaxed);
+    const int64_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
+    if (b - t > a->capacity - 1) {
+      a = grow(a, t, b);
+    }
+    a->put(b, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only. NULL if empty.
+  T* pop() {
+    const int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    T* x = nullptr;
+    if (t <= b) {
+      x = a->get(b);
+      if (t == b) {
+        // The last one: race with the thieves
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+          x = nullptr;
+        }
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return x;
+  }
+
+  // Any thread. NULL if empty or if another thread took the element first.
+  T* steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    Array* a = array_.load(std::memory_order_acquire);
+    T* x = a->get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return x;
+  }
+
+  bool empty() const {
+    return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  Array* grow(Array* a, const int64_t t, const int64_t b) {
+    Array* na = new Array(a->capacity * 2);
+    for (int64_t i = t; i < b; i++) {
+      na->put(i, a->get(i));
+    }
+    retired_.push_back(a);
+    array_.store(na, std::memory_order_release);
+    return na;
+  }
+
+  alignas(64) std::atomic<int64_t> top_{0};
+  alignas(64) std::atomic<int64_t> bottom_{0};
+  std::atomic<Array*> array_;
+  std::vector<Array*> retired_;  // owner only
+};
+
+#endif  // DS_WORK_STEALING_DEQUE_H_
@@ -0,0 +1,66 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+constexpr int kMaxNumEpochThreads = 1024;
+
+// Epoch-based reclamation for tables reachable by raw pointers.
+// Readers announce the global epoch in a per-thread slot for the duration of
+// an operation (EpochGuard). Objects unlinked by writers are retired with the
+// epoch at unlinking, and freed once no thread is in that epoch or an older
+// one.
+class EpochManager {
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch;  // 0: quiescent
+    int depth;  // nesting level, owner thread only
+    Slot() : epoch(0), depth(0) { }
+  };
+  struct Retired {
+    uint64_t epoch;
+    std::function<void()> free_fn;
+  };
+
+ public:
+  EpochManager();
+  ~EpochManager();
+
+  // Reentrant. Pointers loaded between enter() and exit() stay valid.
+  void enter();
+  void exit();
+  // True if the calling thread is between enter() and exit(), for checks
+  bool in_epoch() const;
+
+  // Blocks until every thread that entered before this call has exited
+  void synchronize();
+  // Runs `free_fn` after a grace period
+  void retire(std::function<void()> free_fn);
+  // Runs the retired functions whose grace period has passed
+  void reclaim();
+
+ private:
+  // Smallest epoch announced by an active thread, UINT64_MAX if none
+  uint64_t min_active_epoch();
+
+ private:
+  std::atomic<uint64_t> epoch_;
+  Slot slots_[kMaxNumEpochThreads];
+  std::mutex mu_;
+  std::deque<Retired> retired_;
+};
+
+class EpochGuard {
+ public:
+  EpochGuard(EpochManager* mgr) : mgr_(mgr) { mgr_->enter(); }
+  ~EpochGuard() { mgr_->exit(); }
+  EpochGuard(const EpochGuard&) = delete;
+  EpochGuard& operator=(const EpochGuard&) = delete;
+
+ private:
+  EpochManager* const mgr_;
+};
+
+#endif  // EPOCH_H_
@@ -1,9 +1,10 @@
 #pragma once
 
+#include <condition_variable>
 #include <deque>
-#include <map>
 #include <memory>
-#include <unordered_set>
+#include <mutex>
+#include <vector>
 
 #include "jobs/job.h"
 #include "jobs/worker.h"
@@ -11,58 +12,77 @@
 class Job;
 class Worker;
 
+// Work-stealing scheduler of compaction jobs.
+//
+// A job waits in the lane of its level until a worker starts it: memtable
+// flushes first, then the jobs of L0, L1, ..., and background jobs (GC,
+// learned index) last, as jobPriorityComparator orders them. The worker
+// pushes the tasks of the job to its own deque of that lane, runs them, and
+// the idle workers steal them. A worker looks for work lane by lane: its
+// own deque, then the deques of the others, then a job to start. The last
+// task of a job to complete runs the job callback.
 class JobManager {
  public:
+  static constexpr int kNumLanes = kMaxNumPmemLevels + 2;
+
   JobManager(const int num_workers, const double high_priority_rate = 0.8);
-  //void config_workers(const int num_workers, ThreadData* tds[]);
   void start();
+  // Workers finish the tasks of started jobs and exit. Jobs not started are
+  // dropped.
   void stop();
+  // Returns when every job enqueued has completed
   void wait();
-  //bool idle();
   void join();
   bool enqueue(std::shared_ptr<Job> job);
-  //void complete(std::shared_ptr<Job> job);
-  void complete_task(std::shared_ptr<Task> task);
   ThreadData* worker_td(const int id);
 
   bool ready() { return ready_.load(); }
-  //void busy_wait_for_ready_state();
+  // Jobs enqueued but not completed yet
+  size_t num_jobs() { return num_jobs_.load(std::memory_order_relaxed); }
+  // Takes the jobs not started yet
   std::deque<std::shared_ptr<Job>> steal_pending_jobs();
+  // Workers 0..n-1 run jobs. The others finish their task and park; the
+  // tasks left in their deques are stolen.
+  void set_num_active_workers(const int n);
+  int num_active_workers() { return num_active_.load(std::memory_order_relaxed); }
+
+  // Loop of a worker thread
+  void work(Worker* w);
 
  private:
   static bool jobPriorityComparator(const std::shared_ptr<Job>& a, const std::shared_ptr<Job>& b);
-  void start_workers();
-  void wrapup_running_jobs();
-  void stop_workers();
-  void job_process_loop();
+  static int lane(Job* job);
+  // Next task for w to run, NULL if there is none. Starts a job if no task
+  // of its lane or of a higher one is queued.
+  Task* find_task(Worker* w);
+  bool start_job(Worker* w, const int l);
+  void run_task(Worker* w, Task* task);
+  // Wakes up parked workers for n more queued tasks or jobs
+  void add_pending(const int n);
 
  private:
   const int num_workers_;
-  int num_high_priority_workers_;
-  bool stop_;
-  std::deque<std::shared_ptr<Job>> jq_;  // job submission queue
-  std::deque<std::shared_ptr<Job>> pq_;
-  std::unordered_set<std::shared_ptr<Job>> running_jobs_;
-  std::unordered_set<std::shared_ptr<Job>> aborted_jobs_;
-  std::deque<Task*> tcq_;  // task completion queue
-  //std::deque<std::shared_ptr<Job>> cq_;  // job completion queue
-
-  static bool workerComparator(Worker* a, Worker* b);
   std::vector<std::shared_ptr<Worker>> workers_;
-  //std::vector<std::shared_ptr<Worker>> workers_[kMaxNumRegions];
-  //std::vector<std::shared_ptr<Worker>> non_bound_workers_;
-  //std::vector<std::shared_ptr<Worker>> high_priority_workers_;
-  std::map<int, std::weak_ptr<Worker>> id_to_worker_;
 
-  // Thread-unsafe
-  std::unordered_map<Task*, Worker*> task_to_worker_;
-  std::unordered_map<Worker*, int> worker_tasks_;
+  // Jobs not started, a heap in the order of jobPriorityComparator per lane
+  struct Lane {
+    std::mutex mu;
+    std::vector<std::shared_ptr<Job>> jobs;
+  };
+  Lane lanes_[kNumLanes];
 
-  std::mutex mu_;
-  std::condition_variable cv_;
-  std::condition_variable wait_cv_;
+  // Tasks in the deques plus jobs in the lanes. Workers park while it is 0.
+  std::atomic<int64_t> num_pending_{0};
+  std::mutex park_mu_;
+  std::condition_variable park_cv_;
+  std::condition_variable inactive_cv_;  // workers beyond num_active_
+  std::atomic<int> num_active_;
+  bool stop_ = false;  // guarded by park_mu_
+  std::atomic<bool> stopping_{false};
 
-  std::thread main_thread_;
+  std::mutex wait_mu_;
+  std::condition_variable wait_cv_;
 
   std::atomic<bool> ready_;
+  std::atomic<size_t> num_jobs_;
 };
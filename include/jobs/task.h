@@ -16,9 +16,13 @@ class Task {
   void run(ThreadData* td);
   void callback(ThreadData* td);
   Job* job();
+  // A queued task holds its job, which holds the task
+  void hold_job(std::shared_ptr<Job> job) { job_ref_ = std::move(job); }
+  std::shared_ptr<Job> release_job() { return std::move(job_ref_); }
 
  private:
   Job* job_;
+  std::shared_ptr<Job> job_ref_;
   std::function<void(ThreadData*)> task_fn_;
   std::function<void(ThreadData*)> cb_fn_;
   //JobManager* job_mgr_;
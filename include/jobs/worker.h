@@ -1,12 +1,12 @@
 #pragma once
 
-#include <condition_variable>
-#include <mutex>
-#include <queue>
+#include <atomic>
+#include <memory>
 #include <thread>
 
 #include <numa.h>
 
+#include "ds/work_stealing_deque.h"
 #include "jobs/job_manager.h"
 #include "jobs/task.h"
 
@@ -17,17 +17,19 @@ class Worker {
  public:
   Worker(const int id, JobManager* job_mgr, const int numa = -1, const int cpu = -1);
   void start();
-  void stop(bool force = false);
-  void wait();
   void join();
-  void enqueue(std::shared_ptr<Task> task);
-  size_t size();  // the number of enqueued tasks
+  int id() const { return worker_id_; }
   ThreadData* td() { return td_; }
 
   bool ready() { return ready_.load(); }
-  bool idle();
   void busy_wait_for_ready_state();
 
+  // Tasks started by this worker, per lane of JobManager. The worker pushes
+  // and pops them, the other workers steal them.
+  WorkStealingDeque<Task>* deque(const int lane) { return &deques_[lane]; }
+  // Next victim to steal from, walked round-robin
+  int next_victim = 0;
+
  private:
   void set_thread_affinity();
   void task_process_loop();
@@ -37,15 +39,8 @@ class Worker {
   const int numa_;
   const int cpu_;
   JobManager* job_mgr_;
-  ThreadData* td_;
-  bool is_stop_ = false;
-  bool force_stop_ = false;
-  std::weak_ptr<Task> running_task_;
-  std::queue<std::shared_ptr<Task>> q_;
-  std::mutex mu_;
-
-  std::condition_variable cv_;
-  std::condition_variable wait_cv_;
+  ThreadData* td_ = NULL;
+  std::unique_ptr<WorkStealingDeque<Task>[]> deques_;  // JobManager::kNumLanes
   std::thread work_thread_;
 
   std::atomic<bool> ready_;
@@ -3,23 +3,42 @@
 
 #include <string_view>
 
+// Value word of a string key: offset of the value in the value log, or
+// kInlineValueFlag | length if the value itself follows the word
+constexpr uint64_t kInlineValueFlag = 1ull << 63;
+
+inline uint64_t inline_value_word(const std::string_view& value) {
+  return kInlineValueFlag | value.length();
+}
+
+// Encoded key: key length (4B), key, padding to 8 bytes, tag (8B), value (8B),
+// inline value padded to 8 bytes (if any).
+// The tag and the value are 8-byte aligned so that the value can be updated
+// with an atomic CAS (e.g., by the value log GC).
 class StringKey {
  public:
-  StringKey(char* buf, const std::string_view& key, const uint64_t tag, const uint64_t value) : data_(buf) {
+  // `inline_value`: bytes of an inline value word
+  StringKey(char* buf, const std::string_view& key, const uint64_t tag, const uint64_t value,
+            const std::string_view& inline_value = std::string_view()) : data_(buf) {
     char* p = data_;
     *reinterpret_cast<uint32_t*>(p) = key.length();
     p += sizeof(uint32_t);
     memcpy(p, key.data(), key.length());
-    p += key.length();
+    p = data_ + tag_offset(key.length());
     *reinterpret_cast<uint64_t*>(p) = tag;
     p += sizeof(uint64_t);
     *reinterpret_cast<uint64_t*>(p) = value;
+    p += sizeof(uint64_t);
+    if (value & kInlineValueFlag) {
+      memcpy(p, inline_value.data(), inline_value.length());
+    }
   }
 
   StringKey(char* buf) : data_(buf) { }
 
-  static size_t compute_alloc_size(const std::string_view& key) {
-    return aligned_size(8, sizeof(uint32_t) + key.length() + sizeof(uint64_t) + sizeof(uint64_t));  // key_len, key, tag, value
+  static size_t compute_alloc_size(const std::string_view& key, const uint64_t value = 0) {
+    return tag_offset(key.length()) + sizeof(uint64_t) + sizeof(uint64_t)  // key_len, key, tag, value
+        + inline_size(value);
   }
 
   uint32_t length() const {
@@ -32,15 +51,41 @@ class StringKey {
   }
 
   uint64_t tag() const {
-    return *reinterpret_cast<uint64_t*>(data_ + sizeof(uint32_t) + this->length());
+    return *reinterpret_cast<uint64_t*>(data_ + tag_offset(this->length()));
   }
 
   uint64_t value() const {
-    return *reinterpret_cast<uint64_t*>(data_ + sizeof(uint32_t) + this->length() + sizeof(uint64_t));
+    return *value_ptr();
+  }
+
+  uint64_t* value_ptr() const {
+    return reinterpret_cast<uint64_t*>(data_ + tag_offset(this->length()) + sizeof(uint64_t));
+  }
+
+  bool has_inline_value() const {
+    return value() & kInlineValueFlag;
+  }
+
+  // Empty if the value is in the value log
+  std::string_view inline_value() const {
+    uint64_t v = value();
+    if (!(v & kInlineValueFlag)) {
+      return std::string_view();
+    }
+    return std::string_view(reinterpret_cast<char*>(value_ptr() + 1), v & ~kInlineValueFlag);
   }
 
   size_t alloc_size() const {
-    return aligned_size(8, sizeof(uint32_t) + this->length() + 2*sizeof(uint64_t));
+    return tag_offset(this->length()) + 2*sizeof(uint64_t) + inline_size(value());
+  }
+
+ private:
+  static size_t tag_offset(const size_t key_length) {
+    return aligned_size(8, sizeof(uint32_t) + key_length);
+  }
+
+  static size_t inline_size(const uint64_t value) {
+    return (value & kInlineValueFlag) ? aligned_size(8, value & ~kInlineValueFlag) : 0;
   }
 
  private:
@@ -2,7 +2,11 @@
 #define LOG_H_
 
 #include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <mutex>
+#include <utility>
+#include <vector>
 
 #include <libpmemobj.h>
 
@@ -17,25 +21,98 @@ class LogBlock {
   size_t fetch_add_size(const size_t size);
   TOID(LogBlockBase) base();
   char* data();
+  int region() { return r_; }
+
+  // Value log: threads that may still write to the block or insert the keys
+  // of its values into the index hold a reference
+  void ref() { writers_.fetch_add(1); }
+  void unref() { writers_.fetch_sub(1); }
+  int num_writers() { return writers_.load(); }
 
  private:
   const int r_;
   TOID(LogBlockBase) base_;
   uint64_t* p_;
   char* data_;
+  std::atomic<int> writers_{0};
+};
+
+// Leader/follower group commit state of a region.
+// Writers publish the range they wrote and wait until a leader has flushed
+// it. The leader flushes every published range and issues a single drain.
+// Before that, it sleeps on `cv` for the commit window, or until enough
+// entries are pending.
+struct alignas(64) LogGroupCommit {
+  std::mutex mu;
+  std::condition_variable cv;
+  std::vector<std::pair<char*, size_t>> pending;  // published, not yet durable
+  size_t pending_entries = 0;                      // protected by mu
+  uint64_t next_ticket = 1;                        // protected by mu
+  std::atomic<uint64_t> durable_ticket{0};
+  std::atomic<bool> leader{false};
 };
 
 class Log {
  public:
   void init(const int s);  // s: shard
   void load(TOID(LogBase) log_base[]);
-  uint64_t write_WAL(ThreadData* td, const int s, const std::string_view& key, const uint64_t value);
-  uint64_t write_IUL(ThreadData* td, const int s, const std::string_view& key, const uint64_t value);
+  // Runs the preparation of spare blocks off the writer path, e.g. as a job.
+  // Inline if unset.
+  void set_background_fn(std::function<void(std::function<void()>)> background_fn) {
+    background_fn_ = background_fn;
+  }
+  // `tag`: see make_tag()
+  // `inline_value`: bytes of an inline value word (string keys)
+  uint64_t write_WAL(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                     const uint64_t tag, const std::string_view& inline_value = std::string_view());
+  uint64_t write_IUL(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                     const uint64_t tag, const std::string_view& inline_value = std::string_view());
+  // Batch versions: one reservation and one drain per block-sized range.
+  // `inline_values` may be NULL if no value is inline.
+  void write_WAL_batch(ThreadData* td, const int s, const size_t n,
+                       const std::string_view* keys, const uint64_t* values, const uint64_t* tags,
+                       const std::string_view* inline_values, uint64_t* log_moffs_out);
+  void write_IUL_batch(ThreadData* td, const int s, const size_t n,
+                       const std::string_view* keys, const uint64_t* values, const uint64_t* tags,
+                       const std::string_view* inline_values, uint64_t* log_moffs_out);
+
+ private:
+  LogBlock* get_available_log_block(ThreadData* td, const int s,
+                                    const int r, const size_t my_size,
+                                    size_t* before_out);
+  // Allocates the spare block of region r if there is none. The block is
+  // recorded in the log root (LogBase::spare) until it is linked, so a crash
+  // does not leak it.
+  void prepare_spare(const int s, const int r);
+  // Carves my_size bytes out of the thread's private chunk
+  char* reserve(ThreadData* td, const int s, const int r, const size_t my_size);
+  static int random_height(Random& rnd);
+  static size_t WAL_entry_size(const std::string_view& key, const uint64_t value);
+  static void write_WAL_entry(char* p, const std::string_view& key, const uint64_t tag, const uint64_t value,
+                              const std::string_view& inline_value);
+  static size_t IUL_entry_size(const std::string_view& key, const int height, const uint64_t value);
+  static void write_IUL_entry(char* p, const std::string_view& key, const uint64_t tag, const uint64_t value, const int height,
+                              const std::string_view& inline_value);
+  // Makes [begin, begin + size) durable, either directly or via group commit
+  void persist_entries(ThreadData* td, const int s, const int r,
+                       char* begin, const size_t size, const size_t num_entries);
+  // The same for several ranges with a single drain, e.g. the headers of
+  // IUL entries without their links
+  void persist_entries(ThreadData* td, const int s, const int r,
+                       const std::pair<char*, size_t>* ranges, const size_t num_ranges,
+                       const size_t num_entries);
+  void group_commit(ThreadData* td, const int s, const int r,
+                    const std::pair<char*, size_t>* ranges, const size_t num_ranges,
+                    const size_t num_entries);
 
  private:
   LogBlock* blocks_[kMaxNumRegions];
+  LogBlock* spare_[kMaxNumRegions] = { NULL };  // pre-allocated next block
+  LogGroupCommit gc_[kMaxNumRegions];
   TOID(LogBase) log_base_[kMaxNumRegions];
   std::mutex mu_;
+  std::mutex spare_mu_;  // serializes prepare_spare(), not held with mu_
+  std::function<void(std::function<void()>)> background_fn_;
 };
 
 #endif  // LOG_H_
@@ -2,8 +2,10 @@
 #define MEMTABLE_H_
 
 #include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <map>
+#include <mutex>
 
 #include "arena.h"
 #include "common.h"
@@ -15,6 +17,9 @@
 class casc_mem_table_iterator;
 class PmemTable;
 
+// PmemTable::id(), for the headers that include this one first
+uint64_t pmem_table_id(const PmemTable* table);
+
 class MemTable {
 #ifndef BR_STRING_KV
   typedef uint64_t Key;
@@ -55,6 +60,7 @@ class MemTable {
     //A'->next = B'
     reserved_skiplist_ = new lockfree_skiplist();
     if (auto upper_sp = upper_.lock()) {
+      upper_id_ = pmem_table_id(upper_sp.get());
       future_pmem_table_ = std::make_shared<PmemTable>(upper_sp);
     } else {
       future_pmem_table_ = std::make_shared<PmemTable>(nullptr);
@@ -81,30 +87,19 @@ class MemTable {
   //  state_.store(0);
   //}
 
+  // Frees every node of this table at once. Called when the last reference
+  // is dropped, i.e. after the table is persisted and popped from immutables.
   ~MemTable() {
     delete skiplist_;
   }
 
-  void init_shortcut_IUL(PMEMobjpool* pops[]) {
-    Node* pred = skiplist_->head();
-    while (pred) {
-      Node* curr = (Node*) pred->next[0].load();
-      if (curr && curr->type() == kTypeShortcut) {
-        uint64_t casc_dst_moff = curr->log_moff;
-        int16_t r = casc_dst_moff & 0xffff;
-        //int r = it->region();
-        //int height = random_height(td->rnd);
-        TOID(char) new_node_buf;
-        size_t palloc_size = pNode::compute_alloc_size(curr->key(), curr->height);
-        POBJ_ALLOC(pops[r], &new_node_buf, char, palloc_size, NULL, NULL);
-        pNode* new_node = pNode::init_node(D_RW(new_node_buf), curr->key(), curr->tag(), casc_dst_moff, curr->height);
-        curr->log_moff = (((uint64_t) new_node - (uint64_t) pops[r])<<16)|r;
-      }
-      pred = curr;
-    }
-  }
-
-  void add(ThreadData* td, const Key& key, const uint64_t value, const uint64_t log_moff) {
+  // `finger`: see lockfree_skiplist::insert(). A batch of ascending keys
+  // passes the same one to each add().
+  // `tag`: make_tag(seq, type)
+  // `inline_value`: bytes of an inline value word (string keys)
+  void add(ThreadData* td, const Key& key, const uint64_t value, const uint64_t log_moff, Node** finger,
+            const uint64_t tag,
+            const std::string_view& inline_value = std::string_view()) {
     // Random Height
     static const unsigned int kBranching = 4;
     int height = 1;
@@ -112,37 +107,41 @@ class MemTable {
       height++;
     }
 
+#ifndef BR_STRING_KV
     const size_t alloc_size = Node::compute_alloc_size(key, height);
-    void* buf = aligned_alloc(8, alloc_size);
-    Node* node = Node::init_node((char*) buf, key, (seq_order_<<8|kTypeValue), value, height);
-    node->log_moff = log_moff;
-
-    //td->visit_cnt = 0;
-    skiplist_->insert(td, node);
-    // sc_node->value => node
-    // sc_node->log_moff => future pmem node of the current node (log_moff)
-#ifdef BR_CASCADE
-    if(false && td->visit_cnt > 5) {  // FOR TEST
-    if (height >= kMaxHeight - 5) {
-//fprintf(stderr,"TSET visit cnt = %zu\n", td->visit_cnt);
-      void* sc_buf = aligned_alloc(8, alloc_size);
-      Node* sc_node = Node::init_node((char*) sc_buf, key, kTypeShortcut, (uint64_t) buf, height);
-#ifdef BR_LOG_IUL
-      sc_node->log_moff = log_moff;
+    char* buf = skiplist_->allocate(alloc_size);
+    Node* node = Node::init_node(buf, key, tag, value, height);
 #else
-      sc_node->log_moff = 0;
+    const size_t alloc_size = Node::compute_alloc_size(key, height, value);
+    char* buf = skiplist_->allocate(alloc_size);
+    Node* node = Node::init_node(buf, key, tag, value, height, true, inline_value);
 #endif
-      reserved_skiplist_->insert(td, sc_node);
-    }
+    node->log_moff = log_moff;
+
+    td->visit_cnt = 0;
+    skiplist_->insert(td, node, finger);
+    // Cascading search: an insert that walks far adds a shortcut to the node
+    // into the next table, which starts with reserved_skiplist_
+    if (kCascadeMinVisits > 0 && td->visit_cnt > (size_t) kCascadeMinVisits && height >= kMaxHeight - 5) {
+      reserved_skiplist_->add_shortcut(td, key, node, shortcut_target(false, seq_order_, 0, td->visit_cnt));
     }
-#endif
   }
-  bool get(ThreadData* td, const Key& key, std::string* value_out) {
-    auto node = skiplist_->find(td, key);
+  // Returns true if the key is found. *deleted is set if it is a tombstone.
+  // Versions newer than `snapshot` are not seen.
+  bool get(ThreadData* td, const Key& key, std::string_view* value_out, bool* deleted = NULL,
+           const uint64_t snapshot = kMaxSequenceNumber) {
+    const Node* node = skiplist_->find(td, key);
+    // A shortcut of the key follows its versions, if any
+    if (node && (snapshot != kMaxSequenceNumber || node->type() == kTypeShortcut)) {
+      node = skiplist_->find_version(node, snapshot);
+    }
     if (node) {
+      if (node->type() == kTypeDeletion) {
+        if (deleted) *deleted = true;
+        return true;
+      }
       if (value_out) {
-        uint64_t value = node->value();
-        value_out->assign((char*) &value, 8);
+        *value_out = node->value_view();
       }
       return true;
     }
@@ -151,10 +150,32 @@ class MemTable {
   //void merge(std::shared_ptr<MemTable> other) {
   //  skiplist_->merge(other->skiplist_);
   //}
-  /* void ref() { ref_cnt_.fetch_add(1); } */
-  /* void unref() { ref_cnt_.fetch_add(-1); } */
+  // Writers hold a reference from before they take their sequence numbers
+  // until their versions are added. The flush of this table waits for the
+  // writers that can still add to it once it is sealed.
+  void ref() { ref_cnt_.fetch_add(1); }
+  void unref() {
+    if (ref_cnt_.fetch_sub(1) == 1) {
+      std::lock_guard<std::mutex> guard(ref_mu_);
+      ref_cv_.notify_all();
+    }
+  }
+  void wait_for_writers() {
+    std::unique_lock<std::mutex> lk(ref_mu_);
+    ref_cv_.wait(lk, [&]{ return ref_cnt_.load() == 0; });
+  }
   size_t fetch_add_size(const size_t size) { return size_.fetch_add(size); }
   size_t size() { return size_.load(); }
+  // Number of versions, by a walk of the bottom level (immutable tables)
+  size_t count_entries() {
+    size_t n = 0;
+    for (Node* node = skiplist_->head()->next[0].load(); node; node = node->next[0].load()) {
+      if (node->type() != kTypeShortcut) {
+        n++;
+      }
+    }
+    return n;
+  }
   int cas_mark_full() {
     int expected = 0;
     state_.compare_exchange_strong(expected, 1);
@@ -163,6 +184,7 @@ class MemTable {
   void mark_persist() { state_.store(-1); }
   bool is_persist() { return state_.load() == -1; }
   lockfree_skiplist* skiplist() { return skiplist_; }
+  size_t memory_usage() { return skiplist_->memory_usage(); }
   lockfree_skiplist* reserved_skiplist() { return reserved_skiplist_; }
   std::shared_ptr<PmemTable> get_future_pmem_table() { return future_pmem_table_; }
 
@@ -171,28 +193,43 @@ class MemTable {
     //future_pmem_table_->seq_seq_order(seq_order_);
   }
   uint64_t seq_order() { return seq_order_; }
-#ifdef BR_CASCADE
-  //static casc_mem_table_iterator* new_casc_iterator(std::shared_ptr<MemTable> memtable) {
-  //  return new casc_mem_table_iterator(memtable);
-  //}
-#endif
+  // Writes to this table have sequence numbers up to seal_seq(), which is
+  // fixed when the table is replaced. A writer that took a larger one
+  // writes to the next table instead.
+  void seal(const std::atomic<uint64_t>& last_seq) {
+    seal_seq_.store(kSealing);  // seal_seq() waits for the final value
+    seal_seq_.store(last_seq.load());
+  }
+  uint64_t seal_seq() {
+    uint64_t seq;
+    while ((seq = seal_seq_.load()) == kSealing) {
+    }
+    return seq;
+  }
   //casc_iterator* new_iterator() {
   //  auto new_iter = new casc_iterator(skiplist_);
   //  return new_iter;
   //}
   std::weak_ptr<MemTable> next() { return next_; }
   std::weak_ptr<PmemTable> upper() { return upper_; }
+  // PmemTable::id() of upper(), the L0 table of the next older memtable
+  uint64_t upper_id() { return upper_id_; }
 
  private:
   lockfree_skiplist* skiplist_;
   uint64_t seq_order_;
+  static constexpr uint64_t kSealing = UINT64_MAX - 1;
+  std::atomic<uint64_t> seal_seq_{UINT64_MAX};
   std::atomic<size_t> size_;
   std::atomic<uint_fast32_t> ref_cnt_;
+  std::mutex ref_mu_;
+  std::condition_variable ref_cv_;
   std::atomic<int> state_;
   lockfree_skiplist* reserved_skiplist_;
   std::shared_ptr<PmemTable> future_pmem_table_;
   std::weak_ptr<MemTable> next_;
   std::weak_ptr<PmemTable> upper_;
+  uint64_t upper_id_ = 0;
 
  public:
   int shard_;
@@ -207,26 +244,34 @@ class casc_mem_table_iterator {
   using NodeCmp = casc_skiplist_iterator::NodeCmp;
 
  public:
-  casc_mem_table_iterator(std::shared_ptr<MemTable> memtable) : table_(memtable) {
-    iter_ = new casc_skiplist_iterator(table_->skiplist());
+  casc_mem_table_iterator(std::shared_ptr<MemTable> memtable)
+      : table_(memtable), table_ptr_(memtable.get()) {
+    iter_ = new casc_skiplist_iterator(table_ptr_->skiplist());
+  }
+  // Does not own the table. Used in an epoch.
+  casc_mem_table_iterator(MemTable* memtable) : table_ptr_(memtable) {
+    iter_ = new casc_skiplist_iterator(table_ptr_->skiplist());
   }
-  void seek(const Key& key, const Node* pred = NULL) {
-    iter_->seek(key, pred);
+  ~casc_mem_table_iterator() { delete iter_; }
+  casc_mem_table_iterator(const casc_mem_table_iterator&) = delete;
+  casc_mem_table_iterator& operator=(const casc_mem_table_iterator&) = delete;
+  void seek(const Key& key, const Node* pred = NULL, const uint64_t* tables = NULL, const int num_tables = 0) {
+    iter_->seek(key, pred, tables, num_tables);
   }
   bool valid() { return iter_->valid(); }
   int cmp() { return iter_->cmp(); }
-  const Node* shortcut() { return iter_->shortcut(); }
+  const Shortcut& shortcut(const int i) { return iter_->shortcut(i); }
   const Node* node() { return iter_->node(); }
-  const uint64_t pmem_shortcut_offset(const int region) { return iter_->pmem_shortcut_offset(region); }
-  MemTable* table_ptr() { return table_.get(); }
+  const Node* pred() { return iter_->pred(); }
+  size_t visits() { return iter_->visits(); }
+  MemTable* table_ptr() { return table_ptr_; }
   void get_value(std::string* out_str) {
     assert(iter_->valid());
     assert(iter_->cmp()==0);
     auto node = iter_->node();
     if (node->type() == kTypeValue) {
 #ifndef BR_WISCKEY
-      uint64_t value = node->value();
-      out_str->assign((char*) &value, 8);  // value 8-byte
+      node->get_value(out_str);
 #else
       abort();
       //node->value();  // offset
@@ -236,6 +281,7 @@ class casc_mem_table_iterator {
 
  private:
   std::shared_ptr<MemTable> table_;
+  MemTable* table_ptr_;
   casc_skiplist_iterator* iter_;
 };
 
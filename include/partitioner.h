@@ -0,0 +1,53 @@
+#ifndef PARTITIONER_H_
+#define PARTITIONER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+struct DBConf;
+
+// Maps a user key to a shard. put, get, del, scan and compaction all route
+// keys through the same partitioner.
+class Partitioner {
+ public:
+  virtual ~Partitioner() = default;
+  // Must return the same shard for the same key, in [0, kNumShards)
+  virtual int shard(const std::string_view& key) const = 0;
+  // True if every key of shard i is smaller than every key of shard i+1
+  virtual bool ordered() const { return false; }
+  virtual const char* name() const = 0;
+};
+
+// Even load for point operations regardless of the key distribution
+class HashPartitioner : public Partitioner {
+ public:
+  HashPartitioner(const int num_shards) : num_shards_(num_shards) { }
+  int shard(const std::string_view& key) const override;
+  const char* name() const override { return "hash"; }
+
+ private:
+  const int num_shards_;
+};
+
+// Contiguous key ranges. Shard i holds the keys whose 8-byte prefix (the key
+// itself for integer keys) is in [split_points[i-1], split_points[i]).
+// Without split points, the prefix space is divided evenly.
+class RangePartitioner : public Partitioner {
+ public:
+  RangePartitioner(const int num_shards, const std::vector<uint64_t>& split_points);
+  int shard(const std::string_view& key) const override;
+  bool ordered() const override { return true; }
+  const char* name() const override { return "range"; }
+
+ private:
+  const int num_shards_;
+  const std::vector<uint64_t> split_points_;
+};
+
+// Returns conf.partitioner if set, otherwise a built-in one by
+// conf.partitioner_mode
+std::shared_ptr<Partitioner> new_partitioner(const DBConf& conf);
+
+#endif  // PARTITIONER_H_
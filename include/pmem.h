@@ -47,6 +47,7 @@ struct RegionBase {
 struct LogBase {
   TOID(LogBlockBase) head_block_base;
   TOID(LogBlockBase) npp;  // non-persistent pointer
+  TOID(LogBlockBase) spare;  // allocated next block, until it is linked
 };
 
 struct LogBlockBase {
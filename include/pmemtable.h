@@ -2,13 +2,16 @@
 #define PMEMTABLE_H_
 
 #include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 
 //#include "arena.h"
 #include "common.h"
 #include "memtable.h"
+#include "ds/learned_index.h"
 #include "ds/lockfree_pskiplist.h"
 
 class PmemTable {
@@ -25,24 +28,70 @@ class PmemTable {
 
  public:
   PmemTable(std::shared_ptr<PmemTable> next_table = nullptr);
+  ~PmemTable();
   void init(PMEMobjpool* pops[]);
-  void add(ThreadData* td, const int r, const Key& key, const uint64_t value);
-  bool get(ThreadData* td, const Key& key, std::string* value_out);
-  void merge_WAL(ThreadData* td, const unsigned long rmask, MemTable* other);
-  void merge_IUL(ThreadData* td, const unsigned long rmask, MemTable* other);
+  // `inline_value`: bytes of an inline value word (string keys)
+  // `tag`: make_tag(seq, type)
+  void add(ThreadData* td, const int r, const Key& key, const uint64_t value,
+           const uint64_t tag,
+           const std::string_view& inline_value = std::string_view());
+  // Returns true if the key is found. *deleted is set if it is a tombstone.
+  // Versions newer than `snapshot` are not seen. *node_out is set to the
+  // version found.
+  bool get(ThreadData* td, const Key& key, std::string_view* value_out, bool* deleted = NULL,
+           const uint64_t snapshot = kMaxSequenceNumber, const Node** node_out = NULL);
+  // lockfree_pskiplist::find_batch(), started by the learned index if any
+  void find_batch(ThreadData* td, const size_t n, const Key* keys, Node** nodes_out);
+  // Flushes a key range of `other`, see lockfree_pskiplist::merge_WAL()
+  void merge_WAL(ThreadData* td, MemTable* other, const mNode* begin, const mNode* end, const uint64_t oldest_snapshot);
+  void merge_IUL(ThreadData* td, MemTable* other, const mNode* begin, const mNode* end, const uint64_t oldest_snapshot);
   void set_shard(const int s) { shard_ = s; skiplist_->shard_ = s; }
+  // Filter of the keys of an L0 table, filled by the merge of its memtable.
+  // Set before the merge. The keys not added yet are still in the memtable,
+  // which readers search first.
+  void init_filter(const size_t num_keys, const int bits_per_key);
+  // False if the table does not have the key. Always true without a filter.
+  bool may_contain(const Key& key) const {
+    BloomFilter* filter = filter_.load(std::memory_order_acquire);
+    return filter == nullptr || filter->may_contain(ht_hash(key));
+  }
+  bool has_filter() const { return filter_.load(std::memory_order_relaxed) != nullptr; }
+  // Learned index of the bottom level (integer keys). Writers of the table
+  // drop it, and a build started before a write does not publish.
+  // Returns the dropped index, which readers in the epoch may still use.
+  LearnedIndex* begin_index_writes();
+  void end_index_writes();
+  // Version of the bottom level a build starts from, -1 while it is written
+  int64_t index_version();
+  // Takes `index` built at `version` if the table was not written since
+  bool set_learned_index(LearnedIndex* index, const int64_t version);
+  const LearnedIndex* learned_index() const { return learned_index_.load(std::memory_order_acquire); }
 
   // Compaction functions.
   // Thread-safe for all
-  void zipper_compaction(ThreadData* td, const unsigned long rmask, const int lower_level, PmemTable* lower);
-  void log_structured_compaction(ThreadData* td, const unsigned long rmask, const int lower_level, PmemTable* lower);
+  // `retire_fn`: runs the freeing of the versions unlinked in the last level
+  // after a grace period
+  void log_structured_compaction(ThreadData* td, const unsigned long rmask, const int lower_level, PmemTable* lower,
+                                 const uint64_t oldest_snapshot,
+                                 const std::function<void(std::function<void()>)>& retire_fn);
 
-  /* void ref() { ref_cnt_.fetch_add(1); } */
-  /* void unref() { ref_cnt_.fetch_add(-1); } */
+  // Writers of this table (puts and compactions into it) hold a reference
+  // while writing. The compaction of this table waits for them to finish.
+  void ref() { ref_cnt_.fetch_add(1); }
+  void unref();
+  void wait_for_writers();
   size_t fetch_add_size(const size_t size);
   size_t size();
   int cas_mark_full();
-  void mark_merged_down();
+  // `level`: level of this table
+  // `reclaim_nodes`: true if the nodes were copied to the upper level and can
+  // be freed together with the table, false if they were zipped into it
+  // `retire_fn`: runs the freeing of the PMEM space after a grace period
+  void mark_merged_down(const int level, const bool reclaim_nodes,
+                        std::function<void(std::function<void()>)> retire_fn);
+  // Readers of this table walk into the nodes zipped into `upper`, so the
+  // space of `upper` is not freed while this table is alive
+  void pin_upper(PmemTable* upper);
   bool is_merged_down();
   lockfree_pskiplist* skiplist();
   Node* get_node_by_offset(const int region, const uint64_t offset);
@@ -57,6 +106,12 @@ class PmemTable {
     return seq_order_;
   }
   std::weak_ptr<PmemTable> next();
+  // Unique among the tables of the DB, for the targets of shortcuts
+  uint64_t id() const { return id_; }
+  // Shortcuts of the cascading search out of this table, into the table
+  // searched after it. They are kept in DRAM, apart from the PMEM nodes.
+  void add_shortcut(ThreadData* td, const Key& key, const void* target_node, const uint64_t target);
+  Shortcut find_shortcut(const Key& key, const uint64_t table) const;
 
   void print_debug();
 
@@ -66,9 +121,35 @@ class PmemTable {
   uint64_t seq_order_;
   std::atomic<size_t> size_;
   std::atomic<uint_fast32_t> ref_cnt_;
+  std::mutex ref_mu_;
+  std::condition_variable ref_cv_;
   std::atomic<int> state_;
   std::weak_ptr<PmemTable> next_;
   int shard_;
+  // Freed with the table, after it is merged down and out of the epoch
+  std::atomic<BloomFilter*> filter_{nullptr};
+  std::atomic<LearnedIndex*> learned_index_{nullptr};
+  std::atomic<lockfree_skiplist*> shortcuts_{nullptr};
+  const uint64_t id_;
+  std::mutex index_mu_;
+  int index_writers_ = 0;
+  int64_t index_version_ = 0;
+
+  // Owns the skiplist and frees its PMEM space once the table is merged down
+  // and neither the table nor a lower table pinning it is alive. String keys:
+  // the lookup cache entries of the nodes are evicted first, and the space is
+  // freed a grace period later (retire_fn), when no reader of the cache can
+  // hold a pointer to a node anymore.
+  struct Reclaimer {
+    lockfree_pskiplist* skiplist = NULL;
+    int level = -1;
+    bool reclaim_nodes = false;
+    bool merged_down = false;
+    std::shared_ptr<Reclaimer> upper;
+    std::function<void(std::function<void()>)> retire_fn;
+    ~Reclaimer();
+  };
+  std::shared_ptr<Reclaimer> reclaimer_;
 };
 
 #if 1
@@ -81,6 +162,11 @@ class casc_pmem_table_iterator {
 
  public:
   casc_pmem_table_iterator(const int region, std::shared_ptr<PmemTable> table);
+  // Does not own the table. Used in an epoch.
+  casc_pmem_table_iterator(const int region, PmemTable* table);
+  ~casc_pmem_table_iterator();
+  casc_pmem_table_iterator(const casc_pmem_table_iterator&) = delete;
+  casc_pmem_table_iterator& operator=(const casc_pmem_table_iterator&) = delete;
   void seek(const Key& key, const Node* pred = NULL);
   //void seek_two(const Key& key, Node* pred, const Key& key_a);
   //void seek_braided(const Key& key, Node* pred);
@@ -89,19 +175,20 @@ class casc_pmem_table_iterator {
   //uint64_t pred_a_moff();
   bool valid() const;
   int cmp();
-  //Node* pred();
   Node* node() const;
   const Node* shortcut();
+  const Node* pred() const { return iter_->pred(); }
+  int16_t pred_region() const { return iter_->pred_region(); }
+  size_t visits() const { return iter_->visits(); }
   std::shared_ptr<PmemTable> table() { return table_; }
-  PmemTable* table_ptr() { return table_.get(); }
+  PmemTable* table_ptr() { return table_ptr_; }
   void get_value(std::string* out_str) {
     assert(iter_->valid());
     assert(iter_->cmp()==0);
     auto node = iter_->node();
     if (node->type() == kTypeValue) {
 #ifndef BR_WISCKEY
-      uint64_t value = node->value();
-      out_str->assign((char*) &value, 8);  // value 8-byte
+      node->get_value(out_str);
 #else
       abort();
       //node->value();  // offset
@@ -112,6 +199,7 @@ class casc_pmem_table_iterator {
  private:
   const int r_;
   std::shared_ptr<PmemTable> table_;
+  PmemTable* table_ptr_;
   casc_pskiplist_iterator* iter_;
 };
 
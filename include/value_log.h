@@ -1,22 +1,80 @@
 #ifndef VALUE_LOG_H_
 #define VALUE_LOG_H_
 
+#include <deque>
+
 #include "log.h"
 
+// Record: value length (4B), key length (4B), key, value, padding to 8 bytes.
+// The key lets the GC check whether the value is still referenced.
+// Every byte of a full block belongs to a record or a padding record, so a
+// full block can be walked from its beginning.
 class ValueLog {
  public:
+  static constexpr uint32_t kPaddingKeyLength = UINT32_MAX;
+  struct Record {
+    std::string_view key;
+    std::string_view value;
+    size_t size;
+    bool is_padding() const { return key.data() == nullptr; }
+  };
+
   void init(const int s);
-  uint64_t write_value(ThreadData* td, const int s, const std::string_view& value);
+  // See Log::set_background_fn()
+  void set_background_fn(std::function<void(std::function<void()>)> background_fn) {
+    background_fn_ = background_fn;
+  }
+  // Writers must be in an epoch of the DB, which keeps a collected block
+  // alive until they leave
+  uint64_t write_value(ThreadData* td, const int s, const std::string_view& key,
+                       const std::string_view& value);
+  void write_values(ThreadData* td, const int s, const size_t n,
+                    const std::string_view* keys, const std::string_view* values,
+                    uint64_t* value_moffs_out);
+  // Returns the blocks referenced by the thread. A thread that stops writing
+  // keeps its last blocks from being collected until it calls this.
+  void release_tail(ThreadData* td, const int s);
+
+  // GC interface
+  static size_t record_size(const std::string_view& key, const std::string_view& value) {
+    return aligned_size(8, 2 * sizeof(uint32_t) + key.length() + value.length());
+  }
+  static Record read_record(const char* p);
+  // Oldest full block without writers, NULL if none
+  LogBlock* oldest_sealed_block();
+  // Unlinks a block returned by oldest_sealed_block() from its chain
+  void unlink_block(LogBlock* b);
+  // Frees an unlinked block once no thread can access it
+  void free_block(LogBlock* b);
+  size_t num_sealed_blocks() { return num_sealed_.load(); }
+  size_t num_blocks() { return num_blocks_.load(); }
 
  private:
   LogBlock* get_available_log_block(ThreadData* td, const int s,
                                     const int r, const size_t my_size,
                                     size_t* before_out);
+  // See Log::prepare_spare()
+  void prepare_spare(const int s, const int r);
+  // Carves my_size bytes out of the thread's private chunk
+  char* reserve(ThreadData* td, const int s, const int r, const size_t my_size);
+  static void write_record(char* p, const std::string_view& key, const std::string_view& value);
+  static void write_padding(const int s, const int r, char* p, const size_t size);
+  // Pads the rest of the thread's chunk and pins its block
+  void retire_chunk(ThreadData* td, const int s);
+  // Unrefs the blocks written by the previous put of the thread
+  void unpin(ThreadData* td, const int s);
 
  private:
-  LogBlock* blocks_[kMaxNumRegions];
+  std::atomic<LogBlock*> blocks_[kMaxNumRegions];
+  LogBlock* spare_[kMaxNumRegions] = { NULL };  // pre-allocated next block
+  std::deque<LogBlock*> sealed_[kMaxNumRegions];  // full blocks, oldest first
+  std::atomic<size_t> num_sealed_{0};
+  std::atomic<size_t> num_blocks_{0};
   TOID(LogBase) log_base_[kMaxNumRegions];
+  int shard_;
   std::mutex mu_;
+  std::mutex spare_mu_;  // serializes prepare_spare(), not held with mu_
+  std::function<void(std::function<void()>)> background_fn_;
 };
 
 #endif  // VALUE_LOG_H_
@@ -0,0 +1,52 @@
+#ifndef WORKER_POLICY_H_
+#define WORKER_POLICY_H_
+
+#include <cstddef>
+#include <memory>
+
+struct DBConf;
+
+// Load of the DB, sampled periodically to size the compaction workers
+struct CompactionLoad {
+  int active_workers = 0;  // workers allowed to run jobs now
+  int max_workers = 0;  // DBConf::num_workers
+  int num_shards = 0;
+  int tasks_per_job = 1;  // DBConf::task_size
+  size_t max_immutables = 0;  // immutable memtables of the most loaded shard
+  double slowdown_immutables = 0;  // immutables of a shard delaying its puts
+  double stall_immutables = 0;  // immutables of a shard blocking its puts
+  size_t num_L0_tables = 0;  // all shards
+  size_t num_jobs = 0;  // compaction jobs enqueued and not completed
+  double write_delay = 0;  // per-put delay of the most delayed shard (usec)
+  double put_mops = 0;  // foreground throughput since the last sample
+  double get_mops = 0;
+};
+
+// Decides how many of the compaction workers run jobs. The others park and
+// leave their CPUs to the clients.
+class CompactionWorkerPolicy {
+ public:
+  virtual ~CompactionWorkerPolicy() = default;
+  // Called by one thread. The result is clamped to [1, load.max_workers].
+  virtual int num_workers(const CompactionLoad& load) = 0;
+  virtual const char* name() const = 0;
+};
+
+// A worker per pending task, every worker once puts are about to be delayed
+// or while the clients are idle. Scales up at once, down one worker per
+// sample.
+class BacklogWorkerPolicy : public CompactionWorkerPolicy {
+ public:
+  BacklogWorkerPolicy(const int min_workers = 1) : min_workers_(min_workers) { }
+  int num_workers(const CompactionLoad& load) override;
+  const char* name() const override { return "backlog"; }
+
+ private:
+  const int min_workers_;
+};
+
+// Returns conf.worker_policy if set, otherwise a built-in one by
+// conf.worker_scaling_mode, NULL if the workers are not scaled
+std::shared_ptr<CompactionWorkerPolicy> new_worker_policy(const DBConf& conf);
+
+#endif  // WORKER_POLICY_H_
@@ -14,14 +14,18 @@ brdb::brdb(const DBConf& conf)
     : conf_(conf),
       stop_(false) {
   common_init_global_variables(conf);
+  retire_fn_ = [&](std::function<void()> free_fn) { epoch_.retire(free_fn); };
+  partitioner_ = new_partitioner(conf);
+  worker_policy_ = new_worker_policy(conf);
 
   printf("======= DB configuration =======\n");
-  printf("num_shards: %d\n", kNumShards);
+  printf("num_shards: %d (%s partitioner)\n", kNumShards, partitioner_->name());
   printf("num_regions: %d\n", kNumRegions);
   printf("memtable size: %ld\n", kMemTableSize);
   printf("DRAM: %zu (%zu memtable+immutables)\n", kDRAMSizeTotal, kDRAMSizeTotal / kMemTableSize);
-  printf("num_workers: %d\n", kNumWorkers);
+  printf("num_workers: %d (%s scaling)\n", kNumWorkers, worker_policy_ ? worker_policy_->name() : "no");
   printf("Logging: %s\n", kLoggingModeString);
+  printf("Log group commit: %d (window: %d us)\n", kLogGroupCommitMode, kLogGroupCommitWindow);
   printf("num_pmem_levels: %d\n", kNumPmemLevels);
   printf("L0->L1 zipper?: %d\n", (kNumLogUnifiedLevels >= 2));
   printf("-------------------------------\n");
@@ -38,12 +42,22 @@ brdb::brdb(const DBConf& conf)
     vlog_[i]->init(i);
     // Init MemTable
     memtable_seq_[i].store(1);
-    mem_[i].table = new_mem_table(i);
+    write_delay_[i].store(0);
+    vlog_gc_scheduled_[i].store(false);
+    vlog_gc_trigger_[i].store(kVLogGCTrigger);
+    learned_index_scheduled_[i].store(false);
+    learned_index_requested_[i].store(false);
+    vlog_gc_next_time_[i].store(0);
+    mem_[i].immutables.set_retire_fn(retire_fn_);
+    mem_[i].set_table(new_mem_table(i));
     mem_[i].table->set_seq_order(memtable_seq_[i].fetch_add(1));
     // Init PmemLevels
+    for (int j = 0; j < kNumPmemLevels; j++) {
+      level_[i][j].immutables.set_retire_fn(retire_fn_);
+    }
     for (int j = 1; j < kNumPmemLevels; j++) {  // FOR TEST
     //for (int j = 0; j < kNumPmemLevels; j++) {
-      level_[i][j].table = new_pmem_table(i, j);
+      level_[i][j].set_table(new_pmem_table(i, j));
     }
   }
   std::atomic_thread_fence(std::memory_order_acquire);
@@ -52,6 +66,19 @@ brdb::brdb(const DBConf& conf)
   // Init Compaction Job Manager
   job_mgr_ = new JobManager(kNumWorkers);
   job_mgr_->start();
+  // Spare log blocks are prepared by jobs, ahead of the flushes since
+  // writers wait for them at a block rollover
+  auto background_fn = [&](std::function<void()> fn) {
+        auto job = std::make_shared<Job>(-1, 0, 1);
+        job->add_task(std::make_shared<Task>(job, [fn](ThreadData* td) { fn(); }));
+        if (!job_mgr_->enqueue(job)) {
+          fn();
+        }
+      };
+  for (int i = 0; i < kNumShards; i++) {
+    log_[i]->set_background_fn(background_fn);
+    vlog_[i]->set_background_fn(background_fn);
+  }
   int num_avail_cores = sysconf(_SC_NPROCESSORS_ONLN);
   for (int i = 0; i < 2; i++) {
     backup_mgr_[i] = new JobManager(num_avail_cores);
@@ -70,6 +97,10 @@ brdb::brdb(const DBConf& conf)
   if (conf_.performance_monitor_mode != 0) {
     perfmon_thread_ = std::thread(std::bind(&brdb::perfmon_loop, this));
   }
+  // Launch Compaction Worker Scaling Thread
+  if (worker_policy_) {
+    worker_scaling_thread_ = std::thread(std::bind(&brdb::worker_scaling_loop, this));
+  }
 }
 
 brdb::brdb() : brdb(DBConf()) { }
@@ -97,12 +128,45 @@ brdb::~brdb() {
   if (perfmon_thread_.joinable()) {
     perfmon_thread_.join();
   }
+  if (worker_scaling_thread_.joinable()) {
+    worker_scaling_thread_.join();
+  }
 }
 
 void brdb::register_client(const int cid, ThreadData* td) {
   cl_td_[cid] = td;
 }
 
+void brdb::release_thread(ThreadData* td) {
+  for (int s = 0; s < kNumShards; s++) {
+    vlog_[s]->release_tail(td, s);
+  }
+}
+
+uint64_t brdb::snapshot() {
+  const uint64_t seq = seq_.load();
+  {
+    std::lock_guard<std::mutex> lk(snapshots_mu_);
+    snapshots_.insert(seq);
+  }
+  // A write takes its sequence number in write_epoch_ and is done when it
+  // leaves
+  write_epoch_.synchronize();
+  return seq;
+}
+
+void brdb::release_snapshot(const uint64_t snapshot) {
+  std::lock_guard<std::mutex> lk(snapshots_mu_);
+  auto it = snapshots_.find(snapshot);
+  assert(it != snapshots_.end());
+  snapshots_.erase(it);
+}
+
+uint64_t brdb::oldest_snapshot() {
+  std::lock_guard<std::mutex> lk(snapshots_mu_);
+  return snapshots_.empty() ? kMaxSequenceNumber : *snapshots_.begin();
+}
+
 void brdb::periodic_compaction_loop() {
   while (!stop_.load()) {
     for (int i = 0; i < kNumShards; i++) {
@@ -127,6 +191,8 @@ void brdb::perfmon_loop() {
   size_t L0_compaction_cnt_last = 0;
   size_t put_cnt_last = 0;
   size_t get_cnt_last = 0;
+  size_t log_sync_cnt_last = 0;
+  size_t log_entry_cnt_last = 0;
   struct TableCount table_cnt;
   while (!stop_.load()) {
     std::unique_lock<std::mutex> lk(perfmon_mu_);
@@ -164,24 +230,91 @@ void brdb::perfmon_loop() {
     // Queries
     size_t put_cnt_now = 0;
     size_t get_cnt_now = 0;
+    size_t log_sync_cnt_now = 0;
+    size_t log_entry_cnt_now = 0;
     for (int i = 0; i < num_avail_cores; i++) {
       put_cnt_now += counter[i].put_cnt;
       get_cnt_now += counter[i].get_cnt;
+      log_sync_cnt_now += counter[i].log_sync_cnt;
+      log_entry_cnt_now += counter[i].log_entry_cnt;
     }
     size_t put_cnt_inc = put_cnt_now - put_cnt_last;
     size_t get_cnt_inc = get_cnt_now - get_cnt_last;
     double put_mops = (double) put_cnt_inc/dur.count()/1000/1000;
     double get_mops = (double) get_cnt_inc/dur.count()/1000/1000;
+    size_t log_sync_cnt_inc = log_sync_cnt_now - log_sync_cnt_last;
+    size_t log_entry_cnt_inc = log_entry_cnt_now - log_entry_cnt_last;
+    double log_entries_per_sync = (log_sync_cnt_inc > 0) ? (double) log_entry_cnt_inc / log_sync_cnt_inc : 0;
 
     get_table_state(&table_cnt);
 
-    fprintf(stdout, "[ TIMESTAMP: %.3lf ]    PUT: %.3lf    GET: %.3lf    MEM_COMPACTION: %.3lf    L0_COMPACTION: %.3lf    | MEM: %zu  L0: %zu  L1: %zu\n", timestamp_double(), put_mops, get_mops, mem_compaction_throughput/1000/1000, L0_compaction_throughput/1000/1000, table_cnt.mem_cnt, table_cnt.pmem_cnt[0], table_cnt.pmem_cnt[1]);
+    fprintf(stdout, "[ TIMESTAMP: %.3lf ]    PUT: %.3lf    GET: %.3lf    MEM_COMPACTION: %.3lf    L0_COMPACTION: %.3lf    LOG_ENTRIES/SYNC: %.2lf    WRITE_DELAY: %.1lfus    | MEM: %zu  L0: %zu  L1: %zu\n", timestamp_double(), put_mops, get_mops, mem_compaction_throughput/1000/1000, L0_compaction_throughput/1000/1000, log_entries_per_sync, write_delay_rate(), table_cnt.mem_cnt, table_cnt.pmem_cnt[0], table_cnt.pmem_cnt[1]);
 
     tp_last = tp_now;
     mem_compaction_cnt_last = mem_compaction_cnt_now;
     L0_compaction_cnt_last = L0_compaction_cnt_now;
     put_cnt_last = put_cnt_now;
     get_cnt_last = get_cnt_now;
+    log_sync_cnt_last = log_sync_cnt_now;
+    log_entry_cnt_last = log_entry_cnt_now;
+  }
+}
+
+void brdb::worker_scaling_loop() {
+  static const auto kInterval = std::chrono::milliseconds(100);
+  auto tp_last = std::chrono::steady_clock::now();
+  size_t put_cnt_last = 0;
+  size_t get_cnt_last = 0;
+  int num_avail_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  struct TableCount table_cnt;
+  while (!stop_.load()) {
+    std::this_thread::sleep_for(kInterval);
+    auto tp_now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> dur = tp_now - tp_last;
+
+    size_t put_cnt_now = 0;
+    size_t get_cnt_now = 0;
+    for (int i = 0; i < num_avail_cores; i++) {
+      put_cnt_now += counter[i].put_cnt;
+      get_cnt_now += counter[i].get_cnt;
+    }
+    get_table_state(&table_cnt);
+
+    CompactionLoad load;
+    load.active_workers = job_mgr_->num_active_workers();
+    load.max_workers = kNumWorkers;
+    load.num_shards = kNumShards;
+    load.tasks_per_job = kCompactionTaskSize;
+    for (int s = 0; s < kNumShards; s++) {
+      load.max_immutables = std::max(load.max_immutables, mem_[s].immutables.size());
+    }
+    // Same thresholds as the write throttle
+    load.stall_immutables = (double) kDRAMSizeTotal / kMemTableSize - 1;
+    load.slowdown_immutables = load.stall_immutables * std::min(kWriteSlowdownTrigger, 100) / 100;
+    load.num_L0_tables = table_cnt.pmem_cnt[0];
+    load.num_jobs = job_mgr_->num_jobs();
+    load.write_delay = write_delay_rate();
+    load.put_mops = (double) (put_cnt_now - put_cnt_last)/dur.count()/1000/1000;
+    load.get_mops = (double) (get_cnt_now - get_cnt_last)/dur.count()/1000/1000;
+
+    const int n = std::min(std::max(worker_policy_->num_workers(load), 1), kNumWorkers);
+    if (n != load.active_workers) {
+      job_mgr_->set_num_active_workers(n);
+      if (n > load.active_workers) {
+        worker_scale_up_cnt_.fetch_add(1);
+      } else {
+        worker_scale_down_cnt_.fetch_add(1);
+      }
+      fprintf(stdout, "= TIMESTAMP: %.3lf - compaction workers: %d -> %d (%s)    IMM: %zu/%.1lf    L0: %zu    JOBS: %zu    WRITE_DELAY: %.1lfus    PUT: %.3lf    GET: %.3lf\n",
+          timestamp_double(), load.active_workers, n, worker_policy_->name(), load.max_immutables, load.stall_immutables,
+          load.num_L0_tables, load.num_jobs, load.write_delay, load.put_mops, load.get_mops);
+    }
+    worker_sample_cnt_.fetch_add(1);
+    worker_active_sum_.fetch_add(n);
+
+    tp_last = tp_now;
+    put_cnt_last = put_cnt_now;
+    get_cnt_last = get_cnt_now;
   }
 }
 
@@ -205,18 +338,28 @@ void brdb::table_stats() {
 void brdb::get_table_state_string(std::string* out_str) {
   // MemTable
   size_t mem_cnt = 0;
+  size_t mem_bytes = 0;
   size_t pmem_cnt[kNumPmemLevels] = { 0 };
+  EpochGuard guard(&epoch_);
   for (int s = 0; s < kNumShards; s++) {
-    auto mem = std::atomic_load(&mem_[s].table);
+    auto mem = mem_[s].table_ptr.load();
     if (mem && mem->size() > 0) {
       mem_cnt++;
     }
+    if (mem) {
+      mem_bytes += mem->memory_usage();
+    }
     mem_cnt += mem_[s].immutables.size();
+    auto it = mem_[s].immutables.begin();
+    while (it.valid()) {
+      mem_bytes += (*it)->memory_usage();
+      it.next();
+    }
   }
   // Pmem Levels
   for (int l = 0; l < kNumPmemLevels; l++) {
     for (int s = 0; s < kNumShards; s++) {
-      auto pmem = std::atomic_load(&level_[s][l].table);
+      auto pmem = level_[s][l].table_ptr.load();
       if (pmem && pmem->size() > 0) {
         pmem_cnt[l]++;
       }
@@ -225,7 +368,7 @@ void brdb::get_table_state_string(std::string* out_str) {
   }
   out_str->clear();
   char wbuf[200];
-  sprintf(wbuf, "MemTable: %zu\n", mem_cnt);
+  sprintf(wbuf, "MemTable: %zu (%zu MB arena)\n", mem_cnt, mem_bytes/1000/1000);
   out_str->append(wbuf);
   for (int l = 0; l <kNumPmemLevels; l++) {
     sprintf(wbuf, "Level %d: %zu\n", l, pmem_cnt[l]);
@@ -237,8 +380,9 @@ void brdb::get_table_state(struct TableCount* out) {
   // MemTable
   size_t mem_cnt = 0;
   size_t pmem_cnt[kNumPmemLevels] = { 0 };
+  EpochGuard guard(&epoch_);
   for (int s = 0; s < kNumShards; s++) {
-    auto mem = std::atomic_load(&mem_[s].table);
+    auto mem = mem_[s].table_ptr.load();
     if (mem && mem->size() > 0) {
       mem_cnt++;
     }
@@ -247,7 +391,7 @@ void brdb::get_table_state(struct TableCount* out) {
   // Pmem Levels
   for (int l = 0; l < kNumPmemLevels; l++) {
     for (int s = 0; s < kNumShards; s++) {
-      auto pmem = std::atomic_load(&level_[s][l].table);
+      auto pmem = level_[s][l].table_ptr.load();
       if (pmem && pmem->size() > 0) {
         pmem_cnt[l]++;
       }
@@ -267,10 +411,142 @@ void brdb::perf_stats() {
     auto td = job_mgr_->worker_td(i);
     fprintf(stdout, "cw_%d: avg_mem_compaction_throughput: %.3lf Mops/s\n", i, (double) td->mem_compaction_cnt/td->mem_compaction_dur/1000/1000);
   }
+
+  // Memtable flushes
+  const size_t flush_cnt = flush_cnt_.load();
+  const double flush_sec = (double) flush_ns_.load()/1000/1000/1000;
+  fprintf(stdout, "memtable flush: %zu flushes, %.3lf MB, %.3lf sec (avg %.3lf sec, %.3lf MB/s)\n",
+      flush_cnt, (double) flush_bytes_.load()/1000/1000, flush_sec,
+      (flush_cnt > 0) ? flush_sec / flush_cnt : 0,
+      (flush_sec > 0) ? (double) flush_bytes_.load()/1000/1000/flush_sec : 0);
+
+  // Compaction worker scaling
+  if (worker_policy_) {
+    const size_t sample_cnt = worker_sample_cnt_.load();
+    fprintf(stdout, "compaction workers: %zu scale-ups, %zu scale-downs, %.2lf active on average\n",
+        worker_scale_up_cnt_.load(), worker_scale_down_cnt_.load(),
+        (sample_cnt > 0) ? (double) worker_active_sum_.load() / sample_cnt : kNumWorkers);
+  }
+
+  // Log persist coverage
+  size_t log_sync_cnt = 0;
+  size_t log_entry_cnt = 0;
+  int num_avail_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 0; i < num_avail_cores; i++) {
+    log_sync_cnt += counter[i].log_sync_cnt;
+    log_entry_cnt += counter[i].log_entry_cnt;
+  }
+  fprintf(stdout, "log: %zu entries / %zu persists (%.2lf entries per persist)\n", log_entry_cnt, log_sync_cnt, (log_sync_cnt > 0) ? (double) log_entry_cnt / log_sync_cnt : 0);
+
+  // Write throttling
+  size_t write_delay_cnt = 0;
+  size_t write_delay_ns = 0;
+  size_t write_stall_ns = 0;
+  for (int i = 0; i < num_avail_cores; i++) {
+    write_delay_cnt += counter[i].write_delay_cnt;
+    write_delay_ns += counter[i].write_delay_ns;
+    write_stall_ns += counter[i].write_stall_ns;
+  }
+  fprintf(stdout, "write throttle: %zu delayed puts, %.3lf sec delayed, %.3lf sec stalled\n", write_delay_cnt, (double) write_delay_ns/1000/1000/1000, (double) write_stall_ns/1000/1000/1000);
+
+  // Lookup cache
+  size_t cache_hit_cnt = 0;
+  size_t cache_miss_cnt = 0;
+  size_t cache_fill_cnt = 0;
+  size_t cache_invalidate_cnt = 0;
+  for (int i = 0; i < num_avail_cores; i++) {
+    cache_hit_cnt += counter[i].cache_hit_cnt;
+    cache_miss_cnt += counter[i].cache_miss_cnt;
+    cache_fill_cnt += counter[i].cache_fill_cnt;
+    cache_invalidate_cnt += counter[i].cache_invalidate_cnt;
+  }
+  fprintf(stdout, "lookup cache: %zu hits, %zu misses (hit ratio %.3lf), %zu fills, %zu invalidations\n",
+      cache_hit_cnt, cache_miss_cnt,
+      (cache_hit_cnt + cache_miss_cnt > 0) ? (double) cache_hit_cnt / (cache_hit_cnt + cache_miss_cnt) : 0,
+      cache_fill_cnt, cache_invalidate_cnt);
+
+  // Table filters: searches skipped, and searches let through that missed
+  if (kFilterBitsPerKey > 0) {
+    for (int l = 0; l < kNumPmemLevels; l++) {
+      size_t filter_useful_cnt = 0;
+      size_t filter_fp_cnt = 0;
+      for (int i = 0; i < num_avail_cores; i++) {
+        filter_useful_cnt += counter[i].filter_useful_cnt[l];
+        filter_fp_cnt += counter[i].filter_fp_cnt[l];
+      }
+      if (filter_useful_cnt + filter_fp_cnt > 0) {
+        fprintf(stdout, "L%d filter: %zu useful, %zu false positives\n", l, filter_useful_cnt, filter_fp_cnt);
+      }
+    }
+  }
+
+  // Learned index of the last level
+  if (kLearnedIndexStride > 0) {
+    size_t learned_index_cnt = 0;
+    for (int i = 0; i < num_avail_cores; i++) {
+      learned_index_cnt += counter[i].learned_index_cnt;
+    }
+    int num_indexed = 0;
+    size_t index_bytes = 0;
+    {
+      EpochGuard guard(&epoch_);
+      for (int s = 0; s < kNumShards; s++) {
+        PmemTable* llt = level_[s][kNumPmemLevels-1].table_ptr.load();
+        const LearnedIndex* index = llt ? llt->learned_index() : nullptr;
+        if (index) {
+          num_indexed++;
+          index_bytes += index->memory_usage();
+        }
+      }
+    }
+    fprintf(stdout, "learned index: %d/%d shards indexed, %.3lf MB, %zu searches\n",
+        num_indexed, kNumShards, (double) index_bytes/1000/1000, learned_index_cnt);
+  }
+
+  // Cascading search
+  if (kCascadeMinVisits > 0) {
+    size_t casc_hits = 0;
+    size_t casc_skipped_nodes = 0;
+    for (int i = 0; i < num_avail_cores; i++) {
+      casc_hits += counter[i].casc_hits;
+      casc_skipped_nodes += counter[i].casc_skipped_nodes;
+    }
+    fprintf(stdout, "cascading search: %zu searches from shortcuts, %zu nodes skipped\n",
+        casc_hits, casc_skipped_nodes);
+  }
+
+  // PMEM space reclaimed from merged-down tables
+  for (int l = 0; l < kNumPmemLevels; l++) {
+    fprintf(stdout, "L%d reclaimed: %.3lf MB\n", l, (double) pmem_reclaimed_bytes[l].load()/1000/1000);
+  }
+
+#ifdef BR_STRING_KV
+  // Value log size and GC. Space amplification: bytes of the collected
+  // blocks per byte of live values found in them.
+  size_t vlog_blocks = 0;
+  for (int s = 0; s < kNumShards; s++) {
+    vlog_blocks += vlog_[s]->num_blocks();
+  }
+  size_t scanned = vlog_gc_scanned_bytes.load();
+  size_t relocated = vlog_gc_relocated_bytes.load();
+  fprintf(stdout, "vlog: %.3lf MB (%zu blocks)\n", (double) vlog_blocks*kLogBlockSize/1000/1000, vlog_blocks);
+  fprintf(stdout, "vlog gc: %zu blocks freed, %.3lf MB scanned, %.3lf MB relocated, space amplification %.2lf\n",
+      vlog_gc_freed_blocks.load(), (double) scanned/1000/1000, (double) relocated/1000/1000,
+      (relocated > 0) ? (double) scanned / relocated : 0);
+#endif
+}
+
+double brdb::write_delay_rate() {
+  uint64_t delay = 0;
+  for (int s = 0; s < kNumShards; s++) {
+    delay = std::max(delay, write_delay_[s].load(std::memory_order_relaxed));
+  }
+  return (double) delay / 1000;
 }
 
 void brdb::wait_compaction() {
   job_mgr_->wait();
+  epoch_.reclaim();
 }
 
 void brdb::stabilize() {
@@ -317,6 +593,7 @@ void brdb::stabilize() {
   my_mgr[low_ind]->wait();
 
   job_mgr_->wait();
+  epoch_.reclaim();
   //flogf(stdout, "Main Workers done all jobs");
 
   flogf(stdout, "Backup Workers done all jobs");
@@ -2,38 +2,62 @@
 
 #include <bitset>
 
+namespace {
+
+// Memtable flush, shared by the tasks of its job
+struct MemFlush {
+  std::vector<lockfree_skiplist::Node*> begins;  // first node of each key range, NULL for the first
+  std::chrono::steady_clock::time_point begin_time;
+};
+
+}  // namespace
+
 void brdb::enq_mem_compaction(const int s, std::shared_ptr<MemTable>& imm, JobManager* mgr) {
-  // Construct a job
+  // Construct a job. Its tasks flush key ranges of imm, which are split once
+  // its writers are done.
   int num_tasks = std::min(kNumWorkers, kCompactionTaskSize);
   auto job = std::make_shared<Job>(-1, imm->seq_order(), num_tasks);
-  job->set_before([&, s, imm, job_raw=job.get()]{
-        while (imm.use_count() > 3) continue;
+  auto flush = std::make_shared<MemFlush>();
+  job->set_before([&, s, imm, flush, num_tasks, job_raw=job.get()]{
+        // Wait for the writers that took sequence numbers of imm before it
+        // was sealed
+        imm->wait_for_writers();
+        flush->begin_time = std::chrono::steady_clock::now();
         //size_t write_size = kMemTableSize / kNumShards;
         auto future_pmem = imm->get_future_pmem_table();
         future_pmem->set_shard(s);
         assert(future_pmem != nullptr);
+        if (kFilterBitsPerKey > 0) {
+          future_pmem->init_filter(imm->count_entries(), kFilterBitsPerKey);
+        }
+        flush->begins.push_back(NULL);
+        for (auto node : imm->skiplist()->split_points(num_tasks)) {
+          flush->begins.push_back(node);
+        }
         job_raw->upper_ = future_pmem;
       });
   // Construct tasks of the job
-  int region_cnt = 0;
-  int num = kNumRegions / num_tasks;
   for (int i = 0; i < num_tasks; i++) {
-    if (i == num_tasks - 1) {
-      num += kNumRegions % num_tasks;
-    }
-    std::bitset<kMaxNumRegions> bs;
-    for (int j = 0; j < num; j++) {
-      bs.set(region_cnt++);
-    }
-    unsigned long rmask = bs.to_ulong();  // region bit masks for a task
-    auto task_fn = [&, s, rmask, imm_raw=imm.get(), job_raw=job.get()](ThreadData* td) {
-      run_mem_compaction_task(td, s, rmask, imm_raw, job_raw->upper_.get());
+    auto task_fn = [&, s, i, flush, imm_raw=imm.get(), job_raw=job.get()](ThreadData* td) {
+      const int num_ranges = (int) flush->begins.size();
+      if (i < num_ranges) {
+        const mNode* end = (i + 1 < num_ranges) ? flush->begins[i + 1] : NULL;
+        run_mem_compaction_task(td, s, imm_raw, flush->begins[i], end, job_raw->upper_.get());
+      }
     };
     auto task = std::make_shared<Task>(job, task_fn);
     job->add_task(task);
   }
   // Callback of the job
-  auto callback_fn = [&, s, imm, job_raw=job.get()]{
+  auto callback_fn = [&, s, imm, flush, job_raw=job.get()]{
+    std::chrono::duration<double> dur = std::chrono::steady_clock::now() - flush->begin_time;
+    const size_t bytes = imm->size();
+    flush_cnt_.fetch_add(1);
+    flush_bytes_.fetch_add(bytes);
+    flush_ns_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(dur).count());
+    flogf(stdout, "Flushed memtable %lu of shard %d: %.3lf MB, %zu tasks, %.3lf sec (%.3lf MB/s)",
+          imm->seq_order(), s, (double) bytes/1000/1000, flush->begins.size(), dur.count(),
+          (dur.count() > 0) ? (double) bytes/1000/1000/dur.count() : 0);
     imm->mark_persist();
     mem_[s].immutables.pop_backs_if([&](std::shared_ptr<MemTable>& t) {
           return t->is_persist();
@@ -49,23 +73,52 @@ void brdb::enq_mem_compaction(const int s, std::shared_ptr<MemTable>& imm, JobMa
   mgr->enqueue(job);
 }
 
-void brdb::run_mem_compaction_task(ThreadData* td, const int s,
-                                   const unsigned long rmask,
-                                   MemTable* imm, PmemTable* pmem) {
-  auto begin = std::chrono::steady_clock::now();
+void brdb::run_mem_compaction_task(ThreadData* td, const int s, MemTable* imm,
+                                   const mNode* begin, const mNode* end, PmemTable* pmem) {
+  auto begin_time = std::chrono::steady_clock::now();
 #ifndef BR_LOG_IUL
-  pmem->merge_WAL(td, rmask, imm);
+  pmem->merge_WAL(td, imm, begin, end, oldest_snapshot());
 #else
-  pmem->merge_IUL(td, rmask, imm);
+  pmem->merge_IUL(td, imm, begin, end, oldest_snapshot());
 #endif
-  auto end = std::chrono::steady_clock::now();
-  std::chrono::duration<double> dur = end - begin;
+  auto end_time = std::chrono::steady_clock::now();
+  std::chrono::duration<double> dur = end_time - begin_time;
   td->mem_compaction_dur += dur.count();
 }
 
+void brdb::add_pending_merge(const int s, const int level, std::shared_ptr<PmemTable> table) {
+  if (level >= kNumPmemLevels - 1) {
+    return;
+  }
+  auto& q = merge_queue_[s][level];
+  std::lock_guard<std::mutex> guard(q.mu);
+  q.tables.emplace_back(std::move(table), false);
+}
+
 void brdb::enq_pmem_compaction(const int s, const int lower_level,
                                std::shared_ptr<PmemTable>& lower,
                                JobManager* mgr) {
+  auto& q = merge_queue_[s][lower_level];
+  std::lock_guard<std::mutex> guard(q.mu);
+  for (auto& t : q.tables) {
+    if (t.first == lower) {
+      t.second = true;
+      break;
+    }
+  }
+  enq_next_pmem_compaction(s, lower_level, mgr);
+}
+
+void brdb::enq_next_pmem_compaction(const int s, const int lower_level, JobManager* mgr) {
+  // The merge goes to the manager of the job that made it possible, which
+  // is still running, so that waiting for the manager covers the chain
+  auto& q = merge_queue_[s][lower_level];
+  if (q.running || q.tables.empty() || !q.tables.front().second) {
+    return;
+  }
+  auto lower = std::move(q.tables.front().first);
+  q.tables.pop_front();
+  q.running = true;
   int upper_level = lower_level + 1;
   if (upper_level < kNumLogUnifiedLevels) {
     enq_zipper_compaction(s, lower_level, upper_level, lower, mgr);
@@ -74,66 +127,75 @@ void brdb::enq_pmem_compaction(const int s, const int lower_level,
   }
 }
 
+void brdb::finish_pmem_compaction(const int s, const int lower_level, JobManager* mgr) {
+  auto& q = merge_queue_[s][lower_level];
+  std::lock_guard<std::mutex> guard(q.mu);
+  q.running = false;
+  enq_next_pmem_compaction(s, lower_level, mgr);
+}
+
 void brdb::enq_zipper_compaction(const int s, const int lower_level,
                                  const int upper_level,
                                  std::shared_ptr<PmemTable>& lower,
                                  JobManager* mgr) {
-  // Construct a job
+  // Construct a job. Its tasks compact key ranges of lower, which are split
+  // once its writers are done.
   int num_tasks = std::min(kNumWorkers, kCompactionTaskSize);
   auto job = std::make_shared<Job>(lower_level, 0, num_tasks);
-  job->set_before([&, s, lower_level, upper_level, lower, job_raw=job.get()]{
-        while (lower.use_count() > 4/* FOR TEST */) { /*fprintf(stderr,"TEST %p use_count = %d\n", lower.get(), lower.use_count());*/ continue; }
+  auto zc = std::make_shared<ZipperCompaction>(lower_level, num_tasks);
+  job->set_before([&, s, lower_level, upper_level, lower, zc, job_raw=job.get()]{
+        lower->wait_for_writers();
         size_t write_size = kPmemTableSize[lower_level] / kNumShards;
         job_raw->upper_ = get_writable_pmemtable(NULL, s, upper_level, write_size, job_raw->job_mgr());
+        if (upper_level == kNumPmemLevels - 1) {
+          begin_last_level_writes(job_raw->upper_.get());
+        }
+        zc->init(job_raw->upper_->skiplist(), lower->skiplist());
       });
   // Construct tasks of the job
-  int region_cnt = 0;
-  int num = kNumRegions / num_tasks;
   for (int i = 0; i < num_tasks; i++) {
-    if (i == num_tasks - 1) {
-      num += kNumRegions % num_tasks;
-    }
-    std::bitset<kMaxNumRegions> bs;
-    for (int j = 0; j < num; j++) {
-      bs.set(region_cnt++);
-    }
-    unsigned long rmask = bs.to_ulong();
-    auto task = std::make_shared<Task>(job,
-        [&, s, rmask, lower_level, upper_level, lower_raw=lower.get(), job_raw=job.get()](ThreadData* td) {
-          run_zipper_compaction_task(td, s, rmask, lower_level, upper_level, lower_raw, job_raw->upper_.get());
+    auto task = std::make_shared<Task>(job, [&, s, zc, i](ThreadData* td) {
+          run_zipper_compaction_task(td, s, zc.get(), i);
         });
     job->add_task(task);
   }
-  job->set_callback([&, s, lower_level, lower, job_raw=job.get()]{
-        lower->mark_merged_down();
+  job->set_callback([&, s, lower_level, upper_level, lower, job_raw=job.get()]{
+        // Nodes of lower now belong to the upper table
+        lower->pin_upper(job_raw->upper_.get());
+        lower->mark_merged_down(lower_level, false, retire_fn_);
+        if (upper_level == kNumPmemLevels - 1) {
+          job_raw->upper_->end_index_writes();
+          schedule_learned_index_build(s);
+        }
+        job_raw->upper_->unref();
         level_[s][lower_level].immutables.pop_backs_if([&](std::shared_ptr<PmemTable>& t) {
               return t->is_merged_down();
             });
         job_raw->upper_ = nullptr;
+        finish_pmem_compaction(s, lower_level, job_raw->job_mgr());
       });
   mgr->enqueue(job);
 }
 
-void brdb::run_zipper_compaction_task(ThreadData* td, const int s, const unsigned long rmask,
-                                      const int lower_level,
-                                      const int upper_level,
-                                      PmemTable* lower,
-                                      PmemTable* upper) {
+void brdb::run_zipper_compaction_task(ThreadData* td, const int s, ZipperCompaction* zc, const int range) {
   // Do compaction
-  upper->zipper_compaction(td, rmask, lower_level, lower);
+  zc->run(td, range);
 }
 
 void brdb::enq_log_structured_compaction(const int s, const int lower_level,
                                          const int upper_level,
                                          std::shared_ptr<PmemTable>& lower,
                                          JobManager* mgr) {
-  // Construct a job
-  int num_tasks = std::min(kNumWorkers, kCompactionTaskSize);
+  // Construct a job, of a task per group of regions
+  int num_tasks = std::min({kNumWorkers, kCompactionTaskSize, kNumRegions});
   auto job = std::make_shared<Job>(lower_level, 0, num_tasks);
   job->set_before([&, s, lower_level, upper_level, lower, job_raw=job.get()]{
-        while (lower.use_count() > 3) { /*fprintf(stderr,"TEST %d\n", lower.use_count());*/ continue; }
+        lower->wait_for_writers();
         size_t write_size = kPmemTableSize[lower_level] / kNumShards;
         job_raw->upper_ = get_writable_pmemtable(NULL, s, upper_level, write_size, job_raw->job_mgr());
+        if (upper_level == kNumPmemLevels - 1) {
+          begin_last_level_writes(job_raw->upper_.get());
+        }
       });
   // Construct tasks of the job
   int region_cnt = 0;
@@ -153,12 +215,24 @@ void brdb::enq_log_structured_compaction(const int s, const int lower_level,
         });
     job->add_task(task);
   }
-  job->set_callback([&, s, lower_level, lower, job_raw=job.get()]{
-        lower->mark_merged_down();
+  job->set_callback([&, s, lower_level, upper_level, lower, job_raw=job.get()]{
+        // Nodes of lower were copied. Log records of a log-unified level are
+        // not individual PMEM objects, so they are left to the log.
+#ifndef BR_LOG_IUL
+        lower->mark_merged_down(lower_level, true, retire_fn_);
+#else
+        lower->mark_merged_down(lower_level, lower_level >= kNumLogUnifiedLevels, retire_fn_);
+#endif
+        if (upper_level == kNumPmemLevels - 1) {
+          job_raw->upper_->end_index_writes();
+          schedule_learned_index_build(s);
+        }
+        job_raw->upper_->unref();
         level_[s][lower_level].immutables.pop_backs_if([&](std::shared_ptr<PmemTable>& t) {
               return t->is_merged_down();
             });
         job_raw->upper_ = nullptr;
+        finish_pmem_compaction(s, lower_level, job_raw->job_mgr());
       });
   mgr->enqueue(job);
 }
@@ -168,8 +242,12 @@ void brdb::run_log_structured_compaction_task(ThreadData* td, const int s, const
                                               const int upper_level,
                                               PmemTable* lower,
                                               PmemTable* upper) {
+#ifdef BR_STRING_KV
+  // Nodes are copied with their value offsets
+  std::shared_lock<std::shared_mutex> lk(vlog_gc_mu_[s]);
+#endif
   // Do compaction
-  upper->log_structured_compaction(td, rmask, lower_level, lower);
+  upper->log_structured_compaction(td, rmask, lower_level, lower, oldest_snapshot(), retire_fn_);
 }
 
 void brdb::enq_manual_compaction(const int s, const int level, JobManager* mgr) {
@@ -184,19 +262,17 @@ void brdb::enq_manual_mem_compaction(const int s, JobManager* mgr) {
   if (kNumPmemLevels < 1) return;
   // immutables were automatically enqueued.
   // enqueue the current mutable table of this level
-  auto mut = mem_[s].table;
+  auto mut = std::atomic_load(&mem_[s].table);
   if (mut) {
     std::unique_lock<std::shared_mutex> lk(mem_[s].mu);
     if (mut == mem_[s].table && mut->size() > 0) {
       if (mut->cas_mark_full() == 0) {
         auto old = std::move(mut);
         mut = new_mem_table(s, old);
-#ifdef BR_LOG_IUL
-        mut->init_shortcut_IUL(lpop[s]);
-#endif
         mut->set_seq_order(memtable_seq_[s].fetch_add(1));
+        old->seal(seq_);
         mem_[s].immutables.push_front(old);
-        std::atomic_store(&(mem_[s].table), mut);
+        mem_[s].set_table(mut);
         // immutable ordering
         // immutables.push_front should be done inside a critical section
         auto future_pmem = old->get_future_pmem_table();
@@ -209,6 +285,7 @@ void brdb::enq_manual_mem_compaction(const int s, JobManager* mgr) {
         future_pmem->set_shard(s);
         future_pmem->cas_mark_full();
         level_[s][0].immutables.push_front(future_pmem);
+        add_pending_merge(s, 0, future_pmem);
         lk.unlock();
         enq_mem_compaction(s, old, mgr);
       }
@@ -219,13 +296,14 @@ void brdb::enq_manual_mem_compaction(const int s, JobManager* mgr) {
 void brdb::enq_manual_pmem_compaction(const int s, const int level, JobManager* mgr) {
   // immutables were automatically enqueued.
   // enqueue the current mutable table of this level
-  auto mut = level_[s][level].table;  // a mutable table
+  auto mut = std::atomic_load(&level_[s][level].table);  // a mutable table
   if (mut && mut->size() > 0 && mut->cas_mark_full() == 0) {
 assert(level!=0);
     auto old = std::move(mut);
     mut = new_pmem_table(s, level, old);
     level_[s][level].immutables.push_front(old);
-    std::atomic_store(&(level_[s][level].table), mut);
+    level_[s][level].set_table(mut);
+    add_pending_merge(s, level, old);
     enq_pmem_compaction(s, level, old, mgr);
   }
 }
@@ -0,0 +1,196 @@
+#include "brdb.h"
+
+#include <mutex>
+#include <shared_mutex>
+
+#include "pmem.h"
+
+// Value log GC
+//
+// A full value log block is collected oldest first. A value is live if the
+// newest version of its key points to it, or a version that a snapshot may
+// read. Live values are appended to the
+// head of the value log and the index nodes pointing to them are switched to
+// the new copy by a CAS on the node value. The block is freed after the
+// readers of the epoch are gone.
+//
+// Memtable nodes are not updated, since a flush may copy them at any time.
+// A block with a live value still in DRAM is retried later.
+
+void brdb::maybe_schedule_vlog_gc(const int s) {
+#ifdef BR_STRING_KV
+  if (kVLogGCTrigger == 0 || vlog_[s]->num_sealed_blocks() < vlog_gc_trigger_[s].load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (vlog_gc_scheduled_[s].load(std::memory_order_relaxed)) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now() - tp_begin_;
+  if (std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() < vlog_gc_next_time_[s].load()) {
+    return;
+  }
+  bool expected = false;
+  if (!vlog_gc_scheduled_[s].compare_exchange_strong(expected, true)) {
+    return;
+  }
+  // Below all compactions in priority
+  auto job = std::make_shared<Job>(kMaxNumPmemLevels, 0, 1);
+  auto task = std::make_shared<Task>(job, [&, s](ThreadData* td) {
+        const size_t num_sealed = vlog_[s]->num_sealed_blocks();
+        if (run_vlog_gc_task(td, s)) {
+          vlog_gc_trigger_[s].store(kVLogGCTrigger);
+        } else {
+          // Nothing to collect until more blocks are sealed
+          vlog_gc_trigger_[s].store(num_sealed + kVLogGCTrigger);
+        }
+        vlog_[s]->release_tail(td, s);
+      });
+  job->add_task(task);
+  job->set_callback([&, s]{
+        vlog_gc_scheduled_[s].store(false);
+      });
+  job_mgr_->enqueue(job);
+#endif
+}
+
+bool brdb::run_vlog_gc_task(ThreadData* td, const int s) {
+#ifndef BR_STRING_KV
+  return false;
+#else
+  auto begin = std::chrono::steady_clock::now();
+  LogBlock* b = nullptr;
+  size_t relocated_bytes = 0;
+  {
+    std::unique_lock<std::shared_mutex> lk(vlog_gc_mu_[s]);
+    EpochGuard guard(&epoch_);
+    b = vlog_[s]->oldest_sealed_block();
+    if (b == nullptr) {
+      return false;
+    }
+    const int r = b->region();
+    // Pass 1: live values. Nothing is changed before the block is known to
+    // be collectable.
+    std::vector<std::pair<char*, uint64_t>> live;  // record, value moff
+    std::vector<std::pair<char*, bool>> versions;
+    const uint64_t oldest = oldest_snapshot();
+    const bool all = (oldest != kMaxSequenceNumber);
+    char* p = b->data();
+    char* end = p + kLogBlockSize;
+    while (p < end) {
+      auto rec = ValueLog::read_record(p);
+      if (!rec.is_padding()) {
+        uint64_t moff = (((uintptr_t) p - (uintptr_t) vpop[s][r]) << 16) | r;
+        versions.clear();
+        find_versions(td, s, rec.key, all, &versions);
+        // A version is needed unless the next newer one is visible at every
+        // snapshot. Copies of a version share its sequence number.
+        uint64_t newer_seq = UINT64_MAX;
+        uint64_t prev_seq = UINT64_MAX;
+        for (auto& v : versions) {
+          StringKey version(v.first);
+          const uint64_t seq = tag_seq(version.tag());
+          if (seq < prev_seq) {
+            newer_seq = prev_seq;
+            prev_seq = seq;
+          }
+          if (newer_seq <= oldest) {
+            break;
+          }
+          if (version.value() == moff && (version.tag() & 0xff) == kTypeValue) {
+            if (v.second) {
+              return false;
+            }
+            live.emplace_back(p, moff);
+            break;
+          }
+        }
+      }
+      p += rec.size;
+    }
+    // Pass 2: relocation. Every index node of the version is updated, since
+    // a log-structured compaction may have copied it to the next level.
+    for (auto& item : live) {
+      auto rec = ValueLog::read_record(item.first);
+      uint64_t new_moff = vlog_[s]->write_value(td, s, rec.key, rec.value);
+      relocated_bytes += rec.size;
+      versions.clear();
+      find_versions(td, s, rec.key, true, &versions);
+      for (auto& v : versions) {
+        auto value = (std::atomic<uint64_t>*) StringKey(v.first).value_ptr();
+        uint64_t expected = item.second;
+        if (!v.second && value->compare_exchange_strong(expected, new_moff)) {
+          pmemobj_persist(pmemobj_pool_by_ptr(value), value, sizeof(uint64_t));
+        }
+      }
+      // The lookup cache holds a copy of the old offset
+      ht_del(s, rec.key);
+    }
+    vlog_[s]->unlink_block(b);
+  }
+  // Outside of the epoch, so that the block can be freed right away
+  epoch_.retire([&, s, b]{ vlog_[s]->free_block(b); });
+
+  vlog_gc_scanned_bytes.fetch_add(kLogBlockSize);
+  vlog_gc_relocated_bytes.fetch_add(relocated_bytes);
+  vlog_gc_freed_blocks.fetch_add(1);
+  // Rate limit: the next GC of the shard starts after the time budget of
+  // the scanned bytes
+  if (kVLogGCRate > 0) {
+    auto budget = std::chrono::nanoseconds((int64_t) ((double) kLogBlockSize * 1000 / kVLogGCRate));
+    auto next = std::chrono::duration_cast<std::chrono::nanoseconds>(begin + budget - tp_begin_);
+    vlog_gc_next_time_[s].store(next.count());
+  }
+  return true;
+#endif
+}
+
+void brdb::find_versions(ThreadData* td, const int s, const std::string_view& key, const bool all,
+                         std::vector<std::pair<char*, bool>>* out) {
+#ifdef BR_STRING_KV
+  auto add = [&](char* encoded_key, bool in_dram) {
+    out->emplace_back(encoded_key, in_dram);
+    return !all;
+  };
+  // Versions of a key in a table are adjacent, newest first
+  auto find_mem = [&](MemTable* t) {
+    auto skiplist = t->skiplist();
+    for (auto node = skiplist->find(td, key); node && skiplist->cmp_(node, key) == 0; node = node->next[0].load()) {
+      if (node->type() != kTypeShortcut && add(node->data(), true)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  auto find_pmem = [&](PmemTable* t) {
+    auto skiplist = t->skiplist();
+    for (auto node = skiplist->find(td, td->region, key); node && skiplist->cmp_(node, key) == 0;
+         node = (pNode*) skiplist->moff_to_ptr(node->next[0].load())) {
+      if (node->type() != kTypeShortcut && add(node->data(), false)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  MemTable* mem = mem_[s].table_ptr.load();
+  if (mem && find_mem(mem)) {
+    return;
+  }
+  for (auto it = mem_[s].immutables.begin(); it.valid(); it.next()) {
+    if (find_mem((*it).get())) {
+      return;
+    }
+  }
+  for (int l = 0; l < kNumPmemLevels; l++) {
+    PmemTable* pmem = level_[s][l].table_ptr.load();
+    if (pmem && find_pmem(pmem)) {
+      return;
+    }
+    for (auto it = level_[s][l].immutables.begin(); it.valid(); it.next()) {
+      if (find_pmem((*it).get())) {
+        return;
+      }
+    }
+  }
+#endif
+}
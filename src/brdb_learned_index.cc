@@ -0,0 +1,101 @@
+#include "brdb.h"
+
+#include "ds/learned_index.h"
+
+// Learned index of the last level
+//
+// The last-level table of a shard is one large skiplist, whose search walks
+// every level of PMEM nodes. Once the level is not written anymore, e.g.,
+// after stabilize(), a background job samples its bottom level into a
+// LearnedIndex in DRAM. Reads then start at the sample before the key and
+// walk at most about learned_index_stride nodes of the bottom level.
+//
+// A compaction into the level drops the index before its first write, since
+// unlinked versions and new nodes would make the walks long or wrong, and
+// schedules a rebuild when it is done. A build that overlaps a write is
+// discarded. Integer keys only.
+
+void brdb::schedule_learned_index_build(const int s) {
+#ifndef BR_STRING_KV
+  if (kLearnedIndexStride <= 0 || kNumPmemLevels < 2) {
+    return;
+  }
+  learned_index_requested_[s].store(true);
+  bool expected = false;
+  if (!learned_index_scheduled_[s].compare_exchange_strong(expected, true)) {
+    // The running build sees the request when it is done
+    return;
+  }
+  // Below all compactions in priority
+  auto job = std::make_shared<Job>(kMaxNumPmemLevels, 0, 1);
+  auto task = std::make_shared<Task>(job, [&, s](ThreadData* td) {
+        learned_index_requested_[s].store(false);
+        build_learned_index(td, s);
+      });
+  job->add_task(task);
+  job->set_callback([&, s]{
+        learned_index_scheduled_[s].store(false);
+        if (learned_index_requested_[s].load()) {
+          schedule_learned_index_build(s);
+        }
+      });
+  job_mgr_->enqueue(job);
+#endif
+}
+
+bool brdb::build_learned_index(ThreadData* td, const int s) {
+#ifdef BR_STRING_KV
+  return false;
+#else
+  // Versions unlinked by a compaction meanwhile are freed after the epoch
+  EpochGuard guard(&epoch_);
+  auto table = std::atomic_load(&level_[s][kNumPmemLevels - 1].table);
+  if (!table || table->learned_index() != nullptr) {
+    return false;
+  }
+  const int64_t version = table->index_version();
+  if (version < 0) {
+    return false;
+  }
+  auto begin = std::chrono::steady_clock::now();
+  auto skiplist = table->skiplist();
+  auto index = std::make_unique<LearnedIndex>();
+  size_t num_nodes = 0;
+  size_t since_sample = kLearnedIndexStride;
+  uint64_t last_key = 0;
+  pNode* node = (pNode*) skiplist->moff_to_ptr(skiplist->head(kPrimaryRegion)->next[0].load());
+  while (node) {
+    // Versions of a key are adjacent, so a sample is the first node of its
+    // key when the stride ends on a later version
+    if (since_sample >= (size_t) kLearnedIndexStride && (index->size() == 0 || node->key() > last_key)) {
+      index->add(node->key(), node);
+      last_key = node->key();
+      since_sample = 0;
+    }
+    since_sample++;
+    if (++num_nodes % 4096 == 0 && table->index_version() != version) {
+      return false;
+    }
+    node = (pNode*) skiplist->moff_to_ptr(node->next[0].load());
+  }
+  index->finish();
+  const size_t num_samples = index->size();
+  const size_t num_segments = index->num_segments();
+  const size_t bytes = index->memory_usage();
+  if (!table->set_learned_index(index.get(), version)) {
+    return false;
+  }
+  index.release();
+  std::chrono::duration<double> dur = std::chrono::steady_clock::now() - begin;
+  flogf(stdout, "Learned index of shard %d: %zu nodes, %zu samples, %zu segments, %.3lf MB (%.3lf sec)",
+        s, num_nodes, num_samples, num_segments, (double) bytes/1000/1000, dur.count());
+  return true;
+#endif
+}
+
+void brdb::begin_last_level_writes(PmemTable* table) {
+  LearnedIndex* index = table->begin_index_writes();
+  if (index) {
+    epoch_.retire([index]{ delete index; });
+  }
+}
@@ -1,549 +1,492 @@
 #include "brdb.h"
 
+#include <type_traits>
+
 #include "db_iterator.h"
 
-bool brdb::get(ThreadData* td, const std::string_view& key, std::string* value_out) {
-//***
-// Compute shard number
+namespace {
+
+// Value of a lookup cache entry, see ht_get()
+inline std::string_view cached_value(const uint64_t& data) {
 #ifndef BR_STRING_KV
-  uint64_t cmp = *((uint64_t*) key.data());
+  return std::string_view((char*) &data, 8);
 #else
-  uint64_t cmp = key_num(key);
+  return string_value_view(StringKey((char*) data));
 #endif
-  int s = cmp % kNumShards;
+}
 
+// Admits the version found by a read that missed the lookup cache. `value`
+// is needed for integer keys. A string key version is cached only from a
+// PMEM table, since memtable nodes are freed without eviction.
+inline void fill_cache(ThreadData* td, const int s, const std::string_view& key, const std::string_view& value,
+                       const pNode* pmem_node, const uint32_t token) {
 #ifndef BR_STRING_KV
-  bool cache_hit = ht_get(s, cmp, NULL);
-  if (cache_hit) {
-    return true;
-  }
+  const bool filled = ht_fill(s, *((uint64_t*) key.data()), *((uint64_t*) value.data()), token);
 #else
-  if (ht_get(s, key, NULL)) {
-    return true;
-  }
+  const bool filled = pmem_node && ht_fill(s, (uint64_t) pmem_node->data(), 0, token);
 #endif
-
-
-  if (read_from_mem_casc(td, s, key, value_out)) {
-    //counter[td->cpu].get_cnt++;
-    return true;
+  if (filled) {
+    counter[td->cpu].cache_fill_cnt++;
   }
-  if (read_from_imms_casc(td, s, key, value_out)) {
-    //counter[td->cpu].get_cnt++;
+}
+
+// Probes the filter of a table of `level` before it is searched. Returns
+// false if the search can be skipped.
+template <typename Key>
+inline bool filter_may_contain(ThreadData* td, PmemTable* t, const int level, const Key& key) {
+  if (t->may_contain(key)) {
     return true;
   }
-  if (read_from_pmem_level_casc(td, s, 0, key, value_out)) {
-    //counter[td->cpu].get_cnt++;
-    return true;
+  counter[td->cpu].filter_useful_cnt[level]++;
+  return false;
+}
+
+// Counts a search that the filter of the table let through and that missed
+inline void filter_missed(ThreadData* td, PmemTable* t, const int level) {
+  if (t->has_filter()) {
+    counter[td->cpu].filter_fp_cnt[level]++;
   }
-  for (int i = 1; i < kNumPmemLevels - 1; i++) {
-    if (read_from_pmem_level(td, s, i, key, value_out)) {
-      //counter[td->cpu].get_cnt++;
+}
+
+}  // namespace
+
+bool brdb::get(ThreadData* td, const std::string_view& key, std::string* value_out,
+               const uint64_t snapshot) {
+  int s = shard_of(key);
+  counter[td->cpu].get_cnt++;
+
+  // Tables loaded below, and the nodes and value log blocks of cached
+  // entries, stay alive until the guard is released
+  EpochGuard guard(&epoch_);
+  // The lookup cache has the latest versions only
+  const bool use_cache = (snapshot == kMaxSequenceNumber);
+  uint32_t fill_token = 0;
+  if (use_cache) {
+    uint64_t data;
+    if (ht_get(s, key, &data)) {
+      counter[td->cpu].cache_hit_cnt++;
+      if (value_out) {
+        auto value = cached_value(data);
+        value_out->assign(value.data(), value.size());
+      }
       return true;
     }
+    counter[td->cpu].cache_miss_cnt++;
+    // Taken before the search, so that a write in between fails the fill
+    fill_token = ht_fill_token(s, key);
   }
-  PmemTable* llt = level_[s][kNumPmemLevels-1].table.get();
-#ifndef BR_STRING_KV
-  auto& search_key = *reinterpret_cast<const uint64_t*>(key.data());
-#else
-  auto& search_key = key;
-#endif
 
-  bool get_result = llt->get(td, search_key, value_out);
-  //counter[td->cpu].get_cnt++;
-  return get_result;
-}
-  
-thread_local uint64_t t_seq_order_last;
-thread_local const mNode* t_sc_mem;
-thread_local uint64_t t_sc_pmem_off;
-thread_local const pNode* t_sc_pmem;
-thread_local uint64_t t_sc_seq_order;
-thread_local int t_sc_table_type;
-thread_local int t_last_table;
-
-bool brdb::read_from_mem_casc(ThreadData* td, const int s, const std::string_view& key, std::string* value_out) {
-  auto mem = mem_[s].table;
-  while (mem == nullptr) mem = mem_[s].table;
-  t_seq_order_last = mem->seq_order();
-  t_sc_mem = NULL;
-  t_sc_pmem_off = 0;
-  t_sc_pmem = NULL;
-  t_last_table = -1;
-  t_sc_seq_order = 0;
-  t_sc_table_type = -1;
-  auto it = casc_mem_table_iterator(mem);
+  std::string_view value;
+  const pNode* pmem_node = NULL;
 #ifndef BR_STRING_KV
-  auto& search_key = *reinterpret_cast<const uint64_t*>(key.data());
+  // The value is the cache entry
+  const bool need_value = (value_out != NULL || use_cache);
 #else
-  auto& search_key = key;
+  const bool need_value = (value_out != NULL);
 #endif
-  it.seek(search_key);
-  if (it.valid() && it.cmp() == 0 && it.node()->type() != kTypeShortcut) {
-    if (value_out) {
-      uint64_t value = it.node()->value();
-      value_out->assign((char*) &value, 8);
-    }
-    return true;
+  if (!lookup(td, s, key, need_value ? &value : NULL, snapshot, &pmem_node)) {
+    return false;
   }
-  t_sc_mem = it.shortcut();
-  t_sc_pmem_off = it.pmem_shortcut_offset(td->region);
-  t_sc_seq_order = t_seq_order_last;
-  return false;
+  if (use_cache) {
+    fill_cache(td, s, key, value, pmem_node, fill_token);
+  }
+  if (value_out) {
+    value_out->assign(value.data(), value.size());
+  }
+  return true;
 }
 
-bool brdb::read_from_imms_casc(ThreadData* td, const int s, const std::string_view& key, std::string* value_out) {
-  if (mem_[s].immutables.empty()) return false;
-#ifndef BR_STRING_KV
-  auto& search_key = *reinterpret_cast<const uint64_t*>(key.data());
-#else
-  auto& search_key = key;
-#endif
-  auto it = mem_[s].immutables.begin();
-  const mNode* pred = NULL;
-  while (it.valid()) {
-    auto imm = *it;
-    if (imm->seq_order() >= t_seq_order_last) {
-      it.next();
+bool brdb::get_view(ThreadData* td, const std::string_view& key, std::string_view* value_out) {
+  // The lookup cache has copies of integer values, which a view cannot
+  // point to, so it is not used. The search runs in the epoch of the
+  // caller's read guard, which keeps the view valid after it returns.
+  assert(epoch_.in_epoch());
+  counter[td->cpu].get_cnt++;
+  return lookup(td, shard_of(key), key, value_out);
+}
+
+void brdb::multi_get(ThreadData* td, const std::vector<std::string_view>& keys,
+                     std::vector<std::string>* values_out, std::vector<bool>* found_out) {
+  const size_t n = keys.size();
+  counter[td->cpu].get_cnt += n;
+  found_out->assign(n, false);
+  if (values_out) {
+    values_out->assign(n, std::string());
+  }
+  std::vector<std::vector<size_t>> by_shard(kNumShards);
+  for (size_t i = 0; i < n; i++) {
+    by_shard[shard_of(keys[i])].push_back(i);
+  }
+  std::vector<std::string_view> shard_keys;
+  std::vector<std::string_view> views;
+  for (int s = 0; s < kNumShards; s++) {
+    auto& idxs = by_shard[s];
+    if (idxs.empty()) {
       continue;
     }
-    if (imm->seq_order() == t_sc_seq_order - 1) {
-      pred = t_sc_mem;
-    } else {
-      pred = NULL;
+    shard_keys.clear();
+    for (auto i : idxs) {
+      shard_keys.push_back(keys[i]);
     }
-    t_seq_order_last = imm->seq_order();
-    auto it2 = casc_mem_table_iterator(imm);
-    it2.seek(search_key, pred);
-    if (it2.valid() && it2.cmp() == 0 && it2.node()->type() != kTypeShortcut) {
-      if (value_out) {
-        uint64_t value = it2.node()->value();
-        value_out->assign((char*) &value, 8);
+    // As in get(), misses of the lookup cache fill it
+    EpochGuard guard(&epoch_);
+    std::unique_ptr<bool[]> hits(new bool[idxs.size()]);
+    std::vector<uint64_t> cached(idxs.size());
+    ht_get_batch(s, idxs.size(), shard_keys.data(), hits.get(), cached.data());
+    std::vector<size_t> misses;
+    for (size_t k = 0; k < idxs.size(); k++) {
+      if (hits[k]) {
+        (*found_out)[idxs[k]] = true;
+        if (values_out) {
+          auto value = cached_value(cached[k]);
+          (*values_out)[idxs[k]].assign(value.data(), value.size());
+        }
+      } else {
+        misses.push_back(k);
+      }
+    }
+    counter[td->cpu].cache_hit_cnt += idxs.size() - misses.size();
+    counter[td->cpu].cache_miss_cnt += misses.size();
+    if (misses.empty()) {
+      continue;
+    }
+    std::vector<uint32_t> tokens(misses.size());
+    for (size_t m = 0; m < misses.size(); m++) {
+      shard_keys[m] = shard_keys[misses[m]];
+      idxs[m] = idxs[misses[m]];
+      tokens[m] = ht_fill_token(s, shard_keys[m]);
+    }
+    shard_keys.resize(misses.size());
+    idxs.resize(misses.size());
+    views.assign(idxs.size(), std::string_view());
+    std::unique_ptr<bool[]> found(new bool[idxs.size()]());
+    std::vector<const pNode*> pmem_nodes(idxs.size());
+    multi_lookup(td, s, shard_keys.size(), shard_keys.data(), views.data(), found.get(), pmem_nodes.data());
+    for (size_t k = 0; k < idxs.size(); k++) {
+      if (found[k]) {
+        (*found_out)[idxs[k]] = true;
+        if (values_out) {
+          (*values_out)[idxs[k]].assign(views[k].data(), views[k].size());
+        }
+        fill_cache(td, s, shard_keys[k], views[k], pmem_nodes[k], tokens[k]);
       }
-      return true;
     }
-    t_sc_mem = it2.shortcut();
-    t_sc_pmem_off = it2.pmem_shortcut_offset(td->region);
-    t_sc_seq_order = t_seq_order_last;
-    it.next();
   }
-  return false;
 }
 
-bool brdb::read_from_pmem_level_casc(ThreadData* td, const int s, const int level, const std::string_view& key, std::string* value_out) {
+void brdb::multi_lookup(ThreadData* td, const int s, const size_t n, const std::string_view* keys,
+                        std::string_view* values_out, bool* found_out, const pNode** pmem_nodes_out) {
+  using Key = lockfree_skiplist::Key;
+  // Keys not settled by the tables searched so far, newest table first
+  std::vector<size_t> pending(n);
+  std::vector<Key> search_keys(n);
+  for (size_t i = 0; i < n; i++) {
+    pending[i] = i;
 #ifndef BR_STRING_KV
-  auto& search_key = *reinterpret_cast<const uint64_t*>(key.data());
+    search_keys[i] = *reinterpret_cast<const uint64_t*>(keys[i].data());
 #else
-  auto& search_key = key;
+    search_keys[i] = keys[i];
 #endif
-  if (level == 0) {
-    if (level_[s][level].immutables.empty()) return false;
-    std::shared_ptr<PmemTable> pmem = nullptr;
-    auto it = level_[s][level].immutables.begin();
-    const pNode* pred = NULL;
-    while (it.valid()) {
-      pmem = *it;
-      if (pmem->seq_order() >= t_seq_order_last) {
-        it.next();
-        continue;
-      }
-      if (pmem->seq_order() == t_sc_seq_order - 1) {
-        pred = t_sc_pmem;
-        if (t_sc_table_type == -1) {
-          //UINT64_pnode* pred = (UINT64_pnode*) pmem->get_node_by_offset(td->region, t_sc_pmem_off);
-          //t_sc_pmem = (UINT64_pnode*) pmem->get_node_by_offset(td->region, t_sc_pmem_off);
-          pred = NULL;
+  }
+  std::vector<mNode*> mem_nodes(n);
+  std::vector<pNode*> pmem_nodes(n);
+  // A tombstone settles its key as not found
+  auto settle = [&](auto& nodes) {
+    size_t m = 0;
+    for (size_t k = 0; k < pending.size(); k++) {
+      auto node = nodes[k];
+      if (node && node->type() != kTypeShortcut) {
+        found_out[pending[k]] = (node->type() != kTypeDeletion);
+        if (found_out[pending[k]]) {
+          values_out[pending[k]] = node->value_view();
+          if constexpr (std::is_same<std::decay_t<decltype(node)>, pNode*>::value) {
+            if (pmem_nodes_out) {
+              pmem_nodes_out[pending[k]] = node;
+            }
+          }
         }
       } else {
-        pred = NULL;
+        search_keys[m] = search_keys[k];
+        pending[m++] = pending[k];
       }
-      t_seq_order_last = pmem->seq_order();
-      auto it2 = casc_pmem_table_iterator(td->region, pmem);
-      //it2.seek(search_key, t_sc_pmem);
-      it2.seek(search_key, pred);
-      if (it2.valid() && it2.cmp() == 0 && it2.node()->type() != kTypeShortcut) {
-        if (value_out) {
-          uint64_t value = it2.node()->value();
-          value_out->assign((char*) &value, 8);
-        }
-        return true;
+    }
+    pending.resize(m);
+    search_keys.resize(m);
+  };
+  auto search_mem = [&](MemTable* t) {
+    t->skiplist()->find_batch(td, pending.size(), search_keys.data(), mem_nodes.data());
+    settle(mem_nodes);
+    return pending.empty();
+  };
+  std::vector<size_t> probed;  // positions in `pending` the filter let through
+  std::vector<Key> probe_keys;
+  std::vector<pNode*> probe_nodes;
+  auto search_pmem = [&](PmemTable* t, const int level) {
+    if (!t->has_filter()) {
+      t->find_batch(td, pending.size(), search_keys.data(), pmem_nodes.data());
+      settle(pmem_nodes);
+      return pending.empty();
+    }
+    probed.clear();
+    probe_keys.clear();
+    for (size_t k = 0; k < pending.size(); k++) {
+      pmem_nodes[k] = NULL;
+      if (t->may_contain(search_keys[k])) {
+        probed.push_back(k);
+        probe_keys.push_back(search_keys[k]);
       }
-      t_last_table = 0;
-      t_sc_pmem = it2.shortcut();
-//t_sc_pmem = NULL;
-      t_sc_seq_order = t_seq_order_last;
-      t_sc_table_type = 0;
-      it.next();
     }
-    return false;
-  } else {
-    auto pmem = level_[s][level].table;
-    while (pmem == nullptr) pmem = level_[s][level].table;
-    auto it2 = casc_pmem_table_iterator(td->region, pmem);
-    //if (t_last_table == -1) {
-    //  UINT64_pnode* pred = (UINT64_pnode*) pmem->get_node_by_offset(td->region, t_sc_pmem_off);
-    //  it2.seek(search_key, pred);
-    //  t_last_table = 0;
-    //} else {
-    //  it2.seek(search_key, t_sc_pmem);
-    //}
-    it2.seek(search_key, NULL);
-    if (it2.valid() && it2.cmp() == 0 && it2.node()->type() != kTypeShortcut) {
-      if (value_out) {
-        uint64_t value = it2.node()->value();
-        value_out->assign((char*) &value, 8);
+    counter[td->cpu].filter_useful_cnt[level] += pending.size() - probed.size();
+    probe_nodes.resize(probed.size());
+    t->find_batch(td, probed.size(), probe_keys.data(), probe_nodes.data());
+    for (size_t j = 0; j < probed.size(); j++) {
+      pmem_nodes[probed[j]] = probe_nodes[j];
+      if (probe_nodes[j] == NULL || probe_nodes[j]->type() == kTypeShortcut) {
+        counter[td->cpu].filter_fp_cnt[level]++;
       }
-      return true;
     }
-  }
-  return false;
-}
+    settle(pmem_nodes);
+    return pending.empty();
+  };
 
-bool brdb::get_cascade(ThreadData* td, const std::string_view& sv_key, std::string* value_out) {
-#if 0
-  auto& key = *reinterpret_cast<const uint64_t*>(sv_key.data());
-  uint64_t cmp = *((uint64_t*) sv_key.data());
-  int s = cmp % kNumShards;
-  auto mem = mem_[s].table;
-  while (mem == nullptr) mem = mem_[s].table;
-
-  lockfree_skiplist* skiplist = mem->skiplist();
-  UINT64_node* pred = skiplist->head();
-  UINT64_node* curr = NULL;
-  // first MEM
-  UINT64_node* pred_a = NULL;
-  UINT64_node* shortcut = NULL;
-  UINT64_pnode* pmem_shortcut = NULL;
-  int h = pred->height;
-  int cr = 1;
-  for (int l = h - 1; l >= 0; l--) {
-    while (true) {
-      curr = pred->next[l].load();
-      if ((cr = skiplist->cmp_(curr, key)) < 0) {
-        if (curr->shortcut != NULL) {
-          shortcut = curr->shortcut;
-        }
-        if (curr->pmem_shortcut != NULL) {
-          pmem_shortcut = curr->pmem_shortcut;
-        }
-        pred = curr;
-        continue;
-      }
-      break;
+  // Same tables as lookup()
+  MemTable* mem = mem_[s].table_ptr.load();
+  if (mem && search_mem(mem)) {
+    return;
+  }
+  for (auto it = mem_[s].immutables.begin(); it.valid(); it.next()) {
+    if (search_mem((*it).get())) {
+      return;
     }
   }
-  pred_a = pred;
-  if (curr && cr == 0) {
-    uint64_t value = curr->value();
-    value_out->assign((char*) &value, 8);
-    return true;
+  for (auto it = level_[s][0].immutables.begin(); it.valid(); it.next()) {
+    if (search_pmem((*it).get(), 0)) {
+      return;
+    }
   }
-
-  // following MEMs
-  while (true) {
-    auto next_wptr = mem->next();
-    if (auto next_table = next_wptr.lock()) {
-      mem = std::move(next_table);
-    } else {
-      break;
+  for (int l = 1; l < kNumPmemLevels - 1; l++) {
+    PmemTable* pmem = level_[s][l].table_ptr.load();
+    while (pmem == nullptr) pmem = level_[s][l].table_ptr.load();
+    if (search_pmem(pmem, l)) {
+      return;
     }
-    uint64_t key_a = pred_a->key();
-    skiplist = mem->skiplist();
-    pred = (shortcut) ? shortcut : skiplist->head();
-    int h = pred->height;
-    int cr = 1;
-    for (int l = h - 1; l >= 0; l--) {
-      while (true) {
-        curr = pred->next[l].load();
-        if (skiplist->cmp_(curr, key_a) < 0) {
-          if (h > kMaxHeight - 5) {
-            pred_a->shortcut = curr;
-          }
-        }
-        if ((cr = skiplist->cmp_(curr, key)) < 0) {
-          if (curr->shortcut != NULL) {
-            shortcut = curr->shortcut;
-          }
-          if (curr->pmem_shortcut != NULL) {
-            pmem_shortcut = curr->pmem_shortcut;
-          }
-          pred = curr;
-          continue;
-        }
-        break;
+    for (auto it = level_[s][l].immutables.begin(); it.valid(); it.next()) {
+      if (search_pmem((*it).get(), l)) {
+        return;
       }
     }
-    pred_a = pred;
-    if (curr && cr == 0) {
-      uint64_t value = curr->value();
-      value_out->assign((char*) &value, 8);
-      return true;
-    }
   }
-
-  return get_cascade_l0(td, sv_key, value_out, pred_a, pmem_shortcut, mem);
-#endif
-  return false;
+  search_pmem(level_[s][kNumPmemLevels-1].table_ptr.load(), kNumPmemLevels - 1);
 }
 
-bool brdb::get_cascade_l0(ThreadData* td, const std::string_view& sv_key, std::string* value_out,
-    UINT64_node* mem_pred_a, UINT64_pnode* shortcut, std::shared_ptr<MemTable>& mem) {
-#if 0
-  auto& key = *reinterpret_cast<const uint64_t*>(sv_key.data());
-  uint64_t cmp = *((uint64_t*) sv_key.data());
-  int s = cmp % kNumShards;
-  int r = td->region;
-
-  // still holding mem
-  // search pmem
-  auto l0_wptr = mem->upper();
-  std::shared_ptr<PmemTable> pmem;
-  UINT64_pnode* curr = NULL;
-  UINT64_pnode* pred = NULL;
-  UINT64_pnode* pred_a = NULL;
-  lockfree_pskiplist* skiplist = NULL;
-  if (auto l0_table = l0_wptr.lock()) {
-    pmem = std::move(l0_table);
-  } else {
-    return false;
-    //return get_cascade_l1(td, sv_key, value_out, mem_pred_a, shortcut, mem);
-  }
-  uint64_t key_a = mem_pred_a->key();
-  skiplist = pmem->skiplist();
-  pred = (shortcut) ? shortcut : skiplist->head(r);
-  int h = pred->height;
-  int cr = 1;
-  for (int l = h - 1; l >= 1; l--) {
-    while (true) {
-      curr = (UINT64_pnode*) skiplist->offset_to_ptr(pred->next[l].load(), r);
-      if (skiplist->cmp_(curr, key_a) < 0) {
-        if (h > kMaxHeight - 5) {
-          if (mem_pred_a->log_moff & 0xffff == r) {
-            mem_pred_a->pmem_shortcut = curr;
-          }
-        }
-      }
-      if (skiplist->cmp_(curr, key) < 0) {
-        if (curr->shortcut != NULL) {
-          shortcut = curr->shortcut;
-        }
-        pred = curr;
-        continue;
-      }
-      break;
-    }
+bool brdb::lookup(ThreadData* td, const int s, const std::string_view& key, std::string_view* value_out,
+                  const uint64_t snapshot, const pNode** pmem_node_out) {
+  // A tombstone ends the search at the level where it is found
+  bool deleted = false;
+  if (read_from_mem_casc(td, s, key, value_out, &deleted, snapshot)) {
+    //counter[td->cpu].get_cnt++;
+    return !deleted;
   }
-  pred_a = pred;
-  // braided
-  {
-    while (true) {
-      curr = (UINT64_pnode*) skiplist->moff_to_ptr(pred->next[0].load());
-      if ((cr = skiplist->cmp_(curr, key)) < 0) {
-        pred = curr;
-        continue;
-      }
-      break;
+  if (read_from_imms_casc(td, s, key, value_out, &deleted, snapshot)) {
+    //counter[td->cpu].get_cnt++;
+    return !deleted;
+  }
+  if (read_from_pmem_level_casc(td, s, 0, key, value_out, &deleted, snapshot, pmem_node_out)) {
+    //counter[td->cpu].get_cnt++;
+    return !deleted;
+  }
+  for (int i = 1; i < kNumPmemLevels - 1; i++) {
+    if (read_from_pmem_level_casc(td, s, i, key, value_out, &deleted, snapshot, pmem_node_out)) {
+      //counter[td->cpu].get_cnt++;
+      return !deleted;
     }
   }
-  if (curr && cr == 0) {
-    uint64_t value = curr->value();
-    value_out->assign((char*) &value, 8);
-    return true;
+  PmemTable* llt = level_[s][kNumPmemLevels-1].table_ptr.load();
+#ifndef BR_STRING_KV
+  auto& search_key = *reinterpret_cast<const uint64_t*>(key.data());
+#else
+  auto& search_key = key;
+#endif
+
+  bool get_result = llt->get(td, search_key, value_out, &deleted, snapshot, pmem_node_out);
+  //counter[td->cpu].get_cnt++;
+  return get_result && !deleted;
+}
+  
+// The version of the key at `node` that a read at `snapshot` sees, NULL if
+// there is none in the table. Shortcut nodes follow the versions of their key.
+template <typename Skiplist, typename Node>
+static const Node* visible_version(Skiplist* skiplist, const Node* node, const uint64_t snapshot) {
+  if (node->type() == kTypeShortcut) {
+    return NULL;
+  }
+  if (snapshot == kMaxSequenceNumber) {
+    return node;
   }
+  return skiplist->find_version(node, snapshot);
+}
+
+// Cascading search
+//
+// A point read searches the tables of a shard from the newest to the oldest.
+// A shortcut of a table points to a node of the table searched after it, and
+// the search of that table starts there instead of at its head:
+//  - memtable: shortcut nodes in its skiplist, into the next older memtable,
+//    its L0 table once it is flushed, or the L1 table
+//  - PMEM table: a DRAM list of shortcut nodes, into the next L0 table
+//    searched or the table of the next level
+// A search that walks more than cascade_min_visits nodes of a table adds a
+// shortcut to the node before the key into the table searched before it.
+// A shortcut is used only for the table it was made for, which keeps the
+// node linked since nodes are only added to it. The last level unlinks
+// versions and is not searched by shortcuts.
+struct CascadeState {
+  uint64_t seq_order_last;  // memtables and L0 tables from this one on were searched
+  uint64_t l1_table;  // shortcut_table() of L1, 0 if it is the last level
+  // Table searched last, where a shortcut into the next one is added. NULL
+  // for the first one.
+  MemTable* mem;
+  PmemTable* pmem;
+  // Tables the shortcuts of `mem` point to (shortcut_table()), and the last
+  // shortcuts into them passed by the search of `mem`
+  uint64_t tables[casc_skiplist_iterator::kMaxShortcutTables];
+  int num_tables;
+  Shortcut shortcuts[casc_skiplist_iterator::kMaxShortcutTables];
+};
+thread_local CascadeState t_casc;
 
-  mem = nullptr;
+namespace {
 
-  while (true) {
-    cr = 1;
-    auto l0_wptr = pmem->next();
-    if (auto l0_table = l0_wptr.lock()) {
-      pmem = std::move(l0_table);
-    } else {
-      return false;
-      //return get_cascade_l1(td, sv_key, value_out, mem_pred_a, shortcut, mem);
+// Index of `table` in t_casc.tables, -1 if it is not there
+int cascade_table_index(const uint64_t table) {
+  for (int i = 0; i < t_casc.num_tables; i++) {
+    if (t_casc.tables[i] == table) {
+      return i;
     }
-    uint64_t key_a = pred_a->key();
-    skiplist = pmem->skiplist();
-    pred = (shortcut) ? shortcut : skiplist->head(r);
-    int h = pred->height;
-    for (int l = h - 1; l >= 1; l--) {
-      while (true) {
-        curr = (UINT64_pnode*) skiplist->offset_to_ptr(pred->next[l].load(), r);
-        //if (skiplist->cmp_(curr, key_a) < 0) {
-        //  if (h > kMaxHeight - 5) {
-        //    pred_a->shortcut = curr;
-        //  }
-        //}
-        if (skiplist->cmp_(curr, key) < 0) {
-          if (curr->shortcut != NULL) {
-            shortcut = curr->shortcut;
-          }
-          pred = curr;
-          continue;
-        }
-        break;
-      }
+  }
+  return -1;
+}
+
+// Shortcut where the search of `table` starts, none for its head
+Shortcut cascade_start(MemTable* table) {
+  if (t_casc.mem) {
+    int i = cascade_table_index(shortcut_table(false, table->seq_order()));
+    if (i >= 0) {
+      return t_casc.shortcuts[i];
     }
-    pred_a = pred;
-    // braided
-    {
-      while (true) {
-        curr = (UINT64_pnode*) skiplist->moff_to_ptr(pred->next[0].load());
-        if ((cr = skiplist->cmp_(curr, key)) < 0) {
-          pred = curr;
-          continue;
-        }
-        break;
-      }
+  }
+  return Shortcut();
+}
+
+template <typename Key>
+Shortcut cascade_start(PmemTable* table, const Key& key) {
+  const uint64_t target = shortcut_table(true, table->id());
+  if (t_casc.mem) {
+    int i = cascade_table_index(target);
+    if (i >= 0) {
+      return t_casc.shortcuts[i];
     }
-    if (curr && cr == 0) {
-      uint64_t value = curr->value();
-      value_out->assign((char*) &value, 8);
-      return true;
+  } else if (t_casc.pmem) {
+    return t_casc.pmem->find_shortcut(key, target);
+  }
+  return Shortcut();
+}
+
+// Called after a table is searched from `sc`, passing `visits` nodes to
+// `pred`. If the search walked far, adds a shortcut to `pred` (`target`)
+// into the table searched before.
+template <typename Node>
+void cascade_searched(ThreadData* td, const Shortcut& sc, const size_t visits, const Node* pred,
+                      const uint64_t target) {
+  if (sc.node) {
+    counter[td->cpu].casc_hits++;
+    if (shortcut_walk(sc.target) > visits) {
+      counter[td->cpu].casc_skipped_nodes += shortcut_walk(sc.target) - visits;
+    }
+  }
+  if (kCascadeMinVisits <= 0 || visits <= (size_t) kCascadeMinVisits) {
+    return;
+  }
+  if (t_casc.mem) {
+    if (cascade_table_index(shortcut_table(target)) >= 0) {
+      t_casc.mem->skiplist()->add_shortcut(td, pred->key(), pred, target);
     }
+  } else if (t_casc.pmem) {
+    t_casc.pmem->add_shortcut(td, pred->key(), pred, target);
   }
+}
 
-  return false;
-#endif
-  return false;
+// Tables the shortcuts of `mem` point to, returns their number
+int cascade_tables(MemTable* mem, uint64_t* tables) {
+  tables[0] = shortcut_table(false, mem->seq_order() - 1);
+  tables[1] = shortcut_table(true, mem->upper_id());
+  if (t_casc.l1_table == 0) {
+    return 2;
+  }
+  tables[2] = t_casc.l1_table;
+  return 3;
 }
 
-//bool brdb::get_cascade_l1(ThreadData* td, const std::string_view& sv_key, std::string* value_out,
-//    UINT64_node* mem_pred_a, UINT64_pnode* l0_pred_a, UINT64_pnode* shortcut, std::shared_ptr<MemTable>& mem, std::shared_ptr<PmemTable>& l0) {
-//  auto& key = *reinterpret_cast<const uint64_t*>(sv_key.data());
-//  uint64_t cmp = *((uint64_t*) sv_key.data());
-//  int s = cmp % kNumShards;
-//  int r = td->region;
-//
-//  if ()
-//
-//  auto l0_wptr = mem->upper();
-//  std::shared_ptr<PmemTable> pmem;
-//  UINT64_pnode* curr = NULL;
-//  UINT64_pnode* pred = NULL;
-//  UINT64_pnode* pred_a = NULL;
-//  lockfree_pskiplist* skiplist = NULL;
-//  if (auto l0_table = l0_wptr.lock()) {
-//    pmem = std::move(l0_table);
-//  } else {
-//    return false;
-//    //return get_cascade_l1(td, sv_key, value_out, mem_pred_a, shortcut, mem);
-//  }
-//  uint64_t key_a = mem_pred_a->key();
-//  skiplist = pmem->skiplist();
-//  pred = (shortcut) ? shortcut : skiplist->head(r);
-//  int h = pred->height;
-//  int cr = 1;
-//  for (int l = h - 1; l >= 1; l--) {
-//    while (true) {
-//      curr = (UINT64_pnode*) skiplist->offset_to_ptr(pred->next[l].load(), r);
-//      if (skiplist->cmp_(curr, key_a) < 0) {
-//        if (h > kMaxHeight - 5) {
-//          if (mem_pred_a->log_moff & 0xffff == r) {
-//            mem_pred_a->pmem_shortcut = curr;
-//          }
-//        }
-//      }
-//      if (skiplist->cmp_(curr, key) < 0) {
-//        if (curr->shortcut != NULL) {
-//          shortcut = curr->shortcut;
-//        }
-//        pred = curr;
-//        continue;
-//      }
-//      break;
-//    }
-//  }
-//  pred_a = pred;
-//  // braided
-//  {
-//    while (true) {
-//      curr = (UINT64_pnode*) skiplist->moff_to_ptr(pred->next[0].load());
-//      if ((cr = skiplist->cmp_(curr, key)) < 0) {
-//        pred = curr;
-//        continue;
-//      }
-//      break;
-//    }
-//  }
-//  if (curr && cr == 0) {
-//    uint64_t value = curr->value();
-//    value_out->assign((char*) &value, 8);
-//    return true;
-//  }
-//
-//  mem = nullptr;
-//
-//  while (true) {
-//    cr = 1;
-//    auto l0_wptr = pmem->next();
-//    if (auto l0_table = l0_wptr.lock()) {
-//      pmem = std::move(l0_table);
-//    } else {
-//      return false;
-//      //return get_cascade_l1(td, sv_key, value_out, mem_pred_a, shortcut, mem);
-//    }
-//    uint64_t key_a = pred_a->key();
-//    skiplist = pmem->skiplist();
-//    pred = (shortcut) ? shortcut : skiplist->head(r);
-//    int h = pred->height;
-//    for (int l = h - 1; l >= 1; l--) {
-//      while (true) {
-//        curr = (UINT64_pnode*) skiplist->offset_to_ptr(pred->next[l].load(), r);
-//        //if (skiplist->cmp_(curr, key_a) < 0) {
-//        //  if (h > kMaxHeight - 5) {
-//        //    pred_a->shortcut = curr;
-//        //  }
-//        //}
-//        if (skiplist->cmp_(curr, key) < 0) {
-//          if (curr->shortcut != NULL) {
-//            shortcut = curr->shortcut;
-//          }
-//          pred = curr;
-//          continue;
-//        }
-//        break;
-//      }
-//    }
-//    pred_a = pred;
-//    // braided
-//    {
-//      while (true) {
-//        curr = (UINT64_pnode*) skiplist->moff_to_ptr(pred->next[0].load());
-//        if ((cr = skiplist->cmp_(curr, key)) < 0) {
-//          pred = curr;
-//          continue;
-//        }
-//        break;
-//      }
-//    }
-//    if (curr && cr == 0) {
-//      uint64_t value = curr->value();
-//      value_out->assign((char*) &value, 8);
-//      return true;
-//    }
-//  }
-//
-//  return false;
-//}
+// Searches `mem` from `sc`, the shortcut of the table searched before it
+template <typename Key>
+void cascade_seek(MemTable* mem, casc_mem_table_iterator& it, const Key& key, const Shortcut& sc) {
+  uint64_t tables[casc_skiplist_iterator::kMaxShortcutTables];
+  const int num_tables = cascade_tables(mem, tables);
+  it.seek(key, (const mNode*) sc.node, tables, num_tables);
+}
+
+void cascade_next(MemTable* mem, casc_mem_table_iterator& it) {
+  t_casc.mem = mem;
+  t_casc.pmem = NULL;
+  t_casc.num_tables = cascade_tables(mem, t_casc.tables);
+  for (int i = 0; i < t_casc.num_tables; i++) {
+    t_casc.shortcuts[i] = it.shortcut(i);
+  }
+}
+
+void cascade_next(PmemTable* pmem) {
+  t_casc.mem = NULL;
+  t_casc.pmem = pmem;
+}
+
+}  // namespace
 
-bool brdb::read_from_mem(ThreadData* td, const int s, const std::string_view& key, std::string* value_out) {
-  std::shared_ptr<MemTable> mem = mem_[s].table;
-  while (mem == nullptr) {
-    //mem = std::atomic_load(&memtable_[s]);
-    //mem = std::atomic_load_explicit(&memtable_[s], std::memory_order_relaxed);
-    mem = mem_[s].table;
-    continue;
+bool brdb::read_from_mem_casc(ThreadData* td, const int s, const std::string_view& key, std::string_view* value_out, bool* deleted,
+                              const uint64_t snapshot) {
+  MemTable* mem = mem_[s].table_ptr.load();
+  while (mem == nullptr) mem = mem_[s].table_ptr.load();
+  t_casc.seq_order_last = mem->seq_order();
+  t_casc.l1_table = 0;
+  if (kNumPmemLevels > 2) {
+    PmemTable* l1 = level_[s][1].table_ptr.load();
+    if (l1) {
+      t_casc.l1_table = shortcut_table(true, l1->id());
+    }
   }
+  t_casc.mem = NULL;
+  t_casc.pmem = NULL;
+  auto it = casc_mem_table_iterator(mem);
 #ifndef BR_STRING_KV
   auto& search_key = *reinterpret_cast<const uint64_t*>(key.data());
 #else
   auto& search_key = key;
 #endif
-  return mem->get(td, search_key, value_out);
+  cascade_seek(mem, it, search_key, Shortcut());
+  const mNode* node = (it.valid() && it.cmp() == 0) ? visible_version(mem->skiplist(), it.node(), snapshot) : NULL;
+  if (node) {
+    if (node->type() == kTypeDeletion) {
+      *deleted = true;
+    } else if (value_out) {
+      *value_out = node->value_view();
+    }
+    return true;
+  }
+  cascade_next(mem, it);
+  return false;
 }
 
-bool brdb::read_from_imms(ThreadData* td, const int s, const std::string_view& key, std::string* value_out) {
+bool brdb::read_from_imms_casc(ThreadData* td, const int s, const std::string_view& key, std::string_view* value_out, bool* deleted,
+                               const uint64_t snapshot) {
   if (mem_[s].immutables.empty()) return false;
 #ifndef BR_STRING_KV
   auto& search_key = *reinterpret_cast<const uint64_t*>(key.data());
@@ -552,85 +495,131 @@ bool brdb::read_from_imms(ThreadData* td, const int s, const std::string_view& k
 #endif
   auto it = mem_[s].immutables.begin();
   while (it.valid()) {
-    auto imm = *it;
-    if (imm->get(td, search_key, value_out)) {
+    MemTable* imm = (*it).get();
+    if (imm->seq_order() >= t_casc.seq_order_last) {
+      it.next();
+      continue;
+    }
+    t_casc.seq_order_last = imm->seq_order();
+    const Shortcut sc = cascade_start(imm);
+    auto it2 = casc_mem_table_iterator(imm);
+    cascade_seek(imm, it2, search_key, sc);
+    cascade_searched(td, sc, it2.visits(), it2.pred(), shortcut_target(false, imm->seq_order(), 0, it2.visits()));
+    const mNode* node = (it2.valid() && it2.cmp() == 0) ? visible_version(imm->skiplist(), it2.node(), snapshot) : NULL;
+    if (node) {
+      if (node->type() == kTypeDeletion) {
+        *deleted = true;
+      } else if (value_out) {
+        *value_out = node->value_view();
+      }
       return true;
     }
+    cascade_next(imm, it2);
     it.next();
   }
   return false;
 }
 
-bool brdb::read_from_pmem_level(ThreadData* td, const int s, const int level, const std::string_view& key, std::string* value_out) {
+bool brdb::read_from_pmem_level_casc(ThreadData* td, const int s, const int level, const std::string_view& key, std::string_view* value_out, bool* deleted,
+                                     const uint64_t snapshot, const pNode** node_out) {
 #ifndef BR_STRING_KV
   auto& search_key = *reinterpret_cast<const uint64_t*>(key.data());
 #else
   auto& search_key = key;
 #endif
+  // Searches `pmem` from the shortcut of the table searched before it
+  auto search = [&](PmemTable* pmem) {
+    const Shortcut sc = cascade_start(pmem, search_key);
+    const int16_t r = (sc.node) ? shortcut_region(sc.target) : td->region;
+    auto it = casc_pmem_table_iterator(r, pmem);
+    it.seek(search_key, (const pNode*) sc.node);
+    cascade_searched(td, sc, it.visits(), it.pred(), shortcut_target(true, pmem->id(), it.pred_region(), it.visits()));
+    const pNode* node = (it.valid() && it.cmp() == 0) ? visible_version(pmem->skiplist(), it.node(), snapshot) : NULL;
+    if (node) {
+      if (node_out) *node_out = node;
+      if (node->type() == kTypeDeletion) {
+        *deleted = true;
+      } else if (value_out) {
+        *value_out = node->value_view();
+      }
+      return true;
+    }
+    cascade_next(pmem);
+    return false;
+  };
   if (level == 0) {
     if (level_[s][level].immutables.empty()) return false;
-    std::shared_ptr<PmemTable> pmem = nullptr;
+    PmemTable* pmem = nullptr;
     auto it = level_[s][level].immutables.begin();
     while (it.valid()) {
-      pmem = *it;
-      if (pmem->get(td, search_key, value_out)) {
+      pmem = (*it).get();
+      if (pmem->seq_order() >= t_casc.seq_order_last) {
+        it.next();
+        continue;
+      }
+      t_casc.seq_order_last = pmem->seq_order();
+      if (!filter_may_contain(td, pmem, level, search_key)) {
+        // The table searched before keeps its shortcuts for the next one
+        it.next();
+        continue;
+      }
+      if (search(pmem)) {
         return true;
       }
+      filter_missed(td, pmem, level);
       it.next();
     }
     return false;
   }
-  std::shared_ptr<PmemTable> pmem = level_[s][level].table;
-  while (pmem == nullptr) {
-    pmem =  level_[s][level].table;
-    continue;
-  }
-  if (pmem->get(td, search_key, value_out)) {
+  assert(level < kNumPmemLevels - 1);
+  PmemTable* pmem = level_[s][level].table_ptr.load();
+  while (pmem == nullptr) pmem = level_[s][level].table_ptr.load();
+  if (search(pmem)) {
     return true;
-  } else {
-    if (level_[s][level].immutables.empty()) return false;
-    pmem = nullptr;
-    auto it = level_[s][level].immutables.begin();
-    while (it.valid()) {
-      pmem = *it;
-      if (pmem->get(td, search_key, value_out)) {
-        return true;
-      }
-      it.next();
+  }
+  // Tables of the level being compacted into the next one
+  if (level_[s][level].immutables.empty()) return false;
+  auto it = level_[s][level].immutables.begin();
+  while (it.valid()) {
+    if ((*it)->get(td, search_key, value_out, deleted, snapshot, node_out)) {
+      return true;
     }
+    it.next();
   }
   return false;
 }
 
-bool brdb::scan(ThreadData* td, const std::string_view& key, const uint64_t len, std::vector<void*>* result) {
-#ifndef BR_STRING_KV
-  auto& begin_key = *reinterpret_cast<const uint64_t*>(key.data());
-#else
-  auto& begin_key = key;
-#endif
-  //using Cmp = PmemTable::NodeCmp;
-  std::vector<casc_pmem_table_iterator*> iters;
-  for (int i = 0; i < kNumShards; i++) {
-    auto it = new casc_pmem_table_iterator(td->region, level_[i][kNumPmemLevels-1].table);
-    it->seek(begin_key);
-    iters.push_back(it);
-  }
-  while (result->size() < len) {
-    std::sort(iters.begin(), iters.end(), [&](const casc_pmem_table_iterator* a, const casc_pmem_table_iterator* b){
-          if (!b->valid()) return true;
-          if (!a->valid()) return true;
-          return (a->node()->key() < b->node()->key());
-        });
-    auto& min_iter = iters.front();
-    if (min_iter->valid()) {
-      result->push_back((void*) min_iter->node());
-      min_iter->next();
-    } else {
-      break;
-    }
-  }
-  for (int i = 0; i < kNumShards; i++) {
-    delete iters[i];
+std::unique_ptr<DBIterator> brdb::new_iterator(ThreadData* td, const uint64_t snapshot) {
+  auto load_shard = [this](DBIterator* iter, const int s) {
+        // The iterator takes references to the tables. The epoch is held
+        // only while the immutables are iterated.
+        EpochGuard guard(&epoch_);
+        auto mem = std::atomic_load(&mem_[s].table);
+        while (mem == nullptr) mem = std::atomic_load(&mem_[s].table);
+        iter->add_table(mem);
+        for (auto it = mem_[s].immutables.begin(); it.valid(); it.next()) {
+          iter->add_table(*it);
+        }
+        for (int l = 0; l < kNumPmemLevels; l++) {
+          // The L0 table is written only without memtables (mem_size 0)
+          auto pmem = std::atomic_load(&level_[s][l].table);
+          if (pmem) {
+            iter->add_table(pmem);
+          }
+          for (auto it = level_[s][l].immutables.begin(); it.valid(); it.next()) {
+            iter->add_table(*it);
+          }
+        }
+      };
+  return std::make_unique<DBIterator>(&epoch_, td->region, snapshot, kNumShards, partitioner_, load_shard);
+}
+
+bool brdb::scan(ThreadData* td, const std::string_view& key, const uint64_t len,
+                std::vector<std::pair<std::string, std::string>>* result,
+                const uint64_t snapshot) {
+  auto iter = new_iterator(td, snapshot);
+  for (iter->seek(key); iter->valid() && result->size() < len; iter->next()) {
+    result->emplace_back(iter->key(), iter->value());
   }
   return (result->size() == len);
 }
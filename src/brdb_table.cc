@@ -3,44 +3,57 @@
 // Table Management Functions
 // table container: nbr_stack<>
 
-std::shared_ptr<MemTable> brdb::get_writable_memtable(ThreadData* td, const int s, const size_t kv_size, JobManager* mgr) {
-  std::shared_ptr<MemTable> mem = mem_[s].table;
+MemTable* brdb::get_writable_memtable(ThreadData* td, const int s, const size_t kv_size, JobManager* mgr) {
+  MemTable* mem = mem_[s].table_ptr.load();
   while (true) {
     if (mem == nullptr) {
-      mem = mem_[s].table;
+      mem = mem_[s].table_ptr.load();
       continue;
     }
+    // Registered before the writer takes its sequence numbers, so the flush
+    // of this table (once sealed) waits for it
+    mem->ref();
     size_t before = mem->fetch_add_size(kv_size);
     if (kMemTableSize > 0 && kv_size + before > (size_t) kMemTableSize / kNumShards) {
+      mem->unref();
       std::unique_lock<std::shared_mutex> lk(mem_[s].mu);
-      if (mem == mem_[s].table) {
+      if (mem == mem_[s].table.get()) {
         // Write-Stall
         size_t num_imms = mem_[s].immutables.size();
         size_t dram_usage = (num_imms + 1) * kMemTableSize / kNumShards;
         size_t dram_limit = kDRAMSizeTotal / kNumShards;
         if (dram_usage >= dram_limit) {
           auto stall_begin = std::chrono::steady_clock::now();
+          // Lets the tables popped meanwhile be freed. A writer in a read
+          // guard stays in the epoch, which only delays that: flushes do not
+          // wait for the epoch. `mem` cannot be retired while mem_[s].mu is
+          // held. No sequence number is taken here, so snapshots need not
+          // wait for this writer.
+          epoch_.exit();
+          write_epoch_.exit();
           std::unique_lock<std::mutex> ws_lk(ws_mu_[s]);
           ws_cv_[s].wait(ws_lk, [&]{
                 size_t ni = mem_[s].immutables.size();
                 size_t du = (ni + 1) * kMemTableSize / kNumShards;
                 return (du < kDRAMSizeTotal / kNumShards);
               });
+          ws_lk.unlock();
+          write_epoch_.enter();
+          epoch_.enter();
           auto stall_end = std::chrono::steady_clock::now();
           std::chrono::duration<double> stall_dur = stall_end - stall_begin;
+          counter[td->cpu].write_stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(stall_dur).count();
           fprintf(stderr, "Stall time: %.3lf sec\n", stall_dur.count());
         }
         // New MemTable
-        auto mem_old = std::move(mem);
-        mem = new_mem_table(s, mem_old);
-#ifdef BR_CASCADE
-#ifdef BR_LOG_IUL
-        mem->init_shortcut_IUL(lpop[s]);
-#endif
-#endif
-        mem->set_seq_order(memtable_seq_[s].fetch_add(1));
+        auto mem_old = mem_[s].table;
+        auto mem_new = new_mem_table(s, mem_old);
+        mem_new->set_seq_order(memtable_seq_[s].fetch_add(1));
+        // Before mem_new is published, so that its writes are newer
+        mem_old->seal(seq_);
         mem_[s].immutables.push_front(mem_old);
-        std::atomic_store(&mem_[s].table, mem);
+        mem_[s].set_table(mem_new);
+        mem = mem_new.get();
         // immutable ordering
         // immutables.push_front should be done inside a critical section
         auto future_pmem = mem_old->get_future_pmem_table();
@@ -54,11 +67,12 @@ std::shared_ptr<MemTable> brdb::get_writable_memtable(ThreadData* td, const int
         future_pmem->set_seq_order(mem_old->seq_order());
         future_pmem->cas_mark_full();
         level_[s][0].immutables.push_front(future_pmem);
+        add_pending_merge(s, 0, future_pmem);
         lk.unlock();
         enq_mem_compaction(s, mem_old, mgr);
       } else {
         //mem = nullptr;
-        mem = mem_[s].table;
+        mem = mem_[s].table_ptr.load();
         lk.unlock();
       }
       continue;
@@ -68,21 +82,66 @@ std::shared_ptr<MemTable> brdb::get_writable_memtable(ThreadData* td, const int
   return mem;
 }
 
+// Delayed write. Between the slowdown trigger and the DRAM limit (where
+// get_writable_memtable() blocks), every put is delayed in proportion to how
+// far compaction is behind. The delay is accumulated per thread and slept in
+// chunks of at least kWriteDelaySleepMin.
+void brdb::throttle_write(ThreadData* td, const int s, const size_t num_puts) {
+  static const uint64_t kWriteDelaySleepMin = 50000;  // nsec
+  if (kMemTableSize <= 0 || kWriteSlowdownTrigger >= 100) {
+    return;
+  }
+  // Backlog in immutables. Writers block once it reaches `limit`.
+  // Pending compaction jobs beyond what the workers can run add to it.
+  const double limit = (double) kDRAMSizeTotal / kMemTableSize - 1;
+  const double trigger = limit * kWriteSlowdownTrigger / 100;
+  double backlog = mem_[s].immutables.size();
+  size_t num_jobs = job_mgr_->num_jobs();
+  if (num_jobs > (size_t) kNumWorkers) {
+    backlog += (double) (num_jobs - kNumWorkers) / kNumShards;
+  }
+  uint64_t delay = 0;
+  if (backlog > trigger && limit > trigger) {
+    double rate = std::min(1.0, (backlog - trigger) / (limit - trigger));
+    delay = rate * kMaxWriteDelay * 1000;
+  }
+  if (write_delay_[s].load(std::memory_order_relaxed) != delay) {
+    write_delay_[s].store(delay, std::memory_order_relaxed);
+  }
+  if (delay == 0) {
+    return;
+  }
+  counter[td->cpu].write_delay_cnt += num_puts;
+  td->write_delay_debt += delay * num_puts;
+  if (td->write_delay_debt >= kWriteDelaySleepMin) {
+    auto begin = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::nanoseconds(td->write_delay_debt));
+    auto end = std::chrono::steady_clock::now();
+    counter[td->cpu].write_delay_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+    td->write_delay_debt = 0;
+  }
+}
+
 std::shared_ptr<PmemTable> brdb::get_writable_pmemtable(ThreadData* td, const int s, const int level, const size_t write_size, JobManager* mgr) {
-  auto pmem = level_[s][level].table;
+  auto pmem = std::atomic_load(&level_[s][level].table);
   while (true) {
     if (pmem == nullptr) {
-      pmem = level_[s][level].table;
+      pmem = std::atomic_load(&level_[s][level].table);
       continue;
     }
+    // Registered before taking space, so the compaction of this table
+    // (enqueued once it is full) waits for this writer
+    pmem->ref();
     size_t before = pmem->fetch_add_size(write_size);
     if (kPmemTableSize[level] > 0 && write_size + before > (size_t) kPmemTableSize[level] / kNumShards) {
+      pmem->unref();
       if (pmem->cas_mark_full() == 0) {
         auto pmem_old = std::move(pmem);
         pmem = new_pmem_table(s, level, pmem_old);
         level_[s][level].immutables.push_front(pmem_old);
-        std::atomic_store(&(level_[s][level].table), pmem);
+        level_[s][level].set_table(pmem);
         if (level < kNumPmemLevels - 1) {
+          add_pending_merge(s, level, pmem_old);
           enq_pmem_compaction(s, level, pmem_old, mgr);
         }
       } else {
@@ -1,45 +1,211 @@
 #include "brdb.h"
 
+#include <algorithm>
+
+#ifdef BR_STRING_KV
+namespace {
+
+// Values this small are stored in the index nodes
+inline bool is_inline_value(const std::string_view& value) {
+  return kInlineValueThreshold > 0 && value.size() <= (size_t) kInlineValueThreshold;
+}
+
+}  // namespace
+#endif
+
 void brdb::put(ThreadData* td, const std::string_view& key, const std::string_view& value) {
-  uint64_t cmp = *((uint64_t*) key.data());
-  int s = cmp % kNumShards;
+  int s = shard_of(key);
   if (conf_.mem_size == 0) {
 #ifndef BR_STRING_KV
     write_to_pmem(td, s, key, *((uint64_t*) value.data()));
 #else
-    uint64_t value_moff = store_value(td, s, value);
-    write_to_pmem(td, s, key, value_moff);
+    std::string_view inline_value;
+    uint64_t value_word = store_value(td, s, key, value, &inline_value);
+    write_to_pmem(td, s, key, value_word, kTypeValue, inline_value);
 #endif
   } else {
 #ifndef BR_STRING_KV
     write_to_mem(td, s, key, *((uint64_t*) value.data()));
 #else
-    uint64_t value_moff = store_value(td, s, value);
-    write_to_mem(td, s, key, value_moff);
+    std::string_view inline_value;
+    uint64_t value_word = store_value(td, s, key, value, &inline_value);
+    write_to_mem(td, s, key, value_word, kTypeValue, inline_value);
 #endif
   }
+  invalidate_cache(td, s, key);
   //td->put_cnt++;
   counter[td->cpu].put_cnt++;
 }
 
+void brdb::del(ThreadData* td, const std::string_view& key) {
+  int s = shard_of(key);
+  if (conf_.mem_size == 0) {
+    write_to_pmem(td, s, key, 0, kTypeDeletion);
+  } else {
+    write_to_mem(td, s, key, 0, kTypeDeletion);
+  }
+  invalidate_cache(td, s, key);
+  counter[td->cpu].put_cnt++;
+}
+
+inline void brdb::invalidate_cache(ThreadData* td, const int s, const std::string_view& key) {
+  // After the version is in the index, so that a read that has not seen it
+  // fails to fill the cache
+  if (ht_del(s, key)) {
+    counter[td->cpu].cache_invalidate_cnt++;
+  }
+}
+
 void brdb::put_batch(ThreadData* td, std::vector<std::pair<std::string_view, std::string_view>>& kvbatch) {
-fprintf(stderr, "NOT IMPLEMENTED : %s\n", __FUNCTION__);
-exit(1);
-  // Implement this later
-  //std::vector<std::vector<std::pair<std::string_view, std::string_view>>> batch_table(kNumShards);
-  //for (auto& kv : kvbatch) {
-  //  uint64_t cmp = *((uint64_t*) key.data());
-  //  int s = cmp % kNumShards;
-  //}
+  using KV = std::pair<std::string_view, std::string_view>;
+  if (conf_.mem_size == 0) {
+    for (auto& kv : kvbatch) {
+      put(td, kv.first, kv.second);
+    }
+    return;
+  }
+  // Group by shard, then order by key within a shard so that each insert can
+  // start from the position of the previous one. stable_sort keeps the
+  // submission order of duplicate keys (the later one wins).
+  std::vector<const KV*> sorted;
+  std::vector<int> shards(kvbatch.size());
+  sorted.reserve(kvbatch.size());
+  for (size_t k = 0; k < kvbatch.size(); k++) {
+    sorted.push_back(&kvbatch[k]);
+    shards[k] = shard_of(kvbatch[k].first);
+  }
+  auto kv_shard = [&](const KV* kv) {
+    return shards[kv - kvbatch.data()];
+  };
+  std::stable_sort(sorted.begin(), sorted.end(), [&](const KV* a, const KV* b) {
+        int sa = kv_shard(a);
+        int sb = kv_shard(b);
+        if (sa != sb) return sa < sb;
+#ifndef BR_STRING_KV
+        return *((uint64_t*) a->first.data()) < *((uint64_t*) b->first.data());
+#else
+        return a->first.compare(b->first) < 0;
+#endif
+      });
+  size_t i = 0;
+  while (i < sorted.size()) {
+    int s = kv_shard(sorted[i]);
+    size_t j = i + 1;
+    while (j < sorted.size() && kv_shard(sorted[j]) == s) {
+      j++;
+    }
+    write_batch_to_mem(td, s, &sorted[i], j - i);
+    for (size_t k = i; k < j; k++) {
+      invalidate_cache(td, s, sorted[k]->first);
+    }
+    i = j;
+  }
+  counter[td->cpu].put_cnt += kvbatch.size();
 }
 
-void brdb::write_to_mem(ThreadData* td, const int s, const std::string_view& key, const uint64_t value) {
+void brdb::write_batch_to_mem(ThreadData* td, const int s,
+                              const std::pair<std::string_view, std::string_view>* const* kvs,
+                              const size_t n) {
+  std::vector<std::string_view> keys(n);
+  std::vector<uint64_t> values(n);
+  std::vector<uint64_t> log_moffs(n);
+  size_t kv_size = 0;
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = kvs[i]->first;
+#ifndef BR_STRING_KV
+    values[i] = *((uint64_t*) kvs[i]->second.data());
+    kv_size += 2 * sizeof(uint64_t);
+#else
+    kv_size += keys[i].size() + sizeof(uint64_t);
+#endif
+  }
+#ifdef BR_STRING_KV
+  std::vector<std::string_view> inline_values(n);
+  {
+    // Values that are not inline go to the value log at once
+    std::vector<size_t> logged;
+    std::vector<std::string_view> logged_keys;
+    std::vector<std::string_view> logged_values;
+    for (size_t i = 0; i < n; i++) {
+      const std::string_view& value = kvs[i]->second;
+      if (is_inline_value(value)) {
+        values[i] = inline_value_word(value);
+        inline_values[i] = value;
+        kv_size += value.size();
+      } else {
+        logged.push_back(i);
+        logged_keys.push_back(keys[i]);
+        logged_values.push_back(value);
+      }
+    }
+    if (!logged.empty()) {
+      std::vector<uint64_t> value_moffs(logged.size());
+      {
+        // Keeps the value log blocks alive against the GC
+        EpochGuard guard(&epoch_);
+        vlog_[s]->write_values(td, s, logged.size(), logged_keys.data(), logged_values.data(), value_moffs.data());
+      }
+      for (size_t k = 0; k < logged.size(); k++) {
+        values[logged[k]] = value_moffs[k];
+      }
+      maybe_schedule_vlog_gc(s);
+    }
+  }
+#endif
+  throttle_write(td, s, n);
+  EpochGuard write_guard(&write_epoch_);
+  EpochGuard guard(&epoch_);
+  auto mem = get_writable_memtable(td, s, kv_size, job_mgr_);
+  // Duplicate keys are in submission order, so the later one gets the
+  // larger sequence number
+  const uint64_t first_seq = assign_seqs(td, s, kv_size, n, &mem);
+  std::vector<uint64_t> tags(n);
+  for (size_t i = 0; i < n; i++) {
+    tags[i] = make_tag(first_seq + i, kTypeValue);
+  }
+
+#ifndef BR_STRING_KV
+  write_log_batch(td, s, n, keys.data(), values.data(), tags.data(), NULL, log_moffs.data());
+#else
+  write_log_batch(td, s, n, keys.data(), values.data(), tags.data(), inline_values.data(), log_moffs.data());
+#endif
+  // Keys are in order, so each search starts from the previous insert
+  mNode* finger[kMaxHeight] = { NULL };
+  for (size_t i = 0; i < n; i++) {
+#ifndef BR_STRING_KV
+    mem->add(td, *reinterpret_cast<const uint64_t*>(keys[i].data()), values[i], log_moffs[i], finger, tags[i]);
+#else
+    mem->add(td, keys[i], values[i], log_moffs[i], finger, tags[i], inline_values[i]);
+#endif
+  }
+  mem->unref();
+}
+
+uint64_t brdb::assign_seqs(ThreadData* td, const int s, const size_t kv_size, const size_t n, MemTable** mem) {
+  while (true) {
+    const uint64_t first_seq = seq_.fetch_add(n) + 1;
+    if (first_seq + n - 1 <= (*mem)->seal_seq()) {
+      return first_seq;
+    }
+    // The numbers belong after the sealed table. They are skipped, and new
+    // ones are taken for the next table.
+    (*mem)->unref();
+    *mem = get_writable_memtable(td, s, kv_size, job_mgr_);
+  }
+}
+
+void brdb::write_to_mem(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                        const ValueType type, const std::string_view& inline_value) {
 #ifndef BR_STRING_KV
   const size_t kv_size = 2 * sizeof(uint64_t);
 #else
-  const size_t kv_size = key.size() + sizeof(uint64_t);
+  const size_t kv_size = key.size() + sizeof(uint64_t) + inline_value.size();
 #endif
+  throttle_write(td, s, 1);
+  EpochGuard write_guard(&write_epoch_);
+  EpochGuard guard(&epoch_);
   auto mem = get_writable_memtable(td, s, kv_size, job_mgr_);
+  const uint64_t tag = make_tag(assign_seqs(td, s, kv_size, 1, &mem), type);
 
   // write_log is very slow at this moment.
   // - POSSIBLE REASON:
@@ -51,38 +217,70 @@ void brdb::write_to_mem(ThreadData* td, const int s, const std::string_view& key
   //  >>>
   //  void* log_ptr = NULL;
   //  <<<
-  uint64_t log_moff = write_log(td, s, key, value);
+  uint64_t log_moff = write_log(td, s, key, value, tag, inline_value);
 #ifndef BR_STRING_KV
-  mem->add(td, *reinterpret_cast<const uint64_t*>(key.data()), value, log_moff);
+  mem->add(td, *reinterpret_cast<const uint64_t*>(key.data()), value, log_moff, NULL, tag);
 #else
-  mem->add(td, key, value, log_moff);
+  mem->add(td, key, value, log_moff, NULL, tag, inline_value);
 #endif
+  mem->unref();
 }
 
-void brdb::write_to_pmem(ThreadData* td, const int s, const std::string_view& key, const uint64_t value) {
+void brdb::write_to_pmem(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                         const ValueType type, const std::string_view& inline_value) {
 #ifndef BR_STRING_KV
   const size_t kv_size = 2 * sizeof(uint64_t);
 #else
-  const size_t kv_size = key.size() + sizeof(uint64_t);
+  const size_t kv_size = key.size() + sizeof(uint64_t) + inline_value.size();
 #endif
 
+  EpochGuard write_guard(&write_epoch_);
   auto pmem = get_writable_pmemtable(td, s, 0, kv_size, job_mgr_);
+  // Writes to a table are waited for before its compaction, so the table
+  // needs no seal
+  const uint64_t tag = make_tag(seq_.fetch_add(1) + 1, type);
 
 #ifndef BR_STRING_KV
-  pmem->add(td, td->region, *reinterpret_cast<const uint64_t*>(key.data()), value);
+  pmem->add(td, td->region, *reinterpret_cast<const uint64_t*>(key.data()), value, tag);
+#else
+  pmem->add(td, td->region, key, value, tag, inline_value);
+#endif
+  pmem->unref();
+}
+
+inline uint64_t brdb::write_log(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                               const uint64_t tag, const std::string_view& inline_value) {
+#ifndef BR_LOG_IUL
+  return log_[s]->write_WAL(td, s, key, value, tag, inline_value);
 #else
-  pmem->add(td, td->region, key, value);
+  return log_[s]->write_IUL(td, s, key, value, tag, inline_value);
 #endif
 }
 
-inline uint64_t brdb::write_log(ThreadData* td, const int s, const std::string_view& key, const uint64_t value) {
+inline void brdb::write_log_batch(ThreadData* td, const int s, const size_t n,
+                                  const std::string_view* keys, const uint64_t* values, const uint64_t* tags,
+                                  const std::string_view* inline_values, uint64_t* log_moffs_out) {
 #ifndef BR_LOG_IUL
-  return log_[s]->write_WAL(td, s, key, value);
+  log_[s]->write_WAL_batch(td, s, n, keys, values, tags, inline_values, log_moffs_out);
 #else
-  return log_[s]->write_IUL(td, s, key, value);
+  log_[s]->write_IUL_batch(td, s, n, keys, values, tags, inline_values, log_moffs_out);
 #endif
 }
 
-inline uint64_t brdb::store_value(ThreadData* td, const int s, const std::string_view& value) {
-  return vlog_[s]->write_value(td, s, value);
+inline uint64_t brdb::store_value(ThreadData* td, const int s, const std::string_view& key,
+                                  const std::string_view& value, std::string_view* inline_value_out) {
+#ifdef BR_STRING_KV
+  if (is_inline_value(value)) {
+    *inline_value_out = value;
+    return inline_value_word(value);
+  }
+#endif
+  uint64_t value_moff;
+  {
+    // Keeps the value log block alive against the GC
+    EpochGuard guard(&epoch_);
+    value_moff = vlog_[s]->write_value(td, s, key, value);
+  }
+  maybe_schedule_vlog_gc(s);
+  return value_moff;
 }
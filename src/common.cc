@@ -1,10 +1,17 @@
 #include "common.h"
 
+#include <algorithm>
 #include <string>
 #include <string_view>
 
-#include "sha1.h"
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#else
 #include "murmur3.h"
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 int aahit = 0;
 int aamiss = 0;
@@ -19,15 +26,30 @@ int kNumMergesToLevel[kMaxNumPmemLevels];
 int64_t kMemTableSize = kMemTableSizeDefault;
 size_t kDRAMSizeTotal = kDRAMSizeTotalDefault;
 int64_t kPmemTableSize[kMaxNumPmemLevels];
+int kLogGroupCommitMode = kLogGroupCommitModeDefault;
+int kLogGroupCommitWindow = kLogGroupCommitWindowDefault;
+int kWriteSlowdownTrigger = kWriteSlowdownTriggerDefault;
+int kMaxWriteDelay = kMaxWriteDelayDefault;
+int kVLogGCTrigger = kVLogGCTriggerDefault;
+int kVLogGCRate = kVLogGCRateDefault;
+int kInlineValueThreshold = kInlineValueThresholdDefault;
+int kFilterBitsPerKey = kFilterBitsPerKeyDefault;
+int kLearnedIndexStride = kLearnedIndexStrideDefault;
+int kCascadeMinVisits = kCascadeMinVisitsDefault;
 
 char kUserName[100];
 char kTabString[kMaxNumPmemLevels][100];
 
 Counters* counter;
+std::atomic<size_t> pmem_reclaimed_bytes[kMaxNumPmemLevels];
+std::atomic<size_t> vlog_gc_scanned_bytes;
+std::atomic<size_t> vlog_gc_relocated_bytes;
+std::atomic<size_t> vlog_gc_freed_blocks;
 
 // Hash Table
 size_t kLookupCacheSize = 0x03ffffff + 1;
-HashTableItem* kHashTable[kMaxNumShards];
+size_t kLookupCacheBuckets;
+LookupCacheBucket* kHashTable[kMaxNumShards];
 
 // DBConf
 void DBConf::print() {
@@ -37,6 +59,19 @@ void DBConf::print() {
   fprintf(stdout, "dram_limit: %zu\n", dram_limit/1000/1000);
   fprintf(stdout, "num_workers: %d\n", num_workers);
   fprintf(stdout, "task_size: %d\n", task_size);
+  fprintf(stdout, "log_group_commit_mode: %d\n", log_group_commit_mode);
+  fprintf(stdout, "log_group_commit_window: %d\n", log_group_commit_window);
+  fprintf(stdout, "write_slowdown_trigger: %d\n", write_slowdown_trigger);
+  fprintf(stdout, "max_write_delay: %d\n", max_write_delay);
+  fprintf(stdout, "partitioner_mode: %d\n", partitioner_mode);
+  fprintf(stdout, "vlog_gc_trigger: %d\n", vlog_gc_trigger);
+  fprintf(stdout, "vlog_gc_rate: %d\n", vlog_gc_rate);
+  fprintf(stdout, "inline_value_threshold: %d\n", inline_value_threshold);
+  fprintf(stdout, "lookup_cache_size: %zu\n", lookup_cache_size);
+  fprintf(stdout, "filter_bits_per_key: %d\n", filter_bits_per_key);
+  fprintf(stdout, "learned_index_stride: %d\n", learned_index_stride);
+  fprintf(stdout, "cascade_min_visits: %d\n", cascade_min_visits);
+  fprintf(stdout, "worker_scaling_mode: %d\n", worker_scaling_mode);
 }
 
 void common_init_global_variables(const DBConf& dbconf) {
@@ -49,8 +84,18 @@ void common_init_global_variables(const DBConf& dbconf) {
   kNumPmemLevels = dbconf.num_pmem_levels;
   kNumLogUnifiedLevels = dbconf.num_log_unified_levels;
   kLookupCacheSize = dbconf.lookup_cache_size;
-  if (kCompactionTaskSize != 1) {
-    flogf(stderr, "kCompactionTaskSize cannot be greater than 1 at this moment. (current: %d)", kCompactionTaskSize);
+  kLogGroupCommitMode = dbconf.log_group_commit_mode;
+  kLogGroupCommitWindow = dbconf.log_group_commit_window;
+  kWriteSlowdownTrigger = dbconf.write_slowdown_trigger;
+  kMaxWriteDelay = dbconf.max_write_delay;
+  kVLogGCTrigger = dbconf.vlog_gc_trigger;
+  kVLogGCRate = dbconf.vlog_gc_rate;
+  kInlineValueThreshold = dbconf.inline_value_threshold;
+  kFilterBitsPerKey = dbconf.filter_bits_per_key;
+  kLearnedIndexStride = dbconf.learned_index_stride;
+  kCascadeMinVisits = dbconf.cascade_min_visits;
+  if (kCompactionTaskSize < 1) {
+    flogf(stderr, "task_size must be at least 1. (current: %d)", kCompactionTaskSize);
     exit(0);
   }
 
@@ -70,15 +115,9 @@ void common_init_global_variables(const DBConf& dbconf) {
   }
 
   kLookupCacheSize = kLookupCacheSize / kNumShards;
+  kLookupCacheBuckets = std::max<size_t>(1, (kLookupCacheSize + LookupCacheBucket::kWays - 1) / LookupCacheBucket::kWays);
   for (int s = 0; s < kNumShards; s++) {
-    kHashTable[s] = new HashTableItem[kLookupCacheSize];
-    for (uint64_t i = 0; i < kLookupCacheSize; i++) {
-      std::atomic_store((std::atomic<uint64_t>*) &kHashTable[s][i].version, 1UL);
-    }
-    //kStash = new HashTableItem[kStashSize];
-    //for (uint64_t i = 0; i < kStashSize; i++) {
-    //  std::atomic_store((std::atomic<uint64_t>*) &kStash[i].version, 1UL);
-    //}
+    kHashTable[s] = new LookupCacheBucket[kLookupCacheBuckets]();
   }
 }
 
@@ -93,147 +132,302 @@ void common_init_global_variables(const DBConf& dbconf) {
 //}
 //
 
-void ht_add(const int s, const uint64_t key, const uint64_t value) {
-  //uint32_t idx = key % kLookupCacheSize;
-	//uint64_t idx = ht_sha1(key);
-#ifndef BR_STRING_KV
-  // key: integer key
-  uint32_t idx = ht_murmur3(key);
-  uint32_t idx2 = ht_sha1(key);
-  auto& buckt = kHashTable[s][idx];
-  auto& buckt2 = kHashTable[s][idx2];
-  uint64_t prev_ver = std::atomic_load((std::atomic<uint64_t>*) &buckt.version);
-  uint64_t prev_ver2 = std::atomic_load((std::atomic<uint64_t>*) &buckt2.version);
-  if (prev_ver > prev_ver2) {
-    while (!std::atomic_compare_exchange_weak((std::atomic<uint64_t>*) &buckt2.version, &prev_ver2, 0UL)) continue;
-    buckt2.key = key;
-    buckt2.value = value;
-    std::atomic_store((std::atomic<uint64_t>*) &buckt2.version, prev_ver2 + 1);
-  } else {
-    while (!std::atomic_compare_exchange_weak((std::atomic<uint64_t>*) &buckt.version, &prev_ver, 0UL)) continue;
-    buckt.key = key;
-    buckt.value = value;
-    std::atomic_store((std::atomic<uint64_t>*) &buckt.version, prev_ver + 1);
-  }
+namespace {
+
+constexpr int kWays = LookupCacheBucket::kWays;
+constexpr uint8_t kAllWays = (1 << kWays) - 1;
+
+inline LookupCacheBucket& ht_bucket(const int s, const uint64_t h) {
+  return kHashTable[s][((h >> 32) * kLookupCacheBuckets) >> 32];
+}
+
+// Bitmap of the valid ways holding `fp`
+inline int ht_match(const LookupCacheBucket& b, const uint64_t fp) {
+#ifdef __AVX2__
+  // The fourth lane is the version and bitmaps, masked out below
+  __m256i fps = _mm256_load_si256((const __m256i*) b.fps);
+  __m256i eq = _mm256_cmpeq_epi64(fps, _mm256_set1_epi64x(fp));
+  return _mm256_movemask_pd(_mm256_castsi256_pd(eq)) & b.valid & kAllWays;
 #else
-  // key: pointer to encoded key
-  StringKey encoded_key((char*) key);
-	//uint32_t idx = ht_sha1(encoded_key.key());
-  uint32_t idx = ht_murmur3(encoded_key.key());
-  auto& buckt = kHashTable[s][idx];
-  uint64_t prev_ver = std::atomic_load((std::atomic<uint64_t>*) &buckt.version);
-  while (!std::atomic_compare_exchange_weak((std::atomic<uint64_t>*) &buckt.version, &prev_ver, 0UL)) continue;
-  buckt.key = key;
-  buckt.value = value;
-  std::atomic_store((std::atomic<uint64_t>*) &buckt.version, prev_ver + 1);
+  int mask = 0;
+  for (int w = 0; w < kWays; w++) {
+    mask |= (b.fps[w] == fp) << w;
+  }
+  return mask & b.valid;
 #endif
 }
 
-bool ht_get(const int s, const std::string_view& key, uint64_t* value_out) {
-  //uint64_t idx = key % kLookupCacheSize;
-	//uint32_t idx = ht_sha1(key);
-  uint32_t idx = ht_murmur3(key);
-  auto& buckt = kHashTable[s][idx];
-  uint64_t k;
-  uint64_t v;
+// Returns the data word of the way holding `fp`
+inline bool ht_lookup(LookupCacheBucket& b, const uint64_t fp, uint64_t* data_out) {
   while (true) {
-    uint64_t prev_ver = buckt.version;
-    if (prev_ver == 0) continue;
-    k = buckt.key;
-    v = buckt.value;
-    if (prev_ver != buckt.version) continue;
-    break;
-  }
-  if (buckt.version > 1) {
-    StringKey encoded_key((char*) k);
-    if (encoded_key.key().compare(key) == 0) {
-      if (value_out) {
-        *value_out = v;
-      }
-      return true;
+    uint32_t ver = b.version.load(std::memory_order_acquire);
+    if (ver & 1) {
+      continue;
     }
-  }
-  return false;
-}
-bool ht_get(const int s, const uint64_t key, uint64_t* value_out) {
-  //uint64_t idx = key % kLookupCacheSize;
-	//uint32_t idx = ht_sha1(key);
-  uint64_t k;
-  uint64_t v;
-  uint64_t k2;
-  uint64_t v2;
-  uint32_t idx = ht_murmur3(key);
-  uint32_t idx2 = ht_sha1(key);
-  auto& buckt = kHashTable[s][idx];
-  auto& buckt2 = kHashTable[s][idx2];
-  uint64_t prev_ver;
-  uint64_t prev_ver2;
-  while (true) {
-    prev_ver = buckt.version;
-    if (prev_ver == 0) continue;
-    k = buckt.key;
-    v = buckt.value;
-    if (prev_ver != buckt.version) continue;
-    break;
-  }
-  if (buckt.version > 1) {
-    if (k == key) {
-      if (value_out) {
-        *value_out = v;
-      }
-      return true;
+    int mask = ht_match(b, fp);
+    int way = __builtin_ctz(mask | (1 << kWays));
+    uint64_t data = (mask != 0) ? b.data[way] : 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (ver != b.version.load(std::memory_order_relaxed)) {
+      continue;
+    }
+    if (mask == 0) {
+      return false;
     }
+    // Written only if not set yet, so that hot buckets stay shared
+    if ((b.referenced.load(std::memory_order_relaxed) & (1 << way)) == 0) {
+      b.referenced.fetch_or(1 << way, std::memory_order_relaxed);
+    }
+    *data_out = data;
+    return true;
   }
-  while (true) {
-    prev_ver2 = buckt2.version;
-    if (prev_ver2 == 0) continue;
-    k2 = buckt2.key;
-    v2 = buckt2.value;
-    if (prev_ver2 != buckt2.version) continue;
-    break;
-  }
-  if (buckt2.version > 1) {
-    if (k2 == key) {
-      if (value_out) {
-        *value_out = v2;
+}
+
+inline void ht_lock(LookupCacheBucket& b) {
+  uint32_t ver = b.version.load(std::memory_order_relaxed);
+  while ((ver & 1) || !b.version.compare_exchange_weak(ver, ver + 1, std::memory_order_acquire)) {
+    ver = b.version.load(std::memory_order_relaxed);
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void ht_unlock(LookupCacheBucket& b) {
+  b.version.store(b.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+inline void ht_invalidate(LookupCacheBucket& b, const int way) {
+  b.valid &= ~(1 << way);
+  b.referenced.fetch_and(~(1 << way), std::memory_order_relaxed);
+}
+
+#ifdef BR_STRING_KV
+// `h`: ht_hash() of the key
+inline bool ht_probe(const int s, const std::string_view& key, const uint64_t h, uint64_t* data_out) {
+  uint64_t data;
+  if (!ht_lookup(ht_bucket(s, h), h, &data)) {
+    return false;
+  }
+  // Same hash, possibly another key
+  if (StringKey((char*) data).key().compare(key) != 0) {
+    return false;
+  }
+  if (data_out) {
+    *data_out = data;
+  }
+  return true;
+}
+#endif
+
+// Hash of the bucket of a key
+inline uint64_t ht_key_hash(const std::string_view& key) {
+#ifndef BR_STRING_KV
+  return ht_hash(*((uint64_t*) key.data()));
+#else
+  return ht_hash(key);
+#endif
+}
+
+// Sets the entry of `fp` in a locked bucket
+inline void ht_put(LookupCacheBucket& b, const uint64_t fp, const uint64_t data) {
+  int way;
+  int mask = ht_match(b, fp);
+  if (mask != 0) {
+    way = __builtin_ctz(mask);
+  } else if (b.valid != kAllWays) {
+    way = __builtin_ctz(~b.valid);
+    b.referenced.fetch_and(~(1 << way), std::memory_order_relaxed);
+  } else {
+    // CLOCK: the hand clears the referenced ways it passes, and stops at the
+    // first way not referenced since its last pass
+    for (int i = 0; i < kWays; i++) {
+      const uint8_t bit = 1 << b.hand;
+      if ((b.referenced.fetch_and(~bit, std::memory_order_relaxed) & bit) == 0) {
+        break;
       }
-      return true;
+      b.hand = (b.hand + 1) % kWays;
     }
+    way = b.hand;
+    b.hand = (b.hand + 1) % kWays;
   }
-  return false;
+  b.fps[way] = fp;
+  b.data[way] = data;
+  b.valid |= 1 << way;
 }
 
-uint32_t ht_sha1(const std::string_view& key) {
-	char result[21];  // 5 * 32bit
-	SHA1(result, key.data(), key.size());
-	return *reinterpret_cast<uint32_t*>(result) % kLookupCacheSize;
+}  // namespace
+
+uint32_t ht_fill_token(const int s, const std::string_view& key) {
+  return ht_bucket(s, ht_key_hash(key)).version.load(std::memory_order_acquire);
 }
-uint32_t ht_sha1(const uint64_t key) {
-	char result[21];  // 5 * 32bit
-	SHA1(result, (char*) &key, 8);
-	return *reinterpret_cast<uint32_t*>(result) % kLookupCacheSize;
+
+bool ht_fill(const int s, const uint64_t key, const uint64_t value, const uint32_t token) {
+#ifndef BR_STRING_KV
+  // key: integer key
+  const uint64_t fp = key;
+  const uint64_t h = ht_hash(key);
+  const uint64_t data = value;
+#else
+  // key: pointer to encoded key, which also has the value
+  const uint64_t fp = ht_hash(StringKey((char*) key).key());
+  const uint64_t h = fp;
+  const uint64_t data = key;
+#endif
+  // A writer held the bucket when the token was taken
+  if (token & 1) {
+    return false;
+  }
+  auto& b = ht_bucket(s, h);
+  uint32_t expected = token;
+  if (!b.version.compare_exchange_strong(expected, token + 1, std::memory_order_acquire)) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  ht_put(b, fp, data);
+  ht_unlock(b);
+  return true;
+}
+
+bool ht_get(const int s, const std::string_view& key, uint64_t* data_out) {
+#ifndef BR_STRING_KV
+  return ht_get(s, *((uint64_t*) key.data()), data_out);
+#else
+  return ht_probe(s, key, ht_hash(key), data_out);
+#endif
+}
+
+bool ht_get(const int s, const uint64_t key, uint64_t* data_out) {
+  uint64_t data;
+  if (!ht_lookup(ht_bucket(s, ht_hash(key)), key, &data)) {
+    return false;
+  }
+  if (data_out) {
+    *data_out = data;
+  }
+  return true;
 }
-void ht_sha1(const uint64_t key, char* result) {
-	//char result[21];  // 5 * 32bit
-	SHA1(result, (char*) &key, 8);
+
+void ht_get_batch(const int s, const size_t n, const std::string_view* keys, bool* hits_out,
+                  uint64_t* data_out) {
+  // Hash all keys and prefetch their buckets before the first probe
+  std::vector<uint64_t> hashes(n);
+  for (size_t i = 0; i < n; i++) {
+    hashes[i] = ht_key_hash(keys[i]);
+    __builtin_prefetch(&ht_bucket(s, hashes[i]));
+  }
+  for (size_t i = 0; i < n; i++) {
+    uint64_t data;
+#ifndef BR_STRING_KV
+    hits_out[i] = ht_lookup(ht_bucket(s, hashes[i]), *((uint64_t*) keys[i].data()), &data);
+#else
+    hits_out[i] = ht_probe(s, keys[i], hashes[i], &data);
+#endif
+    if (hits_out[i] && data_out) {
+      data_out[i] = data;
+    }
+  }
 }
-uint32_t ht_murmur3(const std::string_view& key) {
-	uint32_t h;
-	static const uint32_t seed = 0xcafeb0ba;
+
+// Invalidates the cached entry of a written key. The bucket is changed even
+// if the key is not cached, which fails the fills of reads in flight.
+bool ht_del(const int s, const std::string_view& key) {
 #ifndef BR_STRING_KV
-	MurmurHash3_x86_32(key.data(), sizeof(uint64_t), seed, (void*) &h);
+  return ht_del(s, *((uint64_t*) key.data()));
 #else
-	MurmurHash3_x86_32(key.data(), key.length(), seed, (void*) &h);
+  const uint64_t h = ht_hash(key);
+  auto& b = ht_bucket(s, h);
+  bool found = false;
+  ht_lock(b);
+  int mask = ht_match(b, h);
+  for (int w = 0; w < kWays; w++) {
+    if ((mask & (1 << w)) && StringKey((char*) b.data[w]).key().compare(key) == 0) {
+      ht_invalidate(b, w);
+      found = true;
+    }
+  }
+  ht_unlock(b);
+  return found;
 #endif
-	return h % kLookupCacheSize;
 }
-uint32_t ht_murmur3(const uint64_t key) {
-	uint32_t h;
-	static const uint32_t seed = 0xcafeb0ba;
-	MurmurHash3_x86_32(&key, sizeof(uint64_t), seed, (void*) &h);
-	return h % kLookupCacheSize;
+
+bool ht_del(const int s, const uint64_t key) {
+  auto& b = ht_bucket(s, ht_hash(key));
+  ht_lock(b);
+  int mask = ht_match(b, key);
+  for (int w = 0; w < kWays; w++) {
+    if (mask & (1 << w)) {
+      ht_invalidate(b, w);
+    }
+  }
+  ht_unlock(b);
+  return mask != 0;
+}
+
+// Invalidates the cached entry pointing to `key_ptr` (string keys only), a
+// grace period before the PMEM object holding the encoded key is freed
+void ht_evict(const int s, const std::string_view& key, const uint64_t key_ptr) {
+  auto& b = ht_bucket(s, ht_hash(key));
+  ht_lock(b);
+  for (int w = 0; w < kWays; w++) {
+    if ((b.valid & (1 << w)) && b.data[w] == key_ptr) {
+      ht_invalidate(b, w);
+    }
+  }
+  ht_unlock(b);
+}
+
+bool ht_refers(const int s, const std::string_view& key, const uint64_t key_ptr) {
+  auto& b = ht_bucket(s, ht_hash(key));
+  bool found = false;
+  ht_lock(b);
+  for (int w = 0; w < kWays; w++) {
+    found |= (b.valid & (1 << w)) && b.data[w] == key_ptr;
+  }
+  ht_unlock(b);
+  return found;
+}
+
+#ifdef __SSE4_2__
+// CRC32C is linear, so the second half of the hash runs over multiplied
+// words to be independent of the first.
+namespace {
+constexpr uint32_t kHashSeed1 = 0xcafeb0ba;
+constexpr uint32_t kHashSeed2 = 0x85ebca6b;
+constexpr uint64_t kHashMul = 0x9e3779b97f4a7c15ULL;
+}  // namespace
+
+uint64_t ht_hash(const std::string_view& key) {
+  uint64_t h1 = kHashSeed1 ^ key.size();
+  uint64_t h2 = kHashSeed2;
+  const char* p = key.data();
+  size_t n = key.size();
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h1 = _mm_crc32_u64(h1, w);
+    h2 = _mm_crc32_u64(h2, w * kHashMul);
+  }
+  if (n > 0) {
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    h1 = _mm_crc32_u64(h1, w);
+    h2 = _mm_crc32_u64(h2, w * kHashMul);
+  }
+  return (h1 << 32) | h2;
 }
-void ht_murmur3(const uint64_t key, uint32_t* h) {
-	static const uint32_t seed = 0xcafeb0ba;
-	MurmurHash3_x86_32(&key, sizeof(uint64_t), seed, (void*) h);
+
+uint64_t ht_hash(const uint64_t key) {
+  return (_mm_crc32_u64(kHashSeed1, key) << 32) | _mm_crc32_u64(kHashSeed2, key * kHashMul);
 }
+#else
+uint64_t ht_hash(const std::string_view& key) {
+  uint64_t h[2];
+  MurmurHash3_x64_128(key.data(), key.length(), 0xcafeb0ba, (void*) h);
+  return h[0];
+}
+
+uint64_t ht_hash(const uint64_t key) {
+  uint64_t h[2];
+  MurmurHash3_x64_128(&key, sizeof(uint64_t), 0xcafeb0ba, (void*) h);
+  return h[0];
+}
+#endif
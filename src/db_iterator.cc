@@ -1,189 +1,204 @@
 #include "db_iterator.h"
 
-#ifdef BR_CASCADE
-////////////////////////////////////////////////////////////////////
-// Level Getter Impl. that iterates over tables in a given level
-
-// For MemTable level
-casc_mem_level_getter::casc_mem_level_getter(TableIter* table_iter) {
-  iter_ = std::unique_ptr<TableIter>(table_iter);
-}
-void casc_mem_level_getter::seek(const Key& key, const Node* pred) {
-//fprintf(stderr, "TEST searching key %zu\n", key);
-  while (true) {
-    iter_->seek(key, pred);
-    if (!iter_->valid() || iter_->cmp() != 0 || iter_->node()->type() == kTypeShortcut) {
-      // key doesn't match
-      pred = iter_->shortcut();
-      assert((pred == NULL) || (pred->type() != kTypeShortcut));
-      auto next_wptr = iter_->table_ptr()->next();
-      if (auto next_table = next_wptr.lock()) {
-        // next memtable available
-        auto next_iter = std::make_unique<TableIter>(next_table);
-        iter_ = std::move(next_iter);
-        continue;
-      }
-    }
-    break;
-  }
+namespace {
+
+inline int compare_keys(const uint64_t a, const uint64_t b) {
+  return (a < b) ? -1 : (a > b);
+}
+
+inline int compare_keys(const std::string_view& a, const std::string_view& b) {
+  return a.compare(b);
 }
-bool casc_mem_level_getter::valid() {
-  return iter_->valid();
-}
-int casc_mem_level_getter::cmp() {
-  return iter_->cmp();
-}
-//const Node* node() { return iter_->node(); }
-//const Node* shortcut() { return iter_->shortcut(); }
-uint64_t casc_mem_level_getter::pmem_shortcut_offset(const int r) {
-  return iter_->pmem_shortcut_offset(r);
-}
-casc_mem_level_getter::UpperLevelGetter* casc_mem_level_getter::new_upper_level_getter(const int r) {
-  auto mem_table = iter_->table_ptr();
-  assert(mem_table->next().expired());
-  auto l0_wp = mem_table->upper();
-  if (auto l0_table = l0_wp.lock()) {
-    // possible use_count()
-    // 1: this ?
-    // 2: this + immutables
-    // 2: this + future_pmem_table_ (X), because mem_table->next().expired() == true
-    // 3 + a: this + immutables + future_pmem_table_
-    if (true /* FOR TEST */|| l0_table.use_count() > 1) {
-      // L0 table is listed on immutable list (in use)
-      auto l0_table_iter = new UpperTableIter(r, l0_table);
-      return new UpperLevelGetter(r, l0_table_iter);
+
+}  // namespace
+
+DBIterator::DBIterator(EpochManager* epoch, const int region, const uint64_t snapshot,
+                       const int num_shards, std::shared_ptr<Partitioner> partitioner, ShardLoader load_shard)
+    : epoch_(epoch), num_shards_(num_shards), partitioner_(partitioner),
+      ordered_(partitioner && partitioner->ordered()), load_shard_(load_shard),
+      r_(region), snapshot_(snapshot) {
+  epoch_->enter();
+  if (!ordered_) {
+    for (int s = 0; s < num_shards_; s++) {
+      load_shard_(this, s);
     }
   }
-  return NULL;
-}
-void casc_mem_level_getter::get_value(std::string* out_str) {
-  return iter_->get_value(out_str);
-}
-
-//casc_mem_level_getter::TableIter* casc_mem_level_getter::table_iter() {
-//  return iter_.get();
-//}
-
-// For PmemTable level (L0)
-casc_pmem_level_getter::casc_pmem_level_getter(const int r, TableIter* table_iter)
-    : r_(r) {
-  iter_ = std::unique_ptr<TableIter>(table_iter);
-}
-void casc_pmem_level_getter::seek_with_shortcut_offset(const Key& key, const uint64_t pred_offset) {
-  //return seek(key, NULL);
-  Node* pred = (Node*) iter_->table_ptr()->get_node_by_offset(r_, pred_offset);
-  return seek(key, pred);
-}
-void casc_pmem_level_getter::seek(const Key& key, const Node* pred) {
-  while (true) {
-    iter_->seek(key, pred);
-    if (!iter_->valid() || iter_->cmp() != 0 || iter_->node()->type() == kTypeShortcut) {
-      // casc_pmem_table_iterator::shortcut()
-      pred = iter_->shortcut();
-      auto next_wptr = iter_->table_ptr()->next();
-      if (auto next_table = next_wptr.lock()) {
-        // next pmemtable available
-        //iter_ = PmemTable::new_casc_iterator(pmemtable_);
-        auto next_iter = std::make_unique<TableIter>(r_, next_table);
-        iter_ = std::move(next_iter);
-        continue;
-      }
+}
+
+DBIterator::~DBIterator() {
+  epoch_->exit();
+}
+
+void DBIterator::add_table(std::shared_ptr<MemTable> table) {
+  Source src;
+  src.rank = sources_.size();
+  src.snapshot = snapshot_;
+  src.mem = table->skiplist();
+  sources_.push_back(src);
+  mem_tables_.push_back(std::move(table));
+}
+
+void DBIterator::add_table(std::shared_ptr<PmemTable> table) {
+  Source src;
+  src.rank = sources_.size();
+  src.snapshot = snapshot_;
+  src.pmem = table->skiplist();
+  sources_.push_back(src);
+  pmem_tables_.push_back(std::move(table));
+}
+
+void DBIterator::seek(const std::string_view& key) {
+#ifndef BR_STRING_KV
+  const Key search_key = *reinterpret_cast<const uint64_t*>(key.data());
+#else
+  const Key search_key = key;
+#endif
+  if (ordered_) {
+    const int s = partitioner_->shard(key);
+    if (s != shard_) {
+      load_shard(s);
     }
-    break;
   }
+  seek_sources(&search_key);
+  skip_exhausted_shards();
 }
-bool casc_pmem_level_getter::valid() {
-  return iter_->valid();
-}
-int casc_pmem_level_getter::cmp() {
-  return iter_->cmp();
+
+void DBIterator::seek_to_first() {
+  if (ordered_ && shard_ != 0) {
+    load_shard(0);
+  }
+  seek_sources(NULL);
+  skip_exhausted_shards();
 }
-void casc_pmem_level_getter::get_value(std::string* out_str) {
-  return iter_->get_value(out_str);
+
+void DBIterator::next() {
+  assert(valid());
+  skip_key(current_->key());
+  find_visible();
+  skip_exhausted_shards();
 }
-//const Node* node() { return iter_->node(); }
-//const Node* shortcut() { return iter_->shortcut(); }
-//uint64_t pmem_shortcut_offset(const int r) { return iter_->pmem_shortcut_offset(r); }
 
+std::string_view DBIterator::key() const {
+#ifndef BR_STRING_KV
+  return std::string_view((const char*) &key_buf_, sizeof(uint64_t));
+#else
+  return current_->key();
+#endif
+}
 
-////////////////////////////////////////
-// class casc_mem_to_l0_getter Impl.
+std::string_view DBIterator::value() const {
+  return current_->value();
+}
 
-casc_mem_to_l0_getter::casc_mem_to_l0_getter(const int region, MemLevelGetter* mem_iter)
-    : r_(region) {
-  mem_getter_ = std::unique_ptr<MemLevelGetter>(mem_iter);
-  pmem_getter_ = nullptr;
-  assert((mem_getter_ != nullptr) ^ (pmem_getter_ != nullptr));
+void DBIterator::seek_sources(const Key* key) {
+  heap_ = decltype(heap_)();
+  for (auto& src : sources_) {
+    src.seek(r_, key);
+    if (src.valid()) {
+      heap_.push(&src);
+    }
+  }
+  find_visible();
 }
 
-void casc_mem_to_l0_getter::seek(const Key& key) {
-  // MemTable
-  //bool go_L1 = false;
-  mem_getter_->seek(key);
-  uint64_t pred_offset = 0;
-  if (!mem_getter_->valid() || mem_getter_->cmp() != 0 || mem_getter_->node()->type() == kTypeShortcut) {
-    uint64_t pred_offset = mem_getter_->pmem_shortcut_offset(r_);  // Using this SLOW DOWN search
-    auto l0_weak = mem_getter_->table_ptr()->upper();
-    if (auto sp = l0_weak.lock()) {
-      if (sp.use_count() > 1) {
-        auto pmem_table_iter = new casc_pmem_table_iterator(r_, std::move(sp));
-        pmem_getter_ = std::unique_ptr<casc_pmem_level_getter>(new casc_pmem_level_getter(r_, pmem_table_iter));
-        mem_getter_ = nullptr;
-      }
+void DBIterator::skip_key(const Key key) {
+  while (!heap_.empty() && compare_keys(heap_.top()->key(), key) == 0) {
+    Source* src = heap_.top();
+    heap_.pop();
+    do {
+      src->next();
+    } while (src->valid() && compare_keys(src->key(), key) == 0);
+    if (src->valid()) {
+      heap_.push(src);
     }
-  } else {
-    return;
   }
-  // When to use pmem_shortcut_offset?
-  if (pmem_getter_) {
-    pmem_getter_->seek_with_shortcut_offset(key, pred_offset);
-    if (kNumPmemLevels > 1 && (!pmem_getter_->valid() || pmem_getter_->cmp() != 0 || pmem_getter_->node()->type() == kTypeShortcut)) {
-      auto pred_for_l1 = pmem_getter_->shortcut();
-      assert(kNumPmemLevels==2);
-      auto l1_table = l1_wp_.lock();
-      assert(l1_table);
-      auto l1_table_iter = new casc_pmem_table_iterator(r_, std::move(l1_table));
-      pmem_getter_ = std::make_unique<casc_pmem_level_getter>(r_, l1_table_iter);
-      pmem_getter_->seek(key, pred_for_l1);
-    } else {
+}
+
+void DBIterator::find_visible() {
+  while (!heap_.empty()) {
+    Source* top = heap_.top();
+    if (top->type() != kTypeDeletion) {
+      current_ = top;
+#ifndef BR_STRING_KV
+      key_buf_ = top->key();
+#endif
       return;
     }
-  } else if (kNumPmemLevels > 1) {
-    assert(kNumPmemLevels==2);
-    auto l1_table = l1_wp_.lock();
-    assert(l1_table);
-    auto l1_table_iter = new casc_pmem_table_iterator(r_, std::move(l1_table));
-    pmem_getter_ = std::make_unique<casc_pmem_level_getter>(r_, l1_table_iter);
-    pmem_getter_->seek_with_shortcut_offset(key, pred_offset);
+    skip_key(top->key());
   }
+  current_ = nullptr;
 }
 
-bool casc_mem_to_l0_getter::valid() {
-  assert((mem_getter_ != nullptr) ^ (pmem_getter_ != nullptr));
-  return (pmem_getter_) ? pmem_getter_->valid() : mem_getter_->valid();
+void DBIterator::load_shard(const int s) {
+  heap_ = decltype(heap_)();
+  current_ = nullptr;
+  sources_.clear();
+  mem_tables_.clear();
+  pmem_tables_.clear();
+  shard_ = s;
+  load_shard_(this, s);
 }
 
-int casc_mem_to_l0_getter::cmp() {
-  assert((mem_getter_ != nullptr) ^ (pmem_getter_ != nullptr));
-  return (pmem_getter_) ? pmem_getter_->cmp() : mem_getter_->cmp();
+void DBIterator::skip_exhausted_shards() {
+  while (ordered_ && !valid() && shard_ + 1 < num_shards_) {
+    load_shard(shard_ + 1);
+    seek_sources(NULL);
+  }
 }
 
-bool casc_mem_to_l0_getter::is_not_shortcut() {
-  if (pmem_getter_) {
-    return (pmem_getter_->node()->type() != kTypeShortcut);
+bool DBIterator::SourceCmp::operator()(const Source* a, const Source* b) const {
+  int cr = compare_keys(a->key(), b->key());
+  return (cr != 0) ? (cr > 0) : (a->rank > b->rank);
+}
+
+void DBIterator::Source::seek(const int r, const Key* key) {
+  if (mem) {
+    const mNode* pred = mem->head();
+    const mNode* curr = pred->next[0].load();
+    if (key) {
+      for (int l = pred->height - 1; l >= 0; l--) {
+        while (true) {
+          curr = pred->next[l].load();
+          if (mem->cmp_(curr, *key) < 0) {
+            pred = curr;
+            continue;
+          }
+          break;
+        }
+      }
+    }
+    mnode = curr;
   } else {
-    return (mem_getter_->node()->type() != kTypeShortcut);
+    // Index levels of region r, then the braided bottom level
+    const pNode* pred = (key) ? pmem->descend(r, *key) : pmem->head_[kPrimaryRegion];
+    const pNode* curr;
+    while (true) {
+      curr = (pNode*) pmem->moff_to_ptr(pred->next[0].load());
+      if (key && pmem->cmp_(curr, *key) < 0) {
+        pred = curr;
+        continue;
+      }
+      break;
+    }
+    pnode = curr;
   }
+  skip_invisible();
 }
 
-void casc_mem_to_l0_getter::get_value(std::string* out_str) {
-  assert(out_str != NULL);
-  assert((mem_getter_ != nullptr) ^ (pmem_getter_ != nullptr));
-  if (pmem_getter_) {
-    return pmem_getter_->get_value(out_str);
+void DBIterator::Source::next() {
+  if (mnode) {
+    mnode = mnode->next[0].load();
   } else {
-    return mem_getter_->get_value(out_str);
+    pnode = (pNode*) pmem->moff_to_ptr(pnode->next[0].load());
   }
+  skip_invisible();
 }
 
-#endif
+void DBIterator::Source::skip_invisible() {
+  while (mnode && (mnode->type() == kTypeShortcut || tag_seq(mnode->tag()) > snapshot)) {
+    mnode = mnode->next[0].load();
+  }
+  while (pnode && (pnode->type() == kTypeShortcut || tag_seq(pnode->tag()) > snapshot)) {
+    pnode = (pNode*) pmem->moff_to_ptr(pnode->next[0].load());
+  }
+}
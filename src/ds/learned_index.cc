@@ -0,0 +1,73 @@
+#include "ds/learned_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+void LearnedIndex::add(const uint64_t key, const void* ptr) {
+  assert(keys_.empty() || keys_.back() < key);
+  const size_t pos = keys_.size();
+  keys_.push_back(key);
+  ptrs_.push_back(ptr);
+  if (!segments_.empty()) {
+    // Shrinking cone: narrow the slopes to those that keep this sample
+    // within kEpsilon of its position, or start a segment at it
+    const Segment& seg = segments_.back();
+    const double dx = (double) (key - first_keys_.back());
+    const double dy = (double) (pos - seg.first_pos);
+    const double lo = std::max(slope_lo_, (dy - kEpsilon) / dx);
+    const double hi = std::min(slope_hi_, (dy + kEpsilon) / dx);
+    if (lo <= hi) {
+      slope_lo_ = lo;
+      slope_hi_ = hi;
+      return;
+    }
+    close_segment();
+  }
+  first_keys_.push_back(key);
+  segments_.push_back({ 0, pos });
+  slope_lo_ = 0;
+  slope_hi_ = std::numeric_limits<double>::infinity();
+}
+
+void LearnedIndex::close_segment() {
+  // A segment of one sample has no upper bound
+  segments_.back().slope = (slope_hi_ == std::numeric_limits<double>::infinity())
+                           ? slope_lo_ : (slope_lo_ + slope_hi_) / 2;
+}
+
+void LearnedIndex::finish() {
+  if (!segments_.empty()) {
+    close_segment();
+  }
+  keys_.shrink_to_fit();
+  ptrs_.shrink_to_fit();
+  first_keys_.shrink_to_fit();
+  segments_.shrink_to_fit();
+}
+
+const void* LearnedIndex::find_pred(const uint64_t key) const {
+  if (keys_.empty() || key <= keys_[0]) {
+    return NULL;
+  }
+  // Last segment starting below the key
+  const size_t i = std::lower_bound(first_keys_.begin(), first_keys_.end(), key) - first_keys_.begin() - 1;
+  const Segment& seg = segments_[i];
+  const size_t seg_end = (i + 1 < segments_.size()) ? segments_[i + 1].first_pos : keys_.size();
+  // The first sample not less than the key is at most kEpsilon + 1 away from
+  // the prediction, or the first one of the next segment
+  const double pred = seg.first_pos + seg.slope * (double) (key - first_keys_[i]);
+  const size_t hi = std::min((double) seg_end, pred + kEpsilon + 2);
+  const size_t lo = std::min((size_t) std::max((double) seg.first_pos, pred - kEpsilon - 1), hi);
+  auto begin = keys_.begin();
+  size_t pos = std::lower_bound(begin + lo, begin + hi, key) - begin;
+  // Floating-point error: check that the window held the position
+  if ((pos == lo && lo > 0 && keys_[lo - 1] >= key) || (pos == hi && hi < keys_.size() && keys_[hi] < key)) {
+    pos = std::lower_bound(begin, keys_.end(), key) - begin;
+  }
+  return ptrs_[pos - 1];
+}
+
+size_t LearnedIndex::memory_usage() const {
+  return keys_.capacity() * sizeof(uint64_t) + ptrs_.capacity() * sizeof(void*)
+      + first_keys_.capacity() * sizeof(uint64_t) + segments_.capacity() * sizeof(Segment);
+}
@@ -1,5 +1,6 @@
 #include "ds/lockfree_pskiplist.h"
 
+#include <algorithm>
 #include <bitset>
 #include <new>
 #include <stack>
@@ -27,8 +28,12 @@ void lockfree_pskiplist::init() {
     head_[i] = Node::init_node(D_RW(head_buf), head_key, 0xffffffffffffffff, 0, kMaxHeight);
     pmemobj_persist(pop_[i], D_RW(head_buf), alloc_size);
     D_RW(base)->head[i] = head_buf;
+#ifdef BR_HYBRID
+    head_tower_[i] = new_tower(head_[i]);
+#endif
   }
   pmemobj_persist(pop_[kPrimaryRegion], D_RW(base), sizeof(BraidedSkipListBase));
+  base_ = base;
 }
 
 void lockfree_pskiplist::load(TOID(BraidedSkipListBase)& base) {
@@ -36,6 +41,28 @@ void lockfree_pskiplist::load(TOID(BraidedSkipListBase)& base) {
     head_[i] = (Node*) D_RW(D_RW(base)->head[i]);
   }
   base_ = base;
+#ifdef BR_HYBRID
+  // The bottom level holds the nodes of every region in order, so appending
+  // each tower at the tails of its region rebuilds the index levels
+  Tower* tails[kMaxNumRegions][kMaxHeight];
+  for (int i = 0; i < kNumRegions; i++) {
+    head_tower_[i] = new_tower(head_[i]);
+    std::fill(tails[i], tails[i] + kMaxHeight, head_tower_[i]);
+  }
+  int16_t r;
+  Node* curr = (Node*) moff_to_ptr(head_[kPrimaryRegion]->next[0].load(), r);
+  while (curr) {
+    if (curr->height > 1) {
+      Tower* tower = new_tower(curr);
+      curr->next[1].store((uintptr_t) tower);
+      for (int l = 1; l < curr->height; l++) {
+        tails[r][l]->next[l].store((uintptr_t) tower);
+        tails[r][l] = tower;
+      }
+    }
+    curr = (Node*) moff_to_ptr(curr->next[0].load(), r);
+  }
+#endif
   std::atomic_thread_fence(std::memory_order_release);
 }
 
@@ -43,7 +70,8 @@ TOID(BraidedSkipListBase) lockfree_pskiplist::base() {
   return base_;
 }
 
-lockfree_pskiplist::Node* lockfree_pskiplist::new_node(ThreadData* td, const int r, const Key& key, const uint64_t value, int height) {
+lockfree_pskiplist::Node* lockfree_pskiplist::new_node(ThreadData* td, const int r, const Key& key, const uint64_t value, int height,
+                                                      const uint64_t tag, const std::string_view& inline_value) {
   if (height == 0) {
     height = 1;
     static const unsigned int kBranching = 4;
@@ -55,46 +83,60 @@ lockfree_pskiplist::Node* lockfree_pskiplist::new_node(ThreadData* td, const int
       }
     }
   }
+#ifndef BR_STRING_KV
   size_t palloc_size = Node::compute_alloc_size(key, height);
   TOID(char) pbuf;
   POBJ_ALLOC(pop_[r], &pbuf, char, palloc_size, NULL, NULL);
-  Node* new_node = Node::init_node(D_RW(pbuf), key, 0x1, value, height);
+  Node* new_node = Node::init_node(D_RW(pbuf), key, tag, value, height);
+#else
+  size_t palloc_size = Node::compute_alloc_size(key, height, value);
+  TOID(char) pbuf;
+  POBJ_ALLOC(pop_[r], &pbuf, char, palloc_size, NULL, NULL);
+  Node* new_node = Node::init_node(D_RW(pbuf), key, tag, value, height, true, inline_value);
+#endif
   new_node->next[0].store(0);
   pmemobj_persist(pop_[r], new_node->data(), new_node->alloc_size());
   return new_node;
 }
 
-lockfree_pskiplist::Node* lockfree_pskiplist::insert(ThreadData* const td, const int r, Node* const node, Node* pred, bool persist)  {
-  if (pred == NULL) {
-    pred = head_[r];
-  }
+lockfree_pskiplist::Upper* lockfree_pskiplist::insert(ThreadData* const td, const int r, Node* const node, Upper* pred, bool persist)  {
   uint64_t node_offset = (uintptr_t) node - (uintptr_t) pop_[r];
   uint64_t node_moff = (node_offset << 16) | (int16_t) r;
   assert(node == moff_to_ptr(node_moff));
-  Node* preds[kMaxHeight];
-  uint64_t succs[kMaxHeight];
+#ifndef BR_HYBRID
+  Upper* upper = node;
+#else
+  // Reachable from the node before the node is linked
+  Upper* upper = (node->height > 1) ? new_tower(node) : NULL;
+  if (upper) {
+    node->next[1].store((uintptr_t) upper);
+  }
+#endif
+  const uint64_t node_link = upper_link(r, upper);
+  Position pos;
   while (true) {
-    find_position(td, r, node, preds, succs, pred);
+    find_position(td, r, node, &pos, pred);
     for (int l = 1; l < node->height; l++) {
-      node->next[l].store(succs[l]);
+      upper->next[l].store(pos.succs[l]);
     }
-    node->next[0].store(succs[0]);
+    node->next[0].store(pos.bottom_succ);
     if (persist) {
-      pmemobj_persist(pop_[r], node->next, node->height * 8);
+      pmemobj_persist(pop_[r], node->next, Node::num_links(node->height) * 8);
     }
-    if (!preds[0]->next[0].compare_exchange_strong(succs[0], node_moff)) {
-      pred = preds[kMaxHeight - 1];
+    if (!pos.bottom_pred->next[0].compare_exchange_strong(pos.bottom_succ, node_moff)) {
+      pred = pos.finger();
       continue;
     }
     if (persist) {
-      int bottom_pred_region = (preds[0] == head_[kPrimaryRegion]) ? kPrimaryRegion : r;
-      pmemobj_persist(pop_[bottom_pred_region], preds[0]->next, 8);
+      int bottom_pred_region = (pos.bottom_pred == head_[kPrimaryRegion]) ? kPrimaryRegion : r;
+      pmemobj_persist(pop_[bottom_pred_region], pos.bottom_pred->next, 8);
     }
 
     for (int l = 1; l < node->height; l++) {
       while (true) {
-        if (!preds[l]->next[l].compare_exchange_strong(succs[l], node_offset)) {
-          find_position(td, r, node, preds, succs, preds[kMaxHeight - 1], l);
+        if (!pos.preds[l]->next[l].compare_exchange_strong(pos.succs[l], node_link)) {
+          find_position(td, r, node, &pos, pos.finger(), l);
+          upper->next[l].store(pos.succs[l]);
           continue;
         }
         break;
@@ -102,105 +144,187 @@ lockfree_pskiplist::Node* lockfree_pskiplist::insert(ThreadData* const td, const
     }
     break;
   }
-  return preds[kMaxHeight - 1];
+  return pos.finger();
 }
 
 lockfree_pskiplist::Node* lockfree_pskiplist::find(ThreadData* const td, const int r, const Key& key, const Node* pred) {
-  if (pred == NULL) {
-    pred = head_[r];
+  return find_braided(td, key, descend(r, key, pred));
+}
+
+const lockfree_pskiplist::Node* lockfree_pskiplist::descend(const int r, const Key& key, const Node* pred) {
+  const Upper* upred = (pred == NULL) ? upper_head(r) : upper_of(pred);
+  if (upred == NULL) {
+    return pred;
   }
-  uint64_t curr_offset;
-  Node* curr;
-  int h = pred->height;
-  int cr;
-  for (int l = h - 1; l >= 1; l--) {
+  for (int l = upred->height - 1; l >= 1; l--) {
     while (true) {
-      curr_offset = pred->next[l].load();
-      curr = (Node*) offset_to_ptr(r, curr_offset);
-      if ((cr = cmp_(curr, key)) < 0) {
+      const Upper* curr = upper_ptr(r, upred->next[l].load());
+      if (upper_cmp(curr, key) < 0) {
 //td->visit_cnt++;
-        pred = curr;
+        upred = curr;
         continue;
       }
       break;
     }
   }
-  if (pred == head_[r] && r != kPrimaryRegion) {
-    pred = head_[kPrimaryRegion];
+  return bottom_start(r, upred);
+}
+
+void lockfree_pskiplist::find_batch(ThreadData* const td, const int r, const size_t n, const Key* keys, Node** nodes_out,
+                                    const Node* const* preds) {
+  // Index levels are private to region r, the bottom level is braided
+  struct Traversal {
+    size_t idx;
+    const Upper* upred;
+    const Upper* ucurr;  // prefetched, compared in the next turn
+    const Node* pred;
+    Node* curr;  // prefetched, compared in the next turn
+    int level;
+  };
+  auto advance = [&](Traversal& t) {
+    if (t.level > 0) {
+      t.ucurr = upper_ptr(r, t.upred->next[t.level].load());
+#ifndef BR_HYBRID
+      prefetch_node(t.ucurr);
+#else
+      __builtin_prefetch(t.ucurr);
+#endif
+    } else {
+      t.curr = (Node*) moff_to_ptr(t.pred->next[0].load());
+      prefetch_node(t.curr);
+    }
+  };
+  std::vector<Traversal> active(n);
+  for (size_t i = 0; i < n; i++) {
+    auto& t = active[i];
+    t.idx = i;
+    if (preds && preds[i]) {
+      t.pred = preds[i];
+      t.level = 0;
+    } else {
+      t.upred = upper_head(r);
+      t.level = t.upred->height - 1;
+      if (t.level == 0) {
+        t.pred = bottom_start(r, t.upred);
+      }
+    }
+    advance(t);
+  }
+  while (!active.empty()) {
+    for (size_t i = 0; i < active.size(); ) {
+      auto& t = active[i];
+      if (t.level > 0) {
+        if (upper_cmp(t.ucurr, keys[t.idx]) < 0) {
+          t.upred = t.ucurr;
+        } else if (--t.level == 0) {
+          t.pred = bottom_start(r, t.upred);
+        }
+      } else {
+        int cr = cmp_(t.curr, keys[t.idx]);
+        if (cr >= 0) {
+          nodes_out[t.idx] = (cr == 0) ? t.curr : NULL;
+          t = active.back();
+          active.pop_back();
+          continue;
+        }
+        t.pred = t.curr;
+      }
+      advance(t);
+      i++;
+    }
   }
-  return find_braided(td, key, pred);
-  //return (cr == 0) ? curr : NULL;
 }
 
-void lockfree_pskiplist::merge_WAL(ThreadData* td, const unsigned long rmask, lockfree_skiplist* other) {
-  std::bitset<kMaxNumRegions> bs(rmask);
-  Node* pred[kMaxNumRegions];
+const lockfree_pskiplist::Node* lockfree_pskiplist::find_version(const Node* node, const uint64_t snapshot) {
+  // Versions of a key are adjacent in the braided bottom level, newest first
+  const Node* curr = node;
+  while (curr && cmp_(curr, node->key()) == 0) {
+    if (curr->type() != kTypeShortcut && tag_seq(curr->tag()) <= snapshot) {
+      return curr;
+    }
+    curr = (const Node*) moff_to_ptr(curr->next[0].load());
+  }
+  return NULL;
+}
+
+void lockfree_pskiplist::merge_WAL(ThreadData* td, lockfree_skiplist* other, const mem_Node* begin, const mem_Node* end,
+                                   const uint64_t oldest_snapshot, BloomFilter* filter) {
+  Upper* pred[kMaxNumRegions];
   for (int i = 0; i < kNumRegions; i++) {
-    pred[i] = head_[i];
+    pred[i] = upper_head(i);
   }
-  mem_Node* o = other->head()->next[0].load();
-  while (o) {
+  mem_Node* newer = NULL;  // previous version in the memtable
+  mem_Node* o = (begin) ? (mem_Node*) begin : other->head()->next[0].load();
+  while (o != end) {
+    // Older versions in the same memtable are not flushed, unless a snapshot
+    // may read them
+    if (o->type() != kTypeShortcut) {
+      if (newer && other->cmp_(newer, o->key()) == 0 && tag_seq(newer->tag()) <= oldest_snapshot) {
+        newer = o;
+        o = o->next[0].load();
+        continue;
+      }
+      newer = o;
+    }
     // *** Create a new persistent node
     // Random Height
     int height = random_height(td->rnd);
     int16_t r = 0xffff & o->log_moff;
-    if (o->type() == kTypeValue && bs.test(r)) {
+    if (o->type() == kTypeValue || o->type() == kTypeDeletion) {
+#ifndef BR_STRING_KV
       size_t palloc_size = Node::compute_alloc_size(o->key(), height);
       TOID(char) pbuf;
       POBJ_ALLOC(pop_[r], &pbuf, char, palloc_size, NULL, NULL);
       Node* new_node = Node::init_node(D_RW(pbuf), o->key(), o->tag(), o->value(), height);
+#else
+      const uint64_t value = o->value();
+      size_t palloc_size = Node::compute_alloc_size(o->key(), height, value);
+      TOID(char) pbuf;
+      POBJ_ALLOC(pop_[r], &pbuf, char, palloc_size, NULL, NULL);
+      Node* new_node = Node::init_node(D_RW(pbuf), o->key(), o->tag(), value, height, true, o->inline_value());
+#endif
       new_node->next[0].store(0);
       pmemobj_persist(pop_[r], new_node->data(), new_node->alloc_size());
 
       pred[r] = insert(td, r, new_node, pred[r], /*persist=*/true);
-#ifndef BR_STRING_KV
-      ht_add(shard_, o->key(), o->value());
-#else
-      ht_add(shard_, (uint64_t) D_RW(pbuf), o->value());
-#endif
+      if (filter) {
+        filter->add(ht_hash(o->key()));
+      }
       td->mem_compaction_cnt++;
     }
     o = o->next[0].load();
   }
 }
 
-void lockfree_pskiplist::merge_IUL(ThreadData* td, const unsigned long rmask, lockfree_skiplist* other) {
-  std::bitset<kMaxNumRegions> bs(rmask);
-  Node* pred[kNumRegions];
+void lockfree_pskiplist::merge_IUL(ThreadData* td, lockfree_skiplist* other, const mem_Node* begin, const mem_Node* end,
+                                   const uint64_t oldest_snapshot, BloomFilter* filter) {
+  Upper* pred[kNumRegions];
   for (int i = 0; i < kNumRegions; i++) {
-    pred[i] = head_[i];
+    pred[i] = upper_head(i);
   }
-  mem_Node* o = other->head()->next[0].load();
-  while (o) {
+  mem_Node* newer = NULL;  // previous version in the memtable
+  mem_Node* o = (begin) ? (mem_Node*) begin : other->head()->next[0].load();
+  while (o != end) {
+    // Older versions in the same memtable are not flushed, unless a snapshot
+    // may read them
+    if (o->type() != kTypeShortcut) {
+      if (newer && other->cmp_(newer, o->key()) == 0 && tag_seq(newer->tag()) <= oldest_snapshot) {
+        newer = o;
+        o = o->next[0].load();
+        continue;
+      }
+      newer = o;
+    }
     int16_t r = 0xffff & o->log_moff;
-    if (o->type() == kTypeValue && bs.test(r)) {
+    if (o->type() == kTypeValue || o->type() == kTypeDeletion) {
       uint64_t log_offset = o->log_moff >> 16;
       char* node_buf = (char*) offset_to_ptr(r, log_offset);
       Node* new_node = Node::load_node(node_buf);
       pred[r] = insert(td, r, new_node, pred[r], /*persist=*/false);
-#ifndef BR_STRING_KV
-      ht_add(shard_, o->key(), o->value());
-#else
-      ht_add(shard_, (uint64_t) node_buf, o->value());
-#endif
+      if (filter) {
+        filter->add(ht_hash(o->key()));
+      }
       td->mem_compaction_cnt++;
-    } else if (/* FOR TEST */true && o->type() == kTypeShortcut && bs.test(r)) {
-      uint64_t log_offset = o->log_moff >> 16;
-      char* node_buf = (char*) offset_to_ptr(r, log_offset);
-      Node* new_node = Node::load_node(node_buf);
-      pred[r] = insert(td, r, new_node, pred[r], /*persist=*/false);
-      //fprintf(stderr,"TSET dram key=%zu pmem key=%zu\n", ((mem_Node*) o->value())->key(), ((Node*) moff_to_ptr(o->log_moff))->key());
-      // Creation: MemTable::add()
-      // Deliver: casc_pskiplist_iterator::shortcut() <= seek()
-      // Use: casc_pmem_level_getter::seek()
-      //size_t palloc_size = Node::compute_alloc_size(o->key(), o->height);
-      //TOID(char) pbuf;
-      //POBJ_ALLOC(pop_[r], &pbuf, char, palloc_size, NULL, NULL);
-      //Node* new_node = Node::init_node(D_RW(pbuf), o->key(), o->tag(), o->log_moff, o->height);
-      //new_node->next[0].store(0);
-      //pmemobj_persist(pop_[r], new_node->data(), new_node->alloc_size());
-
-      //pred[r] = insert(td, r, new_node, pred[r], /*persist=*/false);
     }
     o = o->next[0].load();
   }
@@ -210,48 +334,40 @@ lockfree_pskiplist::Node* lockfree_pskiplist::head(const int r) {
   return head_[r];
 }
 
-// `r`: Shortcut region
-void lockfree_pskiplist::zipper_compaction(ThreadData* const td, const unsigned long rmask, const int lower_level, lockfree_pskiplist* lower) {
+void lockfree_pskiplist::zipper_scan(ThreadData* const td, lockfree_pskiplist* lower, Node* begin, const Node* end,
+                                     std::deque<zc_item>* items) {
   Node* lnode;
-  Node* unode[kMaxNumRegions];
-  Node* preds[kMaxHeight];
-  uint64_t succs[kMaxHeight];
+  Upper* unode[kMaxNumRegions];
+  Position pos;
   int16_t rr;  // region read from node
-  std::deque<zc_item> item_stack;
-
-  std::bitset<kMaxNumRegions> bs(rmask);
-  lnode = lower->head(kPrimaryRegion);
-  assert(lnode != NULL);
-  do {
-    lnode = (Node*) lower->moff_to_ptr(lnode->next[0].load(), rr);
-  } while (lnode && !bs.test(rr));
 
+  if (begin) {
+    // Split points are nodes of the primary region
+    lnode = begin;
+    rr = kPrimaryRegion;
+  } else {
+    lnode = (Node*) lower->moff_to_ptr(lower->head(kPrimaryRegion)->next[0].load(), rr);
+  }
   for (int i = 0; i < kNumRegions; i++) {
-    if (bs.test(i)) {
-      unode[i] = head_[i];
-    } else {
-      unode[i] = NULL;
-    }
+    unode[i] = upper_head(i);
   }
-  // 1. Scan Phase
-  while (lnode) {
-    if (/* FOR TEST */true || lnode->type() != kTypeShortcut) {
-      assert(lnode->key() != 0);
-      find_position(td, rr, lnode, preds, succs, unode[rr]);
-      item_stack.emplace_back(rr, lnode, preds, succs);
-      unode[rr] = preds[kMaxHeight - 1];
-    }
-    do {
-      lnode = (Node*) lower->moff_to_ptr(lnode->next[0].load(), rr);
-    } while (lnode && !bs.test(rr));
+  while (lnode && lnode != end) {
+    assert(lnode->key() != Node::head_key());
+    find_position(td, rr, lnode, &pos, unode[rr]);
+    items->emplace_back(rr, lnode, pos);
+    unode[rr] = pos.finger();
+    lnode = (Node*) lower->moff_to_ptr(lnode->next[0].load(), rr);
   }
-  // 2. Merge Phase
+}
+
+void lockfree_pskiplist::zipper_merge(ThreadData* const td, const int lower_level, std::deque<zc_item>* items) {
+  std::deque<zc_item>& item_stack = *items;
   while (!item_stack.empty()) {
     auto& z = item_stack.back();  // item being merged
     while (true) {
       uint64_t ori_moff = z.node->next[0].load();  // original, lower
       Node* ori_succ = (Node*) moff_to_ptr(ori_moff);
-      uint64_t cand_moff = z.succs[0];  // candidate, upper
+      uint64_t cand_moff = z.pos.bottom_succ;  // candidate, upper
       Node* cand_succ = (Node*) moff_to_ptr(cand_moff);
       uint64_t expected_succ_moff;
       if (ori_succ == NULL || cmp_(cand_succ, ori_succ) < 0) {
@@ -263,32 +379,32 @@ void lockfree_pskiplist::zipper_compaction(ThreadData* const td, const unsigned
       }
       uint64_t z_offset = (uintptr_t) z.node - (uintptr_t) pop_[z.region];
       uint64_t z_moff = (z_offset << 16) | (int16_t) z.region;
-      if (!z.preds[0]->next[0].compare_exchange_strong(expected_succ_moff, z_moff)) {
+      if (!z.pos.bottom_pred->next[0].compare_exchange_strong(expected_succ_moff, z_moff)) {
         // With high probability, consecutive zipper items will fail on CAS
-        find_position(td, z.region, z.node, z.preds, z.succs, z.preds[kMaxHeight-1]);
+        find_position(td, z.region, z.node, &z.pos, z.pos.finger());
         continue;
       } else {
         break;
       }
     }
 
-    // height 1 to top
+    // height 1 to top. Hybrid: the tower moves along with the node.
+    Upper* zu = upper_of(z.node);
     for (int h = 1; h < z.node->height; h++) {
       while (true) {
-        uint64_t ori_offset = z.node->next[h].load();
-        Node* ori_succ = (Node*) offset_to_ptr(z.region, ori_offset);
-        uint64_t cand_offset = z.succs[h];
-        Node* cand_succ = (Node*) offset_to_ptr(z.region, cand_offset);
-        uint64_t expected_succ_offset;
-        if (ori_succ == NULL || cmp_(cand_succ, ori_succ) < 0) {
-          z.node->next[h].store(cand_offset);
-          expected_succ_offset = cand_offset;
+        uint64_t ori_link = zu->next[h].load();
+        Upper* ori_succ = upper_ptr(z.region, ori_link);
+        uint64_t cand_link = z.pos.succs[h];
+        Upper* cand_succ = upper_ptr(z.region, cand_link);
+        uint64_t expected_succ_link;
+        if (ori_succ == NULL || upper_cmp(cand_succ, ori_succ) < 0) {
+          zu->next[h].store(cand_link);
+          expected_succ_link = cand_link;
         } else {
-          expected_succ_offset = ori_offset;
+          expected_succ_link = ori_link;
         }
-        uint64_t z_offset = (uintptr_t) z.node - (uintptr_t) pop_[z.region];
-        if (!z.preds[h]->next[h].compare_exchange_strong(expected_succ_offset, z_offset)) {
-          find_position(td, z.region, z.node, z.preds, z.succs, z.preds[kMaxHeight - 1], h);
+        if (!z.pos.preds[h]->next[h].compare_exchange_strong(expected_succ_link, upper_link(z.region, zu))) {
+          find_position(td, z.region, z.node, &z.pos, z.pos.finger(), h);
           continue;
         } else {
           break;
@@ -300,29 +416,279 @@ void lockfree_pskiplist::zipper_compaction(ThreadData* const td, const unsigned
   }
 }
 
-void lockfree_pskiplist::log_structured_compaction(ThreadData* td, const unsigned long rmask, const int lower_level, lockfree_pskiplist* lower) {
-  Node* pred[kMaxNumRegions];
+std::vector<lockfree_pskiplist::Node*> lockfree_pskiplist::split_points(const int n) {
+  static const size_t kNodesPerRange = 4;
+  std::vector<Node*> points;
+  if (n <= 1) {
+    return points;
+  }
+  Upper* head = upper_head(kPrimaryRegion);
+  std::vector<Upper*> nodes;
+  for (int l = head->height - 1; l >= 1; l--) {
+    nodes.clear();
+    Upper* u = upper_ptr(kPrimaryRegion, head->next[l].load());
+    while (u) {
+      nodes.push_back(u);
+      u = upper_ptr(kPrimaryRegion, u->next[l].load());
+    }
+    if (nodes.size() >= kNodesPerRange * n) {
+      break;
+    }
+  }
+  for (int i = 1; i < n; i++) {
+    const size_t j = nodes.size() * i / n;
+    if (j > 0 && (points.empty() || node_of(nodes[j]) != points.back())) {
+      points.push_back(node_of(nodes[j]));
+    }
+  }
+  return points;
+}
+
+ZipperCompaction::ZipperCompaction(const int lower_level, const int num_tasks)
+    : lower_level_(lower_level), scanned_(num_tasks, false) { }
+
+void ZipperCompaction::init(lockfree_pskiplist* upper, lockfree_pskiplist* lower) {
+  upper_ = upper;
+  lower_ = lower;
+  begins_.push_back(NULL);
+  for (auto node : lower->split_points((int) scanned_.size())) {
+    begins_.push_back(node);
+  }
+  items_.resize(begins_.size());
+  next_merge_ = num_ranges() - 1;
+}
+
+void ZipperCompaction::run(ThreadData* td, const int range) {
+  if (range < num_ranges()) {
+    const Node* end = (range + 1 < num_ranges()) ? begins_[range + 1] : NULL;
+    upper_->zipper_scan(td, lower_, begins_[range], end, &items_[range]);
+  }
+  std::unique_lock<std::mutex> lk(mu_);
+  scanned_[range] = true;
+  if (merging_) {
+    // The merging task takes this range when it gets to it
+    return;
+  }
+  merging_ = true;
+  while (next_merge_ >= 0 && scanned_[next_merge_]) {
+    const int r = next_merge_;
+    lk.unlock();
+    upper_->zipper_merge(td, lower_level_, &items_[r]);
+    lk.lock();
+    next_merge_--;
+  }
+  merging_ = false;
+}
+
+void lockfree_pskiplist::log_structured_compaction(ThreadData* td, const unsigned long rmask, const int lower_level, lockfree_pskiplist* lower,
+                                                   const uint64_t oldest_snapshot,
+                                                   const std::function<void(std::function<void()>)>& retire_fn) {
+  // Writing into the last level, only the newest version of a key and the
+  // versions of snapshots survive, and tombstones are dropped once the
+  // versions they shadow are unlinked.
+  const bool last_level = (lower_level + 1 == kNumPmemLevels - 1);
+  std::unique_lock<std::mutex> lk(compaction_mu_, std::defer_lock);
+  if (last_level) {
+    lk.lock();
+  }
+  Upper* pred[kMaxNumRegions];
   for (int i = 0; i < kNumRegions; i++) {
-    pred[i] = head_[i];
+    pred[i] = upper_head(i);
   }
   auto it = lower->new_region_iterator(rmask);
   while (it->valid()) {
     Node* lnode = it->node();
     if (lnode->type() != kTypeShortcut) {
       int r = it->region();
+      Node* prev = it->prev();
+      if (prev->type() != kTypeShortcut && cmp_(prev, lnode->key()) == 0
+          && tag_seq(prev->tag()) <= oldest_snapshot) {
+        // Shadowed by a newer version in lower
+        it->next();
+        continue;
+      }
+      if (last_level) {
+        if (lnode->type() == kTypeDeletion && tag_seq(lnode->tag()) <= oldest_snapshot) {
+          unlink_versions(td, r, lnode, NULL, oldest_snapshot, retire_fn);
+          td->pmem_compaction_cnt[lower_level]++;
+          it->next();
+          continue;
+        }
+      }
       int height = random_height(td->rnd);
       TOID(char) new_node_buf;
+#ifndef BR_STRING_KV
       size_t alloc_size = Node::compute_alloc_size(lnode->key(), height);
       POBJ_ALLOC(pop_[r], &new_node_buf, char, alloc_size, NULL, NULL);
       Node* new_node = Node::init_node(D_RW(new_node_buf), lnode->key(), lnode->tag(), lnode->value(), height);
-      pmemobj_persist(pop_[r], D_RW(new_node_buf), alloc_size - (height-1)*8);
+#else
+      const uint64_t value = lnode->value();
+      size_t alloc_size = Node::compute_alloc_size(lnode->key(), height, value);
+      POBJ_ALLOC(pop_[r], &new_node_buf, char, alloc_size, NULL, NULL);
+      Node* new_node = Node::init_node(D_RW(new_node_buf), lnode->key(), lnode->tag(), value, height, true, lnode->inline_value());
+#endif
+      pmemobj_persist(pop_[r], D_RW(new_node_buf), alloc_size - (Node::num_links(height)-1)*8);
       pred[r] = insert(td, r, new_node, pred[r], /*persist=*/true);
+      if (last_level) {
+        unlink_versions(td, r, lnode, new_node, oldest_snapshot, retire_fn);
+      }
       td->pmem_compaction_cnt[lower_level]++;
     }
     it->next();
   }
 }
 
+void lockfree_pskiplist::unlink_versions(ThreadData* const td, const int r, Node* probe, Node* keep,
+                                         const uint64_t oldest_snapshot,
+                                         const std::function<void(std::function<void()>)>& retire_fn) {
+  Position pos;
+  // All versions of a key are adjacent in the braided bottom level, and a
+  // newly inserted version (keep) precedes the older ones.
+  find_position(td, r, probe, &pos);
+  Node* bottom_pred = pos.bottom_pred;
+  uint64_t curr_moff = bottom_pred->next[0].load();
+  Node* curr = (Node*) moff_to_ptr(curr_moff);
+  if (keep) {
+    while (curr != keep) {
+      bottom_pred = curr;
+      curr_moff = curr->next[0].load();
+      curr = (Node*) moff_to_ptr(curr_moff);
+    }
+    bottom_pred = keep;
+    curr_moff = keep->next[0].load();
+    curr = (Node*) moff_to_ptr(curr_moff);
+  }
+  // A version stays while its next newer version is newer than a snapshot
+  uint64_t newer_seq = tag_seq(keep ? keep->tag() : probe->tag());
+  while (curr && cmp_(curr, probe->key()) == 0 && newer_seq > oldest_snapshot) {
+    newer_seq = tag_seq(curr->tag());
+    bottom_pred = curr;
+    curr_moff = curr->next[0].load();
+    curr = (Node*) moff_to_ptr(curr_moff);
+  }
+  Node* first = curr;
+  if (first == NULL || cmp_(first, probe->key()) != 0) {
+    return;
+  }
+  // Unlink from the region-local upper levels first
+  std::vector<Node*> unlinked;
+  while (curr && cmp_(curr, probe->key()) == 0) {
+    unlinked.push_back(curr);
+    int16_t cr = curr_moff & 0xffff;
+    if (curr->height > 1) {
+      Upper* ucurr = upper_of(curr);
+      Position upos;
+      find_position(td, cr, probe, &upos, NULL, 1);
+      for (int l = curr->height - 1; l >= 1; l--) {
+        Upper* p = upos.preds[l];
+        while (upper_ptr(cr, p->next[l].load()) != ucurr) {
+          p = upper_ptr(cr, p->next[l].load());
+        }
+        p->next[l].store(ucurr->next[l].load());
+      }
+    }
+    curr_moff = curr->next[0].load();
+    curr = (Node*) moff_to_ptr(curr_moff);
+  }
+  // Then splice the whole run out of the bottom level
+  bottom_pred->next[0].store(curr_moff);
+  pmemobj_persist(pmemobj_pool_by_ptr(bottom_pred), &bottom_pred->next[0], 8);
+
+  // Concurrent readers may still be on the unlinked nodes, which are freed
+  // a grace period later. Cache entries filled from them were taken before
+  // the splice, so they are evicted now and no reader can fill them again.
+#ifdef BR_STRING_KV
+  for (Node* node : unlinked) {
+    ht_evict(shard_, node->key(), (uint64_t) node->data());
+  }
+#endif
+#ifdef BR_HYBRID
+  std::vector<Upper*> towers;
+  for (Node* node : unlinked) {
+    towers.push_back(upper_of(node));
+  }
+#endif
+  auto free_fn = [unlinked=std::move(unlinked)
+#ifdef BR_HYBRID
+                  , towers=std::move(towers)
+#endif
+                  ]{
+        size_t freed = 0;
+        for (Node* node : unlinked) {
+          freed += node->alloc_size();
+          PMEMoid oid = pmemobj_oid(node->data());
+          pmemobj_free(&oid);
+        }
+#ifdef BR_HYBRID
+        for (Upper* tower : towers) {
+          free(tower);
+        }
+#endif
+        pmem_reclaimed_bytes[kNumPmemLevels - 1].fetch_add(freed);
+      };
+  if (retire_fn) {
+    retire_fn(free_fn);
+  } else {
+    free_fn();
+  }
+}
+
+size_t lockfree_pskiplist::reclaim(const bool reclaim_nodes, const bool reclaim_towers) {
+  size_t freed = 0;
+  auto free_node = [&](Node* node) {
+    freed += node->alloc_size();
+    PMEMoid oid = pmemobj_oid(node->data());
+    pmemobj_free(&oid);
+  };
+#ifndef BR_HYBRID
+  const bool walk = reclaim_nodes;
+#else
+  const bool walk = reclaim_nodes || reclaim_towers;
+#endif
+  if (walk) {
+    // Every region is braided into the bottom level of the primary head
+    Node* curr = (Node*) moff_to_ptr(head_[kPrimaryRegion]->next[0].load());
+    while (curr) {
+      Node* next = (Node*) moff_to_ptr(curr->next[0].load());
+#ifdef BR_HYBRID
+      if (reclaim_towers) {
+        free(upper_of(curr));
+      }
+#endif
+      if (reclaim_nodes) {
+#ifdef BR_STRING_KV
+        // evict_cached() ran a grace period before, and no reader could
+        // reach the node to cache it again
+        assert(!ht_refers(shard_, curr->key(), (uint64_t) curr->data()));
+#endif
+        free_node(curr);
+      }
+      curr = next;
+    }
+  }
+  for (int i = 0; i < kNumRegions; i++) {
+#ifdef BR_HYBRID
+    free(head_tower_[i]);
+#endif
+    free_node(head_[i]);
+  }
+  if (!TOID_IS_NULL(base_)) {
+    freed += sizeof(BraidedSkipListBase);
+    POBJ_FREE(&base_);
+  }
+  return freed;
+}
+
+#ifdef BR_STRING_KV
+void lockfree_pskiplist::evict_cached() {
+  Node* curr = (Node*) moff_to_ptr(head_[kPrimaryRegion]->next[0].load());
+  while (curr) {
+    ht_evict(shard_, curr->key(), (uint64_t) curr->data());
+    curr = (Node*) moff_to_ptr(curr->next[0].load());
+  }
+}
+#endif
+
 // Refer this code for later researches
 //  see how num_consec_locals works
 //void lockfree_pskiplist::log_structured_compaction_all_regions(ThreadData* const td, const int lower_level, lockfree_pskiplist* lower) {
@@ -354,38 +720,33 @@ void lockfree_pskiplist::log_structured_compaction(ThreadData* td, const unsigne
 //  }
 //}
 
-void lockfree_pskiplist::find_position(ThreadData* const td, const int r, Node* node, Node* preds[], uint64_t succs[], Node* pred, const int min_h) {
+void lockfree_pskiplist::find_position(ThreadData* const td, const int r, Node* node, Position* pos, Upper* pred, const int min_h) {
   if (pred == NULL) {
-    pred = head_[r];
+    pred = upper_head(r);
   }
-  uint64_t curr_offset;
-  Node* curr;
+  uint64_t curr_link;
+  Upper* curr;
   int h = pred->height;
   int l;
   for (l = h - 1; l >= std::max(1, min_h); l--) {
     while (true) {
-//if (pred) fprintf(stdout, "pred->key=%zu @%p\n", pred->key, pred);
-      curr_offset = pred->next[l].load();
-      curr = (Node*) offset_to_ptr(r, curr_offset);
-      if (cmp_(curr, node) < 0) {
+      curr_link = pred->next[l].load();
+      curr = upper_ptr(r, curr_link);
+      if (upper_cmp(curr, node) < 0) {
         pred = curr;
         continue;
       }
       break;
     }
-//fprintf(stdout, "l=%d pred = %p\n", l, pred);
-    preds[l] = pred;
-    succs[l] = curr_offset;
+    pos->preds[l] = pred;
+    pos->succs[l] = curr_link;
   }
-  if (l == 0) {
-    if (pred == head_[r] && r != kPrimaryRegion) {
-      pred = head_[kPrimaryRegion];
-    }
-    find_position_braided(td, node, preds, succs, pred);
+  if (min_h == 0) {
+    find_position_braided(td, node, pos, bottom_start(r, pred));
   }
 }
 
-void lockfree_pskiplist::find_position_braided(ThreadData* const td, Node* node, Node* preds[], uint64_t succs[], Node* pred) {
+void lockfree_pskiplist::find_position_braided(ThreadData* const td, Node* node, Position* pos, Node* pred) {
   assert(pred != NULL);
   uint64_t curr_moff;
   Node* curr;
@@ -398,9 +759,8 @@ void lockfree_pskiplist::find_position_braided(ThreadData* const td, Node* node,
     }
     break;
   }
-//fprintf(stdout, "l=0 pred = %p\n", pred);
-  preds[0] = pred;
-  succs[0] = curr_moff;
+  pos->bottom_pred = pred;
+  pos->bottom_succ = curr_moff;
 }
 
 lockfree_pskiplist::Node* lockfree_pskiplist::find_braided(ThreadData* const td, const Key& key, const Node* pred) {
@@ -463,6 +823,69 @@ int lockfree_pskiplist::random_height(Random& rnd) {
   return height;
 }
 
+#ifdef BR_HYBRID
+namespace {
+
+// Newer sequence first, as in NodeCmp
+int cmp_tags(const uint64_t a, const uint64_t b) {
+  if ((a >> 8) < (b >> 8)) {
+    return 1;
+  } else if ((a >> 8) > (b >> 8)) {
+    return -1;
+  } else {
+    return 0;
+  }
+}
+
+}  // namespace
+
+int lockfree_pskiplist::upper_cmp(const Tower* a, const Key& key) const {
+  if (a == NULL) {
+    return 1;
+  }
+#ifndef BR_STRING_KV
+  return (a->key > key) ? 1 : ((a->key < key) ? -1 : 0);
+#else
+  return a->key.compare(key);
+#endif
+}
+
+int lockfree_pskiplist::upper_cmp(const Tower* a, const Tower* b) const {
+  assert(b != NULL);
+  int cr = upper_cmp(a, b->key);
+  return (a == NULL || cr != 0) ? cr : cmp_tags(a->tag, b->tag);
+}
+
+int lockfree_pskiplist::upper_cmp(const Tower* a, const Node* b) const {
+  assert(b != NULL);
+  int cr = upper_cmp(a, b->key());
+  return (a == NULL || cr != 0) ? cr : cmp_tags(a->tag, b->tag());
+}
+
+lockfree_pskiplist::Tower* lockfree_pskiplist::new_tower(Node* node) {
+  const int height = node->height;
+  size_t size = sizeof(Tower) + (height - 1) * 8;
+#ifdef BR_STRING_KV
+  const std::string_view key = node->key();
+  size += key.size();
+#endif
+  char* buf = (char*) malloc(size);
+  Tower* tower = (Tower*) buf;
+  tower->node = node;
+  tower->tag = node->tag();
+#ifndef BR_STRING_KV
+  tower->key = node->key();
+#else
+  char* key_buf = buf + sizeof(Tower) + (height - 1) * 8;
+  memcpy(key_buf, key.data(), key.size());
+  tower->key = std::string_view(key_buf, key.size());
+#endif
+  tower->height = height;
+  memset((void*) tower->next, 0, height * 8);
+  return tower;
+}
+#endif
+
 std::shared_ptr<PRegionIterator> lockfree_pskiplist::new_region_iterator(const unsigned long rmask) {
   auto it = std::make_shared<PRegionIterator>(this, rmask);
   return it;
@@ -513,11 +936,14 @@ bool PRegionIterator::valid() {
 
 void PRegionIterator::next() {
   Node* node = node_;
+  Node* prev;
   int16_t node_region;
   do {
+    prev = node;
     node = (Node*) skiplist_->moff_to_ptr(node->next[0].load(), node_region);
   } while (node && !rbs_.test(node_region));
   r_ = node_region;
+  prev_ = prev;
   node_ = node;
 }
 
@@ -525,6 +951,10 @@ PRegionIterator::Node* PRegionIterator::node() {
   return node_;
 }
 
+PRegionIterator::Node* PRegionIterator::prev() {
+  return prev_;
+}
+
 int PRegionIterator::region() {
   return r_;
 }
@@ -536,54 +966,56 @@ int PRegionIterator::region() {
 // -----------------------------------------
 casc_pskiplist_iterator::casc_pskiplist_iterator(const int region, lockfree_pskiplist* const skiplist)
     : r_(region), skiplist_(skiplist) {
-  //pred_ = NULL;
+  pred_ = NULL;
+  pred_region_ = region;
+  visits_ = 0;
   node_ = NULL;
   shortcut_ = NULL;
   //pred_a_offset_ = 0;
 }
 
 void casc_pskiplist_iterator::seek(const Key& key, const Node* pred) {
-  if (pred == NULL) {
-    pred = skiplist_->head_[r_];
+  using Upper = lockfree_pskiplist::Upper;
+  const Upper* upred = (pred == NULL) ? skiplist_->upper_head(r_) : skiplist_->upper_of(pred);
+  if (upred == NULL) {
+    return seek_braided(key, pred);
   }
-  uint64_t curr_offset;
-  Node* curr = NULL;
-  int h = pred->height;
-  for (int l = h - 1; l >= 1; l--) {
+  for (int l = upred->height - 1; l >= 1; l--) {
     while (true) {
-      curr_offset = pred->next[l].load();
-      curr = (Node*) skiplist_->offset_to_ptr(r_, curr_offset);
-      if (skiplist_->cmp_(curr, key) < 0) {
-        pred = curr;
-        if (pred->type() == kTypeShortcut) {
+      const Upper* curr = skiplist_->upper_ptr(r_, upred->next[l].load());
+      if (skiplist_->upper_cmp(curr, key) < 0) {
+        upred = curr;
+        visits_++;
+        if (skiplist_->upper_type(upred) == kTypeShortcut) {
           //int16_t r;
-          shortcut_ = (Node*) skiplist_->moff_to_ptr(pred->value());
+          shortcut_ = (Node*) skiplist_->moff_to_ptr(skiplist_->node_of(upred)->value());
         }
         continue;
       }
       break;
     }
   }
-  if (pred == skiplist_->head_[r_] && r_ != kPrimaryRegion) {
-    pred = skiplist_->head_[kPrimaryRegion];
-  }
-  return seek_braided(key, pred);
+  return seek_braided(key, skiplist_->bottom_start(r_, upred));
 }
 
 void casc_pskiplist_iterator::seek_braided(const Key& key, const Node* pred) {
   assert(pred != NULL);
   uint64_t curr_moff;
   Node* curr;
+  int16_t curr_region;
   int cr = 1;
   while (true) {
     curr_moff = pred->next[0].load();
-    curr = (Node*) skiplist_->moff_to_ptr(curr_moff);
+    curr = (Node*) skiplist_->moff_to_ptr(curr_moff, curr_region);
     if ((cr = skiplist_->cmp_(curr, key)) < 0) {
       pred = curr;
+      pred_region_ = curr_region;
+      visits_++;
       continue;
     }
     break;
   }
+  pred_ = pred;
   cmp_ = cr;
   //node_ = (cr == 0) ? curr : NULL;
   node_ = curr;
@@ -693,16 +1125,20 @@ void casc_pskiplist_iterator::seek_braided(const Key& key, Node* pred) {
   assert(pred != NULL);
   uint64_t curr_moff;
   Node* curr;
+  int16_t curr_region;
   int cr = 1;
   while (true) {
     curr_moff = pred->next[0].load();
-    curr = (Node*) skiplist_->moff_to_ptr(curr_moff);
+    curr = (Node*) skiplist_->moff_to_ptr(curr_moff, curr_region);
     if ((cr = skiplist_->cmp_(curr, key)) < 0) {
       pred = curr;
+      pred_region_ = curr_region;
+      visits_++;
       continue;
     }
     break;
   }
+  pred_ = pred;
   cmp_ = cr;
   node_ = curr;
 }
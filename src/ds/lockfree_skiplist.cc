@@ -1,5 +1,6 @@
 #include "ds/lockfree_skiplist.h"
 
+#include <algorithm>
 #include <cstring>
 #include <new>
 
@@ -7,38 +8,46 @@
 
 #include "common.h"
 
-lockfree_skiplist::lockfree_skiplist() {
+lockfree_skiplist::lockfree_skiplist(const size_t arena_block_size)
+    : arena_(arena_block_size, arena_block_size >= kMemTableArenaBlockSize) {
   auto head_key = Node::head_key();
   const size_t alloc_size = Node::compute_alloc_size(head_key, kMaxHeight);
-  void* buf = aligned_alloc(8, alloc_size);
+  void* buf = arena_.allocate(alloc_size);
   head_ = Node::init_node((char*) buf, head_key, 0xffffffffffffffff, 0, kMaxHeight);
   head_->log_moff = 0x000000000000ffff;  // offset: 0, region: -1
   std::atomic_thread_fence(std::memory_order_release);
 }
 
-lockfree_skiplist::Node* lockfree_skiplist::insert(ThreadData* const td, Node* const node, Node* pred)  {
+void lockfree_skiplist::insert(ThreadData* const td, Node* const node, Node** finger)  {
   //td->visit_cnt++;
   //assert(node->key != 0);
-  if (pred == NULL) {
-    pred = head_;
-  }
   Node* preds[kMaxHeight];
   Node* succs[kMaxHeight];
+  // Highest level searched. The finger keeps the predecessors above it.
+  int top = kMaxHeight - 1;
+  Node* pred = head_;
+  if (finger && finger[0]) {
+    top = node->height - 1;
+    while (top < kMaxHeight - 1 && cmp_(finger[top]->next[top].load(), node) <= 0) {
+      top++;
+    }
+    pred = finger[top];
+  }
   while (true) {
-    find_position(td, node, preds, succs, pred);
+    find_position(td, node, preds, succs, pred, 0, top);
     for (int l = 1; l < node->height; l++) {
       node->next[l].store(succs[l]);
     }
     node->next[0].store(succs[0]);
     if (!preds[0]->next[0].compare_exchange_strong(succs[0], node)) {
-      pred = preds[kMaxHeight - 1];
+      pred = preds[top];
       continue;
     }
 
     for (int l = 1; l < node->height; l++) {
       while (true) {
         if (!preds[l]->next[l].compare_exchange_strong(succs[l], node)) {
-          find_position(td, node, preds, succs, preds[kMaxHeight - 1], l);
+          find_position(td, node, preds, succs, preds[top], l, top);
           continue;
         }
         break;
@@ -46,16 +55,93 @@ lockfree_skiplist::Node* lockfree_skiplist::insert(ThreadData* const td, Node* c
     }
     break;
   }
-  return preds[kMaxHeight - 1];
+  if (finger) {
+    for (int l = 0; l <= top; l++) {
+      finger[l] = preds[l];
+    }
+  }
+}
+
+void lockfree_skiplist::add_shortcut(ThreadData* const td, const Key& key, const void* target_node, const uint64_t target) {
+  // Shortcuts of a key follow its versions
+  for (const Node* node = find(td, key); node && cmp_(node, key) == 0; node = node->next[0].load()) {
+    if (node->type() == kTypeShortcut && shortcut_table(node->log_moff) == shortcut_table(target)) {
+      return;
+    }
+  }
+  static const unsigned int kBranching = 4;
+  int height = 1;
+  while (height < kMaxHeight && ((td->rnd.Next() % kBranching) == 0)) {
+    height++;
+  }
+  const size_t alloc_size = Node::compute_alloc_size(key, height);
+  Node* node = Node::init_node(allocate(alloc_size), key, kTypeShortcut, (uint64_t) target_node, height);
+  node->log_moff = target;
+  insert(td, node);
+}
+
+Shortcut lockfree_skiplist::find_shortcut(const Key& key, const uint64_t table) {
+  Shortcut sc;
+  const Node* pred = head_;
+  for (int l = pred->height - 1; l >= 0; l--) {
+    while (true) {
+      const Node* curr = pred->next[l].load();
+      if (cmp_(curr, key) < 0) {
+        pred = curr;
+        if (pred->type() == kTypeShortcut && shortcut_table(pred->log_moff) == table) {
+          sc.node = (const void*) pred->value();
+          sc.target = pred->log_moff;
+        }
+        continue;
+      }
+      break;
+    }
+  }
+  return sc;
+}
+
+std::vector<lockfree_skiplist::Node*> lockfree_skiplist::split_points(const int n) {
+  static const size_t kNodesPerRange = 4;
+  std::vector<Node*> points;
+  if (n <= 1) {
+    return points;
+  }
+  // The lowest index level that has a few nodes per range
+  std::vector<Node*> nodes;
+  for (int l = kMaxHeight - 1; l >= 1; l--) {
+    nodes.clear();
+    for (Node* node = head_->next[l].load(); node; node = node->next[l].load()) {
+      nodes.push_back(node);
+    }
+    if (nodes.size() >= kNodesPerRange * n) {
+      break;
+    }
+  }
+  for (int i = 1; i < n; i++) {
+    const size_t j = nodes.size() * i / n;
+    if (j == 0) {
+      continue;
+    }
+    Node* node = nodes[j];
+    Node* next = node->next[0].load();
+    while (next && cmp_(next, node->key()) == 0) {
+      node = next;
+      next = node->next[0].load();
+    }
+    if (next && (points.empty() || cmp_(next, points.back()) > 0)) {
+      points.push_back(next);
+    }
+  }
+  return points;
 }
 
 lockfree_skiplist::Node* lockfree_skiplist::find(ThreadData* const td, const Key& key, const Node* pred) {
   if (pred == NULL) {
     pred = head_;
   }
-  Node* curr;
+  Node* curr = nullptr;
   int h = pred->height;
-  int cr;
+  int cr = 1;
   for (int l = h - 1; l >= 0; l--) {
     while (true) {
       curr = pred->next[l].load();
@@ -69,6 +155,53 @@ lockfree_skiplist::Node* lockfree_skiplist::find(ThreadData* const td, const Key
   return (cr == 0) ? curr : NULL;
 }
 
+const lockfree_skiplist::Node* lockfree_skiplist::find_version(const Node* node, const uint64_t snapshot) {
+  // Versions of a key are adjacent, newest first
+  const Node* curr = node;
+  while (curr && cmp_(curr, node->key()) == 0) {
+    if (curr->type() != kTypeShortcut && tag_seq(curr->tag()) <= snapshot) {
+      return curr;
+    }
+    curr = curr->next[0].load();
+  }
+  return NULL;
+}
+
+void lockfree_skiplist::find_batch(ThreadData* const td, const size_t n, const Key* keys, Node** nodes_out) {
+  struct Traversal {
+    size_t idx;
+    const Node* pred;
+    Node* curr;  // prefetched, compared in the next turn
+    int level;
+  };
+  std::vector<Traversal> active(n);
+  for (size_t i = 0; i < n; i++) {
+    auto& t = active[i];
+    t.idx = i;
+    t.pred = head_;
+    t.level = head_->height - 1;
+    t.curr = head_->next[t.level].load();
+    prefetch_node(t.curr);
+  }
+  while (!active.empty()) {
+    for (size_t i = 0; i < active.size(); ) {
+      auto& t = active[i];
+      int cr = cmp_(t.curr, keys[t.idx]);
+      if (cr < 0) {
+        t.pred = t.curr;
+      } else if (--t.level < 0) {
+        nodes_out[t.idx] = (cr == 0) ? t.curr : NULL;
+        t = active.back();
+        active.pop_back();
+        continue;
+      }
+      t.curr = t.pred->next[t.level].load();
+      prefetch_node(t.curr);
+      i++;
+    }
+  }
+}
+
 //void lockfree_skiplist::merge(lockfree_skiplist* other) {
 //  Node* pred = head_;
 //  Node* o = other->head_->next[0].load();
@@ -84,17 +217,18 @@ lockfree_skiplist::Node* lockfree_skiplist::head() {
   return head_;
 }
 
-void lockfree_skiplist::find_position(ThreadData* const td, Node* node, Node* preds[], Node* succs[], Node* pred, const int min_h) {
+void lockfree_skiplist::find_position(ThreadData* const td, Node* node, Node* preds[], Node* succs[], Node* pred, const int min_h,
+                                      const int max_h) {
   if (pred == NULL) {
     pred = head_;
   }
   Node* curr;
-  int h = pred->height;
+  int h = std::min(pred->height, max_h + 1);
   for (int l = h - 1; l >= min_h; l--) {
     while (true) {
       curr = pred->next[l].load();
       if (cmp_(curr, node) < 0) {
-        //td->visit_cnt++;
+        td->visit_cnt++;
         pred = curr;
         continue;
       }
@@ -109,12 +243,13 @@ void lockfree_skiplist::find_position(ThreadData* const td, Node* node, Node* pr
 
 casc_skiplist_iterator::casc_skiplist_iterator(lockfree_skiplist* const skiplist) : skiplist_(skiplist) {
   node_ = skiplist_->head_;
+  pred_ = skiplist_->head_;
   cmp_ = 0;
-  shortcut_ = NULL;
-  std::memset(pmem_shortcut_offsets_, 0, 8*kNumRegions);
+  visits_ = 0;
 }
 
-void casc_skiplist_iterator::seek(const Key& key, const Node* pred) {
+void casc_skiplist_iterator::seek(const Key& key, const Node* pred, const uint64_t* tables, const int num_tables) {
+  assert(num_tables <= kMaxShortcutTables);
   if (pred == NULL) {
     pred = skiplist_->head_;
   }
@@ -126,27 +261,21 @@ void casc_skiplist_iterator::seek(const Key& key, const Node* pred) {
       curr = pred->next[l].load();
       if ((cr = skiplist_->cmp_(curr, key)) < 0) {
         pred = curr;
+        visits_++;
         if (pred->type() == kTypeShortcut) {
-          shortcut_ = (Node*) pred->value();
-#ifdef BR_LOG_IUL
-          int16_t region = pred->log_moff & 0xffff;
-          uint64_t offset = pred->log_moff >> 16;
-          pmem_shortcut_offsets_[region] = offset;
-#endif
+          for (int i = 0; i < num_tables; i++) {
+            if (shortcut_table(pred->log_moff) == tables[i]) {
+              shortcuts_[i].node = (const void*) pred->value();
+              shortcuts_[i].target = pred->log_moff;
+            }
+          }
         }
-        //if (pred->has_shortcut()) {
-        //  shortcut_ = pred;
-        //  uint64_t moff = pred->pmem_shortcut_moff();
-        //  int16_t region = moff & 0xffff;
-        //  uint64_t offset = moff >> 16;
-        //  pmem_shortcut_offs_[region] = offset; 
-        //}
         continue;
       }
       break;
     }
   }
-  //pred_ = pred;
+  pred_ = pred;
   cmp_ = cr;
   node_ = curr;
 }
@@ -163,12 +292,16 @@ const casc_skiplist_iterator::Node* casc_skiplist_iterator::node() {
   return node_;
 }
 
-const casc_skiplist_iterator::Node* casc_skiplist_iterator::shortcut() {
-  return shortcut_;
+const casc_skiplist_iterator::Node* casc_skiplist_iterator::pred() {
+  return pred_;
+}
+
+size_t casc_skiplist_iterator::visits() {
+  return visits_;
 }
 
-uint64_t casc_skiplist_iterator::pmem_shortcut_offset(const int r) {
-  return pmem_shortcut_offsets_[r];
+const Shortcut& casc_skiplist_iterator::shortcut(const int i) {
+  return shortcuts_[i];
 }
 
 #endif
@@ -0,0 +1,118 @@
+#include "epoch.h"
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::atomic<bool> thread_id_used[kMaxNumEpochThreads];
+
+// Slot index of a thread, shared by all EpochManagers and released when the
+// thread exits
+struct EpochThreadId {
+  int id = -1;
+  EpochThreadId() {
+    for (int i = 0; i < kMaxNumEpochThreads; i++) {
+      bool expected = false;
+      if (!thread_id_used[i].load(std::memory_order_relaxed)
+          && thread_id_used[i].compare_exchange_strong(expected, true)) {
+        id = i;
+        return;
+      }
+    }
+    fprintf(stderr, "Too many threads for EpochManager (max: %d)\n", kMaxNumEpochThreads);
+    abort();
+  }
+  ~EpochThreadId() {
+    thread_id_used[id].store(false);
+  }
+};
+
+thread_local EpochThreadId t_epoch_thread_id;
+
+}  // namespace
+
+EpochManager::EpochManager() : epoch_(1) { }
+
+EpochManager::~EpochManager() {
+  // A freed object may retire another one
+  while (!retired_.empty()) {
+    auto free_fn = std::move(retired_.front().free_fn);
+    retired_.pop_front();
+    free_fn();
+  }
+}
+
+void EpochManager::enter() {
+  auto& slot = slots_[t_epoch_thread_id.id];
+  if (slot.depth++ == 0) {
+    slot.epoch.store(epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // The announcement must be visible before any table pointer is loaded
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+void EpochManager::exit() {
+  auto& slot = slots_[t_epoch_thread_id.id];
+  assert(slot.depth > 0);
+  if (--slot.depth == 0) {
+    slot.epoch.store(0, std::memory_order_release);
+  }
+}
+
+bool EpochManager::in_epoch() const {
+  return slots_[t_epoch_thread_id.id].depth > 0;
+}
+
+uint64_t EpochManager::min_active_epoch() {
+  uint64_t min_epoch = UINT64_MAX;
+  for (int i = 0; i < kMaxNumEpochThreads; i++) {
+    uint64_t e = slots_[i].epoch.load();
+    if (e != 0 && e < min_epoch) {
+      min_epoch = e;
+    }
+  }
+  return min_epoch;
+}
+
+void EpochManager::synchronize() {
+  const uint64_t e = epoch_.fetch_add(1);
+  // Yield first, then sleep with an exponential backoff
+  int spins = 0;
+  auto sleep = std::chrono::microseconds(1);
+  while (min_active_epoch() <= e) {
+    if (spins++ < 16) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(sleep);
+      sleep = std::min(sleep * 2, std::chrono::microseconds(1000));
+    }
+  }
+}
+
+void EpochManager::retire(std::function<void()> free_fn) {
+  std::unique_lock<std::mutex> lk(mu_);
+  retired_.push_back({ epoch_.fetch_add(1), std::move(free_fn) });
+  lk.unlock();
+  reclaim();
+}
+
+void EpochManager::reclaim() {
+  std::vector<std::function<void()>> ready;
+  // Scan the slots only after the objects are retired (unlinked)
+  std::unique_lock<std::mutex> lk(mu_);
+  const uint64_t min_epoch = min_active_epoch();
+  while (!retired_.empty() && retired_.front().epoch < min_epoch) {
+    ready.push_back(std::move(retired_.front().free_fn));
+    retired_.pop_front();
+  }
+  lk.unlock();
+  for (auto& fn : ready) {
+    fn();
+  }
+}
@@ -1,382 +1,200 @@
 #include "jobs/job_manager.h"
 
-JobManager::JobManager(const int num_workers, const double high_priority_rate) : num_workers_(num_workers) {
-  stop_ = false;
+#include <algorithm>
+
+JobManager::JobManager(const int num_workers, const double high_priority_rate)
+    : num_workers_(num_workers), num_active_(num_workers) {
   ready_.store(false);
-  int id_cnt = 0;
+  num_jobs_.store(0);
   for (int i = 0; i < num_workers_; i++) {
-    auto worker = std::make_shared<Worker>(id_cnt, this);
-    workers_.push_back(worker);
-    id_to_worker_.emplace(id_cnt, worker);
-    worker_tasks_[worker.get()] = 0;
-    //id_to_size_.emplace(id_cnt, 0);
-    id_cnt++;
+    workers_.push_back(std::make_shared<Worker>(i, this));
   }
 }
 
 void JobManager::start() {
-  //FOR_ALL_WORKERS(start());
-  main_thread_ = std::thread(std::bind(&JobManager::job_process_loop, this));
-  std::unique_lock<std::mutex> lk(mu_);
-  wait_cv_.wait(lk, [&]{ return ready_.load(); });
-}
-
-void JobManager::start_workers() {
   for (auto& w : workers_) {
     w->start();
   }
+  for (auto& w : workers_) {
+    w->busy_wait_for_ready_state();
+  }
+  ready_.store(true);
 }
 
 void JobManager::stop() {
-//flogf(stdout, "STOPSTOPSTOPSTOPSTOPSTOPSTOPSTOPSTOPSTOP");
-  for (auto& w : workers_) {
-    w->stop();
-  }
-  std::unique_lock<std::mutex> lk(mu_);
+  stopping_.store(true);
+  std::lock_guard<std::mutex> guard(park_mu_);
   stop_ = true;
-  lk.unlock();
-  cv_.notify_all();
+  park_cv_.notify_all();
+  inactive_cv_.notify_all();
 }
 
 void JobManager::wait() {
-flogf(stderr, "jq_.size() = %zu, pending = %zu, running_jobs_.size() = %zu", jq_.size(), pq_.size(), running_jobs_.size());
-  cv_.notify_all();
-  while (true) {
-    std::unique_lock<std::mutex> lk(mu_);
-    //wait_cv_.wait(lk, [&]{ return jq_.empty() && pq_.empty() && running_jobs_.empty(); });
-    wait_cv_.wait(lk, [&]{ 
-        return jq_.empty() && pq_.empty() && running_jobs_.empty(); });
-    if (/*all workers are idle=?*/true) {
-      break;
-    }
-  }
+  std::unique_lock<std::mutex> lk(wait_mu_);
+  wait_cv_.wait(lk, [&]{ return num_jobs_.load() == 0; });
 }
 
-//bool JobManager::idle() {
-//  std::lock_guard<std::mutex> guard(mu_);
-//  return jq_.empty() && running_jobs_.empty();
-//}
-
 void JobManager::join() {
   for (auto& w : workers_) {
     w->join();
   }
-  if (main_thread_.joinable()) {
-    main_thread_.join();
-  }
 }
 
 bool JobManager::enqueue(std::shared_ptr<Job> job) {
-  std::unique_lock<std::mutex> lk(mu_);
-  if (stop_) return false;
-  jq_.push_back(job);
+  if (stopping_.load()) return false;
+  assert(job->size() > 0);
+  job->set_job_manager(this);
+  num_jobs_.fetch_add(1);
+  Lane& l = lanes_[lane(job.get())];
+  std::unique_lock<std::mutex> lk(l.mu);
+  l.jobs.push_back(std::move(job));
+  std::push_heap(l.jobs.begin(), l.jobs.end(), [](const auto& a, const auto& b) {
+        return jobPriorityComparator(b, a);
+      });
   lk.unlock();
-  cv_.notify_all();
+  add_pending(1);
   return true;
 }
 
-//void JobManager::complete(std::shared_ptr<Job> job) {
-//  std::unique_lock<std::mutex> lk(mu_);
-//  cq_.push_back(job);
-//  lk.unlock();
-//  cv_.notify_all();
-//}
-
-void JobManager::complete_task(std::shared_ptr<Task> task) {
-  std::unique_lock<std::mutex> lk(mu_);
-  tcq_.push_back(task.get());
-  lk.unlock();
-  cv_.notify_all();
-}
-
 ThreadData* JobManager::worker_td(const int id) {
-  auto& wp = id_to_worker_[id];
-  if (auto sp = wp.lock()) {
-    return sp->td();
-  } else {
-    return NULL;
-  }
+  return workers_[id]->td();
 }
 
-//void JobManager::busy_wait_for_ready_state() {
-//  while (!ready_.load()) continue;
-//}
-
 std::deque<std::shared_ptr<Job>> JobManager::steal_pending_jobs() {
-  std::unique_lock<std::mutex> lk(mu_);
   std::deque<std::shared_ptr<Job>> stolen;
-  stolen.swap(pq_);
-  lk.unlock();
-  wait_cv_.notify_all();
+  for (int i = 0; i < kNumLanes; i++) {
+    std::lock_guard<std::mutex> guard(lanes_[i].mu);
+    for (auto& job : lanes_[i].jobs) {
+      stolen.push_back(std::move(job));
+    }
+    lanes_[i].jobs.clear();
+  }
+  num_pending_.fetch_sub(stolen.size());
+  if (num_jobs_.fetch_sub(stolen.size()) == stolen.size()) {
+    std::lock_guard<std::mutex> guard(wait_mu_);
+    wait_cv_.notify_all();
+  }
   return stolen;
 }
-//void JobManager::job_process_loop() {
-//  FOR_ALL_WORKERS(busy_wait_for_ready_state());
-//  ready_.store(true);
-//  while (true) {
-//    std::unique_lock<std::mutex> lk(mu_);
-//    cv_.wait(lk, [&]{ return stop_ || !jq_.empty() || !cq_.empty(); });
-//    if (stop_) break;
-//     
-//    std::deque<std::shared_ptr<Job>> jobs;
-//    std::deque<std::shared_ptr<Job>> comp_jobs;
-//    jobs.swap(jq_);
-//    for (auto& j : jobs) {
-//      running_jobs_.insert(j);
-//    }
-//    comp_jobs.swap(cq_);
-//    lk.unlock();
-//
-//    // Process incoming jobs
-//    std::sort(jobs.begin(), jobs.end(), jobPriorityComparator);
-//    for (auto& job : jobs) {
-//      if (job->level() < 0) {
-//        int remain = job->size();
-//        int task_cnt = 0;
-//        while (remain > 0) {
-//          Worker* worker = NULL;
-//          for (auto& w : non_bound_workers_) {
-//            if (!worker || w->size() < worker->size()) {
-//              worker = w.get();
-//            }
-//          }
-//          for (auto& w : high_priority_workers_) {
-//            if (!worker || w->size() < worker->size()) {
-//              worker = w.get();
-//            }
-//          }
-//          worker->enqueue(job->task(task_cnt++));
-//          remain--;
-//        }
-//      } else {
-//        int remain = job->size();
-//        int task_cnt = 0;
-//        //PARALLEL EXECUTION NOT WORKING
-//        //while (remain >= kNumRegions) {
-//        //  int non_empty_regions = 0;
-//        //  for (int i = 0; i < kNumRegions; i++) {
-//        //    if (workers_[i].size() > 0) {
-//        //      non_empty_regions++;
-//        //    }
-//        //  }
-//        //  if (non_empty_regions < kNumRegions) {
-//        //    break;
-//        //  }
-//        //  for (int i = 0; i < kNumRegions; i++) {
-//        //    Worker* worker = NULL;
-//        //    for (auto& w : workers_[i]) {
-//        //      if (!worker || w->size() < worker->size()) {
-//        //        worker = w.get();
-//        //      }
-//        //    }
-//        //    worker->enqueue(job->task(task_cnt++));
-//        //    remain--;
-//        //  }
-//        //}
-//        if (remain > 0) {
-//          if (non_bound_workers_.size() > 0) {
-//            while (remain > 0) {
-//              Worker* worker = NULL;
-//              for (auto& w : non_bound_workers_) {
-//                if (!worker || w->size() < worker->size()) {
-//                  worker = w.get();
-//                }
-//              }
-//              worker->enqueue(job->task(task_cnt++));
-//              remain--;
-//            }
-//          } else {
-//            std::vector<Worker*> workers;
-//            for (int i = 0; i < kNumRegions; i++) {
-//              for (int j = 0; j < workers_[i].size(); j++) {
-//                workers.push_back(workers_[i][j].get());
-//              }
-//            }
-//            while (remain > 0) {
-//              Worker* worker = NULL;
-//              for (auto& w : workers) {
-//                if (!worker || w->size() < worker->size()) {
-//                  worker = w;
-//                }
-//              }
-//              worker->enqueue(job->task(task_cnt++));
-//              remain--;
-//            }
-//          }
-//        }
-//      }
-//    }
-//    // Process completed jobs
-//    for (auto& j : comp_jobs) {
-//      j->callback();
-//    }
-//    lk.lock();
-//    for (auto& j : comp_jobs) {
-//      running_jobs_.erase(j);
-//    }
-//    lk.unlock();
-//    wait_cv_.notify_all();
-//  }
-//}
-
-// Wake up when
-//  1. job submission
-//  2. task completion
-//  3. stop signal
-//  4. job migration signal
-// Responsible for
-//  1. task scheduling
-void JobManager::job_process_loop() {
 
-  start_workers();
-
-  ready_.store(true);
-  wait_cv_.notify_all();
-
-  std::vector<Worker*> workers;
-  for (auto& w : workers_) {
-    workers.push_back(w.get());
-  }
+void JobManager::set_num_active_workers(const int n) {
+  num_active_.store(std::min(std::max(n, 1), num_workers_));
+  std::lock_guard<std::mutex> guard(park_mu_);
+  inactive_cv_.notify_all();
+}
 
+void JobManager::work(Worker* w) {
   while (true) {
-    std::unique_lock<std::mutex> lk(mu_);
-    cv_.wait(lk, [&] {
-          return stop_ || !jq_.empty() || !tcq_.empty();
-        });
-    if (stop_) {
-      break;
-    }
-    for (auto& j : jq_) {
-      pq_.push_back(j);
-    }
-    jq_.clear();
-    //std::deque<std::shared_ptr<Job>> jobs(pq_);
-    std::deque<Task*> tasks;
-    tasks.swap(tcq_);
-    lk.unlock();
-
-    // Process requests
-
-    // Task Completion
-    std::unordered_set<Job*> comp_jobs;
-    for (auto& t : tasks) {
-      auto wit = task_to_worker_.find(t);
-      assert(wit != task_to_worker_.end());
-      worker_tasks_[wit->second]--;
-      task_to_worker_.erase(wit);
-      size_t num_comps = t->job()->fetch_add_completion(1);
-      if (num_comps + 1 == t->job()->size()) {
-        comp_jobs.insert(t->job());
+    if (w->id() >= num_active_.load(std::memory_order_relaxed) && !stopping_.load()) {
+      std::unique_lock<std::mutex> lk(park_mu_);
+      // Pass on a wakeup meant for an active worker
+      if (num_pending_.load() > 0) {
+        park_cv_.notify_one();
       }
+      inactive_cv_.wait(lk, [&]{ return stop_ || w->id() < num_active_.load(); });
+      continue;
     }
-    for (auto& j : comp_jobs) {
-      j->callback();
+    Task* task = find_task(w);
+    if (task) {
+      run_task(w, task);
+      continue;
     }
-    lk.lock();
-    auto iter = running_jobs_.begin();
-    while (iter != running_jobs_.end()) {
-      if (comp_jobs.find((*iter).get()) != comp_jobs.end()) {
-        iter = running_jobs_.erase(iter);
-      } else {
-        iter++;
+    std::unique_lock<std::mutex> lk(park_mu_);
+    if (stop_) {
+      // Jobs not started are left, but the tasks of started ones run
+      bool queued = false;
+      for (auto& v : workers_) {
+        for (int i = 0; i < kNumLanes; i++) {
+          queued |= !v->deque(i)->empty();
+        }
+      }
+      if (!queued) {
+        break;
       }
+      continue;
     }
-    lk.unlock();
+    park_cv_.wait(lk, [&]{ return stop_ || num_pending_.load() > 0; });
+  }
+}
 
-    // Job Schedule
-    //std::sort(jobs.begin(), jobs.end(), jobPriorityComparator);
-    std::sort(workers.begin(), workers.end(), [&](const auto& a, const auto& b) {
-          return worker_tasks_[a] < worker_tasks_[b];
-        });
-    int idle_cnt = 0;
-    for (auto& w : workers) {
-      if (worker_tasks_[w] == 0) {
-        idle_cnt++;
-      }
+Task* JobManager::find_task(Worker* w) {
+  for (int l = 0; l < kNumLanes; l++) {
+    Task* task = w->deque(l)->pop();
+    if (task) {
+      return task;
     }
-    lk.lock();
-    std::sort(pq_.begin(), pq_.end(), jobPriorityComparator);
-    std::vector<std::shared_ptr<Job>> jobs;
-    for (int i = 0; i < idle_cnt && !pq_.empty(); i++) {
-      jobs.push_back(pq_.front());
-      pq_.pop_front();
+    for (int i = 1; i < num_workers_; i++) {
+      Worker* v = workers_[(w->next_victim + i) % num_workers_].get();
+      if (v == w || v->deque(l)->empty()) {
+        continue;
+      }
+      task = v->deque(l)->steal();
+      if (task) {
+        w->next_victim = v->id();
+        return task;
+      }
     }
-    running_jobs_.insert(jobs.begin(), jobs.end());
-    lk.unlock();
-
-    // Schedule all tasks of a job at least one worker is idle
-    auto it = jobs.begin();
-    auto worker_iter = workers.begin();
-    while (it != jobs.end()) {
-      auto& job = *it;
-      auto& w = *worker_iter;
-      job->set_job_manager(this);
-      w->enqueue(job->task(0));
-      task_to_worker_[job->task(0).get()] = w;
-      worker_tasks_[w]++;
-      it++;
+    if (!stopping_.load() && start_job(w, l)) {
+      task = w->deque(l)->pop();
+      if (task) {
+        return task;
+      }
     }
-
-    wait_cv_.notify_all();
   }
-flogf(stderr, "TERMINATING!");
-
-  wrapup_running_jobs();
-
-  stop_workers();
+  return NULL;
 }
 
-void JobManager::wrapup_running_jobs() {
-  // Wrapping up remaining tasks before stop
-  // if there are running jobs, wait
-  if (!jq_.empty()) {
-    for (auto& j : jq_) {
-      pq_.push_back(j);
+bool JobManager::start_job(Worker* w, const int l) {
+  std::shared_ptr<Job> job;
+  {
+    std::lock_guard<std::mutex> guard(lanes_[l].mu);
+    auto& jobs = lanes_[l].jobs;
+    if (jobs.empty()) {
+      return false;
     }
-    jq_.clear();
+    std::pop_heap(jobs.begin(), jobs.end(), [](const auto& a, const auto& b) {
+          return jobPriorityComparator(b, a);
+        });
+    job = std::move(jobs.back());
+    jobs.pop_back();
+  }
+  // The job becomes its tasks, the first one on top for this worker to pop
+  const int n = job->size();
+  for (int i = n - 1; i >= 0; i--) {
+    auto task = job->task(i);
+    task->hold_job(job);
+    w->deque(l)->push(task.get());
   }
-  if (!running_jobs_.empty()) {
-    while (true) {
-      std::unique_lock<std::mutex> lk(mu_);
-      cv_.wait(lk, [&] { return !tcq_.empty(); });
-      std::deque<Task*> tasks;
-      tasks.swap(tcq_);
-      lk.unlock();
+  add_pending(n - 1);
+  return true;
+}
 
-      std::unordered_set<Job*> comp_jobs;
-      for (auto& t : tasks) {
-        auto wit = task_to_worker_.find(t);
-        assert(wit != task_to_worker_.end());
-        worker_tasks_[wit->second]--;
-        task_to_worker_.erase(wit);
-        size_t num_comps = t->job()->fetch_add_completion(1);
-        if (num_comps + 1 == t->job()->size()) {
-          comp_jobs.insert(t->job());
-        }
-      }
-      //lk.lock();
-      auto iter = running_jobs_.begin();
-      while (iter != running_jobs_.end()) {
-        if (comp_jobs.find((*iter).get()) != comp_jobs.end()) {
-          running_jobs_.erase(iter);
-        }
-        iter++;
-      }
-      //std::erase_if(running_jobs_, [&comp_jobs](auto const& sp) {
-      //      return comp_jobs.contains(sp.get());
-      //    });
-      //lk.unlock();
-      if (running_jobs_.size() == 0) {
-        break;
-      }
-      //lk.unlock();
+void JobManager::run_task(Worker* w, Task* task) {
+  num_pending_.fetch_sub(1);
+  std::shared_ptr<Job> job = task->release_job();
+  job->before();
+  task->run(w->td());
+  task->callback(w->td());
+  if ((size_t) job->fetch_add_completion(1) + 1 == job->size()) {
+    // The last task of the job
+    job->callback();
+    if (num_jobs_.fetch_sub(1) == 1) {
+      std::lock_guard<std::mutex> guard(wait_mu_);
+      wait_cv_.notify_all();
     }
   }
 }
 
-void JobManager::stop_workers() {
-  for (auto& w : workers_) {
-    w->stop();
+void JobManager::add_pending(const int n) {
+  if (n <= 0) {
+    return;
+  }
+  num_pending_.fetch_add(n);
+  std::lock_guard<std::mutex> guard(park_mu_);
+  if (n == 1) {
+    park_cv_.notify_one();
+  } else {
+    park_cv_.notify_all();
   }
 }
 
@@ -385,9 +203,7 @@ bool JobManager::jobPriorityComparator(const std::shared_ptr<Job>& a, const std:
       || (a->level() == b->level() && a->seq_num() > b->seq_num());
 }
 
-bool JobManager::workerComparator(Worker* a, Worker* b) {
-  if (b == NULL) {
-    return true;
-  }
-  return a->size() < b->size();
+int JobManager::lane(Job* job) {
+  // Levels from -1 (memtable flush) to kMaxNumPmemLevels (background jobs)
+  return std::min(std::max(job->level() + 1, 0), kNumLanes - 1);
 }
@@ -1,5 +1,9 @@
 #include "log.h"
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
 // LogBlock impl.
 
 LogBlock::LogBlock(const int r) : r_(r) { }
@@ -50,6 +54,7 @@ void Log::init(const int s) {
     LogBlock* nb = new (buf) LogBlock(i);  // new block
     nb->load(nbb);
     blocks_[i] = nb;
+    prepare_spare(s, i);
   }
 }
 
@@ -68,54 +73,119 @@ void Log::load(TOID(LogBase) log_base[]) {
     LogBlock* nb = new (buf) LogBlock(i);
     nb->load(bb);
     blocks_[i] = nb;
+    // A spare left by a crash is the last block if it was linked, otherwise
+    // it is kept as the spare
+    TOID(LogBlockBase) sbb = D_RW(log_base_[i])->spare;
+    if (TOID_EQUALS(sbb, bb)) {
+      TOID_ASSIGN(D_RW(log_base_[i])->spare, OID_NULL);
+      pmemobj_persist(pmemobj_pool_by_ptr(D_RW(log_base_[i])), &(D_RW(log_base_[i])->spare),
+                      sizeof(TOID(LogBlockBase)));
+    } else if (!TOID_IS_NULL(sbb)) {
+      void* sbuf = malloc(sizeof(LogBlock));
+      LogBlock* sb = new (sbuf) LogBlock(i);
+      sb->load(sbb);
+      spare_[i] = sb;
+    }
   }
 }
 
-uint64_t Log::write_WAL(ThreadData* td, const int s, const std::string_view& key, const uint64_t value) {
-  const int r = td->region;
-  // 8-byte for seq_num, value type and etc., which are not implemented yet.
-#ifndef BR_STRING_KV
-  const size_t my_size = 3 * sizeof(uint64_t);  // key, tag, value
-#else
-  const size_t my_size = sizeof(uint32_t) + key.size() + sizeof(uint64_t) + sizeof(uint64_t);  // key_len, key, tag, value
-#endif
+void Log::prepare_spare(const int s, const int r) {
+  std::lock_guard<std::mutex> spare_guard(spare_mu_);
+  {
+    std::lock_guard<std::mutex> guard(mu_);
+    if (spare_[r] != NULL) {
+      return;
+    }
+  }
+  // Allocated into the root slot, which is empty while spare_[r] is NULL
+  POBJ_ZALLOC(lpop[s][r], &(D_RW(log_base_[r])->spare), LogBlockBase, sizeof(LogBlockBase) + (kLogBlockSize - 1));
+  void* buf = malloc(sizeof(LogBlock));
+  LogBlock* nb = new (buf) LogBlock(r);
+  nb->load(D_RW(log_base_[r])->spare);
+  std::lock_guard<std::mutex> guard(mu_);
+  spare_[r] = nb;
+}
+
+LogBlock* Log::get_available_log_block(ThreadData* td, const int s,
+                                       const int r, const size_t my_size,
+                                       size_t* before) {
   LogBlock* b = blocks_[r];
-  size_t before;
   while (true) {
     if (b == NULL) {
       b = blocks_[r];
       continue;
     }
-    before = b->fetch_add_size(my_size);
-    if (my_size + before > kLogBlockSize) {
+    *before = b->fetch_add_size(my_size);
+    if (my_size + *before > kLogBlockSize) {
+      bool refill = false;
       std::unique_lock<std::mutex> lk(mu_);
       if (b == blocks_[r]) {
-        TOID(LogBlockBase) nbb;
-        POBJ_ZALLOC(lpop[s][r], &nbb, LogBlockBase, sizeof(LogBlockBase) + (kLogBlockSize - 1));
-        LogBlockBase* nbbp = D_RW(nbb);
-        nbbp->p = 0;
-        nbbp->npp = 0;
-        D_RW(b->base())->next = nbb;
+        // Link the spare block prepared in advance
+        LogBlock* nb = spare_[r];
+        if (nb == NULL) {
+          // The refill is behind. Allocate outside of the critical section
+          // and retry.
+          lk.unlock();
+          prepare_spare(s, r);
+          continue;
+        }
+        spare_[r] = NULL;
+        D_RW(b->base())->next = nb->base();
         pmemobj_persist(lpop[s][r], &(D_RW(b->base())->next), sizeof(TOID(LogBlockBase)));
-        void* buf = malloc(sizeof(LogBlock));
-        LogBlock* nb = new (buf) LogBlock(r);
-        nb->load(nbb);
+        // Linked: load() clears the slot if a crash comes first
+        TOID_ASSIGN(D_RW(log_base_[r])->spare, OID_NULL);
+        pmemobj_persist(lpop[s][r], &(D_RW(log_base_[r])->spare), sizeof(TOID(LogBlockBase)));
         //std::atomic_store(&blocks_[r], nb);
         blocks_[r] = nb;
-        b = blocks_[r];
-        //b->fetch_add_size(my_size);
-      } else {
-        b = blocks_[r];
+        refill = true;
       }
+      b = blocks_[r];
       lk.unlock();
+      if (refill) {
+        auto refill_fn = [this, s, r]{ prepare_spare(s, r); };
+        if (background_fn_) {
+          background_fn_(refill_fn);
+        } else {
+          refill_fn();
+        }
+      }
       continue;
     }
     break;
   }
-  // Write log entry
-  uint64_t dummy_tag = 0x1;
-  void* begin = b->data() + before;
-  char* p = (char*) begin;
+  return b;
+}
+
+char* Log::reserve(ThreadData* td, const int s, const int r, const size_t my_size) {
+  size_t before;
+  if (my_size > kLogChunkSize) {
+    LogBlock* b = get_available_log_block(td, s, r, my_size, &before);
+    return b->data() + before;
+  }
+  LogTail& tail = td->log_tail[s];
+  if (tail.region != r || tail.cur + my_size > tail.end) {
+    // The remainder of the current chunk is left unused.
+    LogBlock* b = get_available_log_block(td, s, r, kLogChunkSize, &before);
+    tail.cur = b->data() + before;
+    tail.end = tail.cur + kLogChunkSize;
+    tail.region = r;
+  }
+  char* begin = tail.cur;
+  tail.cur += my_size;
+  return begin;
+}
+
+size_t Log::WAL_entry_size(const std::string_view& key, const uint64_t value) {
+#ifndef BR_STRING_KV
+  return 3 * sizeof(uint64_t);  // key, tag, value
+#else
+  size_t inline_size = (value & kInlineValueFlag) ? (value & ~kInlineValueFlag) : 0;
+  return sizeof(uint32_t) + key.size() + sizeof(uint64_t) + sizeof(uint64_t) + inline_size;  // key_len, key, tag, value, inline value
+#endif
+}
+
+void Log::write_WAL_entry(char* p, const std::string_view& key, const uint64_t tag, const uint64_t value,
+                          const std::string_view& inline_value) {
 #ifndef BR_STRING_KV
   *((uint64_t*) p) = *((uint64_t*) key.data());
   p += 8;
@@ -125,81 +195,213 @@ uint64_t Log::write_WAL(ThreadData* td, const int s, const std::string_view& key
   memcpy(p, key.data(), key.length());
   p += key.length();
 #endif
-  *((uint64_t*) p) = dummy_tag;
+  *((uint64_t*) p) = tag;
   p += 8;
   *((uint64_t*) p) = value;
-  pmemobj_persist(lpop[s][r], begin, my_size);
+#ifdef BR_STRING_KV
+  p += 8;
+  if (value & kInlineValueFlag) {
+    memcpy(p, inline_value.data(), inline_value.length());
+  }
+#endif
+}
+
+uint64_t Log::write_WAL(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                        const uint64_t tag, const std::string_view& inline_value) {
+  const int r = td->region;
+  const size_t my_size = WAL_entry_size(key, value);
+  // Write log entry
+  void* begin = reserve(td, s, r, my_size);
+  write_WAL_entry((char*) begin, key, tag, value, inline_value);
+  persist_entries(td, s, r, (char*) begin, my_size, 1);
   uint64_t log_moff = (((uintptr_t) begin - (uintptr_t) lpop[s][r]) << 16) | r;
   return log_moff;
 }
 
-uint64_t Log::write_IUL(ThreadData* td, const int s, const std::string_view& key, const uint64_t value) {
+void Log::write_WAL_batch(ThreadData* td, const int s, const size_t n,
+                          const std::string_view* keys, const uint64_t* values, const uint64_t* tags,
+                          const std::string_view* inline_values, uint64_t* log_moffs_out) {
   const int r = td->region;
-  // Random Height
+  size_t i = 0;
+  while (i < n) {
+    // Entries [i, j) share a single reservation. A range never spans two
+    // blocks, so a batch larger than a block is split.
+    size_t range_size = 0;
+    size_t j = i;
+    while (j < n && (j == i || range_size + WAL_entry_size(keys[j], values[j]) <= kLogChunkSize)) {
+      range_size += WAL_entry_size(keys[j], values[j]);
+      j++;
+    }
+    char* begin = reserve(td, s, r, range_size);
+    char* p = begin;
+    for (size_t k = i; k < j; k++) {
+      write_WAL_entry(p, keys[k], tags[k], values[k], inline_values ? inline_values[k] : std::string_view());
+      log_moffs_out[k] = (((uintptr_t) p - (uintptr_t) lpop[s][r]) << 16) | r;
+      p += WAL_entry_size(keys[k], values[k]);
+    }
+    persist_entries(td, s, r, begin, range_size, j - i);
+    i = j;
+  }
+}
+
+int Log::random_height(Random& rnd) {
   static const unsigned int kBranching = 4;
   const int bb = (kBranching > (unsigned int) kNumRegions) ? kBranching / kNumRegions : 1;
   int height = 1;
-  if (height < kMaxHeight && ((td->rnd.Next() % bb) == 0)) {
+  if (height < kMaxHeight && ((rnd.Next() % bb) == 0)) {
     height++;
-    while (height < kMaxHeight && ((td->rnd.Next() % kBranching) == 0)) {
+    while (height < kMaxHeight && ((rnd.Next() % kBranching) == 0)) {
       height++;
     }
   }
-  // Compute Allocation Size
+  return height;
+}
+
+size_t Log::IUL_entry_size(const std::string_view& key, const int height, const uint64_t value) {
 #ifndef BR_STRING_KV
-  const size_t my_size = sizeof(UINT64_pnode) + (height - 1) * 8;
+  return UINT64_pnode::compute_alloc_size(0, height);
 #else
-  const size_t my_size = VARSTR_pnode::compute_alloc_size(key, height);
+  return VARSTR_pnode::compute_alloc_size(key, height, value);
 #endif
-  LogBlock* b = blocks_[r];
-  size_t before;
-  while (true) {
-    if (b == NULL) {
-      b = blocks_[r];
-      continue;
-    }
-    before = b->fetch_add_size(my_size);
-    if (my_size + before > kLogBlockSize) {
-      std::unique_lock<std::mutex> lk(mu_);
-      if (b == blocks_[r]) {
-        TOID(LogBlockBase) nbb;
-        POBJ_ZALLOC(lpop[s][r], &nbb, LogBlockBase, sizeof(LogBlockBase) + (kLogBlockSize - 1));
-        LogBlockBase* nbbp = D_RW(nbb);
-        nbbp->p = 0;
-        nbbp->npp = 0;
-        D_RW(b->base())->next = nbb;
-        pmemobj_persist(lpop[s][r], &(D_RW(b->base())->next), 16);
-        void* buf = malloc(sizeof(LogBlock));
-        LogBlock* nb = new (buf) LogBlock(r);
-        nb->load(nbb);
-        //std::atomic_store(&(blocks_[r]), nb);
-        blocks_[r] = nb;
-        b = blocks_[r];
-      } else {
-        b = blocks_[r];
-      }
-      lk.unlock();
-      continue;
-    }
-    break;
-  }
-  // Write log entry
-  uint64_t dummy_tag = kTypeValue;
-  void* begin = b->data() + before;
-  char* p = (char*) begin;
+}
+
+void Log::write_IUL_entry(char* p, const std::string_view& key, const uint64_t tag, const uint64_t value, const int height,
+                          const std::string_view& inline_value) {
 #ifndef BR_STRING_KV
   *((uint64_t*) p) = *((uint64_t*) key.data());
   p += 8;
-  *((uint64_t*) p) = dummy_tag;
+  *((uint64_t*) p) = tag;
   p += 8;
   *((uint64_t*) p) = value;
   p += 8;
   *((int*) p) = height;
 #else
-  VARSTR_pnode::init_node(p, key, dummy_tag, value, height, false);
-#endif 
-  pmemobj_persist(lpop[s][r], begin, my_size - (height * 8));
+  VARSTR_pnode::init_node(p, key, tag, value, height, false, inline_value);
+#endif
+}
+
+uint64_t Log::write_IUL(ThreadData* td, const int s, const std::string_view& key, const uint64_t value,
+                        const uint64_t tag, const std::string_view& inline_value) {
+  const int r = td->region;
+  // Random Height
+  int height = random_height(td->rnd);
+  // Compute Allocation Size
+  const size_t my_size = IUL_entry_size(key, height, value);
+  // Write log entry
+  void* begin = reserve(td, s, r, my_size);
+  write_IUL_entry((char*) begin, key, tag, value, height, inline_value);
+  persist_entries(td, s, r, (char*) begin, my_size - (pNode::num_links(height) * 8), 1);
   uint64_t log_moff = (((uintptr_t) begin - (uintptr_t) lpop[s][r]) << 16) | r;
   return log_moff;
 }
 
+void Log::write_IUL_batch(ThreadData* td, const int s, const size_t n,
+                          const std::string_view* keys, const uint64_t* values, const uint64_t* tags,
+                          const std::string_view* inline_values, uint64_t* log_moffs_out) {
+  const int r = td->region;
+  std::vector<int> heights(n);
+  for (size_t k = 0; k < n; k++) {
+    heights[k] = random_height(td->rnd);
+  }
+  std::vector<std::pair<char*, size_t>> headers;
+  size_t i = 0;
+  while (i < n) {
+    size_t range_size = 0;
+    size_t j = i;
+    while (j < n && (j == i || range_size + IUL_entry_size(keys[j], heights[j], values[j]) <= kLogChunkSize)) {
+      range_size += IUL_entry_size(keys[j], heights[j], values[j]);
+      j++;
+    }
+    char* p = reserve(td, s, r, range_size);
+    headers.clear();
+    for (size_t k = i; k < j; k++) {
+      const size_t my_size = IUL_entry_size(keys[k], heights[k], values[k]);
+      write_IUL_entry(p, keys[k], tags[k], values[k], heights[k],
+                      inline_values ? inline_values[k] : std::string_view());
+      // next[] is filled at flush time, so only the header needs persisting.
+      headers.emplace_back(p, my_size - (pNode::num_links(heights[k]) * 8));
+      log_moffs_out[k] = (((uintptr_t) p - (uintptr_t) lpop[s][r]) << 16) | r;
+      p += my_size;
+    }
+    persist_entries(td, s, r, headers.data(), headers.size(), j - i);
+    i = j;
+  }
+}
+
+void Log::persist_entries(ThreadData* td, const int s, const int r,
+                          char* begin, const size_t size, const size_t num_entries) {
+  const std::pair<char*, size_t> range(begin, size);
+  persist_entries(td, s, r, &range, 1, num_entries);
+}
+
+void Log::persist_entries(ThreadData* td, const int s, const int r,
+                          const std::pair<char*, size_t>* ranges, const size_t num_ranges,
+                          const size_t num_entries) {
+  if (kLogGroupCommitMode == 0) {
+    for (size_t i = 0; i < num_ranges; i++) {
+      pmemobj_flush(lpop[s][r], ranges[i].first, ranges[i].second);
+    }
+    pmemobj_drain(lpop[s][r]);
+    counter[td->cpu].log_sync_cnt++;
+    counter[td->cpu].log_entry_cnt += num_entries;
+  } else {
+    group_commit(td, s, r, ranges, num_ranges, num_entries);
+  }
+}
+
+void Log::group_commit(ThreadData* td, const int s, const int r,
+                       const std::pair<char*, size_t>* ranges, const size_t num_ranges,
+                       const size_t num_entries) {
+  auto& gc = gc_[r];
+  // Publish
+  std::unique_lock<std::mutex> lk(gc.mu);
+  uint64_t ticket = gc.next_ticket++;
+  gc.pending.insert(gc.pending.end(), ranges, ranges + num_ranges);
+  gc.pending_entries += num_entries;
+  const bool group_full = (gc.pending_entries >= kLogGroupCommitMaxEntries);
+  lk.unlock();
+  if (group_full && kLogGroupCommitWindow > 0) {
+    gc.cv.notify_one();
+  }
+
+  while (gc.durable_ticket.load() < ticket) {
+    bool expected = false;
+    if (gc.leader.load() || !gc.leader.compare_exchange_strong(expected, true)) {
+      std::this_thread::yield();
+      continue;
+    }
+    std::vector<std::pair<char*, size_t>> group;
+    lk.lock();
+    // Leader: give followers a chance to join the group
+    if (kLogGroupCommitWindow > 0) {
+      gc.cv.wait_for(lk, std::chrono::microseconds(kLogGroupCommitWindow),
+                     [&]{ return gc.pending_entries >= kLogGroupCommitMaxEntries; });
+    }
+    group.swap(gc.pending);
+    gc.pending_entries = 0;
+    uint64_t last_ticket = gc.next_ticket - 1;
+    lk.unlock();
+
+    if (!group.empty()) {
+      // Coalesce adjacent ranges (entries reserved back-to-back in a block)
+      std::sort(group.begin(), group.end());
+      char* rbegin = group[0].first;
+      char* rend = rbegin + group[0].second;
+      for (size_t i = 1; i < group.size(); i++) {
+        if (group[i].first <= rend) {
+          rend = std::max(rend, group[i].first + group[i].second);
+        } else {
+          pmemobj_flush(lpop[s][r], rbegin, rend - rbegin);
+          rbegin = group[i].first;
+          rend = rbegin + group[i].second;
+        }
+      }
+      pmemobj_flush(lpop[s][r], rbegin, rend - rbegin);
+      pmemobj_drain(lpop[s][r]);
+      counter[td->cpu].log_sync_cnt++;
+    }
+    gc.durable_ticket.store(last_ticket);
+    gc.leader.store(false);
+  }
+  counter[td->cpu].log_entry_cnt += num_entries;
+}
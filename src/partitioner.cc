@@ -0,0 +1,72 @@
+#include "partitioner.h"
+
+#include <algorithm>
+
+#include "common.h"
+#include "murmur3.h"
+
+namespace {
+
+// Order-preserving 8-byte prefix of a key
+inline uint64_t key_prefix(const std::string_view& key) {
+#ifndef BR_STRING_KV
+  return *((uint64_t*) key.data());
+#else
+  return key_num(key);
+#endif
+}
+
+// Finalizer of MurmurHash3 (x64). Differs from the hash of the lookup cache,
+// which is indexed within a shard.
+inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+}  // namespace
+
+int HashPartitioner::shard(const std::string_view& key) const {
+  if (num_shards_ == 1) {
+    return 0;
+  }
+#ifndef BR_STRING_KV
+  uint64_t h = fmix64(*((uint64_t*) key.data()));
+#else
+  uint32_t h;
+  static const uint32_t seed = 0x5eed5a4d;
+  MurmurHash3_x86_32(key.data(), key.length(), seed, (void*) &h);
+#endif
+  return h % num_shards_;
+}
+
+RangePartitioner::RangePartitioner(const int num_shards, const std::vector<uint64_t>& split_points)
+    : num_shards_(num_shards), split_points_(split_points) {
+  if (!split_points_.empty()
+      && (split_points_.size() != (size_t) num_shards_ - 1
+          || !std::is_sorted(split_points_.begin(), split_points_.end()))) {
+    flogf(stderr, "shard_split_points needs %d sorted keys (current: %zu)", num_shards_ - 1, split_points_.size());
+    exit(0);
+  }
+}
+
+int RangePartitioner::shard(const std::string_view& key) const {
+  uint64_t prefix = key_prefix(key);
+  if (split_points_.empty()) {
+    return (int) (((unsigned __int128) prefix * num_shards_) >> 64);
+  }
+  return std::upper_bound(split_points_.begin(), split_points_.end(), prefix) - split_points_.begin();
+}
+
+std::shared_ptr<Partitioner> new_partitioner(const DBConf& conf) {
+  if (conf.partitioner) {
+    return conf.partitioner;
+  }
+  if (conf.partitioner_mode == 1) {
+    return std::make_shared<RangePartitioner>(conf.num_shards, conf.shard_split_points);
+  }
+  return std::make_shared<HashPartitioner>(conf.num_shards);
+}
@@ -1,50 +1,177 @@
 #include "pmemtable.h"
 
-PmemTable::PmemTable(std::shared_ptr<PmemTable> next_table) {
+static std::atomic<uint64_t> next_table_id{1};
+
+PmemTable::PmemTable(std::shared_ptr<PmemTable> next_table)
+    : skiplist_(NULL), id_(next_table_id.fetch_add(1)), reclaimer_(std::make_shared<Reclaimer>()) {
+  ref_cnt_.store(0);
+  state_.store(0);
   if (next_table) {
     next_ = next_table;
   }
 }
 
+uint64_t pmem_table_id(const PmemTable* table) {
+  return table->id();
+}
+
+PmemTable::~PmemTable() {
+  delete filter_.load();
+  delete learned_index_.load();
+  delete shortcuts_.load();
+}
+
+PmemTable::Reclaimer::~Reclaimer() {
+  if (!skiplist || !merged_down) {
+    delete skiplist;
+    return;
+  }
+#ifdef BR_STRING_KV
+  if (reclaim_nodes) {
+    skiplist->evict_cached();
+  }
+#endif
+  // Zipped nodes keep their towers in the upper table, which stays pinned
+  // until they are freed
+  auto free_fn = [skiplist=skiplist, level=level, reclaim_nodes=reclaim_nodes, upper=upper]{
+        size_t freed = skiplist->reclaim(reclaim_nodes, /*reclaim_towers=*/upper == nullptr);
+        pmem_reclaimed_bytes[level].fetch_add(freed);
+        delete skiplist;
+      };
+  if (retire_fn) {
+    retire_fn(free_fn);
+  } else {
+    free_fn();
+  }
+}
+
 void PmemTable::init(PMEMobjpool* pops[]) {
   skiplist_ = new lockfree_pskiplist(pops);
   skiplist_->init();
+  reclaimer_->skiplist = skiplist_;
   ref_cnt_.store(0);
   size_.store(0);
   state_.store(0);
 }
 
-void PmemTable::add(ThreadData* td, const int r, const Key& key, const uint64_t value) {
-  auto new_node = skiplist_->new_node(td, r, key, value);
+void PmemTable::add(ThreadData* td, const int r, const Key& key, const uint64_t value,
+                    const uint64_t tag, const std::string_view& inline_value) {
+  auto new_node = skiplist_->new_node(td, r, key, value, 0, tag, inline_value);
   skiplist_->insert(td, r, new_node, NULL, true);
 }
 
-bool PmemTable::get(ThreadData* td, const Key& key, std::string* value_out) {
-  auto node = skiplist_->find(td, td->region, key);
+bool PmemTable::get(ThreadData* td, const Key& key, std::string_view* value_out, bool* deleted,
+                    const uint64_t snapshot, const Node** node_out) {
+  const Node* node;
+#ifndef BR_STRING_KV
+  if (const LearnedIndex* index = learned_index()) {
+    // A short walk of the bottom level from the sample before the key
+    const Node* pred = (const Node*) index->find_pred(key);
+    node = skiplist_->find_braided(td, key, pred ? pred : skiplist_->head(kPrimaryRegion));
+    counter[td->cpu].learned_index_cnt++;
+  } else {
+    node = skiplist_->find(td, td->region, key);
+  }
+#else
+  node = skiplist_->find(td, td->region, key);
+#endif
+  if (node && snapshot != kMaxSequenceNumber) {
+    node = skiplist_->find_version(node, snapshot);
+  }
   if (node) {
+    if (node_out) *node_out = node;
+    if (node->type() == kTypeDeletion) {
+      if (deleted) *deleted = true;
+      return true;
+    }
     if (value_out) {
-      uint64_t value = node->value();
-      value_out->assign((char*) &value, 8);
+      *value_out = node->value_view();
     }
     return true;
   }
   return false;
 }
 
-void PmemTable::merge_WAL(ThreadData* td, const unsigned long rmask, MemTable* other) {
-  skiplist_->merge_WAL(td, rmask, other->skiplist());
+// Shortcuts are few compared to the nodes of a table
+static constexpr size_t kShortcutArenaBlockSize = 64*1024;
+
+void PmemTable::add_shortcut(ThreadData* td, const Key& key, const void* target_node, const uint64_t target) {
+  lockfree_skiplist* shortcuts = shortcuts_.load(std::memory_order_acquire);
+  if (shortcuts == nullptr) {
+    auto new_shortcuts = new lockfree_skiplist(kShortcutArenaBlockSize);
+    if (shortcuts_.compare_exchange_strong(shortcuts, new_shortcuts)) {
+      shortcuts = new_shortcuts;
+    } else {
+      delete new_shortcuts;
+    }
+  }
+  shortcuts->add_shortcut(td, key, target_node, target);
 }
-void PmemTable::merge_IUL(ThreadData* td, const unsigned long rmask, MemTable* other) {
-  skiplist_->merge_IUL(td, rmask, other->skiplist());
+
+Shortcut PmemTable::find_shortcut(const Key& key, const uint64_t table) const {
+  lockfree_skiplist* shortcuts = shortcuts_.load(std::memory_order_acquire);
+  return (shortcuts) ? shortcuts->find_shortcut(key, table) : Shortcut();
 }
 
-void PmemTable::zipper_compaction(ThreadData* td, const unsigned long rmask, const int lower_level, PmemTable* lower) {
-  std::bitset<kMaxNumRegions> rbs(rmask);
-  skiplist_->zipper_compaction(td, rmask, lower_level, lower->skiplist());
+void PmemTable::find_batch(ThreadData* td, const size_t n, const Key* keys, Node** nodes_out) {
+#ifndef BR_STRING_KV
+  if (const LearnedIndex* index = learned_index()) {
+    std::vector<const Node*> preds(n);
+    for (size_t i = 0; i < n; i++) {
+      preds[i] = (const Node*) index->find_pred(keys[i]);
+    }
+    skiplist_->find_batch(td, td->region, n, keys, nodes_out, preds.data());
+    counter[td->cpu].learned_index_cnt += n;
+    return;
+  }
+#endif
+  skiplist_->find_batch(td, td->region, n, keys, nodes_out);
 }
 
-void PmemTable::log_structured_compaction(ThreadData* td, const unsigned long rmask, const int lower_level, PmemTable* lower) {
-  skiplist_->log_structured_compaction(td, rmask, lower_level, lower->skiplist());
+void PmemTable::merge_WAL(ThreadData* td, MemTable* other, const mNode* begin, const mNode* end,
+                          const uint64_t oldest_snapshot) {
+  skiplist_->merge_WAL(td, other->skiplist(), begin, end, oldest_snapshot, filter_.load());
+}
+void PmemTable::merge_IUL(ThreadData* td, MemTable* other, const mNode* begin, const mNode* end,
+                          const uint64_t oldest_snapshot) {
+  skiplist_->merge_IUL(td, other->skiplist(), begin, end, oldest_snapshot, filter_.load());
+}
+
+void PmemTable::init_filter(const size_t num_keys, const int bits_per_key) {
+  filter_.store(new BloomFilter(num_keys, bits_per_key), std::memory_order_release);
+}
+
+LearnedIndex* PmemTable::begin_index_writes() {
+  std::lock_guard<std::mutex> guard(index_mu_);
+  index_writers_++;
+  index_version_++;
+  return learned_index_.exchange(nullptr);
+}
+
+void PmemTable::end_index_writes() {
+  std::lock_guard<std::mutex> guard(index_mu_);
+  index_writers_--;
+  index_version_++;
+}
+
+int64_t PmemTable::index_version() {
+  std::lock_guard<std::mutex> guard(index_mu_);
+  return (index_writers_ > 0) ? -1 : index_version_;
+}
+
+bool PmemTable::set_learned_index(LearnedIndex* index, const int64_t version) {
+  std::lock_guard<std::mutex> guard(index_mu_);
+  if (index_writers_ > 0 || index_version_ != version || learned_index_.load() != nullptr) {
+    return false;
+  }
+  learned_index_.store(index, std::memory_order_release);
+  return true;
+}
+
+void PmemTable::log_structured_compaction(ThreadData* td, const unsigned long rmask, const int lower_level, PmemTable* lower,
+                                          const uint64_t oldest_snapshot,
+                                          const std::function<void(std::function<void()>)>& retire_fn) {
+  skiplist_->log_structured_compaction(td, rmask, lower_level, lower->skiplist(), oldest_snapshot, retire_fn);
 }
 
 size_t PmemTable::fetch_add_size(const size_t size) {
@@ -55,16 +182,37 @@ size_t PmemTable::size() {
   return size_.load();
 }
 
+void PmemTable::unref() {
+  if (ref_cnt_.fetch_sub(1) == 1) {
+    std::lock_guard<std::mutex> guard(ref_mu_);
+    ref_cv_.notify_all();
+  }
+}
+
+void PmemTable::wait_for_writers() {
+  std::unique_lock<std::mutex> lk(ref_mu_);
+  ref_cv_.wait(lk, [&]{ return ref_cnt_.load() == 0; });
+}
+
 int PmemTable::cas_mark_full() {
   int expected = 0;
   state_.compare_exchange_strong(expected, 1);
   return expected;
 }
 
-void PmemTable::mark_merged_down() {
+void PmemTable::mark_merged_down(const int level, const bool reclaim_nodes,
+                                 std::function<void(std::function<void()>)> retire_fn) {
+  reclaimer_->level = level;
+  reclaimer_->reclaim_nodes = reclaim_nodes;
+  reclaimer_->retire_fn = retire_fn;
+  reclaimer_->merged_down = true;
   state_.store(-1);
 }
 
+void PmemTable::pin_upper(PmemTable* upper) {
+  reclaimer_->upper = upper->reclaimer_;
+}
+
 bool PmemTable::is_merged_down() {
   return state_.load() == -1;
 }
@@ -96,8 +244,17 @@ void PmemTable::print_debug() {
 //}
 
 casc_pmem_table_iterator::casc_pmem_table_iterator(const int region, std::shared_ptr<PmemTable> table)
-    : r_(region), table_(table) {
-  iter_ = new casc_pskiplist_iterator(r_, table_->skiplist());
+    : r_(region), table_(table), table_ptr_(table.get()) {
+  iter_ = new casc_pskiplist_iterator(r_, table_ptr_->skiplist());
+}
+
+casc_pmem_table_iterator::casc_pmem_table_iterator(const int region, PmemTable* table)
+    : r_(region), table_ptr_(table) {
+  iter_ = new casc_pskiplist_iterator(r_, table_ptr_->skiplist());
+}
+
+casc_pmem_table_iterator::~casc_pmem_table_iterator() {
+  delete iter_;
 }
 
 void casc_pmem_table_iterator::seek(const Key& key, const Node* pred) {
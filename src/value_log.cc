@@ -1,6 +1,9 @@
 #include "value_log.h"
 
+#include <algorithm>
+
 void ValueLog::init(const int s) {
+  shard_ = s;
   for (int i = 0; i < kNumRegions; i++) {
     TOID(LogBase) base;
     POBJ_ZALLOC(vpop[s][i], &base, LogBase, sizeof(LogBase));
@@ -16,58 +19,256 @@ void ValueLog::init(const int s) {
     LogBlock* nb = new (buf) LogBlock(i);  // new block
     nb->load(nbb);
     blocks_[i] = nb;
+    num_blocks_.fetch_add(1);
+    prepare_spare(s, i);
   }
 }
 
+void ValueLog::prepare_spare(const int s, const int r) {
+  std::lock_guard<std::mutex> spare_guard(spare_mu_);
+  {
+    std::lock_guard<std::mutex> guard(mu_);
+    if (spare_[r] != NULL) {
+      return;
+    }
+  }
+  // Allocated into the root slot, which is empty while spare_[r] is NULL
+  POBJ_ZALLOC(vpop[s][r], &(D_RW(log_base_[r])->spare), LogBlockBase, sizeof(LogBlockBase) + (kLogBlockSize - 1));
+  void* buf = malloc(sizeof(LogBlock));
+  LogBlock* nb = new (buf) LogBlock(r);
+  nb->load(D_RW(log_base_[r])->spare);
+  std::lock_guard<std::mutex> guard(mu_);
+  spare_[r] = nb;
+}
+
 LogBlock* ValueLog::get_available_log_block(ThreadData* td, const int s,
                                             const int r, const size_t my_size,
                                             size_t* before) {
-  LogBlock* b = blocks_[r];
   while (true) {
-    if (b == NULL) {
-      b = blocks_[r];
+    LogBlock* b = blocks_[r].load();
+    // A block is collected only after it is replaced and has no writers
+    b->ref();
+    if (b != blocks_[r].load()) {
+      b->unref();
       continue;
     }
     *before = b->fetch_add_size(my_size);
     if (my_size + *before > kLogBlockSize) {
+      if (*before < kLogBlockSize) {
+        // The first reservation past the end pads the rest of the block
+        write_padding(s, r, b->data() + *before, kLogBlockSize - *before);
+      }
+      bool refill = false;
       std::unique_lock<std::mutex> lk(mu_);
-      if (b == blocks_[r]) {
-        TOID(LogBlockBase) nbb;
-        POBJ_ZALLOC(vpop[s][r], &nbb, LogBlockBase, sizeof(LogBlockBase) + (kLogBlockSize - 1));
-        LogBlockBase* nbbp = D_RW(nbb);
-        nbbp->p = 0;
-        nbbp->npp = 0;
-        D_RW(b->base())->next = nbb;
+      if (b == blocks_[r].load()) {
+        // Link the spare block prepared in advance
+        LogBlock* nb = spare_[r];
+        if (nb == NULL) {
+          // The refill is behind. Allocate outside of the critical section
+          // and retry.
+          lk.unlock();
+          b->unref();
+          prepare_spare(s, r);
+          continue;
+        }
+        spare_[r] = NULL;
+        D_RW(b->base())->next = nb->base();
         pmemobj_persist(vpop[s][r], &(D_RW(b->base())->next), sizeof(TOID(LogBlockBase)));
-        void* buf = malloc(sizeof(LogBlock));
-        LogBlock* nb = new (buf) LogBlock(r);
-        nb->load(nbb);
-        //std::atomic_store(&blocks_[r], nb);
-        blocks_[r] = nb;
-        b = blocks_[r];
-      } else {
-        b = blocks_[r];
+        TOID_ASSIGN(D_RW(log_base_[r])->spare, OID_NULL);
+        pmemobj_persist(vpop[s][r], &(D_RW(log_base_[r])->spare), sizeof(TOID(LogBlockBase)));
+        blocks_[r].store(nb);
+        sealed_[r].push_back(b);
+        num_sealed_.fetch_add(1);
+        num_blocks_.fetch_add(1);
+        refill = true;
       }
       lk.unlock();
+      b->unref();
+      if (refill) {
+        auto refill_fn = [this, s, r]{ prepare_spare(s, r); };
+        if (background_fn_) {
+          background_fn_(refill_fn);
+        } else {
+          refill_fn();
+        }
+      }
       continue;
     }
-    break;
+    return b;
   }
-  return b;
 }
 
-uint64_t ValueLog::write_value(ThreadData* td, const int s, const std::string_view& value) {
-  const int r = td->region;
-  size_t my_size = 4 + value.length();
-  size_t before = 0;
-  auto b = get_available_log_block(td, s, r, my_size, &before);
+void ValueLog::write_padding(const int s, const int r, char* p, const size_t size) {
+  assert(size % 8 == 0);
+  if (size == 0) {
+    return;
+  }
+  *((uint32_t*) p) = size - 2 * sizeof(uint32_t);
+  *((uint32_t*) (p + 4)) = kPaddingKeyLength;
+  pmemobj_persist(vpop[s][r], p, 2 * sizeof(uint32_t));
+}
+
+void ValueLog::retire_chunk(ThreadData* td, const int s) {
+  LogTail& tail = td->vlog_tail[s];
+  if (tail.block == nullptr) {
+    return;
+  }
+  write_padding(s, tail.region, tail.cur, tail.end - tail.cur);
+  // The values of the chunk may not be in the index yet
+  td->vlog_pins[s].push_back(tail.block);
+  tail.block = nullptr;
+  tail.cur = tail.end = nullptr;
+  tail.region = -1;
+}
 
-  void* begin = b->data() + before;
-  char* p = (char*) begin;
+void ValueLog::unpin(ThreadData* td, const int s) {
+  for (auto b : td->vlog_pins[s]) {
+    b->unref();
+  }
+  td->vlog_pins[s].clear();
+}
+
+void ValueLog::release_tail(ThreadData* td, const int s) {
+  retire_chunk(td, s);
+  unpin(td, s);
+}
+
+char* ValueLog::reserve(ThreadData* td, const int s, const int r, const size_t my_size) {
+  size_t before;
+  if (my_size > kLogChunkSize) {
+    LogBlock* b = get_available_log_block(td, s, r, my_size, &before);
+    td->vlog_pins[s].push_back(b);
+    return b->data() + before;
+  }
+  LogTail& tail = td->vlog_tail[s];
+  if (tail.region != r || tail.cur + my_size > tail.end) {
+    retire_chunk(td, s);
+    LogBlock* b = get_available_log_block(td, s, r, kLogChunkSize, &before);
+    tail.cur = b->data() + before;
+    tail.end = tail.cur + kLogChunkSize;
+    tail.region = r;
+    tail.block = b;
+  }
+  char* begin = tail.cur;
+  tail.cur += my_size;
+  return begin;
+}
+
+void ValueLog::write_record(char* p, const std::string_view& key, const std::string_view& value) {
   *((uint32_t*) p) = value.length();
-  p += 4;
+  *((uint32_t*) (p + 4)) = key.length();
+  p += 2 * sizeof(uint32_t);
+  memcpy(p, key.data(), key.length());
+  p += key.length();
   memcpy(p, value.data(), value.length());
-  pmemobj_persist(vpop[s][r], begin, sizeof(uint32_t) + value.length());
+}
+
+ValueLog::Record ValueLog::read_record(const char* p) {
+  uint32_t value_length = *((uint32_t*) p);
+  uint32_t key_length = *((uint32_t*) (p + 4));
+  Record rec;
+  if (key_length == kPaddingKeyLength) {
+    rec.size = 2 * sizeof(uint32_t) + value_length;
+    return rec;
+  }
+  rec.key = std::string_view(p + 2 * sizeof(uint32_t), key_length);
+  rec.value = std::string_view(p + 2 * sizeof(uint32_t) + key_length, value_length);
+  rec.size = record_size(rec.key, rec.value);
+  return rec;
+}
+
+uint64_t ValueLog::write_value(ThreadData* td, const int s, const std::string_view& key,
+                               const std::string_view& value) {
+  // The previous put of this thread has inserted its key into the index
+  unpin(td, s);
+  const int r = td->region;
+  size_t my_size = record_size(key, value);
+  char* begin = reserve(td, s, r, my_size);
+  write_record(begin, key, value);
+  pmemobj_persist(vpop[s][r], begin, my_size);
   uint64_t value_moff = (((uintptr_t) begin - (uintptr_t) vpop[s][r]) << 16) | r;
   return value_moff;
 }
+
+void ValueLog::write_values(ThreadData* td, const int s, const size_t n,
+                            const std::string_view* keys, const std::string_view* values,
+                            uint64_t* value_moffs_out) {
+  unpin(td, s);
+  const int r = td->region;
+  size_t i = 0;
+  while (i < n) {
+    size_t range_size = 0;
+    size_t j = i;
+    while (j < n && (j == i || range_size + record_size(keys[j], values[j]) <= kLogChunkSize)) {
+      range_size += record_size(keys[j], values[j]);
+      j++;
+    }
+    char* begin = reserve(td, s, r, range_size);
+    char* p = begin;
+    for (size_t k = i; k < j; k++) {
+      value_moffs_out[k] = (((uintptr_t) p - (uintptr_t) vpop[s][r]) << 16) | r;
+      write_record(p, keys[k], values[k]);
+      p += record_size(keys[k], values[k]);
+    }
+    pmemobj_persist(vpop[s][r], begin, range_size);
+    i = j;
+  }
+}
+
+LogBlock* ValueLog::oldest_sealed_block() {
+  std::lock_guard<std::mutex> lk(mu_);
+  // Regions are collected in proportion to their garbage
+  int r = -1;
+  for (int i = 0; i < kNumRegions; i++) {
+    if (!sealed_[i].empty() && (r < 0 || sealed_[i].size() > sealed_[r].size())) {
+      r = i;
+    }
+  }
+  if (r < 0) {
+    return NULL;
+  }
+  for (auto b : sealed_[r]) {
+    if (b->num_writers() == 0) {
+      return b;
+    }
+  }
+  return NULL;
+}
+
+void ValueLog::unlink_block(LogBlock* b) {
+  const int r = b->region();
+  std::lock_guard<std::mutex> lk(mu_);
+  auto it = std::find(sealed_[r].begin(), sealed_[r].end(), b);
+  assert(it != sealed_[r].end());
+  TOID(LogBlockBase) next = D_RO(b->base())->next;
+  if (it == sealed_[r].begin()) {
+    LogBase* base = D_RW(log_base_[r]);
+    base->head_block_base = next;
+    base->npp = next;
+    pmemobj_persist(vpop[shard_][r], base, sizeof(LogBase));
+  } else {
+    LogBlock* pred = *(it - 1);
+    D_RW(pred->base())->next = next;
+    pmemobj_persist(vpop[shard_][r], &(D_RW(pred->base())->next), sizeof(TOID(LogBlockBase)));
+  }
+  sealed_[r].erase(it);
+  num_sealed_.fetch_sub(1);
+}
+
+void ValueLog::free_block(LogBlock* b) {
+  TOID(LogBlockBase) bb = b->base();
+  POBJ_FREE(&bb);
+  b->~LogBlock();
+  free(b);
+  num_blocks_.fetch_sub(1);
+}
+
+std::string_view string_value_view(const StringKey& encoded_key) {
+  if (encoded_key.has_inline_value()) {
+    return encoded_key.inline_value();
+  }
+  // Value pools are shared by the shards
+  const uint64_t moff = encoded_key.value();
+  const int r = moff & 0xffff;
+  return ValueLog::read_record((char*) vpop[0][r] + (moff >> 16)).value;
+}
@@ -0,0 +1,37 @@
+#include "worker_policy.h"
+
+#include <algorithm>
+
+#include "common.h"
+
+int BacklogWorkerPolicy::num_workers(const CompactionLoad& load) {
+  // Flushes must keep up before the writers slow down
+  if (load.write_delay > 0 || load.max_immutables + 1 >= load.slowdown_immutables) {
+    return load.max_workers;
+  }
+  // No client to give the CPUs to
+  if (load.put_mops + load.get_mops == 0) {
+    return load.max_workers;
+  }
+  // Tasks of the jobs in flight, and of the L0 compactions due: L0 tables
+  // beyond one per shard
+  size_t backlog = load.num_jobs * load.tasks_per_job;
+  if (load.num_L0_tables > (size_t) load.num_shards) {
+    backlog += load.num_L0_tables - load.num_shards;
+  }
+  int n = std::min<size_t>(std::max<size_t>(backlog, min_workers_), load.max_workers);
+  if (n < load.active_workers) {
+    n = load.active_workers - 1;
+  }
+  return n;
+}
+
+std::shared_ptr<CompactionWorkerPolicy> new_worker_policy(const DBConf& conf) {
+  if (conf.worker_policy) {
+    return conf.worker_policy;
+  }
+  if (conf.worker_scaling_mode == 1) {
+    return std::make_shared<BacklogWorkerPolicy>();
+  }
+  return nullptr;
+}
@@ -209,7 +209,7 @@ void BrDBClient::BrDBWorker(uint64_t num, int coreid, bool is_master){
         std::string_view w_value(w_value_buf, req->Length());
         db_->put(&td, req->Key(), w_value);
       }else if(opt == SCAN){
-        std::vector<void*> result;
+        std::vector<std::pair<std::string, std::string>> result;
         db_->scan(&td, req->Key(), req->Length(), &result);
       }else{
         throw utils::Exception("Operation request is not recognized!");
@@ -226,6 +226,8 @@ void BrDBClient::BrDBWorker(uint64_t num, int coreid, bool is_master){
     }
   }
 
+  db_->release_thread(&td);
+
   mutex_.lock();
   request_time_->Join(&request_time);
   read_time_->Join(&read_time);
@@ -260,6 +262,8 @@ void BrDBClient::BrDBLoader(uint64_t num, int coreid){
     }
   }
 
+  db_->release_thread(&td);
+
   mutex_.lock();
   update_time_->Join(&update_time);
   mutex_.unlock();